@@ -1,6 +1,8 @@
 #ifndef AFE_REGS
 #define AFE_REGS
 
+#include <stdint.h>
+
 /*==========================================
 =    TI AFE4400 initialization, timing,    =
 =        and TIA register addresses        =
@@ -57,4 +59,89 @@
 #define LED1ABSVAL   0x2f
 #define DIAG         0x30
 
+/*============================================================================
+=  Timing engine windows (datasheet pg. 31-32), derived from the sample     =
+=  rate and LED duty cycle instead of worked out by hand. The pulse         =
+=  repetition period is split into four equal phases, and each one:         =
+=                                                                           =
+=    phase 0   sample ambient 2                 convert LED2                =
+=    phase 1   LED1 on, sample LED1             convert ambient 2           =
+=    phase 2   sample ambient 1                 convert LED1                =
+=    phase 3   LED2 on, sample LED2             convert ambient 1           =
+=                                                                           =
+=  starts with an ADC reset. An LED is on from the start of its phase for   =
+=  the duty cycle of the period; sampling starts once it has settled and    =
+=  ends a count before it goes off. Ambient phases sample the same window   =
+=  with both LEDs off.                                                      =
+=                                                                           =
+=  afeTimingValid() checks a rate and duty cycle against the datasheet      =
+=  limits, for a static_assert; afeTimingCount() gives the count that       =
+=  goes in each register from LED2STC to PRPCOUNT.                          =
+==============================================================================*/
+
+const uint32_t AFE_CLOCK_HZ = 4000000;         // 8MHz crystal, divided by 2
+const uint32_t AFE_PERIOD_MAX_COUNTS = 64000;  // 62.5Hz, the slowest pulse repetition rate
+const uint32_t AFE_PERIOD_MIN_COUNTS = 800;    // 5kHz, the fastest
+const uint32_t AFE_ADC_RESET_COUNTS = 6;       // at the start of every phase
+const uint32_t AFE_LED_SETTLE_COUNTS = 80;     // 20us from LED on to sample start
+const uint32_t AFE_SAMPLE_MIN_COUNTS = 200;    // 50us sampled at least
+const uint32_t AFE_CONVERT_MIN_COUNTS = 200;   // 50us to convert at least
+
+const uint8_t AFE_TIMING_FIRST = LED2STC;
+const uint8_t AFE_TIMING_LAST = PRPCOUNT;
+
+enum AFEWindow { AFE_WINDOW_SAMPLE, AFE_WINDOW_LED, AFE_WINDOW_CONVERT, AFE_WINDOW_RESET };
+
+constexpr uint32_t afePeriodCounts(uint32_t rateHz) {
+  return AFE_CLOCK_HZ / rateHz;
+}
+
+constexpr uint32_t afePhaseCounts(uint32_t rateHz) {
+  return afePeriodCounts(rateHz) / 4;
+}
+
+constexpr uint32_t afeLEDCounts(uint32_t rateHz, uint32_t dutyPercent) {
+  return afePeriodCounts(rateHz) * dutyPercent / 100;
+}
+
+constexpr bool afeTimingValid(uint32_t rateHz, uint32_t dutyPercent) {
+  return rateHz > 0 && AFE_CLOCK_HZ % (4 * rateHz) == 0 &&  // whole counts, four equal phases
+         afePeriodCounts(rateHz) <= AFE_PERIOD_MAX_COUNTS && afePeriodCounts(rateHz) >= AFE_PERIOD_MIN_COUNTS &&
+         afeLEDCounts(rateHz, dutyPercent) <= afePhaseCounts(rateHz) &&
+         afeLEDCounts(rateHz, dutyPercent) >= AFE_LED_SETTLE_COUNTS + AFE_SAMPLE_MIN_COUNTS + 2 &&
+         afePhaseCounts(rateHz) >= AFE_ADC_RESET_COUNTS + AFE_CONVERT_MIN_COUNTS;
+}
+
+// first or last count of a window in phase
+constexpr uint32_t afeWindowCount(uint32_t rateHz, uint32_t dutyPercent, AFEWindow window, uint32_t phase,
+                                  bool end) {
+  return phase * afePhaseCounts(rateHz) +
+         (window == AFE_WINDOW_SAMPLE  ? (end ? afeLEDCounts(rateHz, dutyPercent) - 2 : AFE_LED_SETTLE_COUNTS) :
+          window == AFE_WINDOW_LED     ? (end ? afeLEDCounts(rateHz, dutyPercent) - 1 : 0) :
+          window == AFE_WINDOW_CONVERT ? (end ? afePhaseCounts(rateHz) - 1 : AFE_ADC_RESET_COUNTS) :
+                                         (end ? AFE_ADC_RESET_COUNTS - 1 : 0));
+}
+
+// LED2 sample, LED2 on, ambient 2 sample, LED1 sample, LED1 on, ambient 1 sample
+constexpr AFEWindow AFE_PAIR_WINDOW[] = { AFE_WINDOW_SAMPLE, AFE_WINDOW_LED, AFE_WINDOW_SAMPLE,
+                                          AFE_WINDOW_SAMPLE, AFE_WINDOW_LED, AFE_WINDOW_SAMPLE };
+constexpr uint8_t AFE_PAIR_PHASE[] = { 3, 3, 0, 1, 1, 2 };
+
+/**
+Count for timing register reg, LED2STC..PRPCOUNT. The registers come in
+start/end pairs from LED2STC, the start at the odd address; the sample
+and LED pairs are listed above, the conversions and ADC resets follow
+one per phase.
+**/
+constexpr uint32_t afeTimingCount(uint32_t rateHz, uint32_t dutyPercent, uint8_t reg) {
+  return reg == PRPCOUNT ? afePeriodCounts(rateHz) - 1 :
+         reg <= ALED1ENDC ?
+           afeWindowCount(rateHz, dutyPercent, AFE_PAIR_WINDOW[(reg - LED2STC) / 2], AFE_PAIR_PHASE[(reg - LED2STC) / 2],
+                          !(reg & 1)) :
+         reg <= ALED1CONVEND ?
+           // LED2, ambient 2, LED1, ambient 1 conversions, each in the phase after its sample
+           afeWindowCount(rateHz, dutyPercent, AFE_WINDOW_CONVERT, (reg - LED2CONVST) / 2, !(reg & 1)) :
+           afeWindowCount(rateHz, dutyPercent, AFE_WINDOW_RESET, (reg - ADCRSTSTCT0) / 2, !(reg & 1));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include <Arduino.h>
+#include <SPI.h>
+#include "Bus.h"
+#include "HAL.h"
+#include "PPG.h"
+#include "Memory.h"
+#include "Stats.h"
+
+/*============================================
+=              SPI bus arbiter               =
+==============================================*/
+
+struct BusDeviceConfig {
+  int cs;
+  SPISettings settings;
+  void (*park)(bool park);   // for a device that has to let go of MISO
+};
+
+static BusDeviceConfig busDevices[BUS_DEVICES] = {
+  { PIN_SS_AFE, SPISettings(20000000, MSBFIRST, SPI_MODE0), AFEPark },
+  { FlashChipSelect1, SPISettings(50000000, MSBFIRST, SPI_MODE0), NULL },
+  { FlashChipSelect2, SPISettings(50000000, MSBFIRST, SPI_MODE0), NULL },
+};
+
+static volatile uint8_t busOwner = BUS_NONE;
+static bool busParked[BUS_DEVICES];
+
+// waiting requests, highest priority first
+static BusRequest *busQueue[BUS_QUEUE_SIZE];
+static volatile int busQueued = 0;
+
+void busInit(void) {
+  for (int d = 0; d < BUS_DEVICES; d++) {
+    pinMode(busDevices[d].cs, OUTPUT);
+    digitalWrite(busDevices[d].cs, HIGH);
+  }
+}
+
+/**
+Hand the bus to device: park every other device that needs it, unpark
+this one if it was
+**/
+static void busGrant(uint8_t device) {
+  busOwner = device;
+  for (int d = 0; d < BUS_DEVICES; d++) {
+    bool park = d != device;
+    if (!busDevices[d].park || busParked[d] == park) continue;
+    busParked[d] = park;
+    busDevices[d].park(park);
+  }
+}
+
+// with interrupts disabled; the bus is left with the last request's device
+static void busRunQueued(void) {
+  while (busQueued) {
+    BusRequest *request = busQueue[0];
+    busQueued--;
+    for (int i = 0; i < busQueued; i++) busQueue[i] = busQueue[i + 1];
+    request->queued = false;
+    statsBusWait(halTicks() - request->tick);
+    busGrant(request->device);
+    request->run();
+  }
+}
+
+/**
+Take the bus for loop(). Requests from ISRs wait in the queue until
+busRelease() or busYield().
+**/
+void busAcquire(BusDevice device) {
+  noInterrupts();
+  busOwner = device;
+  interrupts();
+  busGrant(device);
+}
+
+// run what queued up meanwhile and free the bus
+void busRelease(void) {
+  noInterrupts();
+  busRunQueued();
+  busOwner = BUS_NONE;
+  interrupts();
+}
+
+/**
+Let queued requests in, then take the bus back; for loop() between the
+transactions of a long run
+**/
+void busYield(void) {
+  uint8_t owner = busOwner;
+  noInterrupts();
+  if (busQueued) {
+    busRunQueued();
+    busGrant(owner);
+  }
+  interrupts();
+}
+
+/**
+From an ISR: run request now if the bus is free, otherwise queue it.
+False if it did not run; it is still queued unless the queue was full.
+A request already waiting is left as it is.
+**/
+bool busRequest(BusRequest *request) {
+  if (request->queued) return false;
+  if (busOwner == BUS_NONE) {
+    busGrant(request->device);
+    request->run();
+    busOwner = BUS_NONE;
+    return true;
+  }
+  if (busQueued == BUS_QUEUE_SIZE) return false;
+
+  int i = busQueued;
+  while (i > 0 && busQueue[i - 1]->priority < request->priority) {
+    busQueue[i] = busQueue[i - 1];
+    i--;
+  }
+  busQueue[i] = request;
+  busQueued++;
+  request->tick = halTicks();
+  request->queued = true;
+  return false;
+}
+
+// one transaction with device, inside a grant
+void busSelect(BusDevice device) {
+  SPI.beginTransaction(busDevices[device].settings);
+  digitalWrite(busDevices[device].cs, LOW);
+}
+
+void busDeselect(BusDevice device) {
+  digitalWrite(busDevices[device].cs, HIGH);
+  SPI.endTransaction();
+}
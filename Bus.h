@@ -0,0 +1,45 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Arbiter for the SPI bus the AFE4400 and both flash chips share. loop()   =
+=  takes the bus for a run of transactions with busAcquire(); an ISR asks   =
+=  for one with busRequest(), which runs it straight away on a free bus     =
+=  and otherwise queues it, highest priority first, for busRelease() or     =
+=  busYield(). A PPG read that lands during a flash step so waits for that  =
+=  step only, never for the rest of what loop() does with the flash.        =
+=                                                                           =
+=  Chip selects and SPISettings of every device are kept here. The AFE4400  =
+=  drives MISO even while deselected, so it is parked (output tri-stated)   =
+=  whenever a flash chip is given the bus, and unparked when the AFE is     =
+=  given it again; both only when the device holding the bus changes.       =
+=  SerialFlash drives its chip selects itself, inside a flash grant.        =
+==============================================================================*/
+
+enum BusDevice { BUS_AFE, BUS_FLASH1, BUS_FLASH2, BUS_DEVICES, BUS_NONE = BUS_DEVICES };
+
+const int BUS_QUEUE_SIZE = 4;
+
+const uint8_t BUS_PRIORITY_LOW = 0;
+const uint8_t BUS_PRIORITY_HIGH = 1;
+
+// an ISR's transaction, waiting in the queue while queued is set
+struct BusRequest {
+  uint8_t device;
+  uint8_t priority;          // higher runs first, equal in the order asked
+  volatile bool queued;
+  uint32_t tick;             // halTicks() when queued
+  void (*run)(void);         // with the bus granted and interrupts disabled
+};
+
+void busInit(void);
+void busAcquire(BusDevice device);
+void busRelease(void);
+void busYield(void);
+bool busRequest(BusRequest *request);
+void busSelect(BusDevice device);
+void busDeselect(BusDevice device);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*============================================================================
+=  CRC-32 (IEEE 802.3, reflected, as zlib) for the flash log store. Pass    =
+=  the previous result as crc to continue over more data.                   =
+==============================================================================*/
+
+uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+#endif
@@ -1,10 +1,21 @@
 #ifndef EDA
 #define EDA
 
-int getEDAData();
-bool isEDADataAvailable();
-void setupInternalInterrupts();
-void TC4_Handler();
-void TC5_Handler();
+#include "Ring.h"
+
+const uint32_t PIN_EDA = A6;
+
+// one ADC reading per sample timer tick, started in sampleEDA()
+struct EDASample {
+  uint32_t tick;
+  uint16_t value;
+};
+
+const int EDA_RING_SIZE = 8;
+extern SampleRing<EDASample, EDA_RING_SIZE> EDARing;
+
+void setupInternalInterrupts(bool enable);
+void sampleEDA();
+char *formatEDAData(char *p, const EDASample *sample);
 
 #endif
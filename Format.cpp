@@ -0,0 +1,35 @@
+#include "Format.h"
+
+static const uint32_t formatPowers[FORMAT_UNSIGNED_MAX] = {
+  1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
+char *formatText(char *p, const char *s) {
+  while (*s) *p++ = *s++;
+  return p;
+}
+
+/**
+Decimal, no leading zeros; each digit is the number of times its power
+of ten can be taken off, at most nine
+**/
+char *formatUnsigned(char *p, uint32_t value) {
+  int i = 0;
+  while (i < FORMAT_UNSIGNED_MAX - 1 && value < formatPowers[i]) i++;
+  for (; i < FORMAT_UNSIGNED_MAX; i++) {
+    uint32_t power = formatPowers[i];
+    char digit = '0';
+    while (value >= power) {
+      value -= power;
+      digit++;
+    }
+    *p++ = digit;
+  }
+  return p;
+}
+
+char *formatSigned(char *p, int32_t value) {
+  if (value >= 0) return formatUnsigned(p, value);
+  *p++ = '-';
+  return formatUnsigned(p, 0u - (uint32_t) value);
+}
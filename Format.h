@@ -0,0 +1,24 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Text formatting without the heap, for the legacy text log lines. Each    =
+=  formatter writes into the caller's buffer, adds no terminator and        =
+=  returns the end, so a line is built left to right in one stack buffer    =
+=  or straight into the log buffer. Integers are converted by subtracting   =
+=  powers of ten: the M0+ has no divide instruction, and the library        =
+=  division a %10 loop calls costs more than the few subtractions a digit   =
+=  takes.                                                                   =
+==============================================================================*/
+
+const int FORMAT_UNSIGNED_MAX = 10;  // characters of a uint32_t
+const int FORMAT_SIGNED_MAX = 11;    // and of an int32_t, sign included
+const int FORMAT_LINE_MAX = 32;      // longest legacy text line, "T:" and the wall clock
+
+char *formatText(char *p, const char *s);
+char *formatUnsigned(char *p, uint32_t value);
+char *formatSigned(char *p, int32_t value);
+
+#endif
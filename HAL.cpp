@@ -0,0 +1,439 @@
+#include <Arduino.h>
+#include <Wire.h>
+#include <malloc.h>
+#include "HAL.h"
+
+/*============================================
+=      SAMD21 implementation of HAL.h        =
+==============================================*/
+
+static volatile halISR sampleTimerISR = NULL;
+
+/**
+Setup the internal sample timer using Atmel ARM's TC interrupt on channel 5
+Use a 16-bit  counter  with  a  prescaler  value  of  64 to set the interrupt frequency
+to roughly 12Hz (48MHz / 64 / 65536)
+**/
+void halSampleTimerBegin(halISR isr) {
+  sampleTimerISR = isr;
+
+  REG_GCLK_CLKCTRL = (uint16_t) (GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID ( GCM_TC4_TC5 ) ) ;
+  while ( GCLK->STATUS.bit.SYNCBUSY == 1 ); // wait for sync
+
+  TcCount16* TC_ = (TcCount16*) TC5; // get timer struct
+
+  TC_->CTRLA.reg &= ~TC_CTRLA_ENABLE;   // Disable TCx
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->CTRLA.reg |= TC_CTRLA_WAVEGEN_NFRQ; // Set TC as normal Normal Frq
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->CTRLA.reg |= TC_CTRLA_PRESCALER_DIV64;   // Set perscaler
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->CC[0].reg = 0xfff;
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->INTENSET.reg = 0;              // disable all interrupts
+  TC_->INTENSET.bit.OVF = 1;          // enable overfollow
+
+  NVIC_EnableIRQ(TC5_IRQn);
+
+  TC_->CTRLA.reg |= TC_CTRLA_ENABLE;
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+}
+
+/**
+Stop the sample timer and its interrupt
+**/
+void halSampleTimerEnd(void) {
+  TcCount16* TC_ = (TcCount16*) TC5;
+
+  NVIC_DisableIRQ(TC5_IRQn);
+  TC_->CTRLA.reg &= ~TC_CTRLA_ENABLE;
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  sampleTimerISR = NULL;
+}
+
+/**
+Setup the microsecond tick counter: GCLK4 divides the 48MHz DFLL down to
+1MHz for TC3, which counts freely in 16 bits with the overflow interrupt
+extending it to 32 bits. COUNT is continuously read-synchronised so
+halTicks() needs no sync wait.
+**/
+static volatile uint16_t tickHigh = 0;
+
+void halTickBegin(void) {
+  GCLK->GENDIV.reg = GCLK_GENDIV_ID(4) | GCLK_GENDIV_DIV(48);
+  while ( GCLK->STATUS.bit.SYNCBUSY == 1 ); // wait for sync
+
+  GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(4) | GCLK_GENCTRL_SRC_DFLL48M | GCLK_GENCTRL_IDC | GCLK_GENCTRL_GENEN;
+  while ( GCLK->STATUS.bit.SYNCBUSY == 1 ); // wait for sync
+
+  REG_GCLK_CLKCTRL = (uint16_t) (GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK4 | GCLK_CLKCTRL_ID ( GCM_TCC2_TC3 ) ) ;
+  while ( GCLK->STATUS.bit.SYNCBUSY == 1 ); // wait for sync
+
+  TcCount16* TC_ = (TcCount16*) TC3;
+
+  TC_->CTRLA.reg &= ~TC_CTRLA_ENABLE;   // Disable TCx
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_WAVEGEN_NFRQ | TC_CTRLA_PRESCALER_DIV1;
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(0x10); // COUNT
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+
+  TC_->INTENSET.reg = 0;              // disable all interrupts
+  TC_->INTENSET.bit.OVF = 1;          // enable overfollow
+
+  NVIC_EnableIRQ(TC3_IRQn);
+
+  TC_->CTRLA.reg |= TC_CTRLA_ENABLE;
+  while (TC_->STATUS.bit.SYNCBUSY == 1); // wait for sync
+}
+
+/**
+Microseconds since halTickBegin(), wrapping every 71.6 minutes. Safe from
+ISRs: an overflow still waiting for TC3_Handler() is accounted for here.
+**/
+uint32_t halTicks(void) {
+  TcCount16* TC_ = (TcCount16*) TC3;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint16_t high = tickHigh;
+  uint16_t low = TC_->COUNT.reg;
+  if (TC_->INTFLAG.bit.OVF == 1 && low < 0x8000) high++;
+  __set_PRIMASK(primask);
+
+  return ((uint32_t) high << 16) | low;
+}
+
+/**
+Mask interrupts and return PRIMASK as it was, for halIRQRestore(); unlike
+noInterrupts()/interrupts() the pair nests, and is safe inside an ISR
+**/
+uint32_t halIRQSave(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  return primask;
+}
+
+void halIRQRestore(uint32_t saved) {
+  __set_PRIMASK(saved);
+}
+
+void TC3_Handler()
+{
+  TcCount16* TC = (TcCount16*) TC3;
+  if (TC->INTFLAG.bit.OVF == 1) {
+    TC->INTFLAG.bit.OVF = 1;
+    tickHigh++;
+  }
+}
+
+/**
+Interrupt service routing (ISR) for the sample timer
+**/
+void TC5_Handler()
+{
+  TcCount16* TC = (TcCount16*) TC5;
+  if (TC->INTFLAG.bit.OVF == 1) {
+    // overflow, clear interrupt flag
+    TC->INTFLAG.bit.OVF = 1;
+    if (sampleTimerISR) sampleTimerISR();
+  }
+}
+
+static volatile halISR adcISR = NULL;
+
+/**
+Single conversions of pin, started by halADCStart() and ended by
+ADC_Handler() calling done(), so no ISR waits on the ADC. One
+analogRead() sets up the pin mux, reference and resolution (and throws
+away the first conversion); the ADC is then left enabled on pin.
+**/
+void halADCBegin(uint32_t pin, halISR done) {
+  adcISR = done;
+  analogRead(pin);
+
+  ADC->INPUTCTRL.bit.MUXPOS = g_APinDescription[pin].ulADCChannelNumber;
+  while (ADC->STATUS.bit.SYNCBUSY == 1); // wait for sync
+  ADC->CTRLA.bit.ENABLE = 1;
+  while (ADC->STATUS.bit.SYNCBUSY == 1); // wait for sync
+  ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+  ADC->INTENSET.reg = ADC_INTENSET_RESRDY;
+  NVIC_EnableIRQ(ADC_IRQn);
+}
+
+void halADCStart(void) {
+  while (ADC->STATUS.bit.SYNCBUSY == 1); // wait for sync
+  ADC->SWTRIG.bit.START = 1;
+}
+
+// no more done() calls, even for a conversion already started
+void halADCEnd(void) {
+  NVIC_DisableIRQ(ADC_IRQn);
+  ADC->INTENCLR.reg = ADC_INTENCLR_RESRDY;
+  ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+  adcISR = NULL;
+}
+
+// the conversion done() was called for
+uint16_t halADCResult(void) {
+  return ADC->RESULT.reg;
+}
+
+void ADC_Handler()
+{
+  if (ADC->INTFLAG.bit.RESRDY == 1) {
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+    if (adcISR) adcISR();
+  }
+}
+
+/**
+Sleep in IDLE until an interrupt, unless busy() says there is work. busy()
+runs with interrupts masked so nothing slips in between it and the WFI; a
+masked interrupt still wakes the core, and runs once they are unmasked.
+IDLE rather than STANDBY: the DFLL has to keep TC3 counting and USB, the
+SPI and I2C SERCOMs and the ADC running. The 1kHz SysTick behind millis()
+would wake the core every millisecond, so a wake that only it caused goes
+straight back to sleep.
+**/
+bool halSleepUnless(bool (*busy)(void)) {
+  __disable_irq();
+  if (busy()) {
+    __enable_irq();
+    return false;
+  }
+
+  PM->SLEEP.reg = PM_SLEEP_IDLE_CPU;
+  SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+  for (;;) {
+    __DSB();
+    __WFI();
+    uint32_t pending = (SCB->ICSR & SCB_ICSR_VECTPENDING_Msk) >> SCB_ICSR_VECTPENDING_Pos;
+    __enable_irq();
+    __disable_irq();
+    if (pending != SysTick_IRQn + 16 || busy()) break;
+  }
+  __enable_irq();
+  return true;
+}
+
+/**
+newlib's view of the heap. It hardly ever hands memory back, so the arena
+it has taken from sbrk() is the high water; free chunks left inside it
+are the fragmentation.
+**/
+void halHeap(HalHeap *heap) {
+  struct mallinfo info = mallinfo();
+  heap->highWater = info.arena;
+  heap->inUse = info.uordblks;
+  heap->freeChunks = info.ordblks;
+}
+
+/**
+I2C transfers by DMA on SERCOM3, Wire's SERCOM on this board. With
+ADDR.LENEN the SERCOM sends the STOP itself once LEN bytes have gone, and
+NACKs the last byte of a read, so the CPU only steps in between the write
+and the read. Wire owns SERCOM3_Handler, so the DMAC interrupt ends each
+phase instead. A phase that has to wait for the SERCOM to finish sending
+a STOP is left to halI2CPoll() from loop(), rather than spin in the ISR.
+Wire keeps the SERCOM set up; halI2CBegin() only changes its clock.
+**/
+static Sercom *const halI2CSercom = SERCOM3;
+static const uint8_t HAL_I2C_TX_CHANNEL = 0;
+static const uint8_t HAL_I2C_RX_CHANNEL = 1;
+
+// what waits for the bus to be let go after a STOP
+enum HalI2CNext { HAL_I2C_NEXT_NONE, HAL_I2C_NEXT_WRITE, HAL_I2C_NEXT_READ };
+static volatile uint8_t halI2CNext = HAL_I2C_NEXT_NONE;
+
+static DmacDescriptor halDmaDescriptors[2] __attribute__ ((aligned (16)));
+static DmacDescriptor halDmaWriteback[2] __attribute__ ((aligned (16)));
+static HalI2CTransfer *volatile halI2CCurrent = NULL;
+static halISR halI2CDone = NULL;
+
+static void halDmaChannelInit(uint8_t channel, uint8_t trigger) {
+  DMAC->CHID.reg = DMAC_CHID_ID(channel);
+  DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+  DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+  while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST); // wait for reset
+  DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(trigger) | DMAC_CHCTRLB_TRIGACT_BEAT;
+  DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+}
+
+void halI2CBegin(uint32_t hz, halISR done) {
+  halI2CDone = done;
+  Wire.setClock(hz);
+
+  PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+  PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+
+  DMAC->CTRL.reg &= ~DMAC_CTRL_DMAENABLE;
+  DMAC->CTRL.reg = DMAC_CTRL_SWRST;
+  while (DMAC->CTRL.reg & DMAC_CTRL_SWRST); // wait for reset
+  DMAC->BASEADDR.reg = (uint32_t) halDmaDescriptors;
+  DMAC->WRBADDR.reg = (uint32_t) halDmaWriteback;
+  DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xf);
+
+  halDmaChannelInit(HAL_I2C_TX_CHANNEL, SERCOM3_DMAC_ID_TX);
+  halDmaChannelInit(HAL_I2C_RX_CHANNEL, SERCOM3_DMAC_ID_RX);
+  NVIC_EnableIRQ(DMAC_IRQn);
+}
+
+/**
+Arm a channel to move len bytes between buf and DATA, one per trigger.
+An incrementing address is given as the end of its block.
+**/
+static void halDmaStart(uint8_t channel, uint8_t *buf, uint8_t len) {
+  DmacDescriptor *d = &halDmaDescriptors[channel];
+  uint32_t data = (uint32_t) &halI2CSercom->I2CM.DATA.reg;
+  bool tx = channel == HAL_I2C_TX_CHANNEL;
+
+  d->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | (tx ? DMAC_BTCTRL_SRCINC : DMAC_BTCTRL_DSTINC);
+  d->BTCNT.reg = len;
+  d->SRCADDR.reg = tx ? (uint32_t) (buf + len) : data;
+  d->DSTADDR.reg = tx ? data : (uint32_t) (buf + len);
+  d->DESCADDR.reg = 0;
+
+  DMAC->CHID.reg = DMAC_CHID_ID(channel);
+  DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+}
+
+// the STOP of the last phase is still going out
+static bool halI2CBusOwned(void) {
+  return halI2CSercom->I2CM.STATUS.bit.BUSSTATE == 2; // owner
+}
+
+// START, the address and LEN; the armed channel moves the bytes
+static void halI2CAddress(bool read, uint8_t len) {
+  halI2CSercom->I2CM.ADDR.reg = SERCOM_I2CM_ADDR_ADDR((halI2CCurrent->address << 1) | read) |
+                                SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(len);
+  while (halI2CSercom->I2CM.SYNCBUSY.bit.SYSOP); // wait for sync
+}
+
+static void halI2CFinish(bool failed) {
+  HalI2CTransfer *transfer = halI2CCurrent;
+  halI2CCurrent = NULL;
+  transfer->failed = failed;
+  if (halI2CDone) halI2CDone();
+}
+
+static void halI2CFail(void) {
+  HalI2CTransfer *transfer = halI2CCurrent;
+  halI2CAbort();
+  halI2CCurrent = transfer;
+  halI2CFinish(true);
+}
+
+static void halI2CRead(void) {
+  HalI2CTransfer *transfer = halI2CCurrent;
+  transfer->readTick = halTicks();
+  if (!transfer->rxLength) {
+    halI2CFinish(false);
+    return;
+  }
+  // Wire leaves NACK set after its own reads
+  halI2CSercom->I2CM.CTRLB.bit.ACKACT = 0;
+  while (halI2CSercom->I2CM.SYNCBUSY.bit.SYSOP); // wait for sync
+  halDmaStart(HAL_I2C_RX_CHANNEL, transfer->rx, transfer->rxLength);
+  halI2CAddress(true, transfer->rxLength);
+}
+
+static void halI2CWrite(void) {
+  HalI2CTransfer *transfer = halI2CCurrent;
+  if (!transfer->txLength) {
+    halI2CRead();
+    return;
+  }
+  halDmaStart(HAL_I2C_TX_CHANNEL, (uint8_t *) transfer->tx, transfer->txLength);
+  halI2CAddress(false, transfer->txLength);
+}
+
+// the write has gone: read, unless the address or a byte was NACKed
+static void halI2CWritten(void) {
+  if (halI2CSercom->I2CM.STATUS.bit.RXNACK) halI2CFail();
+  else halI2CRead();
+}
+
+/**
+Start a transfer; done() comes from DMAC_Handler() or halI2CPoll(), or
+never if the address is NACKed, which the caller times out with
+halI2CAbort()
+**/
+void halI2CStart(HalI2CTransfer *transfer) {
+  transfer->failed = false;
+  halI2CCurrent = transfer;
+  if (halI2CBusOwned()) {
+    halI2CNext = HAL_I2C_NEXT_WRITE;
+    return;
+  }
+  halI2CWrite();
+}
+
+/**
+From loop(), with interrupts masked: start the phase that was waiting for
+a STOP to go out, once it has. The wait is 10 SCL periods at most, a byte
+and the STOP, 25us at 400kHz.
+**/
+void halI2CPoll(void) {
+  uint8_t next = halI2CNext;
+  if (next == HAL_I2C_NEXT_NONE) return;
+  // a NACKed write gets no STOP of its own; halI2CFail() sends it
+  bool nacked = next == HAL_I2C_NEXT_READ && halI2CSercom->I2CM.STATUS.bit.RXNACK;
+  if (!nacked && halI2CBusOwned()) return;
+  halI2CNext = HAL_I2C_NEXT_NONE;
+  if (next == HAL_I2C_NEXT_WRITE) halI2CWrite();
+  else halI2CWritten();
+}
+
+// halI2CPoll() has a phase to start
+bool halI2CWaiting(void) {
+  return halI2CNext != HAL_I2C_NEXT_NONE;
+}
+
+// disarm both channels and let go of the bus
+void halI2CAbort(void) {
+  for (uint8_t channel = HAL_I2C_TX_CHANNEL; channel <= HAL_I2C_RX_CHANNEL; channel++) {
+    DMAC->CHID.reg = DMAC_CHID_ID(channel);
+    DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR;
+  }
+  halI2CNext = HAL_I2C_NEXT_NONE;
+  if (halI2CSercom->I2CM.STATUS.bit.BUSSTATE == 2) {
+    halI2CSercom->I2CM.CTRLB.bit.CMD = 3; // STOP
+    while (halI2CSercom->I2CM.SYNCBUSY.bit.SYSOP); // wait for sync
+  }
+  halI2CCurrent = NULL;
+}
+
+/**
+A channel has moved its last byte. After the write the SERCOM is still
+sending it and the STOP, up to 25us at 400kHz, before the read can start,
+so the read is usually left to halI2CPoll(); after the read the transfer
+is over.
+**/
+void DMAC_Handler()
+{
+  for (uint8_t channel = HAL_I2C_TX_CHANNEL; channel <= HAL_I2C_RX_CHANNEL; channel++) {
+    DMAC->CHID.reg = DMAC_CHID_ID(channel);
+    uint8_t flags = DMAC->CHINTFLAG.reg & (DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR);
+    DMAC->CHINTFLAG.reg = flags;
+    if (!flags || !halI2CCurrent) continue;
+
+    if (flags & DMAC_CHINTFLAG_TERR) {
+      halI2CFail();
+    } else if (channel == HAL_I2C_RX_CHANNEL) {
+      halI2CFinish(false);
+    } else if (!halI2CSercom->I2CM.STATUS.bit.RXNACK && halI2CBusOwned()) {
+      halI2CNext = HAL_I2C_NEXT_READ;
+    } else {
+      halI2CWritten();
+    }
+  }
+}
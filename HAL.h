@@ -0,0 +1,57 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <Arduino.h>
+
+/*============================================================================
+=  Hardware abstraction layer for the few pieces of the firmware that talk  =
+=  to SAMD21 peripheral registers directly instead of going through an      =
+=  Arduino library. HAL.cpp implements these for the board; sim/HALsim.cpp  =
+=  implements them for the host simulator.                                  =
+==============================================================================*/
+
+typedef void (*halISR)(void);
+
+struct HalHeap {
+  uint32_t highWater;    // bytes the heap has grown to
+  uint32_t inUse;        // bytes allocated now
+  uint32_t freeChunks;   // pieces the rest of it is split into
+};
+
+/**
+One I2C transfer on the Wire SERCOM, run without the CPU: tx is written
+and ended with a STOP, then rxLength bytes are read into rx. done() is
+called from the interrupt that ends it.
+**/
+struct HalI2CTransfer {
+  uint8_t address;
+  uint8_t txLength;
+  uint8_t rxLength;      // up to 255
+  bool failed;           // set by the HAL: a NACK or bus error
+  const uint8_t *tx;
+  uint8_t *rx;
+  uint32_t readTick;     // set by the HAL: halTicks() as the read began
+};
+
+// free-running microsecond counter that every sample is timestamped with
+const uint32_t HAL_TICK_HZ = 1000000;
+
+void halSampleTimerBegin(halISR isr);
+void halSampleTimerEnd(void);
+void halADCBegin(uint32_t pin, halISR done);
+void halADCStart(void);
+void halADCEnd(void);
+uint16_t halADCResult(void);
+void halTickBegin(void);
+uint32_t halTicks(void);
+uint32_t halIRQSave(void);
+void halIRQRestore(uint32_t saved);
+bool halSleepUnless(bool (*busy)(void));
+void halHeap(HalHeap *heap);
+void halI2CBegin(uint32_t hz, halISR done);
+void halI2CStart(HalI2CTransfer *transfer);
+void halI2CAbort(void);
+void halI2CPoll(void);
+bool halI2CWaiting(void);
+
+#endif
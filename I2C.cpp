@@ -0,0 +1,97 @@
+#include <Arduino.h>
+#include "I2C.h"
+#include "HAL.h"
+
+/*============================================
+=           Asynchronous I2C reads           =
+==============================================*/
+
+// in the order submitted, the first one on the bus
+static I2CTransaction *i2cQueue[I2C_QUEUE_SIZE];
+static volatile int i2cQueued = 0;
+static HalI2CTransfer i2cTransfer;
+static uint32_t i2cStarted = 0;
+
+// with interrupts disabled
+static void i2cStartFirst(void) {
+  I2CTransaction *t = i2cQueue[0];
+  t->status = I2C_BUSY;
+  i2cTransfer.address = t->address;
+  i2cTransfer.txLength = 1;
+  i2cTransfer.rxLength = t->length;
+  i2cTransfer.tx = &t->reg;
+  i2cTransfer.rx = t->data;
+  i2cStarted = halTicks();
+  halI2CStart(&i2cTransfer);
+}
+
+/**
+Take the transaction on the bus off the queue and start the next before
+calling done(), so the bus is not left idle while it runs
+**/
+static void i2cFinish(bool failed) {
+  I2CTransaction *t = i2cQueue[0];
+  i2cQueued--;
+  for (int i = 0; i < i2cQueued; i++) i2cQueue[i] = i2cQueue[i + 1];
+  t->tick = i2cTransfer.readTick;
+  t->status = failed ? I2C_FAILED : I2C_DONE;
+  if (i2cQueued) i2cStartFirst();
+  if (t->done) t->done(t);
+}
+
+static void i2cTransferDone(void) {
+  i2cFinish(i2cTransfer.failed);
+}
+
+// after Wire.begin(), which sets up the SERCOM
+void i2cBegin(void) {
+  halI2CBegin(I2C_CLOCK_HZ, i2cTransferDone);
+}
+
+bool i2cPending(const I2CTransaction *t) {
+  return t->status == I2C_QUEUED || t->status == I2C_BUSY;
+}
+
+/**
+Queue a read of t->length bytes from t->reg; false if the queue is full or
+t is in it already. From loop() or a done() callback.
+**/
+bool i2cSubmit(I2CTransaction *t) {
+  uint32_t saved = halIRQSave();
+  bool queued = !i2cPending(t) && i2cQueued < I2C_QUEUE_SIZE;
+  if (queued) {
+    t->status = I2C_QUEUED;
+    i2cQueue[i2cQueued++] = t;
+    if (i2cQueued == 1) i2cStartFirst();
+  }
+  halIRQRestore(saved);
+  return queued;
+}
+
+/**
+Start a phase that was waiting for a STOP to go out (HAL.h), and give up a
+transfer that has not ended in I2C_TIMEOUT_TICKS: on the board a NACKed
+address never moves the DMA, so nothing else would end it
+**/
+void i2cService(void) {
+  uint32_t saved = halIRQSave();
+  halI2CPoll();
+  if (i2cQueued && halTicks() - i2cStarted >= I2C_TIMEOUT_TICKS) {
+    halI2CAbort();
+    i2cFinish(true);
+  }
+  halIRQRestore(saved);
+}
+
+// i2cService() has a phase to start, which no interrupt will wake loop() for
+bool i2cServiceDue(void) {
+  return halI2CWaiting();
+}
+
+// until the queue is empty and Wire can have the bus
+void i2cWait(void) {
+  while (i2cQueued) {
+    delayMicroseconds(10);
+    i2cService();
+  }
+}
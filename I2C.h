@@ -0,0 +1,44 @@
+#ifndef I2C_H
+#define I2C_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Register reads on the I2C bus shared by the MPU6050 (0x69) and the RTC   =
+=  (0x68), run without the CPU. i2cSubmit() queues a transaction; the HAL   =
+=  moves its bytes by DMA on the board, and the interrupt that ends one     =
+=  starts the next and calls the finished one's done(), so loop() goes on   =
+=  with other streams while a burst of DMP packets is in flight. A phase    =
+=  that has to wait for a STOP to go out is started from i2cService()       =
+=  instead of spinning in the interrupt; i2cServiceDue() keeps loop() awake =
+=  for it. The bus runs in Fast mode.                                       =
+=                                                                           =
+=  Writes, and the reads of setup(), still go through Wire (and I2Cdev),    =
+=  which must not touch the bus while a transaction is queued: i2cWait()    =
+=  first.                                                                   =
+==============================================================================*/
+
+const uint32_t I2C_CLOCK_HZ = 400000;
+const int I2C_QUEUE_SIZE = 4;
+const uint32_t I2C_TIMEOUT_TICKS = 20000;  // a transfer that has not ended is given up
+
+enum I2CStatus { I2C_IDLE, I2C_QUEUED, I2C_BUSY, I2C_DONE, I2C_FAILED };
+
+struct I2CTransaction {
+  uint8_t address;
+  uint8_t reg;               // register pointer written first
+  uint8_t length;            // bytes read from it, up to 255
+  uint8_t *data;
+  void (*done)(I2CTransaction *t);  // from the interrupt or i2cService(), may be NULL
+  volatile uint8_t status;   // I2CStatus, I2C_DONE or I2C_FAILED until submitted again
+  uint32_t tick;             // halTicks() as the read began
+};
+
+void i2cBegin(void);
+bool i2cSubmit(I2CTransaction *t);
+bool i2cPending(const I2CTransaction *t);
+void i2cService(void);
+bool i2cServiceDue(void);
+void i2cWait(void);
+
+#endif
@@ -1,21 +1,25 @@
 #include <Wire.h>
 #include <I2Cdev.h>
 #include <MPU6050_6Axis_MotionApps20.h>
+#include "HAL.h"
+#include "I2C.h"
+#include "MPU.h"
+#include "Stats.h"
+#include "Format.h"
 
 // Initialize MPU on alternative I2C address (since RTC occupies 0x68)
-MPU6050 mpu(0x69); 
+MPU6050 mpu(MPU_I2C_ADDR);
 
 /*============================================
 =        MPU control/status variables        =
 ==============================================*/
 volatile bool MPUPoweredDown = false;
-volatile bool MPUDataAvailable = false;
 volatile bool dmpReady = false;  // set true if DMP init was successful
 uint8_t mpuIntStatus;   // holds actual interrupt status byte from MPU
 uint8_t devStatus;      // return status after each device operation (0 = success, !0 = error)
 uint16_t packetSize;    // expected DMP packet size (default is 42 bytes)
 uint16_t fifoCount;     // count of all bytes currently in FIFO
-uint8_t fifoBuffer[64]; // FIFO storage buffer
+uint8_t fifoBuffer[MPU_BURST_PACKETS * 42]; // FIFO storage buffer, one burst of packets
 
 /*============================================
 =        Orientation/Motion variables        =
@@ -26,16 +30,37 @@ VectorInt16 aaReal;     // [x, y, z]            gravity-free accel sensor measur
 VectorInt16 aaWorld;    // [x, y, z]            world-frame accel sensor measurements
 VectorFloat gravity;    // [x, y, z]            gravity vector
 
+SampleRing<uint32_t, MPU_RING_SIZE> MPURing;
+
+// packets decoded by the last burst, handed out by popMPUSample()
+MPUSample mpuBatch[MPU_BURST_PACKETS];
+int mpuBatchCount = 0;
+int mpuBatchNext = 0;
+uint32_t mpuLastTick = 0;
+
+// where the burst in progress stands; the I2C interrupt moves it on
+enum MPUReadState { MPU_READ_IDLE, MPU_READ_COUNT, MPU_READ_FIFO, MPU_READ_DONE, MPU_READ_OVERFLOW, MPU_READ_EMPTY,
+                    MPU_READ_FAILED };
+static volatile uint8_t mpuReadState = MPU_READ_IDLE;
+static uint8_t mpuCountRegs[2];
+static int mpuReadPackets = 0;  // packets the FIFO read takes
+static int mpuStaleTicks = 0;   // queued ticks with no packet behind them, after those
+
+static void mpuCountDone(I2CTransaction *t);
+static void mpuFIFODone(I2CTransaction *t);
+
+static I2CTransaction mpuStatusRead = { MPU_I2C_ADDR, MPU6050_RA_INT_STATUS, 1, &mpuIntStatus, NULL, I2C_IDLE, 0 };
+static I2CTransaction mpuCountRead = { MPU_I2C_ADDR, MPU6050_RA_FIFO_COUNTH, 2, mpuCountRegs, mpuCountDone,
+                                       I2C_IDLE, 0 };
+static I2CTransaction mpuFIFORead = { MPU_I2C_ADDR, MPU6050_RA_FIFO_R_W, 0, fifoBuffer, mpuFIFODone, I2C_IDLE, 0 };
+
 /**
 MPU interrupt service routine
 **/
 void dmpDataReady() {
   if(!dmpReady) return;
-  MPUDataAvailable = true;
-}
-
-bool isMPUDataAvailable() {
-  return MPUDataAvailable;
+  statsProduced(STORE_STREAM_ACCEL);
+  MPURing.push(halTicks());
 }
 
 /** 
@@ -70,52 +95,285 @@ void MPUinit() {
 void MPUPowerUp(void) {
   if(!MPUPoweredDown) return;
   MPUPoweredDown = false;
+  i2cWait();
   mpu.setSleepEnabled(false);
 }
 
 void MPUPowerDown(void) {
   if(MPUPoweredDown) return;
   MPUPoweredDown = true;
+  i2cWait();
   mpu.setSleepEnabled(true);
 }
 
-String getMPUData(void) {
+/**
+"x:y:z" text of a sample for the legacy A: line
+**/
+char *formatMPUData(char *p, const MPUSample *sample) {
+  p = formatSigned(p, sample->accel[0]);
+  *p++ = ':';
+  p = formatSigned(p, sample->accel[1]);
+  *p++ = ':';
+  return formatSigned(p, sample->accel[2]);
+}
 
-  String output = "";
-  MPUDataAvailable = false;
-    mpuIntStatus = mpu.getIntStatus();
+/**
+World-frame linear acceleration of one DMP packet using the library's
+float helpers
+**/
+void MPUWorldAccelFloat(const uint8_t *packet, int16_t *xyz) {
+  // get initial world-frame acceleration, adjusted to remove gravity
+  // and rotated based on known orientation from quaternion
+  mpu.dmpGetQuaternion(&q, packet);
+  mpu.dmpGetAccel(&aa, packet);
+  mpu.dmpGetGravity(&gravity, &q);
+  mpu.dmpGetLinearAccel(&aaReal, &aa, &gravity);
+  mpu.dmpGetLinearAccelInWorld(&aaWorld, &aaReal, &q);
+
+  xyz[0] = aaWorld.x;
+  xyz[1] = aaWorld.y;
+  xyz[2] = aaWorld.z;
+}
+
+static int16_t clamp16(int32_t v) {
+  if (v > 32767) return 32767;
+  if (v < -32768) return -32768;
+  return v;
+}
+
+/**
+Same result in integer arithmetic, for the M0+ which has no FPU. The Q30
+quaternion is cut to Q14 (the precision the float path uses) and expanded
+into the Q28 matrix of v -> q v q*. Its bottom row is the gravity vector
+dmpGetGravity() computes, so gravity removal and rotation share it. Only
+the output is rounded, where the float path truncates twice.
+**/
+void MPUWorldAccelFixed(const uint8_t *packet, int16_t *xyz) {
+  int32_t q30[4];
+  int16_t raw[3];
+  mpu.dmpGetQuaternion(q30, packet);
+  mpu.dmpGetAccel(raw, packet);
 
-    // get current FIFO count
-    fifoCount = mpu.getFIFOCount();
+  int32_t w = q30[0] >> 16, x = q30[1] >> 16, y = q30[2] >> 16, z = q30[3] >> 16;
+  int32_t ww = w*w, xx = x*x, yy = y*y, zz = z*z;
+  int32_t xy = x*y, xz = x*z, yz = y*z, wx = w*x, wy = w*y, wz = w*z;
+
+  int32_t m[3][3] = {
+    { ww + xx - yy - zz, 2 * (xy - wz),     2 * (xz + wy) },
+    { 2 * (xy + wz),     ww - xx + yy - zz, 2 * (yz - wx) },
+    { 2 * (xz - wy),     2 * (yz + wx),     ww - xx - yy + zz },
+  };
+
+  // linear accel with 8 fraction bits; +1g = +8192, so gravity is the Q28 row >> 7
+  int32_t a[3];
+  for (int j = 0; j < 3; j++) a[j] = ((int32_t) raw[j] << 8) - ((m[2][j] + (1L << 6)) >> 7);
+
+  for (int i = 0; i < 3; i++) {
+    int64_t v = (int64_t) m[i][0] * a[0] + (int64_t) m[i][1] * a[1] + (int64_t) m[i][2] * a[2];
+    xyz[i] = clamp16((int32_t) ((v + (1LL << 35)) >> 36));
+  }
+}
+
+#if MPU_BENCHMARK
+// tilted sensor accelerating at (0.1, -0.2, 0.15)g, as the DMP packs it
+static const uint8_t benchPacket[42] = {
+  0x39, 0x87, 0x33, 0xd6, 0x0c, 0xc8, 0xb6, 0x30, 0xec, 0xd2, 0xee, 0xb9, 0x0f, 0xfa,
+  0xe3, 0xbc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x17, 0x9d, 0x00, 0x00, 0x00, 0xcc, 0x00, 0x00, 0x1d, 0x1b, 0x00, 0x00, 0x00, 0x00
+};
+
+static unsigned long benchCycles(void (*path)(const uint8_t *, int16_t *)) {
+  const int rounds = 200;
+  int16_t xyz[3];
+  volatile int32_t sink = 0;
+  unsigned long start = micros();
+  for (int i = 0; i < rounds; i++) {
+    path(benchPacket, xyz);
+    sink += xyz[0];
+  }
+  return (micros() - start) * (F_CPU / 1000000L) / rounds;
+}
+
+/**
+Cycles per packet of the float and fixed point world-frame paths, timed
+on the target (micros() resolution, averaged over 200 packets)
+**/
+void MPUBenchmarkMath(void) {
+  unsigned long floatCycles = benchCycles(MPUWorldAccelFloat);
+  unsigned long fixedCycles = benchCycles(MPUWorldAccelFixed);
+  SerialUSB.print("DMP math cycles/packet: float ");
+  SerialUSB.print(floatCycles);
+  SerialUSB.print(", fixed ");
+  SerialUSB.println(fixedCycles);
+}
+#endif
+
+/**
+I2C interrupt, once the interrupt status and FIFO count are in: read every
+complete DMP packet (as many as fit fifoBuffer) in one burst, started
+straight from here
+**/
+static void mpuCountDone(I2CTransaction *t) {
+    if (mpuStatusRead.status != I2C_DONE || t->status != I2C_DONE) {
+        mpuReadState = MPU_READ_FAILED;
+        return;
+    }
+    fifoCount = ((uint16_t) mpuCountRegs[0] << 8) | mpuCountRegs[1];
 
     // check for overflow (this should never happen unless our code is too inefficient)
     if ((mpuIntStatus & 0x10) || fifoCount == 1024) {
-        // reset so we can continue cleanly
-        mpu.resetFIFO();
-        //SerialUSB.println(F("FIFO overflow!"));
-
-    // otherwise, check for DMP data ready interrupt (this should happen frequently)
-    } else if (mpuIntStatus & 0x02) {
-        // wait for correct available data length, should be a VERY short wait
-        while (fifoCount < packetSize) fifoCount = mpu.getFIFOCount();
-
-        // read a packet from FIFO
-        mpu.getFIFOBytes(fifoBuffer, packetSize);
-        
-        // track FIFO count here in case there is > 1 packet available
-        // (this lets us immediately read more without waiting for an interrupt)
-        fifoCount -= packetSize;
-
-        // get initial world-frame acceleration, adjusted to remove gravity
-        // and rotated based on known orientation from quaternion
-        mpu.dmpGetQuaternion(&q, fifoBuffer);
-        mpu.dmpGetAccel(&aa, fifoBuffer);
-        mpu.dmpGetGravity(&gravity, &q);
-        mpu.dmpGetLinearAccel(&aaReal, &aa, &gravity);
-        mpu.dmpGetLinearAccelInWorld(&aaWorld, &aaReal, &q);
-
-        output = String(aaWorld.x) + ":" + String(aaWorld.y) + ":" + String(aaWorld.z);
+        mpuReadState = MPU_READ_OVERFLOW;
+        return;
+    }
+
+    int packets = fifoCount / packetSize;
+    if (packets > (int) (sizeof(fifoBuffer) / packetSize)) packets = sizeof(fifoBuffer) / packetSize;
+    if (packets == 0) {
+        mpuReadState = MPU_READ_EMPTY;
+        return;
     }
+    fifoCount -= packets * packetSize;
 
-    return output;
+    // FIFO drained: ticks queued beyond its packets have none behind them
+    int queued = MPURing.count();
+    mpuStaleTicks = fifoCount < packetSize && queued > packets ? queued - packets : 0;
+    mpuReadPackets = packets;
+    mpuFIFORead.length = packets * packetSize;
+    mpuReadState = MPU_READ_FIFO;
+    if (!i2cSubmit(&mpuFIFORead)) mpuReadState = MPU_READ_FAILED;
+}
+
+// a failed read leaves the FIFO out of step with its packets: reset it
+static void mpuFIFODone(I2CTransaction *t) {
+    mpuReadState = t->status == I2C_DONE ? MPU_READ_DONE : MPU_READ_OVERFLOW;
+}
+
+/**
+Decode the packets of a finished burst into mpuBatch. Each packet takes
+the next queued interrupt tick; any without one are placed
+MPU_PACKET_TICKS after the previous.
+**/
+static void decodeMPUBurst(void) {
+    for (int i = 0; i < mpuReadPackets; i++) {
+        uint8_t *packet = fifoBuffer + i * packetSize;
+#if MPU_FIXED_POINT
+        MPUWorldAccelFixed(packet, mpuBatch[i].accel);
+#else
+        MPUWorldAccelFloat(packet, mpuBatch[i].accel);
+#endif
+
+        uint32_t tick;
+        if (!MPURing.pop(tick)) tick = mpuLastTick + MPU_PACKET_TICKS;
+        mpuLastTick = tick;
+        mpuBatch[i].tick = tick;
+    }
+
+    uint32_t stale;
+    for (int i = 0; i < mpuStaleTicks; i++) MPURing.pop(stale);
+
+    mpuBatchCount = mpuReadPackets;
+    mpuBatchNext = 0;
+}
+
+/**
+True once enough packets are queued to make a burst worthwhile, or the
+oldest has waited MPU_BURST_WAIT ticks. Until then the packets are safe in
+the FIFO, which holds 240ms of them.
+**/
+static bool MPUBurstDue(void) {
+  if (MPURing.empty()) return false;
+  if (MPURing.count() >= MPU_READ_PACKETS) return true;
+  return halTicks() - MPURing.peek() >= MPU_BURST_WAIT;
+}
+
+/**
+Move the FIFO bursts on, from loop(): decode a finished one, reset the
+FIFO after an overflow, and once the last burst is handed out and the
+next is due, queue the reads of the interrupt status and FIFO count. The
+packets are read from the I2C interrupt in the meantime.
+**/
+void MPUService(void) {
+  uint8_t state = mpuReadState;
+  if (state == MPU_READ_DONE) {
+    decodeMPUBurst();
+  } else if (state == MPU_READ_OVERFLOW) {
+    // reset so we can continue cleanly
+    i2cWait();
+    mpu.resetFIFO();
+    statsFIFOReset(fifoCount / packetSize);
+    // the interrupts queued for the discarded packets are stale now
+    MPURing.clear();
+  } else if (state == MPU_READ_EMPTY && !(mpuIntStatus & 0x02)) {
+    // an interrupt with no packet behind it; drop its tick. With DMP
+    // data ready but not all of it in the FIFO yet, just ask again.
+    uint32_t stale;
+    MPURing.pop(stale);
+  } else if (state == MPU_READ_FAILED) {
+    // the status or count read failed; the burst is tried again, but ticks
+    // nextStream() has passed over are dropped as missed
+    uint32_t stale;
+    uint32_t dropped = 0;
+    while (MPUStalled() && MPURing.pop(stale)) dropped++;
+    if (dropped) statsMissed(STORE_STREAM_ACCEL, dropped);
+  }
+  if (state == MPU_READ_DONE || state == MPU_READ_OVERFLOW || state == MPU_READ_EMPTY || state == MPU_READ_FAILED) {
+    mpuReadState = state = MPU_READ_IDLE;
+  }
+
+  if (state != MPU_READ_IDLE || mpuBatchNext < mpuBatchCount || !MPUBurstDue()) return;
+  mpuReadState = MPU_READ_COUNT;
+  // I2C_QUEUE_SIZE has room for both and the RTC's read
+  if (!i2cSubmit(&mpuStatusRead) || !i2cSubmit(&mpuCountRead)) mpuReadState = MPU_READ_IDLE;
+}
+
+// MPUService() has something to do
+bool MPUServiceDue(void) {
+  uint8_t state = mpuReadState;
+  if (state == MPU_READ_DONE || state == MPU_READ_OVERFLOW || state == MPU_READ_EMPTY || state == MPU_READ_FAILED) {
+    return true;
+  }
+  return state == MPU_READ_IDLE && mpuBatchNext == mpuBatchCount && MPUBurstDue();
+}
+
+/**
+Tick of the next accelerometer sample popMPUSample() would return, if any
+**/
+bool peekMPUTick(uint32_t *tick) {
+  if (mpuBatchNext < mpuBatchCount) {
+    *tick = mpuBatch[mpuBatchNext].tick;
+    return true;
+  }
+  if (MPURing.empty()) return false;
+  *tick = MPURing.peek();
+  return true;
+}
+
+/**
+True while decoded samples are waiting in mpuBatch
+**/
+bool MPUBurstReady(void) {
+  return mpuBatchNext < mpuBatchCount;
+}
+
+/**
+True while the oldest queued tick has no decoded sample, has waited past
+MPU_STALE_TICKS, longer than a burst takes even when its reads time out,
+and no burst is in flight for it: the MPU is not being read. A burst
+started late, after loop() was held up, is still waited for.
+**/
+bool MPUStalled(void) {
+  uint8_t state = mpuReadState;
+  if (state == MPU_READ_COUNT || state == MPU_READ_FIFO || state == MPU_READ_DONE) return false;
+  if (mpuBatchNext < mpuBatchCount || MPURing.empty()) return false;
+  return halTicks() - MPURing.peek() >= MPU_STALE_TICKS;
+}
+
+/**
+Next decoded accelerometer sample; false until MPUService() has decoded a
+burst
+**/
+bool popMPUSample(MPUSample *sample) {
+  if (mpuBatchNext == mpuBatchCount) return false;
+  *sample = mpuBatch[mpuBatchNext++];
+  return true;
 }
@@ -1,12 +1,51 @@
 #ifndef MPU
 #define MPU
 
+#include "Ring.h"
+#include "I2C.h"
+
 const int MPUInterruptPin = 3;
+const uint8_t MPU_I2C_ADDR = 0x69;      // alternative address, the RTC occupies 0x68
+
+// 0 goes back to the library's float gravity removal and rotation
+#ifndef MPU_FIXED_POINT
+#define MPU_FIXED_POINT 1
+#endif
+
+// 1 prints the cycles per packet of both paths over SerialUSB from setup()
+#ifndef MPU_BENCHMARK
+#define MPU_BENCHMARK 0
+#endif
+
+// tick of each DMP interrupt; the packets themselves wait in the MPU FIFO
+const int MPU_RING_SIZE = 32;
+extern SampleRing<uint32_t, MPU_RING_SIZE> MPURing;
+
+const int MPU_BURST_PACKETS = 6;      // 42 byte DMP packets per FIFO burst, one I2C read of 252 bytes
+const int MPU_READ_PACKETS = 3;       // queued packets that make a burst worth starting
+const uint32_t MPU_PACKET_TICKS = 10000; // DMP output rate is 100Hz, in halTicks() microseconds
+const uint32_t MPU_BURST_WAIT = 50000;   // longest a packet waits in the FIFO for others to share its burst
+// a tick left this long is past any burst, even one whose reads time out
+const uint32_t MPU_STALE_TICKS = MPU_BURST_WAIT + I2C_TIMEOUT_TICKS;
+
+// world-frame linear acceleration decoded from one DMP packet
+struct MPUSample {
+  uint32_t tick;
+  int16_t accel[3];
+};
 
 void dmpDataReady();
 void MPUinit();
-String getMPUData(void);
-bool isMPUDataAvailable();
+char *formatMPUData(char *p, const MPUSample *sample);
+void MPUWorldAccelFloat(const uint8_t *packet, int16_t *xyz);
+void MPUWorldAccelFixed(const uint8_t *packet, int16_t *xyz);
+void MPUBenchmarkMath(void);
+bool peekMPUTick(uint32_t *tick);
+void MPUService(void);
+bool MPUServiceDue(void);
+bool MPUBurstReady(void);
+bool MPUStalled(void);
+bool popMPUSample(MPUSample *sample);
 void MPUPowerDown(void);
 void MPUPowerUp(void);
 
@@ -1,16 +1,85 @@
 #include <Wire.h>
 #include <SerialFlash.h>
 #include <SPI.h>
-#include "PPG.h"
+#include <Time.h>
+#include "Bus.h"
 #include "MPU.h"
 #include "Memory.h"
 #include "EDA.h"
+#include "Record.h"
+#include "RTCtime.h"
+#include "HAL.h"
+#include "Stats.h"
 
-char bufferedData[fileSizeInBytes] = "";
-int bufferIndex = 0;
-int memFileCounter = 0;
+// ping-pong capture buffers: loop() appends records to one while
+// memService() cuts what has been committed into flash pages, running on
+// from the end of the other one
+char memBuffers[2][memBufferSize];
+int memBufferLength[2];         // bytes in a handed-off buffer
+bool memBufferEndsSegment[2];   // its last page closes the segment
+bool memBufferStartsStream[2] = { true, false };
+int memActiveBuffer = 0;
+int bufferIndex = 0;            // append cursor in the active buffer
+int memSegmentLeft = 0;         // record bytes the segment appended to can still take
+bool memStreamStart = true;     // the next append begins a record stream
 bool memoryChipReachedCapacity = false;
 volatile bool shouldRecordData = false;
+unsigned long memRecordsDropped = 0;
+
+// flash chips the store stripes across, and the one SerialFlash drives
+const int memChipSelects[STORE_MAX_STRIPES] = { FlashChipSelect1, FlashChipSelect2 };
+uint32_t memChips = 1;
+int memSelectedChip = -1;
+
+// log store position (Store.h)
+uint32_t memSegmentCount = 0;    // blocks on the smallest chip
+uint32_t memSegmentData = 0;     // record stream bytes a segment holds
+uint32_t memSegment = 0;         // block of the segment being written
+uint32_t memSegmentSequence = 0;
+bool memSegmentOpen = false;     // its header is written
+uint32_t memTail = 0;            // block of the oldest segment kept
+uint32_t memTailSequence = 0;
+uint32_t memEraseNext = 0;       // block the erase-ahead works on next
+uint32_t memEraseChip = 0;       // chips it is erased on so far
+bool memCircular = MEM_CIRCULAR;
+uint32_t memRetainSeconds = MEM_RETAIN_SECONDS;
+uint32_t memRetainKB = MEM_RETAIN_KB;
+uint32_t memCheckpointBlock = 0; // superblock taking checkpoints
+uint32_t memCheckpointSlot = 0;  // next free checkpoint in it
+uint32_t memCheckpointSequence = 0;
+
+enum MemFlushState { MEM_FLUSH_IDLE, MEM_FLUSH_OPEN, MEM_FLUSH_PROGRAM, MEM_FLUSH_SUMMARY };
+enum MemOpenStep { MEM_OPEN_ERASE, MEM_OPEN_HEADER, MEM_OPEN_CHECKPOINT };
+
+MemFlushState memFlushState = MEM_FLUSH_IDLE;
+MemOpenStep memOpenStep = MEM_OPEN_ERASE;
+uint32_t memFlushStarted = 0;   // tick the page being flushed came due
+bool memSuperblockErased = false;
+bool memErasingAll = false;      // memEraseAll() running, the store is off limits
+
+// page commits: the next committed byte to cut into a page, and the page
+int memPageBuffer = 0;
+int memPageOffset = 0;
+uint32_t memPageIndex = 0;      // next page of memSegment to program
+struct {
+  StorePageHeader header;
+  uint8_t data[STORE_PAGE_DATA];
+} memPage;
+bool memPageStaged = false;
+bool memPageClosesSegment = false;
+uint32_t memCommitted = 0;      // record bytes committed, counting up forever
+uint32_t memPaged = 0;          // and cut into pages
+static uint32_t memPageCuts = 0;
+uint32_t memFlushUntil = 0;     // memFlush() mark: cut pages part full up to here
+
+// segment summaries (Store.h): of the segment records are appended to, and
+// of the one closed by a hand-off, programmed once its last page is
+StoreSegmentSummary memAppendSummary;
+StoreSegmentSummary memClosingSummary;
+bool memClosingCounted = false; // memClosingSummary is for the segment being closed
+uint32_t memSummaryBlock = 0;
+bool memSummaryDue = false;
+static uint32_t memMountedTime = 0; // newest RTC time the mounted store holds
 
 void setShouldRecordData(bool val) {
   if(val) {
@@ -18,114 +87,777 @@ void setShouldRecordData(bool val) {
     MPUPowerUp();
   } else {
     MPUPowerDown();
+    if (shouldRecordData) {
+#if LOG_BINARY_RECORDS
+      // PPG samples still waiting for a full block
+      recordPPGFlush();
+#endif
+      memFlush();
+    }
   }
   
   shouldRecordData = val;
 }
 
-void memEnable() {
-  /* 
-  Disable OTHER memory module. Note that SS is automatically pulled
-  high in the next call to SerialFlash.
-  */
-  digitalWrite(FlashChipSelect2, HIGH);
+/**
+Choose linear or circular recording. Circular recording also gives up a
+segment once all of it is older than seconds, or once the segments kept
+come to more than kilobytes; either is ignored when 0. The window is
+applied as each segment is opened.
+**/
+void memSetRetention(bool circular, uint32_t seconds, uint32_t kilobytes) {
+  memCircular = circular;
+  memRetainSeconds = seconds;
+  memRetainKB = kilobytes;
 }
 
-void memDisable() {
-  digitalWrite(FlashChipSelect1, HIGH);
-  digitalWrite(FlashChipSelect2, HIGH);
+/**
+Status of a chip read directly, since SerialFlash only knows about the
+chip it was last begun on. False while a program or erase is running.
+**/
+static bool memChipReady(uint32_t chip) {
+  BusDevice device = (BusDevice) (BUS_FLASH1 + chip);
+  busSelect(device);
+  SPI.transfer(0x05); // read status register
+  uint8_t status = SPI.transfer(0);
+  busDeselect(device);
+  return !(status & 0x01);
 }
 
-void memInit() {
-  pinMode(FlashChipSelect1, OUTPUT);
-  pinMode(FlashChipSelect2, OUTPUT);
+/**
+Point SerialFlash at a chip; only once memChipReady(), as begin() talks
+to it straight away
+**/
+static void memSelectChip(uint32_t chip) {
+  if ((int) chip == memSelectedChip) return;
+  SerialFlash.begin(memChipSelects[chip]);
+  memSelectedChip = chip;
+}
+
+/**
+Last valid checkpoint in a superblock: checkpoints are appended in order,
+so the first erased slot is found by binary search. Returns the number of
+slots in use, or 0 with cp untouched if none is valid.
+**/
+static uint32_t memLastCheckpoint(uint32_t block, StoreCheckpoint *cp) {
+  uint32_t base = block * STORE_BLOCK_SIZE;
+  uint32_t lo = 0, hi = STORE_CHECKPOINTS;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    uint32_t magic;
+    SerialFlash.read(base + mid * STORE_CHECKPOINT_SIZE, &magic, sizeof(magic));
+    if (magic == STORE_ERASED) hi = mid;
+    else lo = mid + 1;
+  }
+
+  // a checkpoint torn by a reset is skipped
+  for (uint32_t used = lo; used > 0 && used + 2 > lo; used--) {
+    StoreCheckpoint last;
+    SerialFlash.read(base + (used - 1) * STORE_CHECKPOINT_SIZE, &last, sizeof(last));
+    if (storeCheckpointValid(&last)) {
+      *cp = last;
+      return lo;
+    }
+  }
+  return 0;
+}
+
+static bool memReadSegmentHeader(uint32_t segment, StoreSegmentHeader *header) {
+  memSelectChip(0);
+  SerialFlash.read(segment * STORE_BLOCK_SIZE, header, sizeof(*header));
+  return storeSegmentValid(header);
+}
+
+// block after this one, wrapping round in circular mode
+static uint32_t memNextBlock(uint32_t block) {
+  block++;
+  if (memCircular && block == memSegmentCount) block = STORE_FIRST_SEGMENT;
+  return block;
+}
+
+// blocks erased and waiting after the segment being written
+static uint32_t memErasedAhead(void) {
+  uint32_t next = memSegmentOpen ? memNextBlock(memSegment) : memSegment;
+  if (memEraseNext >= next) return memEraseNext - next;
+  return memEraseNext + memSegmentCount - STORE_FIRST_SEGMENT - next;
+}
+
+static bool memEraseAheadDue(void) {
+  if (memoryChipReachedCapacity || memEraseNext >= memSegmentCount) return false;
+  return memErasedAhead() < (uint32_t) memEraseAhead;
+}
+
+static void memReleaseTail(void) {
+  memTail = memNextBlock(memTail);
+  memTailSequence++;
+}
+
+/**
+One step of erasing the next block ahead of the write head: on each chip
+in turn, once it is free. In circular mode the oldest segment is given up
+when the head has come round to it.
+**/
+static void memEraseAheadStep(void) {
+  if (!memChipReady(memEraseChip)) return;
+
+  if (memEraseChip == 0 && memEraseNext == memTail && memTailSequence != memSegmentSequence) {
+    memReleaseTail();
+  }
+  memSelectChip(memEraseChip);
+  SerialFlash.eraseBlock(memEraseNext * STORE_BLOCK_SIZE);
+
+  if (++memEraseChip == memChips) {
+    memEraseChip = 0;
+    memEraseNext = memNextBlock(memEraseNext);
+  }
+}
+
+/**
+Give up the oldest segments once they fall outside the retention window.
+The segment being opened is always kept.
+**/
+static void memApplyRetention(void) {
+  if (!memCircular) return;
+
+  uint32_t now = RTCnow();
+  while (memTailSequence != memSegmentSequence) {
+    uint32_t kept = memSegmentSequence - memTailSequence + 1;
+    bool tooBig = memRetainKB && (uint64_t) kept * memSegmentData > (uint64_t) memRetainKB * 1024;
+
+    // the oldest segment ends where the next one starts
+    StoreSegmentHeader next;
+    bool tooOld = memRetainSeconds && (!memReadSegmentHeader(memNextBlock(memTail), &next) ||
+                                       next.opened + memRetainSeconds <= now);
+    if (!tooBig && !tooOld) return;
+    memReleaseTail();
+  }
+}
+
+/**
+First page of a segment not programmed yet, by binary search: pages are
+programmed in order. Chips are idle at boot.
+**/
+static uint32_t memFirstFreePage(uint32_t segment, uint32_t stripes) {
+  uint32_t lo = 1, hi = storeSegmentPages(stripes);
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    uint32_t chip;
+    uint32_t address = storeAddress(segment, stripes, mid * STORE_PAGE_SIZE, &chip);
+    StorePageHeader page;
+    memSelectChip(chip);
+    SerialFlash.read(address, &page, sizeof(page));
+    if (storePageErased(&page)) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
 
+static bool memBlockErased(uint32_t block) {
+  uint32_t magic;
+  SerialFlash.read(block * STORE_BLOCK_SIZE, &magic, sizeof(magic));
+  return magic == STORE_ERASED;
+}
+
+// start counting the samples of a segment afresh
+static void memSummaryReset(uint32_t flags, uint32_t first) {
+  memAppendSummary.magic = STORE_SUMMARY_MAGIC;
+  memAppendSummary.first = first;
+  memAppendSummary.last = first;
+  for (int i = 0; i < STORE_STREAMS; i++) memAppendSummary.samples[i] = 0;
+  memAppendSummary.flags = flags;
+}
+
+// store position on flash with empty superblocks
+static void memFormatted(void) {
+  memCheckpointBlock = 0;
+  memCheckpointSlot = 0;
+  memCheckpointSequence = 1;
+  memSegment = STORE_FIRST_SEGMENT;
+  memSegmentSequence = 1;
+  memSegmentOpen = false;
+  memTail = memSegment;
+  memTailSequence = memSegmentSequence;
+  memEraseNext = memSegment;
+  memEraseChip = 0;
+  memSegmentLeft = memSegmentData;
+  memoryChipReachedCapacity = false;
+  memSummaryReset(0, STORE_ERASED);
+  memClosingCounted = false;
+  memSummaryDue = false;
+}
+
+/**
+Find where the last recording stopped from the newest checkpoint, then
+step over the segment opened after it if the checkpoint for that one was
+lost, and past any oldest segments erased since. Recording carries on in
+the newest segment after its last page. A chip with no checkpoints is
+formatted.
+**/
+static void memMount() {
+  StoreCheckpoint newest = {}, cp;
+  bool found = false;
+
+  memSelectChip(0);
+  for (uint32_t block = 0; block < STORE_SUPERBLOCKS; block++) {
+    uint32_t used = memLastCheckpoint(block, &cp);
+    if (used && (!found || (int32_t) (cp.sequence - newest.sequence) > 0)) {
+      newest = cp;
+      found = true;
+      memCheckpointBlock = block;
+      memCheckpointSlot = used;
+    }
+  }
+
+  if (!found) {
+    for (uint32_t block = 0; block < STORE_SUPERBLOCKS; block++) {
+      if (memBlockErased(block)) continue;
+      SerialFlash.eraseBlock(block * STORE_BLOCK_SIZE);
+      SerialFlash.wait();
+    }
+    memFormatted();
+    return;
+  }
+
+  uint32_t segment = newest.segment;
+  uint32_t sequence = newest.segmentSequence;
+  StoreSegmentHeader header;
+  uint32_t next = memNextBlock(segment);
+  while (next < memSegmentCount && memReadSegmentHeader(next, &header) && header.sequence == sequence + 1) {
+    segment = next;
+    sequence++;
+    next = memNextBlock(segment);
+  }
+
+  memCheckpointSequence = newest.sequence + 1;
+  uint32_t pages = storeSegmentPages(memChips);
+  StoreSegmentSummary summary;
+  bool valid = memReadSegmentHeader(segment, &header);
+  SerialFlash.read(segment * STORE_BLOCK_SIZE + STORE_SEGMENT_HEADER_SIZE, &summary, sizeof(summary));
+  if (storeSummaryValid(&summary)) memMountedTime = summary.last;
+  else if (valid) memMountedTime = header.opened;
+  bool resumable = valid && header.stripes == memChips;
+  uint32_t page = resumable ? memFirstFreePage(segment, memChips) : pages;
+  if (page < pages) {
+    memSegment = segment;
+    memSegmentSequence = sequence;
+    memSegmentOpen = true;
+    memPageIndex = page;
+    memSegmentLeft = (pages - page) * STORE_PAGE_DATA;
+    // what came before the reset is not counted again
+    memSummaryReset(STORE_SUMMARY_PARTIAL, header.opened);
+  } else {
+    memSegment = next;
+    memSegmentSequence = sequence + 1;
+    memSegmentLeft = memSegmentData;
+    memSummaryReset(0, STORE_ERASED);
+  }
+
+  memTail = newest.tail;
+  memTailSequence = newest.tailSequence;
+  while (memTailSequence != memSegmentSequence &&
+         (!memReadSegmentHeader(memTail, &header) || header.sequence != memTailSequence)) {
+    memReleaseTail();
+  }
+  // nothing ahead of the head is known to be erased
+  memEraseNext = memSegmentOpen ? memNextBlock(memSegment) : memSegment;
+}
+
+void memInit() {
+  busAcquire(BUS_FLASH1);
   if (!SerialFlash.begin(FlashChipSelect1)) {
     memError("Unable to access SPI Flash chip");
   }
 
-  SerialFlash.printStatus();
+  uint8_t id[5];
+  SerialFlash.readID(id);
+  memSegmentCount = SerialFlash.capacity(id) / STORE_BLOCK_SIZE;
 
-  SerialFlash.opendir();
-  while (1) {
-    char filename[64];
-    unsigned long filesize;
+  // a second chip doubles capacity and lets programs overlap
+  if (SerialFlash.begin(FlashChipSelect2)) {
+    SerialFlash.readID(id);
+    uint32_t blocks = SerialFlash.capacity(id) / STORE_BLOCK_SIZE;
+    if (blocks > STORE_FIRST_SEGMENT) {
+      memChips = 2;
+      if (blocks < memSegmentCount) memSegmentCount = blocks;
+    }
+  }
+  memSelectedChip = 1;
+  memSegmentData = (storeSegmentPages(memChips) - 1) * STORE_PAGE_DATA;
+
+  memMount();
+  busRelease();
+
+  SerialUSB.print("Log store: ");
+  SerialUSB.print(memChips);
+  SerialUSB.print(memCircular ? " chip(s), circular, next segment " : " chip(s), next segment ");
+  SerialUSB.print(memSegment);
+  SerialUSB.print(" of ");
+  SerialUSB.print(memSegmentCount);
+  SerialUSB.print(", sequence ");
+  SerialUSB.print(memSegmentSequence);
+  SerialUSB.print(", page ");
+  SerialUSB.print(memSegmentOpen ? memPageIndex : 1);
+  SerialUSB.print(", oldest kept ");
+  SerialUSB.println(memTailSequence);
+}
+
+/**
+Newest RTC time memInit() found on flash: when the segment recording
+resumes in was opened, or else the last sample of the newest segment
+**/
+uint32_t memLatestTime(void) {
+  return memMountedTime;
+}
+
+// the segment's last page is written; the next page opens a new one
+static void memSegmentClosed(void) {
+  if(memClosingCounted) {
+    memSummaryBlock = memSegment;
+    memSummaryDue = true;
+    memClosingCounted = false;
+  }
+  memSegment = memNextBlock(memSegment);
+  memSegmentSequence++;
+  memSegmentOpen = false;
+  SerialUSB.println("Wrote to new segment!");
+}
+
+/**
+Committed bytes not cut into a page yet, from the page cursor on. When
+the cursor is still in the handed-off buffer a page runs on into the
+active one, unless the handed-off buffer ends the segment.
+**/
+static int memPageAvailable(bool *segmentEnd) {
+  *segmentEnd = false;
+  if(memPageBuffer == memActiveBuffer) return bufferIndex - memPageOffset;
+
+  int available = memBufferLength[memPageBuffer] - memPageOffset;
+  if(memBufferEndsSegment[memPageBuffer]) {
+    *segmentEnd = true;
+    return available;
+  }
+  return available + bufferIndex;
+}
 
-    if (SerialFlash.readdir(filename, sizeof(filename), filesize)) {
-      memFileCounter++;
-    } else {
-      break; // no more files
+/**
+A page is cut once it can be filled, or part full when it is the last of
+its segment or memFlush() asked for everything committed so far.
+**/
+static bool memPageDue(void) {
+  if(memPageStaged) return true;
+  bool segmentEnd;
+  int available = memPageAvailable(&segmentEnd);
+  if(available >= (int) STORE_PAGE_DATA) return true;
+  return available > 0 && (segmentEnd || (int32_t) (memFlushUntil - memPaged) > 0);
+}
+
+/**
+Copy the next page of record stream out of the capture buffers into
+memPage, moving the cursor on to the active buffer when it reaches the
+end of the handed-off one.
+**/
+static void memCutPage(void) {
+  bool segmentEnd;
+  int n = memPageAvailable(&segmentEnd);
+  if(n > (int) STORE_PAGE_DATA) n = STORE_PAGE_DATA;
+  if((int32_t) (memFlushUntil - memPaged) > 0 && (uint32_t) n > memFlushUntil - memPaged) {
+    n = memFlushUntil - memPaged;
+  }
+
+  memPage.header.length = n;
+  memPage.header.flags = memPageOffset == 0 && memBufferStartsStream[memPageBuffer] ? STORE_PAGE_STREAM_START : 0;
+  memPageClosesSegment = false;
+
+  uint8_t *out = memPage.data;
+  int left = n;
+  while(left > 0) {
+    int end = memPageBuffer == memActiveBuffer ? bufferIndex : memBufferLength[memPageBuffer];
+    int take = end - memPageOffset < left ? end - memPageOffset : left;
+    memcpy(out, memBuffers[memPageBuffer] + memPageOffset, take);
+    out += take;
+    left -= take;
+    memPageOffset += take;
+    if(memPageBuffer != memActiveBuffer && memPageOffset == end) {
+      memPageClosesSegment = memBufferEndsSegment[memPageBuffer];
+      memPageBuffer = memActiveBuffer;
+      memPageOffset = 0;
     }
   }
+
+  memPaged += n;
+  memPageCuts++;
+  memPageStaged = true;
 }
 
-void memCreateFileNameFromCounter(char *fileName) {
-  String constructedFileName = (memFileNameDefault + memFileCounter + ".txt");
-  constructedFileName.toCharArray(fileName, 64);
+/**
+Hand the active buffer to memService() and start appending to the other
+one. Fails while the other buffer still has bytes waiting to be cut into
+pages.
+**/
+static bool memHandOff(bool closeSegment) {
+  if(memPageBuffer != memActiveBuffer) return false;
+
+  // don't leave a tail so short it would fill before this buffer is written
+  if(memSegmentLeft < memBufferSize / 2) closeSegment = true;
+
+  memBufferLength[memActiveBuffer] = bufferIndex;
+  memBufferEndsSegment[memActiveBuffer] = closeSegment;
+  if(closeSegment) {
+    memClosingSummary = memAppendSummary;
+    if(memClosingSummary.first == STORE_ERASED) memClosingSummary.first = memClosingSummary.last = RTCnow();
+    memClosingCounted = true;
+    memSummaryReset(0, STORE_ERASED);
+  }
+  memActiveBuffer ^= 1;
+  memBufferStartsStream[memActiveBuffer] = closeSegment;
+
+  // all of it is in pages already: the cursor moves straight on
+  if(memPageOffset == bufferIndex) {
+    memPageBuffer = memActiveBuffer;
+    memPageOffset = 0;
+    if(closeSegment && memPageStaged) memPageClosesSegment = true;
+    else if(closeSegment && memSegmentOpen) memSegmentClosed();
+  }
+
+  bufferIndex = 0;
+  if(closeSegment) {
+    memSegmentLeft = memSegmentData;
+    memStreamStart = true;
+  }
+  return true;
 }
 
-void memWrite(const char *s) {  
-  if(!shouldRecordData) return;
-  if(strlen(bufferedData) < fileSizeInBytes*0.9) {
-    strcat(bufferedData, s);
-    strcat(bufferedData, "\n");
-  } else {
-    memCreateNewFile();
-    // clear the buffer
-    memset(bufferedData, 0, sizeof(bufferedData));
-    memWrite(s);
+/**
+Reserve len bytes at the append cursor, handing the buffer over for
+flushing first if they don't fit in it or in the current segment.
+Producers write their record in place and then call memCommit() with the
+bytes actually used. Returns NULL when not recording, or when both
+buffers are full and the record has to be dropped (counted in
+memDroppedRecords()).
+**/
+uint8_t *memReserve(int len) {
+  if(!shouldRecordData) return NULL;
+
+  int need = len;
+#if LOG_BINARY_RECORDS
+  if(memStreamStart) need += REC_START_SIZE + REC_TIME_SIZE;
+#endif
+  if(need > memSegmentLeft || bufferIndex + need > memBufferSize) {
+    if(!memHandOff(need > memSegmentLeft)) {
+      memRecordsDropped++;
+      return NULL;
+    }
+  }
+#if LOG_BINARY_RECORDS
+  if(memStreamStart) {
+    memCommit(recordFileHeader((uint8_t *) memBuffers[memActiveBuffer] + bufferIndex));
   }
+#endif
+  memStreamStart = false;
+  return (uint8_t *) memBuffers[memActiveBuffer] + bufferIndex;
 }
 
-void memCreateNewFile() {
-  noInterrupts();
-  disableAFE();
-  memEnable();
+void memCommit(int len) {
+  bufferIndex += len;
+  memCommitted += len;
+  memSegmentLeft -= len;
+}
+
+/**
+Count samples just committed, taken from firstTick to lastTick, into the
+summary of the segment they went to
+**/
+void memCountSamples(StoreStream stream, uint32_t count, uint32_t firstTick, uint32_t lastTick) {
+  StoreSegmentSummary &summary = memAppendSummary;
+  uint32_t first = RTCtimeAt(firstTick);
+  uint32_t last = RTCtimeAt(lastTick);
+  // a PPG block is written after samples taken during it
+  if(summary.first == STORE_ERASED) summary.first = summary.last = first;
+  if(first < summary.first) summary.first = first;
+  if(last > summary.last) summary.last = last;
+  summary.samples[stream] += count;
+}
 
+/**
+Have memService() write out everything committed so far, the last page
+part full, rather than wait for full pages. The space the short page
+leaves unused is taken off what the segment can still hold.
+**/
+void memFlush(void) {
+  bool segmentEnd;
+  int available = memPageAvailable(&segmentEnd);
+  int pending = segmentEnd ? bufferIndex : available;
+  if(pending % STORE_PAGE_DATA) memSegmentLeft -= STORE_PAGE_DATA - pending % STORE_PAGE_DATA;
+  memFlushUntil = memCommitted;
+}
+
+int memBufferFill(void) {
+  return bufferIndex;
+}
+
+// committed bytes a reset would lose now
+// pages cut so far: a change means everything committed before it is on its way to flash
+uint32_t memPagesCut(void) {
+  return memPageCuts;
+}
+
+int memPendingBytes(void) {
+  return memCommitted - memPaged + (memPageStaged ? memPage.header.length : 0);
+}
+
+unsigned long memDroppedRecords(void) {
+  return memRecordsDropped;
+}
+
+bool memFlushPending(void) {
+  return memFlushState != MEM_FLUSH_IDLE || memSummaryDue || memPageDue();
+}
+
+// a legacy text line, newline added
+bool memWrite(const char *line, int len) {
+  char *p = (char *) memReserve(len + 1);
+  if(!p) return false;
+  memcpy(p, line, len);
+  p[len] = '\n';
+  memCommit(len + 1);
+  return true;
+}
+
+/**
+One step of opening the next segment for the page waiting to be written:
+erase its block if the erase-ahead has not, write its header, then
+checkpoint it in the superblock along with the oldest segment kept. Steps
+wait for the chip they need. Once linear recording has filled the chips
+the page is discarded instead.
+**/
+void memOpenSegment() {
   if(memoryChipReachedCapacity) {
-    memDisable();
-    enableAFE();
-    interrupts();
+    memPageStaged = false;
+    memFlushState = MEM_FLUSH_IDLE;
     return;
   }
 
-  if(maxFilesToLog < memFileCounter + 1) {
+  if(memSegment >= memSegmentCount) {
     memoryChipReachedCapacity = true;
-    memDisable();
-    enableAFE();
-    interrupts();
+    memPageStaged = false;
+    memFlushState = MEM_FLUSH_IDLE;
     memCapacityReachedChangePowerLED();
     return;
   }
-  
-  SerialFlashFile file;
-  char fileName[64];
-  memCreateFileNameFromCounter(fileName);
 
-  while (SerialFlash.exists(fileName)) {
-    memFileCounter++;
-    memCreateFileNameFromCounter(fileName);
+  if(memOpenStep == MEM_OPEN_ERASE) {
+    if(memErasedAhead() == 0) {
+      memEraseAheadStep();
+      return;
+    }
+    memOpenStep = MEM_OPEN_HEADER;
   }
 
-  if (!SerialFlash.create(fileName, fileSizeInBytes)) {
-    memError("File could not be created!");
+  // the header and superblocks are on the first chip
+  if(!memChipReady(0)) return;
+  memSelectChip(0);
+
+  if(memOpenStep == MEM_OPEN_HEADER) {
+    StoreSegmentHeader header = { STORE_SEGMENT_MAGIC, memSegmentSequence, memChips, (uint32_t) RTCnow(),
+                                  { STORE_ERASED, STORE_ERASED, STORE_ERASED }, 0 };
+    header.crc = crc32(&header, sizeof(header) - 4);
+    SerialFlash.write(memSegment * STORE_BLOCK_SIZE, &header, sizeof(header));
+    memSegmentOpen = true;
+    memPageIndex = 1;
+    memOpenStep = MEM_OPEN_CHECKPOINT;
+    return;
+  }
+
+  // a full superblock hands over to the other one, erased first
+  if(memCheckpointSlot == STORE_CHECKPOINTS) {
+    uint32_t other = memCheckpointBlock ^ 1;
+    if(!memSuperblockErased) {
+      SerialFlash.eraseBlock(other * STORE_BLOCK_SIZE);
+      memSuperblockErased = true;
+      return;
+    }
+    memSuperblockErased = false;
+    memCheckpointBlock = other;
+    memCheckpointSlot = 0;
+  }
+
+  memApplyRetention();
+
+  StoreCheckpoint cp = { STORE_CHECKPOINT_MAGIC, memCheckpointSequence, memSegment, memSegmentSequence,
+                         memTail, memTailSequence, STORE_ERASED, 0 };
+  cp.crc = crc32(&cp, sizeof(cp) - 4);
+  SerialFlash.write(memCheckpointBlock * STORE_BLOCK_SIZE + memCheckpointSlot * STORE_CHECKPOINT_SIZE,
+                    &cp, sizeof(cp));
+  memCheckpointSlot++;
+  memCheckpointSequence++;
+  memFlushState = MEM_FLUSH_PROGRAM;
+}
+
+/**
+Program the page waiting in memPage, header and crc included, once the
+chip it falls on has finished its previous one. Pages alternate between
+chips, so with two the next page is usually free to go while this one
+programs.
+**/
+static void memProgramPage() {
+  uint32_t chip;
+  uint32_t address = storeAddress(memSegment, memChips, memPageIndex * STORE_PAGE_SIZE, &chip);
+  if(!memChipReady(chip)) return;
+  memSelectChip(chip);
+
+  memPage.header.index = memPageIndex;
+  memPage.header.crc = storePageCrc(&memPage.header, memPage.data);
+  SerialFlash.write(address, &memPage, STORE_PAGE_HEADER_SIZE + memPage.header.length);
+  memPageIndex++;
+  memPageStaged = false;
+  memFlushState = MEM_FLUSH_IDLE;
+  statsFlush(halTicks() - memFlushStarted);
+  if(memPageClosesSegment) memSegmentClosed();
+}
+
+/**
+Program the summary of the segment just closed after its header, on the
+first chip
+**/
+static void memWriteSummary() {
+  if(!memChipReady(0)) return;
+  memSelectChip(0);
+
+  memClosingSummary.crc = crc32(&memClosingSummary, sizeof(memClosingSummary) - 4);
+  SerialFlash.write(memSummaryBlock * STORE_BLOCK_SIZE + STORE_SEGMENT_HEADER_SIZE, &memClosingSummary,
+                    sizeof(memClosingSummary));
+  memSummaryDue = false;
+  memFlushState = MEM_FLUSH_IDLE;
+}
+
+/**
+Advance the background flush by at most one step: one stage of opening a
+segment, one flash page program, or a closed segment's summary, each once
+the chip it needs has finished its previous one. With no page due, one
+step of the erase-ahead instead; pages for the chip being erased then
+wait for it, up to a block erase time, and the capture buffers take up
+the slack. Called from loop() between samples; interrupts stay enabled
+throughout.
+**/
+void memService() {
+  if(memErasingAll) return;
+
+  if(memFlushState == MEM_FLUSH_IDLE && memSummaryDue) {
+    memFlushState = MEM_FLUSH_SUMMARY;
+  } else if(memFlushState == MEM_FLUSH_IDLE) {
+    if(memoryChipReachedCapacity) {
+      while(memPageDue()) {
+        if(!memPageStaged) memCutPage();
+        memPageStaged = false;
+      }
+      return;
+    }
+
+    if(memPageDue()) {
+      if(!memPageStaged) memCutPage();
+      // a full segment without a close is never expected; start a new one
+      if(memSegmentOpen && memPageIndex == storeSegmentPages(memChips)) memSegmentClosed();
+      memFlushState = memSegmentOpen ? MEM_FLUSH_PROGRAM : MEM_FLUSH_OPEN;
+      memOpenStep = MEM_OPEN_ERASE;
+      memFlushStarted = halTicks();
+    } else if(!memEraseAheadDue() || bufferIndex >= memBufferSize / 2) {
+      // only start an erase while the active buffer has room to take up
+      // what arrives meanwhile
+      return;
+    }
+  }
+
+  uint32_t started = halTicks();
+  busAcquire(BUS_FLASH1);
+
+  if(memFlushState == MEM_FLUSH_IDLE) {
+    memEraseAheadStep();
+  } else if(memFlushState == MEM_FLUSH_OPEN) {
+    memOpenSegment();
+  } else if(memFlushState == MEM_FLUSH_SUMMARY) {
+    memWriteSummary();
   } else {
-    memFileCounter++;
+    memProgramPage();
   }
 
-  while (!SerialFlash.ready());
+  busRelease();
+  statsService(halTicks() - started);
+}
+
+void memStoreInfo(MemStoreInfo *info) {
+  info->chips = memChips;
+  info->blocks = memSegmentCount;
+  info->head = memSegment;
+  info->headSequence = memSegmentSequence;
+  info->headPages = memSegmentOpen ? memPageIndex : 0;
+  info->tail = memTail;
+  info->tailSequence = memTailSequence;
+  info->circular = memCircular;
+  info->recording = shouldRecordData;
+}
+
+/**
+Read flash directly, for offload. False, to be tried again, until the
+flush has written out everything committed and the chip is free.
+**/
+bool memReadRaw(uint32_t chip, uint32_t address, void *buf, uint32_t len) {
+  if(chip >= memChips || memErasingAll || memFlushPending()) return false;
 
-  file = SerialFlash.open(fileName);
-  if (file) {  // true if the file exists
-    file.write(bufferedData, fileSizeInBytes);
-    SerialUSB.println("Wrote to new file!");
-  } else memError("File could not be opened!");
+  busAcquire(BUS_FLASH1);
+  bool ready = memChipReady(chip);
+  if(ready) {
+    memSelectChip(chip);
+    SerialFlash.read(address, buf, len);
+  }
+  busRelease();
+  return ready;
+}
 
-  while (!SerialFlash.ready());
+/**
+Start erasing every chip, which leaves an empty store. Recording has to
+be stopped; false, to be tried again, until the flush has finished and
+the chips are free. memEraseAllDone() tells when it is over.
+**/
+bool memEraseAll(void) {
+  if(shouldRecordData || memErasingAll || memFlushPending()) return false;
 
-  memDisable();
-  enableAFE();
-  interrupts();
+  busAcquire(BUS_FLASH1);
+  bool ready = true;
+  for(uint32_t chip = 0; chip < memChips; chip++) ready = ready && memChipReady(chip);
+  if(ready) {
+    for(uint32_t chip = 0; chip < memChips; chip++) {
+      memSelectChip(chip);
+      SerialFlash.eraseAll();
+      busYield();
+    }
+    memErasingAll = true;
+  }
+  busRelease();
+  return ready;
+}
+
+bool memEraseAllDone(void) {
+  if(!memErasingAll) return true;
+
+  busAcquire(BUS_FLASH1);
+  bool done = true;
+  for(uint32_t chip = 0; chip < memChips; chip++) done = done && memChipReady(chip);
+  busRelease();
+  if(!done) return false;
+
+  // what is recorded next starts a new stream in the first segment
+  memFormatted();
+  memActiveBuffer = 0;
+  bufferIndex = 0;
+  memPageBuffer = 0;
+  memPageOffset = 0;
+  memBufferStartsStream[0] = true;
+  memStreamStart = true;
+  memPaged = memCommitted;
+  memFlushUntil = memCommitted;
+  memErasingAll = false;
+  SerialUSB.println("Log store erased");
+  return true;
 }
 
 void memError(const char *message) {
@@ -136,32 +868,27 @@ void memError(const char *message) {
   }
 }
 
-void memOutputListOfExistingFiles(void) {
-  noInterrupts();
-  disableAFE();
-  
-  SerialFlash.opendir();
-  while (1) {
-    char filename[64];
-    unsigned long filesize;
-
-    if (SerialFlash.readdir(filename, sizeof(filename), filesize)) {
-      SerialUSB.print("  ");
-      SerialUSB.print(filename);
-      for (int i = 0; i < 20 - strlen(filename); i++) {
-        SerialUSB.print(" ");
-      }
-      SerialUSB.print("  ");
-      SerialUSB.print(filesize);
-      SerialUSB.print(" bytes");
-      SerialUSB.println();
-    } else {
-      break; // no more files
-    }
+/**
+Segments kept, oldest first; reads every header, so for debugging only
+**/
+void memOutputListOfSegments(void) {
+  busAcquire(BUS_FLASH1);
+
+  uint32_t segment = memTail;
+  for (uint32_t sequence = memTailSequence; sequence != memSegmentSequence + memSegmentOpen;
+       sequence++, segment = memNextBlock(segment)) {
+    StoreSegmentHeader header;
+    if (!memReadSegmentHeader(segment, &header)) continue;
+    busYield();
+    SerialUSB.print("  segment ");
+    SerialUSB.print(segment);
+    SerialUSB.print("  sequence ");
+    SerialUSB.print(header.sequence);
+    SerialUSB.print("  chips ");
+    SerialUSB.println(header.stripes);
   }
 
-  enableAFE();
-  interrupts();
+  busRelease();
 }
 
 void memCapacityReachedChangePowerLED() {
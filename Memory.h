@@ -1,23 +1,64 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
-const int fileSizeInBytes = 16384; // keep this well below 20K as the total sram is 32K
+#include "Store.h"
+
+const int memBufferSize = 4096; // two of these are resident; the total sram is 32K
+const int memEraseAhead = 1;    // segments kept erased ahead of the write head
 const int FlashChipSelect1 = 7;
 const int FlashChipSelect2 = 6;
-const String memFileNameDefault = "r";
-const int maxChipCapacity = 67108864; // taken from SerialFlash.capacity(id)
-const int maxFilesToLog = 3900; // maxChipCapacity/fileSizeInBytes
 
-void memEnable();
-void memDisable();
+/*
+Recording mode: linear recording stops once the flash is full, circular
+recording reuses the oldest segments. A retention window in seconds or
+kilobytes (0 for none) limits how much circular recording keeps.
+*/
+#ifndef MEM_CIRCULAR
+#define MEM_CIRCULAR 0
+#endif
+#ifndef MEM_RETAIN_SECONDS
+#define MEM_RETAIN_SECONDS 0
+#endif
+#ifndef MEM_RETAIN_KB
+#define MEM_RETAIN_KB 0
+#endif
+
+// where the log store stands, for reading it out
+struct MemStoreInfo {
+  uint32_t chips;
+  uint32_t blocks;          // erase blocks per chip
+  uint32_t head;            // block of the segment being written
+  uint32_t headSequence;
+  uint32_t headPages;       // pages written in it, 0 if not opened yet
+  uint32_t tail;            // block of the oldest segment kept
+  uint32_t tailSequence;
+  bool circular;
+  bool recording;
+};
+
 void memInit();
 void memError(const char *message);
 
-void memCreateFileNameFromCounter(char *fileName);
-void memCreateNewFile();
-void memOutputListOfExistingFiles(void);
-void memWrite(const char *s);
+void memOpenSegment();
+void memService();
+bool memFlushPending(void);
+void memFlush(void);
+int memPendingBytes(void);
+uint32_t memPagesCut(void);
+uint32_t memLatestTime(void);
+unsigned long memDroppedRecords(void);
+void memOutputListOfSegments(void);
+bool memWrite(const char *line, int len);
+uint8_t *memReserve(int len);
+void memCommit(int len);
+void memCountSamples(StoreStream stream, uint32_t count, uint32_t firstTick, uint32_t lastTick);
+int memBufferFill(void);
 void memCapacityReachedChangePowerLED();
 void setShouldRecordData(bool val);
+void memSetRetention(bool circular, uint32_t seconds, uint32_t kilobytes);
+void memStoreInfo(MemStoreInfo *info);
+bool memReadRaw(uint32_t chip, uint32_t address, void *buf, uint32_t len);
+bool memEraseAll(void);
+bool memEraseAllDone(void);
 
 #endif
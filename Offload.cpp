@@ -0,0 +1,309 @@
+#include <Arduino.h>
+#include "Offload.h"
+#include "Memory.h"
+#include "Crc.h"
+
+/*============================================
+=        Offload over SerialUSB              =
+==============================================*/
+
+enum OffloadState { OFFLOAD_IDLE, OFFLOAD_LISTING, OFFLOAD_READING, OFFLOAD_ERASING };
+
+static OffloadState offloadState = OFFLOAD_IDLE;
+
+// request being assembled from SerialUSB
+static uint8_t offloadRx[sizeof(OffloadFrameHeader) + sizeof(OffloadReadRequest) + 4];
+static int offloadRxLength = 0;
+
+// frame being sent, built in place
+static uint8_t offloadTx[OFFLOAD_FRAME_OVERHEAD + OFFLOAD_MAX_PAYLOAD];
+
+// store as the request found it; listing: the next segment to send
+static MemStoreInfo offloadStore;
+static bool offloadInfoSent = false;
+static uint32_t offloadListBlock = 0;
+static uint32_t offloadListSequence = 0;
+
+// finding: the time range, and the segments, counted from the tail, the
+// first one ending in it is still searched for among
+static uint8_t offloadListType = OFFLOAD_LIST;
+static OffloadFindRequest offloadRange;
+static uint32_t offloadFindLow = 0;
+static uint32_t offloadFindHigh = 0;
+
+// reading: chip bytes [offloadSent, offloadEnd) still to go, and the
+// first one the host has not acknowledged
+static uint32_t offloadChip = 0;
+static uint32_t offloadSent = 0;
+static uint32_t offloadAcked = 0;
+static uint32_t offloadEnd = 0;
+static uint32_t offloadWindow = OFFLOAD_WINDOW;
+
+static bool offloadErasing = false;   // memEraseAll() started
+
+static uint8_t *offloadPayload(void) {
+  return offloadTx + sizeof(OffloadFrameHeader);
+}
+
+// frame the payload already in offloadTx and send it
+static void offloadSend(uint8_t type, uint32_t length) {
+  OffloadFrameHeader header = { OFFLOAD_SYNC, type, (uint16_t) length };
+  memcpy(offloadTx, &header, sizeof(header));
+  uint32_t end = sizeof(header) + length;
+  uint32_t crc = crc32(offloadTx, end);
+  memcpy(offloadTx + end, &crc, sizeof(crc));
+  SerialUSB.write(offloadTx, end + sizeof(crc));
+}
+
+static void offloadDone(uint8_t request, uint8_t status) {
+  OffloadDone done = { request, status, 0 };
+  memcpy(offloadPayload(), &done, sizeof(done));
+  offloadSend(OFFLOAD_DONE, sizeof(done));
+  offloadState = OFFLOAD_IDLE;
+}
+
+static void offloadSendInfo(void) {
+  OffloadInfo info = { OFFLOAD_VERSION, (uint8_t) offloadStore.chips, offloadStore.circular,
+                       offloadStore.recording, offloadStore.blocks, STORE_BLOCK_SIZE, offloadStore.head,
+                       offloadStore.headSequence, offloadStore.headPages, offloadStore.tail,
+                       offloadStore.tailSequence };
+  memcpy(offloadPayload(), &info, sizeof(info));
+  offloadSend(OFFLOAD_INFO, sizeof(info));
+}
+
+// C frame, sent straight away whatever else is going on
+static void offloadSendStats(void) {
+  StatsSnapshot stats;
+  statsRead(&stats, false);
+  memcpy(offloadPayload(), &stats, sizeof(stats));
+  offloadSend(OFFLOAD_COUNTERS, sizeof(stats));
+}
+
+/**
+Act on a request; a new request replaces one still going. Reads and the
+erase stop recording first, which only a record request turns back on.
+**/
+static void offloadRequest(uint8_t type, const uint8_t *payload, uint32_t length) {
+  if (type == OFFLOAD_ACK) {
+    OffloadAck ack;
+    if (length != sizeof(ack) || offloadState != OFFLOAD_READING) return;
+    memcpy(&ack, payload, sizeof(ack));
+    if (ack.offset > offloadAcked && ack.offset <= offloadSent) offloadAcked = ack.offset;
+    return;
+  }
+  if (type == OFFLOAD_STATS) {
+    if (length == 0) offloadSendStats();
+    return;
+  }
+
+  if (type == OFFLOAD_RECORD) {
+    OffloadRecordRequest record;
+    // the chips have to be left alone until an erase is over
+    if (length != sizeof(record) || offloadErasing) {
+      offloadDone(type, OFFLOAD_BAD_REQUEST);
+      return;
+    }
+    memcpy(&record, payload, sizeof(record));
+    setShouldRecordData(record.on != 0);
+    offloadDone(type, OFFLOAD_OK);
+    return;
+  }
+
+  memStoreInfo(&offloadStore);
+  if (type == OFFLOAD_READ || type == OFFLOAD_ERASE) setShouldRecordData(false);
+
+  if ((type == OFFLOAD_LIST && length == 0) || (type == OFFLOAD_FIND && length == sizeof(offloadRange))) {
+    if (type == OFFLOAD_FIND) memcpy(&offloadRange, payload, sizeof(offloadRange));
+    offloadListType = type;
+    offloadInfoSent = false;
+    offloadState = OFFLOAD_LISTING;
+  } else if (type == OFFLOAD_READ && length == sizeof(OffloadReadRequest)) {
+    OffloadReadRequest read;
+    memcpy(&read, payload, sizeof(read));
+    uint32_t capacity = offloadStore.blocks * STORE_BLOCK_SIZE;
+    if (read.chip >= offloadStore.chips || read.start > read.end || read.end > capacity || !read.window) {
+      offloadDone(type, OFFLOAD_BAD_REQUEST);
+      return;
+    }
+    offloadChip = read.chip;
+    offloadSent = offloadAcked = read.start;
+    offloadEnd = read.end;
+    offloadWindow = read.window < OFFLOAD_WINDOW ? read.window : OFFLOAD_WINDOW;
+    offloadState = OFFLOAD_READING;
+  } else if (type == OFFLOAD_ERASE && length == sizeof(OffloadEraseRequest)) {
+    OffloadEraseRequest erase;
+    memcpy(&erase, payload, sizeof(erase));
+    if (erase.key != OFFLOAD_ERASE_KEY) {
+      offloadDone(type, OFFLOAD_BAD_REQUEST);
+      return;
+    }
+    offloadState = OFFLOAD_ERASING;
+  } else {
+    offloadDone(type, OFFLOAD_BAD_REQUEST);
+  }
+}
+
+/**
+Take in what the host has sent. A frame that fails its crc, or claims
+more payload than any request has, loses its sync byte and the rest is
+searched again.
+**/
+static void offloadReceive(void) {
+  while (SerialUSB.available() > 0) {
+    uint8_t c = SerialUSB.read();
+    if (offloadRxLength == 0 && c != OFFLOAD_SYNC) continue;
+    offloadRx[offloadRxLength++] = c;
+
+    while (offloadRxLength >= (int) sizeof(OffloadFrameHeader)) {
+      OffloadFrameHeader header;
+      memcpy(&header, offloadRx, sizeof(header));
+      uint32_t frame = OFFLOAD_FRAME_OVERHEAD + header.length;
+      bool fits = frame <= sizeof(offloadRx);
+      if (fits && (uint32_t) offloadRxLength < frame) break;
+
+      uint32_t crc = 0;
+      if (fits) memcpy(&crc, offloadRx + frame - sizeof(crc), sizeof(crc));
+      if (fits && crc == crc32(offloadRx, frame - sizeof(crc))) {
+        offloadRxLength = 0;
+        offloadRequest(header.type, offloadRx + sizeof(header), header.length);
+        break;
+      }
+
+      // resynchronise on the next sync byte
+      int next = 1;
+      while (next < offloadRxLength && offloadRx[next] != OFFLOAD_SYNC) next++;
+      memmove(offloadRx, offloadRx + next, offloadRxLength - next);
+      offloadRxLength -= next;
+    }
+  }
+}
+
+/**
+One step of the binary search for the first segment kept that ends at or
+after the start of the range: segments are in time order from the tail.
+Listing starts there once the search is over.
+**/
+static void offloadFindStep(void) {
+  uint32_t middle = (offloadFindLow + offloadFindHigh) / 2;
+  uint32_t block = storeSegmentBlock(offloadStore.tail, middle, offloadStore.blocks);
+  StoreSegmentSummary summary;
+  if (!memReadRaw(0, block * STORE_BLOCK_SIZE + STORE_SEGMENT_HEADER_SIZE, &summary, sizeof(summary))) return;
+
+  if (storeSegmentEnd(&summary) < offloadRange.from) offloadFindLow = middle + 1;
+  else offloadFindHigh = middle;
+  if (offloadFindLow == offloadFindHigh) {
+    offloadListSequence = offloadStore.tailSequence + offloadFindLow;
+    offloadListBlock = storeSegmentBlock(offloadStore.tail, offloadFindLow, offloadStore.blocks);
+  }
+}
+
+/**
+Info once a recording stopped for an earlier request has been flushed,
+then one segment header and summary per call. Finding searches first and
+stops at the first segment starting after the range.
+**/
+static void offloadSendSegment(void) {
+  if (!offloadInfoSent) {
+    if (memFlushPending()) return;
+    bool recording = offloadStore.recording;
+    memStoreInfo(&offloadStore);
+    offloadStore.recording = recording;
+    offloadSendInfo();
+    offloadListBlock = offloadStore.tail;
+    offloadListSequence = offloadStore.tailSequence;
+    offloadFindLow = 0;
+    offloadFindHigh = 0;
+    if (offloadListType == OFFLOAD_FIND) {
+      offloadFindHigh = offloadStore.headSequence - offloadStore.tailSequence + (offloadStore.headPages ? 1 : 0);
+    }
+    offloadInfoSent = true;
+    return;
+  }
+
+  if (offloadFindLow < offloadFindHigh) {
+    offloadFindStep();
+    return;
+  }
+
+  uint32_t last = offloadStore.headSequence - (offloadStore.headPages ? 0 : 1);
+  if ((int32_t) (offloadListSequence - last) > 0) {
+    offloadDone(offloadListType, OFFLOAD_OK);
+    return;
+  }
+
+  OffloadSegment segment;
+  segment.block = offloadListBlock;
+  uint32_t address = offloadListBlock * STORE_BLOCK_SIZE;
+  if (!memReadRaw(0, address, &segment.header, sizeof(segment.header)) ||
+      !memReadRaw(0, address + STORE_SEGMENT_HEADER_SIZE, &segment.summary, sizeof(segment.summary))) {
+    return;
+  }
+  if (offloadListType == OFFLOAD_FIND && storeSegmentStart(&segment.header, &segment.summary) > offloadRange.to) {
+    offloadDone(OFFLOAD_FIND, OFFLOAD_OK);
+    return;
+  }
+  memcpy(offloadPayload(), &segment, sizeof(segment));
+  offloadSend(OFFLOAD_SEGMENT, sizeof(segment));
+
+  offloadListSequence++;
+  offloadListBlock++;
+  if (offloadStore.circular && offloadListBlock == offloadStore.blocks) offloadListBlock = STORE_FIRST_SEGMENT;
+}
+
+static bool offloadErased(const uint8_t *data, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    if (data[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+/**
+Send chunks while the window has room, read straight into the frame.
+Done once the host has acknowledged the last byte.
+**/
+static void offloadSendData(void) {
+  while (offloadSent < offloadEnd && offloadSent - offloadAcked < offloadWindow * OFFLOAD_CHUNK) {
+    uint32_t length = offloadEnd - offloadSent < OFFLOAD_CHUNK ? offloadEnd - offloadSent : OFFLOAD_CHUNK;
+    uint8_t *data = offloadPayload() + sizeof(OffloadData);
+    if (!memReadRaw(offloadChip, offloadSent, data, length)) return;
+
+    OffloadData chunk = { offloadSent, (uint16_t) length, 0, 0 };
+    if (offloadErased(data, length)) chunk.flags = OFFLOAD_DATA_ERASED;
+    memcpy(offloadPayload(), &chunk, sizeof(chunk));
+    offloadSend(OFFLOAD_DATA, sizeof(chunk) + (chunk.flags & OFFLOAD_DATA_ERASED ? 0 : length));
+    offloadSent += length;
+  }
+  if (offloadAcked == offloadEnd) offloadDone(OFFLOAD_READ, OFFLOAD_OK);
+}
+
+/**
+Serve the offload protocol (Offload.h): take in requests and move the
+one in progress on by what can be done without waiting. Called from
+loop() next to memService().
+**/
+void offloadService(void) {
+  offloadReceive();
+
+  if (offloadState == OFFLOAD_LISTING) {
+    offloadSendSegment();
+  } else if (offloadState == OFFLOAD_READING) {
+    offloadSendData();
+  } else if (offloadState == OFFLOAD_ERASING && !offloadErasing) {
+    offloadErasing = memEraseAll();
+  }
+
+  // seen through even if another request came in meanwhile
+  if (offloadErasing && memEraseAllDone()) {
+    offloadErasing = false;
+    if (offloadState == OFFLOAD_ERASING) offloadDone(OFFLOAD_ERASE, OFFLOAD_OK);
+  }
+}
+
+/**
+Whether offloadService() has more to do right away; a chip erase is left
+to finish while the CPU sleeps
+**/
+bool offloadBusy(void) {
+  return offloadState == OFFLOAD_LISTING || offloadState == OFFLOAD_READING ||
+         (offloadState == OFFLOAD_ERASING && !offloadErasing);
+}
@@ -0,0 +1,139 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdint.h>
+#include "Store.h"
+#include "Stats.h"
+
+/*============================================================================
+=  Binary offload protocol on SerialUSB, shared with tools/sentioffload.    =
+=  Every frame in either direction is                                       =
+=                                                                           =
+=    sync:u8 type:u8 length:u16 payload[length] crc:u32                     =
+=                                                                           =
+=  with crc32() of everything before it; multi-byte fields are              =
+=  little-endian. A receiver that sees a bad crc drops the sync byte and    =
+=  hunts for the next one. Requests from the host:                          =
+=                                                                           =
+=    L  list            I info, one G per segment kept (oldest first), Z    =
+=    F  find            as L, but only the segments with samples in a time  =
+=                       range, found by binary search of their summaries    =
+=    R  read-range      D data chunks of chip bytes [start, end), then Z    =
+=                       once all are acknowledged                           =
+=    K  acknowledge     every byte before offset arrived                    =
+=    X  erase           both chips, Z when done; needs OFFLOAD_ERASE_KEY    =
+=    S  stats           C, the acquisition counters (Stats.h)               =
+=    W  record          recording on or off, Z                              =
+=                                                                           =
+=  Reads keep up to window chunks unacknowledged in flight. The host        =
+=  resumes after a lost or damaged chunk, a timeout or a dropped link by    =
+=  sending R again from the first byte it is missing; the device drops      =
+=  whatever read it had going. A chunk of erased flash is sent as its       =
+=  header alone. R and X stop recording first, so the flash holds still     =
+=  while it is read or erased, and it stays stopped until W turns it back   =
+=  on; L, F and S leave it as it is.                                        =
+==============================================================================*/
+
+const uint8_t OFFLOAD_SYNC = 0xA5;
+const uint8_t OFFLOAD_VERSION = 4;
+const uint32_t OFFLOAD_CHUNK = 512;          // flash bytes in a D frame
+const uint32_t OFFLOAD_WINDOW = 16;          // D frames in flight at most
+const uint32_t OFFLOAD_ERASE_KEY = 0x45534152;
+
+const uint8_t OFFLOAD_LIST = 'L';
+const uint8_t OFFLOAD_FIND = 'F';
+const uint8_t OFFLOAD_READ = 'R';
+const uint8_t OFFLOAD_ACK = 'K';
+const uint8_t OFFLOAD_ERASE = 'X';
+const uint8_t OFFLOAD_STATS = 'S';
+const uint8_t OFFLOAD_RECORD = 'W';
+const uint8_t OFFLOAD_INFO = 'I';
+const uint8_t OFFLOAD_SEGMENT = 'G';
+const uint8_t OFFLOAD_DATA = 'D';
+const uint8_t OFFLOAD_DONE = 'Z';
+const uint8_t OFFLOAD_COUNTERS = 'C';
+
+const uint8_t OFFLOAD_OK = 0;
+const uint8_t OFFLOAD_BAD_REQUEST = 1;
+
+const uint8_t OFFLOAD_DATA_ERASED = 0x01;   // every byte of the chunk is 0xFF
+
+struct OffloadFrameHeader {
+  uint8_t sync;
+  uint8_t type;
+  uint16_t length;           // payload bytes
+};
+
+struct OffloadReadRequest {
+  uint8_t chip;              // 0 for CS 7, 1 for CS 6
+  uint8_t window;            // chunks the host can take in flight
+  uint16_t reserved;
+  uint32_t start;
+  uint32_t end;
+};
+
+struct OffloadAck {
+  uint32_t offset;
+};
+
+struct OffloadFindRequest {
+  uint32_t from;             // UTC seconds, both ends included
+  uint32_t to;
+};
+
+struct OffloadEraseRequest {
+  uint32_t key;
+};
+
+struct OffloadRecordRequest {
+  uint8_t on;
+  uint8_t reserved[3];
+};
+
+struct OffloadInfo {
+  uint8_t version;
+  uint8_t chips;
+  uint8_t circular;
+  uint8_t recording;         // when the request arrived
+  uint32_t blocks;           // erase blocks per chip
+  uint32_t blockSize;
+  uint32_t head;             // block of the segment being written
+  uint32_t headSequence;
+  uint32_t headPages;        // pages written in it, 0 if not opened yet
+  uint32_t tail;             // block of the oldest segment kept
+  uint32_t tailSequence;
+};
+
+struct OffloadSegment {
+  uint32_t block;
+  StoreSegmentHeader header;
+  StoreSegmentSummary summary;  // erased while the segment is being written
+};
+
+struct OffloadData {
+  uint32_t offset;
+  uint16_t length;           // flash bytes covered; payload is empty when erased
+  uint8_t flags;
+  uint8_t reserved;
+};
+
+struct OffloadDone {
+  uint8_t request;           // type it answers
+  uint8_t status;
+  uint16_t reserved;
+};
+
+const uint32_t OFFLOAD_FRAME_OVERHEAD = sizeof(OffloadFrameHeader) + 4;
+const uint32_t OFFLOAD_MAX_PAYLOAD = sizeof(OffloadData) + OFFLOAD_CHUNK;
+
+static_assert(sizeof(OffloadFrameHeader) == 4, "frame header layout");
+static_assert(sizeof(OffloadReadRequest) == 12, "read request layout");
+static_assert(sizeof(OffloadInfo) == 32, "info layout");
+static_assert(sizeof(OffloadSegment) == 68, "segment layout");
+static_assert(sizeof(OffloadData) == 8, "data header layout");
+static_assert(sizeof(StatsSnapshot) <= OFFLOAD_MAX_PAYLOAD, "stats fit a frame");
+
+void offloadService(void);
+bool offloadBusy(void);
+
+#endif
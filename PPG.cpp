@@ -1,25 +1,79 @@
 #include <SPI.h>
+#include <string.h>
 #include <Time.h> 
 #include <TimeLib.h>  
 #include <Wire.h>
+#include "HAL.h"
+#include "Bus.h"
 #include "PPG.h"
 #include "AFE4400regs.h"
+#include "Stats.h"
+#include "Format.h"
 
-volatile bool adc_ready = false;
 volatile bool afe_powered_down = false;
+static volatile uint32_t afe_sample_tick = 0;
+
+const AFEProfile AFE_PROFILE_DEFAULT = {
+  PPG_SAMPLE_HZ, PPG_LED_DUTY_PERCENT, CURRENT_LED1, CURRENT_LED2, B0100, true, B010, B10000, B110
+};
+
+// configuration registers the shadow map holds
+static const uint8_t AFE_CONFIG_FIRST = LED2STC;
+static const uint8_t AFE_CONFIG_LAST = CONTROL2;
+static const int AFE_CONFIG_REGS = AFE_CONFIG_LAST - AFE_CONFIG_FIRST + 1;
+
+static const uint32_t AFE_SPI_READ = 1L << 0;
+static const uint32_t AFE_DIAG_EN = 1L << 2;
+static const uint32_t AFE_SW_RST = 1L << 3;
+static const uint32_t AFE_TIMEREN = 1L << 8;
+static const uint32_t AFE_DIAG_FAULTS = 0x1FFF;     // DIAG[12:0]: shorts, opens and alarms
+// Push-Pull Driver, and the SPI output tri-stated while parked
+static const uint32_t AFE_CONTROL2 = (1L << 17) | (1L << 11) | (1L << 8);
+static const uint32_t AFE_DIGOUT_TRISTATE = 1L << 10;
 
-SPISettings AFE_SPI_Settings(20000000, MSBFIRST, SPI_MODE0);
+/**
+What the configuration registers hold, as last written, and whether the
+part is in read mode. Not valid until a reset or a full write has made
+it so.
+**/
+static uint32_t afeShadow[AFE_CONFIG_REGS];
+static bool afeShadowValid = false;
+static bool afeReadMode = false;
+
+static uint32_t frameValue(const uint8_t *frame) {
+  return ((uint32_t) frame[1] << 16) | ((uint32_t) frame[2] << 8) | frame[3];
+}
 
-bool isAFEDataAvailable(void) {
-  return adc_ready;
+// one 32-bit SPI frame: register address, then data MSB first
+static void writeFrame(uint8_t *frame, uint8_t address, uint32_t data) {
+  frame[0] = address;
+  frame[1] = (data >> 16) & 0xFF;
+  frame[2] = (data >> 8) & 0xFF;
+  frame[3] = data & 0xFF;
 }
 
-void restAFEReady(void) {
-  adc_ready = false;
+SampleRing<PPGSample, PPG_RING_SIZE> PPGRing;
+
+static void readAFESample(void) {
+  PPGSample sample;
+  sample.tick = afe_sample_tick;
+  AFE4400ReadPhases(&sample.phases);
+  PPGRing.push(sample);
 }
 
+static BusRequest afeRead = { BUS_AFE, BUS_PRIORITY_HIGH, false, 0, readAFESample };
+
+/**
+ADC_RDY interrupt: read the new sample before the next conversion
+overwrites it, straight away unless loop() has the bus, as soon as it
+lets go of it otherwise
+**/
 void sampleAFE(void) {
-  adc_ready = true;
+  statsProduced(STORE_STREAM_PPG);
+  // the conversion already waiting is overwritten before it is read
+  if (afeRead.queued) statsMissed(STORE_STREAM_PPG, 1);
+  afe_sample_tick = halTicks();
+  if (!busRequest(&afeRead) && !afeRead.queued) statsMissed(STORE_STREAM_PPG, 1);
 }
 
 void AFEPowerDown(void) {
@@ -29,110 +83,236 @@ void AFEPowerDown(void) {
   digitalWrite(PIN_AFE_PDN, LOW);
 }
 
+/**
+The registers are not trusted after a power down: the next
+AFEApplyProfile() writes them all
+**/
 void AFEPowerUp(void) {
   if(!afe_powered_down) return;
   // Power down AFE (using pin, can also do using CONTROL2 register)
   digitalWrite(PIN_AFE_PDN, HIGH);
   afe_powered_down = false;
+  afeShadowValid = false;
 }
 
-void disableAFE(void) {
-  // Tri-State SPI, Push-Pull Driver
-  AFE4400Write(CONTROL2, (1L << 17) | (1L << 11) | (1L << 10) | (1L << 8));
-
-  // Deselect AFE
-  digitalWrite(PIN_SS_AFE, HIGH);
+/**
+Write the values for count registers from first that differ from the
+shadow map, back to back under one chip select, and leave the part in
+read mode or not. Registers only take writes outside read mode, so it is
+left first if anything is written. The AFE has to have the bus.
+**/
+static void afeWriteChanged(uint8_t first, const uint32_t *values, int count, bool readMode) {
+  uint8_t frames[(AFE_CONFIG_REGS + 2) * 4];
+  int n = 0;
+  // before the first reset, read mode is not known either
+  bool reading = afeReadMode || !afeShadowValid;
+
+  for (int i = 0; i < count; i++) {
+    uint8_t reg = first + i;
+    uint32_t *shadow = &afeShadow[reg - AFE_CONFIG_FIRST];
+    if (afeShadowValid && *shadow == values[i]) continue;
+    if (reading) {
+      writeFrame(frames + 4 * n++, CONTROL0, 0x00);
+      reading = false;
+    }
+    writeFrame(frames + 4 * n++, reg, values[i]);
+    *shadow = values[i];
+  }
+  if (reading != readMode) writeFrame(frames + 4 * n++, CONTROL0, readMode ? AFE_SPI_READ : 0x00);
+  if (!n) return;
+
+  busSelect(BUS_AFE);
+  SPI.transfer(frames, 4 * n);
+  busDeselect(BUS_AFE);
+  afeReadMode = readMode;
 }
 
-void enableAFE(void) {
-  // Normal operation SPI, Push-Pull Driver
-  AFE4400Write(CONTROL2,(1L << 17) | (1L << 11) | (1L << 8));
+/**
+Bus arbiter hook (Bus.h): tri-state the AFE's SPI output while a flash
+chip has the bus, and go back to read mode once the AFE has it again
+**/
+void AFEPark(bool park) {
+  uint32_t control2 = park ? AFE_CONTROL2 | AFE_DIGOUT_TRISTATE : AFE_CONTROL2;
+  afeWriteChanged(CONTROL2, &control2, 1, !park);
 }
 
 uint32_t getPPGData(void) {
-  uint32_t data_led1 = AFE4400Read(LED1ABSVAL);
-  float reading_led1 = convert_ADC_to_float(data_led1);
-  
-  uint32_t data_led2 = AFE4400Read(LED2ABSVAL);
-  float reading_led2 = convert_ADC_to_float(data_led2);
+  AFEPhases phases;
+  busAcquire(BUS_AFE);
+  AFE4400ReadPhases(&phases);
+  busRelease();
+  return PPGAverage(&phases);
+}
 
-  float finalPPGValue = (reading_led1 + reading_led2)/2.0;
-  uint32_t finalPPGValueHex = (data_led1 + data_led2)/0x2;
+/**
+The single value the text log records: the mean of both ambient-corrected
+channels, as raw register values
+**/
+uint32_t PPGAverage(const AFEPhases *phases) {
+  return (phases->led1Abs + phases->led2Abs)/0x2;
+}
 
-  return finalPPGValueHex;
+// PPGAverage() text for the legacy P: line
+char *formatPPGData(char *p, const AFEPhases *phases) {
+  return formatUnsigned(p, PPGAverage(phases));
 }
 
 /*=========================================
 =            AFE4400 Functions            =
 ===========================================*/
 
-void AFE4400Diagnostics (void) {
-  AFE4400Write(CONTROL0, B100);
+/**
+Run the AFE's own diagnostics (16ms, LED and photodiode shorts and opens)
+and return DIAG; leaves the part in read mode. The AFE has to have the
+bus.
+**/
+uint32_t AFE4400Diagnostics (void) {
+  AFE4400Write(CONTROL0, AFE_DIAG_EN);
   delay(20);
-  uint32_t results = AFE4400Read(DIAG);
-  SerialUSB.println(results, BIN);
+  AFE4400Write(CONTROL0, AFE_SPI_READ);
+  return AFE4400Read(DIAG);
 }
 
 /**
-Initialize device operational and transimpeadance amplifier registers.
-See datasheet for default values.
+Reset the part: every register reads zero afterwards, which is where the
+shadow map starts from. The AFE has to have the bus.
 **/
 void AFE4400InitConfigs (void) {
 
-  pinMode(PIN_SS_AFE, OUTPUT);
   pinMode(PIN_ADC_RDY, INPUT);
 
   AFE4400Write(CONTROL0, (uint32_t) B1010); // reset registers and clear timers
+}
 
+// the configuration register values for profile, from AFE_CONFIG_FIRST
+static void afeProfileImage(const AFEProfile *profile, uint32_t *image) {
+  memset(image, 0, AFE_CONFIG_REGS * sizeof(uint32_t));
+  for (uint8_t reg = AFE_TIMING_FIRST; reg <= AFE_TIMING_LAST; reg++) {
+    image[reg - AFE_CONFIG_FIRST] = afeTimingCount(profile->sampleHz, profile->ledDutyPercent, reg);
+  }
+  // internal timer ON
+  image[CONTROL1 - AFE_CONFIG_FIRST] = AFE_TIMEREN | (1L << 1);
   // TIA Parameters (datasheet pg. 24-26)
-  long AMBDAC = B0100;  // AMBDAC[3:0]: Ambient DAC value
-  long STAGE2EN = B1;   // STAGE2EN: Stage 2 enable for LED 2
-  long STG2GAIN = B010; //B000; // STG2GAIN[2:0]: Stage 2 gain setting
-  long CF_LED = B10000; //B00000; // CF_LED[4:0]: Program CF for LEDs
-  long RF_LED = B110;   //B101; // RF_LED[2:0]: Program RF for LEDs
-  AFE4400Write(TIA_AMB_GAIN, (AMBDAC << 16) | (STAGE2EN << 14) | (STG2GAIN << 8) | (CF_LED << 3) | RF_LED);
-
-  // Tri-State SPI, Push-Pull Driver
-  AFE4400Write(CONTROL2,(1L << 17) | (1L << 11) | (1L << 8));
+  image[TIA_AMB_GAIN - AFE_CONFIG_FIRST] = ((uint32_t) profile->ambDAC << 16) | ((uint32_t) profile->stage2 << 14) |
+                                           ((uint32_t) profile->stage2Gain << 8) | (profile->cf << 3) | profile->rf;
   // LED Current
-  long drive_led1 = (long) (CURRENT_LED1 / 50.0 * 256.0);
-  long drive_led2 = (long) (CURRENT_LED2 / 50.0 * 256.0);
-  AFE4400Write(LEDCNTRL, (1L << 16) | (drive_led1 << 8) | (drive_led2));
-  // internal timer ON
-  AFE4400Write(CONTROL1, (1L << 8) | (1L << 1));
+  uint32_t drive_led1 = (uint32_t) (profile->led1mA / 50.0 * 256.0);
+  uint32_t drive_led2 = (uint32_t) (profile->led2mA / 50.0 * 256.0);
+  image[LEDCNTRL - AFE_CONFIG_FIRST] = (1L << 16) | (drive_led1 << 8) | drive_led2;
+  image[CONTROL2 - AFE_CONFIG_FIRST] = AFE_CONTROL2;
 }
 
-void AFE4400Write (uint8_t address, uint32_t data) {
-  digitalWrite(PIN_SS_AFE, LOW);
+/**
+Switch the AFE to profile, writing only the registers whose values differ
+from what they hold, in one SPI transaction, and leave it in read mode.
+False, with nothing written, for a profile out of the part's limits. The
+AFE has to have the bus.
+**/
+bool AFEApplyProfile(const AFEProfile *profile) {
+  if (!afeTimingValid(profile->sampleHz, profile->ledDutyPercent)) return false;
+  if (profile->led1mA < 0 || profile->led1mA >= 50.0 || profile->led2mA < 0 || profile->led2mA >= 50.0) return false;
+
+  uint32_t image[AFE_CONFIG_REGS];
+  afeProfileImage(profile, image);
+  afeWriteChanged(AFE_CONFIG_FIRST, image, AFE_CONFIG_REGS, true);
+  afeShadowValid = true;
+  return true;
+}
+
+/**
+Check the part against the applied profile: its diagnostics find no
+fault, and every configuration register reads back what the shadow map
+says it holds. The timer is stopped while the diagnostics run, so no
+conversion goes unread. Takes 20ms, for setup(); the AFE has to have the
+bus.
+**/
+bool AFE4400SelfTest(void) {
+  if (!afeShadowValid) return false;
+  uint32_t control1 = afeShadow[CONTROL1 - AFE_CONFIG_FIRST];
+  uint32_t stopped = control1 & ~AFE_TIMEREN;
+  afeWriteChanged(CONTROL1, &stopped, 1, false);
+  uint32_t faults = AFE4400Diagnostics() & AFE_DIAG_FAULTS;
+  afeWriteChanged(CONTROL1, &control1, 1, true);
+  if (faults) return false;
+
+  uint8_t frames[AFE_CONFIG_REGS * 4];
+  for (int i = 0; i < AFE_CONFIG_REGS; i++) writeFrame(frames + 4 * i, AFE_CONFIG_FIRST + i, 0);
+  busSelect(BUS_AFE);
+  SPI.transfer(frames, sizeof(frames));
+  busDeselect(BUS_AFE);
+
+  for (int i = 0; i < AFE_CONFIG_REGS; i++) {
+    if (AFE_CONFIG_FIRST + i != SPARE1 && frameValue(frames + 4 * i) != afeShadow[i]) return false;
+  }
+  return true;
+}
 
-  SPI.beginTransaction(AFE_SPI_Settings);
+/**
+One register write, keeping the shadow map and read mode in step; a
+reset zeroes every register
+**/
+void AFE4400Write (uint8_t address, uint32_t data) {
+  if (address == CONTROL0) {
+    afeReadMode = data & AFE_SPI_READ;
+    if (data & AFE_SW_RST) {
+      memset(afeShadow, 0, sizeof(afeShadow));
+      afeShadowValid = true;
+      afeReadMode = false;
+    }
+  } else if (address >= AFE_CONFIG_FIRST && address <= AFE_CONFIG_LAST) {
+    afeShadow[address - AFE_CONFIG_FIRST] = data;
+  }
+
+  busSelect(BUS_AFE);
   SPI.transfer(address); // register address
   // transmit bytes in MSB-first order
   SPI.transfer((data >> 16) & 0xFF); // DATA[23:16]
   SPI.transfer((data >> 8) & 0xFF);  // DATA[15:8]
   SPI.transfer(data & 0xFF);         // DATA[7:0]
-  SPI.endTransaction();
-
-  digitalWrite(PIN_SS_AFE, HIGH);
+  busDeselect(BUS_AFE);
 }
 
 uint32_t AFE4400Read (uint8_t address) {
   uint32_t data = 0x0;
 
-  digitalWrite(PIN_SS_AFE, LOW);
-
-  SPI.beginTransaction(AFE_SPI_Settings);
+  busSelect(BUS_AFE);
   SPI.transfer(address); // register address
   data |= ((uint32_t) SPI.transfer(0) << 16);  // DATA[23:16]
   data |= ((uint32_t) SPI.transfer(0) << 8);   // DATA[15:8]
   data |= (uint32_t) SPI.transfer(0);          // DATA[7:0]
-  SPI.endTransaction();
-
-  digitalWrite(PIN_SS_AFE, HIGH);
+  busDeselect(BUS_AFE);
 
   return data;
 }
 
+
+/**
+Read all six result registers (0x2a-0x2f) under one chip select: the
+32-bit read frames are sent back to back in a single buffered transfer
+**/
+void AFE4400ReadPhases (AFEPhases *phases) {
+  const int count = LED1ABSVAL - LED2VAL + 1;
+  uint8_t frames[count * 4];
+
+  for (int i = 0; i < count; i++) {
+    frames[4 * i] = LED2VAL + i; // register address
+    frames[4 * i + 1] = 0;
+    frames[4 * i + 2] = 0;
+    frames[4 * i + 3] = 0;
+  }
+
+  busSelect(BUS_AFE);
+  SPI.transfer(frames, sizeof(frames));
+  busDeselect(BUS_AFE);
+
+  phases->led2 = frameValue(frames + 4 * (LED2VAL - LED2VAL));
+  phases->aled2 = frameValue(frames + 4 * (ALED2VAL - LED2VAL));
+  phases->led1 = frameValue(frames + 4 * (LED1VAL - LED2VAL));
+  phases->aled1 = frameValue(frames + 4 * (ALED1VAL - LED2VAL));
+  phases->led2Abs = frameValue(frames + 4 * (LED2ABSVAL - LED2VAL));
+  phases->led1Abs = frameValue(frames + 4 * (LED1ABSVAL - LED2VAL));
+}
+
 /**
 Converts 22-bit signed integer to float [-1.0, 1.0)
 **/
@@ -142,53 +322,19 @@ float convert_ADC_to_float(uint32_t data) {
   return float(adc_s22) / 2097152.0; // [-2^21, 2^21 - 1]
 }
 
-/**
-Configure AFE4400 timing registers for 100Hz sample rate
-**/
-void AFE4400InitTimings100Hz (void) {
-  // See Page 31-32 of AFE4400 Datesheet for Timings
-
-  // Pulse Repetition Period Count (16-bits)
-  // Sample Frequency = 4MHz / (PRPCOUNT + 1)
-  // Must be Integral Sample Frequency
-  AFE4400Write(PRPCOUNT, 0x009C3F); // 39999
-
-  // Sample Phases
-  AFE4400Write(ALED2STC,      0x000050);   // Sample ambient 2 start
-  AFE4400Write(ALED2ENDC,     0x0007CE); // Sample ambient 2 end
-  AFE4400Write(LED1STC,       0x002760);
-  AFE4400Write(LED1ENDC,      0x002EDE);
-  AFE4400Write(ALED1STC,      0x004E70);
-  AFE4400Write(ALED1ENDC,     0x0055EE);
-  AFE4400Write(LED2STC,       0x007580); // Sample LED2 start
-  AFE4400Write(LED2ENDC,      0x007CFE); // Sample LED2 end
-  
-  // LED ON Phases
-  AFE4400Write(LED1LEDSTC,    0x002710);
-  AFE4400Write(LED1LEDENDC,   0x002EDF);
-  AFE4400Write(LED2LEDSTC,    0x007530); // LED2 start
-  AFE4400Write(LED2LEDENDC,   0x007CFF); // LED2 end
-
-  // ADC Conversion Phases
-  AFE4400Write(ALED2CONVST,   0x002716); // Ambient 2 convert phase start
-  AFE4400Write(ALED2CONVEND,  0x004E1F); // Ambient 2 convert phase end
-  AFE4400Write(LED1CONVST,    0x004E26);
-  AFE4400Write(LED1CONVEND,   0x00752F);
-  AFE4400Write(ALED1CONVST,   0x007536);
-  AFE4400Write(ALED1CONVEND,  0x009C3F);
-  AFE4400Write(LED2CONVST,    0x000006);  // LED2 convert phase start
-  AFE4400Write(LED2CONVEND,   0x00270F); // LED2 convert phase end
-
-  // ADC Reset Phases
-  AFE4400Write(ADCRSTSTCT0,   0x000000);  
-  AFE4400Write(ADCRSTENDCT0,  0x000005);  
-  AFE4400Write(ADCRSTSTCT1,   0x002710);  
-  AFE4400Write(ADCRSTENDCT1,  0x002715);  
-  AFE4400Write(ADCRSTSTCT2,   0x004E20);  
-  AFE4400Write(ADCRSTENDCT2,  0x004E25);   
-  AFE4400Write(ADCRSTSTCT3,   0x007530);   
-  AFE4400Write(ADCRSTENDCT3,  0x007535);   
-
-  AFE4400Write(CONTROL0, 0x01); // read mode
+static_assert(afeTimingValid(PPG_SAMPLE_HZ, PPG_LED_DUTY_PERCENT),
+              "PPG_SAMPLE_HZ and PPG_LED_DUTY_PERCENT out of the AFE4400's timing limits");
+
+// the table worked out by hand for 100Hz at 5%, LED2STC..PRPCOUNT
+static constexpr uint32_t AFE_TIMINGS_100HZ[] = {
+  0x007580, 0x007CFE, 0x007530, 0x007CFF, 0x000050, 0x0007CE, 0x002760, 0x002EDE, 0x002710, 0x002EDF,
+  0x004E70, 0x0055EE, 0x000006, 0x00270F, 0x002716, 0x004E1F, 0x004E26, 0x00752F, 0x007536, 0x009C3F,
+  0x000000, 0x000005, 0x002710, 0x002715, 0x004E20, 0x004E25, 0x007530, 0x007535, 0x009C3F,
+};
+
+static constexpr bool afeTimingsMatch(const uint32_t *table, uint8_t reg) {
+  return reg > AFE_TIMING_LAST ||
+         (afeTimingCount(100, 5, reg) == table[reg - AFE_TIMING_FIRST] && afeTimingsMatch(table, reg + 1));
 }
 
+static_assert(afeTimingsMatch(AFE_TIMINGS_100HZ, AFE_TIMING_FIRST), "generated timings match the 100Hz table");
@@ -1,25 +1,74 @@
 #ifndef PPGFNS
 #define PPGFNS
 
+#include "Ring.h"
+
 const int PIN_SS_AFE = 4; 
 const int PIN_ADC_RDY = 5;
 const int PIN_AFE_PDN = 1;
 
+// PPG sample rate, and the share of each period either LED is on; checked by afeTimingValid()
+#ifndef PPG_SAMPLE_HZ
+#define PPG_SAMPLE_HZ 100
+#endif
+#ifndef PPG_LED_DUTY_PERCENT
+#define PPG_LED_DUTY_PERCENT 5
+#endif
+
 // LED current in mA; 50mA max; typically <20mA
 const float CURRENT_LED1 = 15.0;
 const float CURRENT_LED2 = 15.0;
 
+// result registers LED2VAL..LED1ABSVAL (0x2a-0x2f), raw 24-bit two's complement
+struct AFEPhases {
+  uint32_t led2;     // LED2 (red) on
+  uint32_t aled2;    // ambient before LED2
+  uint32_t led1;     // LED1 (IR) on
+  uint32_t aled1;    // ambient before LED1
+  uint32_t led2Abs;  // LED2 - ambient
+  uint32_t led1Abs;  // LED1 - ambient
+};
+
+// all phases of one conversion per ADC_RDY edge, read in sampleAFE()
+struct PPGSample {
+  uint32_t tick;
+  AFEPhases phases;
+};
+
+const int PPG_RING_SIZE = 32;
+extern SampleRing<PPGSample, PPG_RING_SIZE> PPGRing;
+
+/**
+AFE4400 configuration as the settings it is made of; AFEApplyProfile()
+derives the register values and writes those that changed
+**/
+struct AFEProfile {
+  uint16_t sampleHz;         // with ledDutyPercent, checked by afeTimingValid()
+  uint8_t ledDutyPercent;
+  float led1mA;              // LED current, 50mA max
+  float led2mA;
+  uint8_t ambDAC;            // AMBDAC[3:0]: ambient DAC value
+  bool stage2;               // STAGE2EN: stage 2 enable for LED 2
+  uint8_t stage2Gain;        // STG2GAIN[2:0]: stage 2 gain setting
+  uint8_t cf;                // CF_LED[4:0]: program CF for LEDs
+  uint8_t rf;                // RF_LED[2:0]: program RF for LEDs
+};
+
+extern const AFEProfile AFE_PROFILE_DEFAULT;
+
 void AFE4400InitConfigs (void);
-void AFE4400InitTimings100Hz (void);
+bool AFEApplyProfile(const AFEProfile *profile);
+bool AFE4400SelfTest(void);
+uint32_t AFE4400Diagnostics (void);
 void AFE4400Write (uint8_t address, uint32_t data);
 uint32_t AFE4400Read (uint8_t address);
-void enableAFE(void);
-void disableAFE(void);
+void AFE4400ReadPhases (AFEPhases *phases);
+void AFEPark(bool park);
 float convert_ADC_to_float(uint32_t data);
 void sampleAFE(void);
-bool isAFEDataAvailable(void);
-void restAFEReady(void);
 uint32_t getPPGData(void);
+uint32_t PPGAverage(const AFEPhases *phases);
+char *formatPPGData(char *p, const AFEPhases *phases);
 void AFEPowerUp(void);
 void AFEPowerDown(void);
 
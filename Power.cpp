@@ -0,0 +1,80 @@
+#include <Arduino.h>
+#include <string.h>
+#include "Power.h"
+#include "HAL.h"
+
+/*============================================
+=          Sleep and duty cycle              =
+==============================================*/
+
+static PowerStats powerTotals;
+static uint32_t powerWokeAt = 0;   // tick the wake in progress began
+#if POWER_REPORT_SECONDS
+static uint32_t powerReportedAt = 0;
+// halTicks() wraps every 71.6 minutes, so the interval is measured in them
+static_assert(POWER_REPORT_SECONDS <= 0xFFFFFFFFUL / HAL_TICK_HZ, "POWER_REPORT_SECONDS over 4294");
+static const uint32_t POWER_REPORT_TICKS = POWER_REPORT_SECONDS * HAL_TICK_HZ;
+#endif
+
+void powerInit(void) {
+  memset(&powerTotals, 0, sizeof(powerTotals));
+  powerWokeAt = halTicks();
+#if POWER_REPORT_SECONDS
+  powerReportedAt = powerWokeAt;
+#endif
+}
+
+/**
+Sleep until an interrupt unless busy() has work for loop(). The check is
+made with interrupts masked, so a sample that lands after it still wakes
+the CPU instead of waiting a whole sample period. True if it slept.
+**/
+bool powerSleep(bool (*busy)(void)) {
+#if POWER_REPORT_SECONDS
+  if (halTicks() - powerReportedAt >= POWER_REPORT_TICKS) {
+    powerReportedAt += POWER_REPORT_TICKS;
+    powerReport();
+  }
+#endif
+#if POWER_SLEEP
+  uint32_t slept = halTicks();
+  if (!halSleepUnless(busy)) return false;
+  uint32_t woke = halTicks();
+
+  uint32_t active = slept - powerWokeAt;
+  uint32_t asleep = woke - slept;
+  powerTotals.wakes++;
+  powerTotals.activeTicks += active;
+  powerTotals.sleepTicks += asleep;
+  if (active > powerTotals.longestActive) powerTotals.longestActive = active;
+  if (asleep > powerTotals.longestSleep) powerTotals.longestSleep = asleep;
+  powerWokeAt = woke;
+  return true;
+#else
+  (void) busy;
+  return false;
+#endif
+}
+
+void powerStats(PowerStats *stats) {
+  *stats = powerTotals;
+  uint32_t active = halTicks() - powerWokeAt;
+  stats->activeTicks += active;
+  if (active > stats->longestActive) stats->longestActive = active;
+}
+
+/**
+One line of duty cycle: active share, wakes and the longest wake
+**/
+void powerReport(void) {
+  PowerStats s;
+  powerStats(&s);
+  uint64_t total = s.activeTicks + s.sleepTicks;
+  SerialUSB.print("power: active ");
+  SerialUSB.print(total ? 100.0 * s.activeTicks / total : 100.0, 2);
+  SerialUSB.print("%, ");
+  SerialUSB.print(s.wakes);
+  SerialUSB.print(" wakes, longest ");
+  SerialUSB.print(s.longestActive);
+  SerialUSB.println(" us");
+}
@@ -0,0 +1,35 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Sleep between samples. loop() ends in powerSleep(), which puts the CPU   =
+=  to sleep until the next interrupt unless there is work queued, and       =
+=  accounts each wake: halTicks() from a wake to the next sleep is active,  =
+=  from there to the wake after it asleep. POWER_SLEEP 0 keeps the old      =
+=  polling loop, whose time then all counts as active, for comparison.      =
+==============================================================================*/
+
+#ifndef POWER_SLEEP
+#define POWER_SLEEP 1
+#endif
+// print the duty cycle on SerialUSB this often, 0 for never
+#ifndef POWER_REPORT_SECONDS
+#define POWER_REPORT_SECONDS 0
+#endif
+
+struct PowerStats {
+  uint32_t wakes;
+  uint64_t activeTicks;      // including the wake in progress
+  uint64_t sleepTicks;
+  uint32_t longestActive;    // ticks, a single wake
+  uint32_t longestSleep;
+};
+
+void powerInit(void);
+bool powerSleep(bool (*busy)(void));
+void powerStats(PowerStats *stats);
+void powerReport(void);
+
+#endif
@@ -1,6 +1,9 @@
 #include <Wire.h>
 #include <Time.h> 
+#include "HAL.h"
+#include "I2C.h"
 #include "RTCtime.h"
+#include "Format.h"
 
 // M41T62 Real Time Clock
 // Datasheet: http://www.st.com/web/en/resource/technical/document/datasheet/CD00019860.pdf
@@ -12,19 +15,46 @@ const char *monthNameList[12] = {
 
 tmElements_t tm;
 
-void RTCinit(const char * timeString, const char * dateString) {
+RTCAnchor rtcAnchor = { 0, 0, 0 };
+
+// anchors since the calibration last changed, for the drift estimate
+static bool rtcAnchored = false;
+static uint16_t rtcDriftAnchors = 0;
+static uint64_t rtcDriftTicks = 0;
+static int64_t rtcDriftCentiseconds = 0;
+
+// the timekeeping registers, read for the next anchor without waiting on the bus
+static uint8_t rtcAnchorRegs[RTC_TIME_REGISTERS];
+static I2CTransaction rtcAnchorRead = { RTC_I2C_ADDR, 0x00, RTC_TIME_REGISTERS, rtcAnchorRegs, NULL, I2C_IDLE, 0 };
+
+/**
+Set the RTC to the build time if its oscillator stopped, never to before
+notBefore (the newest time already recorded), so the wall clock does not
+step back across a reset. A clock that kept running on its backup supply
+is left as it is.
+**/
+void RTCinit(const char * timeString, const char * dateString, time_t notBefore) {
+
+  bool stopped = rtc_read(RTC_FLAGS) & RTC_FLAG_OF || rtc_read(0x01) & RTC_SECONDS_ST;
+  if (!stopped) {
+    RTCsync();
+    return;
+  }
 
   getTimeFromPC(timeString);
   getDateFromPC(dateString);
+  if (makeTime(tm) < notBefore) breakTime(notBefore, tm);
   setTime(makeTime(tm));
 
-  rtc_centiseconds_write(millis() % 1000);
+  // __TIME__ has whole seconds
+  rtc_centiseconds_write(0);
   rtc_seconds_write(tm.Second);
   rtc_minutes_write(tm.Minute);
   rtc_hours_write(tm.Hour);
   rtc_date_write(tm.Day);
   rtc_month_write(tm.Month);
-  rtc_year_write(tm.Year);
+  rtc_year_write(tm.Year - 30);
+  rtc_write(RTC_FLAGS, rtc_read(RTC_FLAGS) & ~RTC_FLAG_OF);
 }
 
 void getTimeFromPC(const char * timeString) {
@@ -45,20 +75,43 @@ void getDateFromPC(const char * dateString) {
   for (monthIndex = 0; monthIndex < 12; monthIndex++) {
     if (strcmp(Month_, monthNameList[monthIndex]) == 0) break;
   }
-  tm.Day = Day_ % 31;
-  tm.Month = (monthIndex + 1) % 12;
-  tm.Year = Year_ + 12;
+  tm.Day = Day_;
+  tm.Month = monthIndex + 1;
+  tm.Year = Year_ - 1970;
+}
+
+/**
+Whole seconds of wall clock now, from the last RTC anchor
+**/
+time_t RTCnow(void) {
+  uint32_t ms = (halTicks() - rtcAnchor.tick) / (HAL_TICK_HZ / 1000) + rtcAnchor.centiseconds * 10;
+  return rtcAnchor.time + ms / 1000;
 }
 
-String getTimeData() {
-  time_t t = now();
-  return String(year(t) + 30) + ":" +
-         String(month(t)) + ":" +
-         String(day(t)) + ":" +
-         String(hour(t)) + ":" + 
-         String(minute(t)) + ":" + 
-         String(second(t)) + ":" + 
-         String(millis() % 1000);
+/**
+Whole seconds of wall clock at a tick, which may be a little before the
+last RTC anchor
+**/
+time_t RTCtimeAt(uint32_t tick) {
+  int32_t ms = (int32_t) (tick - rtcAnchor.tick) / (int32_t) (HAL_TICK_HZ / 1000) + rtcAnchor.centiseconds * 10;
+  return rtcAnchor.time + (ms >= 0 ? ms / 1000 : (ms - 999) / 1000);
+}
+
+/**
+Wall clock now as year:month:day:hour:minute:second:millisecond text for
+the legacy T: line, counted forward from the last RTC anchor in ticks so
+the milliseconds line up with the RTC second
+**/
+char *formatTimeData(char *p) {
+  uint32_t ms = (halTicks() - rtcAnchor.tick) / (HAL_TICK_HZ / 1000) + rtcAnchor.centiseconds * 10;
+  time_t t = rtcAnchor.time + ms / 1000;
+  const uint32_t fields[7] = { (uint32_t) year(t), (uint32_t) month(t), (uint32_t) day(t), (uint32_t) hour(t),
+                               (uint32_t) minute(t), (uint32_t) second(t), ms % 1000 };
+  for (int i = 0; i < 7; i++) {
+    if (i) *p++ = ':';
+    p = formatUnsigned(p, fields[i]);
+  }
+  return p;
 }
 
 void RTCsync() {
@@ -66,14 +119,113 @@ void RTCsync() {
 }
 
 time_t RTCsyncProvider() {
-  tmElements_t tm;
-  tm.Hour   = (int)rtc_hours_read() % 24;
-  tm.Minute = (int)rtc_minutes_read() % 60;
-  tm.Second = (int)rtc_seconds_read() % 60;
-  tm.Day    = (int)rtc_date_read() % 31;
-  tm.Month  = (int)rtc_month_read() % 12;
-  tm.Year   = (int)rtc_year_read();
-  return makeTime(tm);
+  uint8_t regs[RTC_TIME_REGISTERS];
+  rtc_time_read(regs);
+  return rtc_time_decode(regs);
+}
+
+static void rtcAnchorDecode(RTCAnchor *anchor, uint32_t tick, const uint8_t *regs) {
+  anchor->tick = tick;
+  anchor->time = rtc_time_decode(regs);
+  anchor->centiseconds = convert_bcd_to_dec(regs[0x00]);
+}
+
+/**
+Read the RTC and note the tick it latched its registers at
+**/
+void RTCreadAnchor(RTCAnchor *anchor) {
+  uint8_t regs[RTC_TIME_REGISTERS];
+  uint32_t tick = rtc_time_read(regs);
+  rtcAnchorDecode(anchor, tick, regs);
+}
+
+/**
+Make anchor the current one and feed the interval since the last one to
+the drift estimate. halTicks() is the reference: the DFLL it counts is
+locked to the MCU's own 32kHz crystal.
+**/
+static void rtcAnchorTaken(const RTCAnchor &anchor) {
+  RTCAnchor previous = rtcAnchor;
+  rtcAnchor = anchor;
+
+  if (rtcAnchored) {
+    rtcDriftTicks += rtcAnchor.tick - previous.tick;
+    rtcDriftCentiseconds += (int64_t) (rtcAnchor.time - previous.time) * 100
+                          + rtcAnchor.centiseconds - previous.centiseconds;
+    if (++rtcDriftAnchors >= RTC_DRIFT_ANCHORS) RTCcalibrate();
+  }
+  rtcAnchored = true;
+}
+
+// take a new anchor, waiting for the bus
+void RTCupdateAnchor(void) {
+  RTCAnchor anchor;
+  RTCreadAnchor(&anchor);
+  rtcAnchorTaken(anchor);
+}
+
+/**
+Take a new anchor from loop() without waiting for the bus: the first call
+queues the burst read (I2C.h), and the one after it has come in takes the
+anchor and returns true. RTCanchorDue() stays false while it is in flight.
+**/
+bool RTCpollAnchor(void) {
+  uint8_t status = rtcAnchorRead.status;
+  if (status == I2C_QUEUED || status == I2C_BUSY) return false;
+  if (status != I2C_DONE) {
+    i2cSubmit(&rtcAnchorRead);
+    return false;
+  }
+
+  RTCAnchor anchor;
+  rtcAnchorDecode(&anchor, rtcAnchorRead.tick, rtcAnchorRegs);
+  rtcAnchorRead.status = I2C_IDLE;
+  rtcAnchorTaken(anchor);
+  return true;
+}
+
+/**
+RTC rate error over the current window in parts per billion, positive when
+the RTC runs fast
+**/
+int32_t RTCdriftPpb(void) {
+  if (rtcDriftTicks == 0) return 0;
+  int64_t rtcTicks = rtcDriftCentiseconds * (int64_t) (HAL_TICK_HZ / 100);
+  return (int32_t) ((rtcTicks - (int64_t) rtcDriftTicks) * 1000000000LL / (int64_t) rtcDriftTicks);
+}
+
+// M41T62 calibration: positive steps speed the clock up, negative slow it down
+static int32_t calibrationPpb(int offset) {
+  return offset > 0 ? offset * RTC_CAL_FAST_PPB : offset * RTC_CAL_SLOW_PPB;
+}
+
+/**
+Trim the RTC by the calibration offset that best cancels the drift
+measured over the window, then start a new window
+**/
+void RTCcalibrate(void) {
+  int current = rtc_calibration_read();
+  int32_t wanted = calibrationPpb(current) - RTCdriftPpb();
+
+  int best = current;
+  for (int offset = -31; offset <= 31; offset++) {
+    int32_t error = calibrationPpb(offset) - wanted;
+    int32_t bestError = calibrationPpb(best) - wanted;
+    if (abs(error) < abs(bestError)) best = offset;
+  }
+  if (best != current) rtc_calibration_write(best);
+
+  rtcDriftAnchors = 0;
+  rtcDriftTicks = 0;
+  rtcDriftCentiseconds = 0;
+}
+
+/**
+True once the last anchor is RTC_ANCHOR_TICKS old, and not while the read
+of the next one is on the bus
+**/
+bool RTCanchorDue(void) {
+  return halTicks() - rtcAnchor.tick >= RTC_ANCHOR_TICKS && !i2cPending(&rtcAnchorRead);
 }
 
 /*=====  End of Main Program  ======*/
@@ -84,6 +236,7 @@ time_t RTCsyncProvider() {
 ==========================================*/
 
 void rtc_write (byte address, byte data) {
+  i2cWait();
   Wire.beginTransmission(RTC_I2C_ADDR); // device address
   Wire.write(address); // register address
   Wire.write(data);
@@ -91,6 +244,7 @@ void rtc_write (byte address, byte data) {
 }
 
 uint32_t rtc_read (byte address) {
+  i2cWait();
   Wire.beginTransmission(RTC_I2C_ADDR); // device address
   Wire.write(address); // register address
   Wire.endTransmission();
@@ -99,6 +253,40 @@ uint32_t rtc_read (byte address) {
   return Wire.read();
 }
 
+/**
+Burst read of the timekeeping registers 0x00-0x07. The M41T62 latches them
+for the whole read so they cannot tear across a rollover; returns the
+tick just before the read.
+**/
+uint32_t rtc_time_read(uint8_t *regs) {
+  i2cWait();
+  Wire.beginTransmission(RTC_I2C_ADDR); // device address
+  Wire.write(0x00); // register address
+  Wire.endTransmission();
+
+  uint32_t tick = halTicks();
+  Wire.requestFrom(RTC_I2C_ADDR, RTC_TIME_REGISTERS, true);
+  for (int i = 0; i < RTC_TIME_REGISTERS; i++) {
+    regs[i] = Wire.read();
+  }
+  return tick;
+}
+
+/**
+Whole seconds from a burst read, with the same masks as the register
+accessors below
+**/
+time_t rtc_time_decode(const uint8_t *regs) {
+  tmElements_t tm;
+  tm.Second = convert_bcd_to_dec(regs[0x01] & 0x7F);
+  tm.Minute = convert_bcd_to_dec(regs[0x02] & 0x7F);
+  tm.Hour   = convert_bcd_to_dec(regs[0x03] & 0x3F);
+  tm.Day    = convert_bcd_to_dec(regs[0x05] & 0x3F);
+  tm.Month  = convert_bcd_to_dec(regs[0x06] & 0x1F);
+  tm.Year   = convert_bcd_to_dec(regs[0x07]) + 30;
+  return makeTime(tm);
+}
+
 /*=====  End of RTC I2C Read/Write  ======*/
 
 /*==============================================
@@ -168,21 +356,21 @@ void rtc_date_write(int date) {
 /*----------  Month  ----------*/
 
 int rtc_month_read() {
-  return convert_bcd_to_dec(rtc_read(0x06) & 0x3F);
+  return convert_bcd_to_dec(rtc_read(0x06) & 0x1F);
 }
 
 void rtc_month_write(int month) {
-  rtc_write(0x06, convert_dec_to_bcd(month) & 0x3F);
+  rtc_write(0x06, convert_dec_to_bcd(month) & 0x1F);
 }
 
 /*----------  Year  ----------*/
 
 int rtc_year_read() {
-  return convert_bcd_to_dec(rtc_read(0x07) & 0x1F);
+  return convert_bcd_to_dec(rtc_read(0x07));
 }
 
 void rtc_year_write(int year) {
-  rtc_write(0x07, convert_dec_to_bcd(year) & 0x1F);
+  rtc_write(0x07, convert_dec_to_bcd(year % 100));
 }
 
 /*----------  Calibration  ----------*/
@@ -190,14 +378,14 @@ void rtc_year_write(int year) {
 int rtc_calibration_read() {
   byte val = rtc_read(0x08);
   int offset = (int) (val & 0x1F);
-  if (val & 0x20 == 0x00) {
+  if ((val & 0x20) == 0x00) {
     offset *= -1;
   }
   return offset;
 }
 
 void rtc_calibration_write(int offset) {
-  byte val = offset & 0x1F;
+  byte val = abs(offset) & 0x1F;
   if (offset > 0) {
     val |= 0x20;
   }
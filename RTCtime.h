@@ -3,12 +3,43 @@
 
 const int RTC_I2C_ADDR = 0x68;
 
-void RTCinit(const char * timeString, const char * dateString);
+// RTC wall clock read against the halTicks() tick it was read at
+struct RTCAnchor {
+  uint32_t tick;
+  time_t time;          // whole seconds
+  uint8_t centiseconds;
+};
+
+const uint32_t RTC_ANCHOR_TICKS = 60000000; // re-read the RTC once a minute
+const int RTC_TIME_REGISTERS = 8;           // centiseconds to year, 0x00-0x07
+const uint8_t RTC_FLAGS = 0x0F;             // flags register
+const uint8_t RTC_FLAG_OF = 0x04;           // oscillator failed, set at first power-up
+const uint8_t RTC_SECONDS_ST = 0x80;        // stop bit in the seconds register
+
+// drift is measured over this many anchors (4 hours) before the RTC is
+// trimmed; the centisecond registers limit the estimate to about 1.4ppm
+const uint16_t RTC_DRIFT_ANCHORS = 240;
+const int32_t RTC_CAL_FAST_PPB = 4068;      // per positive calibration step
+const int32_t RTC_CAL_SLOW_PPB = 2034;      // per negative calibration step
+
+extern RTCAnchor rtcAnchor;
+
+void RTCinit(const char * timeString, const char * dateString, time_t notBefore);
 void RTCsync();
 time_t RTCsyncProvider();
+void RTCreadAnchor(RTCAnchor *anchor);
+void RTCupdateAnchor(void);
+bool RTCpollAnchor(void);
+bool RTCanchorDue(void);
+time_t RTCnow(void);
+time_t RTCtimeAt(uint32_t tick);
+int32_t RTCdriftPpb(void);
+void RTCcalibrate(void);
 void rtc_write (byte address, byte data);
 uint32_t rtc_read (byte address);
-String getTimeData();
+uint32_t rtc_time_read(uint8_t *regs);
+time_t rtc_time_decode(const uint8_t *regs);
+char *formatTimeData(char *p);
 void getTimeFromPC(const char * timeString);
 void getDateFromPC(const char * dateString);
 
@@ -0,0 +1,207 @@
+#include <Arduino.h>
+#include <Time.h>
+#include "Record.h"
+#include "Memory.h"
+#include "PPG.h"
+#include "RTCtime.h"
+#include "Rice.h"
+#include "Stats.h"
+
+/*============================================
+=          Binary record encoding            =
+==============================================*/
+
+// tick of the last sample record, deltas are taken against it
+static uint32_t recordLastTick = 0;
+
+// PPG samples waiting for their Q record, one row per channel
+static int32_t ppgBlock[RECORD_PPG_CHANNELS][RECORD_PPG_BLOCK];
+static int ppgBlockCount = 0;
+static uint32_t ppgBlockPages = 0;  // memPagesCut() as the block began
+
+static_assert(REC_STATS_MAX_SIZE >= 6 + 5 * STATS_FIELDS, "room for every counter");
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *put24(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  return p + 3;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+  p = put16(p, v & 0xFFFF);
+  return put16(p, v >> 16);
+}
+
+// unsigned LEB128
+static uint8_t *putVarint(uint8_t *p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+/**
+Tag byte followed by the tick delta as a varint. Samples are logged
+oldest first; one that is still older than the last record is logged at
+the last record's tick.
+**/
+static uint8_t *recordBegin(uint8_t *p, uint8_t tag, uint32_t tick) {
+  if ((int32_t) (tick - recordLastTick) < 0) tick = recordLastTick;
+  uint32_t dt = tick - recordLastTick;
+  recordLastTick = tick;
+
+  *p++ = tag;
+  return putVarint(p, dt);
+}
+
+/**
+T record for the last RTC anchor; it carries its own tick, so repeating
+an older anchor at the start of a new stream is still exact
+**/
+static uint8_t *putTime(uint8_t *p) {
+  time_t t = rtcAnchor.time;
+  *p++ = REC_TIME;
+  p = put32(p, rtcAnchor.tick);
+  p = put16(p, year(t));
+  *p++ = month(t);
+  *p++ = day(t);
+  *p++ = hour(t);
+  *p++ = minute(t);
+  *p++ = second(t);
+  *p++ = rtcAnchor.centiseconds;
+  return p;
+}
+
+/**
+S and T records that open every record stream. The tick base is the last
+sample tick so a record encoded before the segment rolled over still
+decodes against the right base.
+**/
+int recordFileHeader(uint8_t *out) {
+  uint8_t *p = out;
+  *p++ = REC_START;
+  *p++ = RECORD_FORMAT_VERSION;
+  p = put32(p, RECORD_TICK_HZ);
+  p = put32(p, recordLastTick);
+  p = putTime(p);
+  return p - out;
+}
+
+void recordTimeAnchor(void) {
+  uint8_t *rec = memReserve(REC_TIME_SIZE);
+  if (!rec) return;
+  memCommit(putTime(rec) - rec);
+}
+
+void recordPPG(uint32_t tick, uint32_t value) {
+  uint8_t *rec = memReserve(RECORD_MAX_SIZE);
+  if (!rec) return;
+  uint8_t *p = recordBegin(rec, REC_PPG, tick);
+  p = put24(p, value);
+  memCommit(p - rec);
+  memCountSamples(STORE_STREAM_PPG, 1, tick, tick);
+}
+
+static int32_t signed24(uint32_t v) {
+  return (int32_t) (v << 8) >> 8;
+}
+
+/**
+Queue a PPG sample for the current Q record, writing it once it holds
+RECORD_PPG_BLOCK samples. A block is also written once a page has been
+cut since it began, so it never holds samples older than the page being
+filled and a reset loses no more PPG than that page's worth of time.
+**/
+void recordPPGPhases(uint32_t tick, const AFEPhases *phases) {
+  if (ppgBlockCount && memPagesCut() != ppgBlockPages) recordPPGFlush();
+  if (!ppgBlockCount) ppgBlockPages = memPagesCut();
+  int i = ppgBlockCount++;
+  ppgBlock[0][i] = (int32_t) tick;
+  ppgBlock[1][i] = signed24(phases->led2Abs);
+  ppgBlock[2][i] = signed24(phases->led1Abs);
+  ppgBlock[3][i] = signed24(phases->aled2);
+  ppgBlock[4][i] = signed24(phases->aled1);
+  if (ppgBlockCount == RECORD_PPG_BLOCK) recordPPGFlush();
+}
+
+/**
+Write the queued PPG samples as a Q record. Each channel is sized before
+it is coded, so exactly the bytes needed are reserved and the coder writes
+straight into the log buffer.
+**/
+void recordPPGFlush(void) {
+  int count = ppgBlockCount;
+  if (!count) return;
+  ppgBlockCount = 0;
+
+  RiceChannel channels[RECORD_PPG_CHANNELS];
+  uint32_t bits = 0;
+  for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+    riceChoose(ppgBlock[c], count, c ? 24 : 32, &channels[c]);
+    bits += channels[c].bits;
+  }
+  int size = (bits + 7) / 8;
+
+  uint8_t *rec = memReserve(REC_PPG_BLOCK_HEADER + size);
+  if (!rec) return;
+  rec[0] = REC_PPG_BLOCK;
+  rec[1] = count;
+  put16(rec + 2, size);
+
+  RiceWriter w;
+  riceWriterInit(&w, rec + REC_PPG_BLOCK_HEADER);
+  for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+    riceEncode(&w, ppgBlock[c], count, c ? 24 : 32, &channels[c]);
+  }
+  memCommit(REC_PPG_BLOCK_HEADER + riceWriterFinish(&w, rec + REC_PPG_BLOCK_HEADER));
+  memCountSamples(STORE_STREAM_PPG, count, ppgBlock[0][0], ppgBlock[0][count - 1]);
+}
+
+void recordAccel(uint32_t tick, const int16_t *xyz) {
+  uint8_t *rec = memReserve(RECORD_MAX_SIZE);
+  if (!rec) return;
+  uint8_t *p = recordBegin(rec, REC_ACCEL, tick);
+  p = put16(p, xyz[0]);
+  p = put16(p, xyz[1]);
+  p = put16(p, xyz[2]);
+  memCommit(p - rec);
+  memCountSamples(STORE_STREAM_ACCEL, 1, tick, tick);
+}
+
+void recordEDA(uint32_t tick, int value) {
+  uint8_t *rec = memReserve(RECORD_MAX_SIZE);
+  if (!rec) return;
+  uint8_t *p = recordBegin(rec, REC_EDA, tick);
+  p = put16(p, value & 0x0FFF);
+  memCommit(p - rec);
+  memCountSamples(STORE_STREAM_EDA, 1, tick, tick);
+}
+
+/**
+C record of the acquisition counters, starting a new window for their
+worst-case fields
+**/
+void recordStats(void) {
+  uint8_t *rec = memReserve(REC_STATS_MAX_SIZE);
+  if (!rec) return;
+  StatsSnapshot stats;
+  statsRead(&stats, true);
+
+  uint32_t values[1 + STATS_FIELDS];
+  memcpy(values, &stats, sizeof(values));
+  uint8_t *p = rec;
+  *p++ = REC_STATS;
+  p = put32(p, stats.tick);
+  *p++ = STATS_FIELDS;
+  for (int i = 1; i <= STATS_FIELDS; i++) p = putVarint(p, values[i]);
+  memCommit(p - rec);
+}
@@ -0,0 +1,75 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Binary log record format, version 5. The log is a run of record streams  =
+=  (Store.h): one starts at boot, after an erase and in the first page of   =
+=  every segment, on a page flagged as a stream start, and it opens with an =
+=  S record. Each sample record carries the ticks elapsed since the         =
+=  previous sample record (or the S record) as an unsigned LEB128 varint.   =
+=  Multi-byte fields are little-endian. Ticks are halTicks() microseconds;  =
+=  T records tie them to the RTC after the S record and then once a minute. =
+=                                                                           =
+=    S  version:u8 tickHz:u32 tick:u32       stream start, sets tick base   =
+=    T  tick:u32 year:u16 month:u8 day:u8    RTC wall clock at tick; does   =
+=       hour:u8 minute:u8 second:u8          not move the tick base         =
+=       centisecond:u8                       (v3 on)                        =
+=    P  dt:varint value:u24                  PPG, as getPPGData() (v1 only) =
+=    O  dt:varint led2abs:u24 led1abs:u24    PPG phases (AFEPhases): red    =
+=       aled2:u24 aled1:u24                  and IR less ambient, and the   =
+=                                            ambients; LEDxVAL = abs + aled =
+=                                            (v2 and v3 only)               =
+=    Q  count:u8 size:u16 bits[size]         block of count PPG phase       =
+=                                            samples, Rice coded (Rice.h):  =
+=                                            tick channel (W=32), then      =
+=                                            led2abs, led1abs, aled2, aled1 =
+=                                            (W=24); carries its own ticks  =
+=                                            and does not move the base     =
+=    A  dt:varint x:i16 y:i16 z:i16          world-frame linear accel       =
+=    E  dt:varint value:u16                  EDA ADC reading (12 bits)      =
+=    C  tick:u32 count:u8                    acquisition counters at tick,  =
+=       value:varint[count]                  StatsSnapshot order (Stats.h); =
+=                                            does not move the tick base    =
+=                                            (v5 on)                        =
+=    0x00 or 0xFF                            end of the stream              =
+==============================================================================*/
+
+// 0 keeps the legacy "E:/A:/P:/T:" text lines for existing tooling
+#ifndef LOG_BINARY_RECORDS
+#define LOG_BINARY_RECORDS 1
+#endif
+
+const uint8_t RECORD_FORMAT_VERSION = 5;
+const uint32_t RECORD_TICK_HZ = 1000000; // ticks are halTicks()
+
+const uint8_t REC_START = 'S';
+const uint8_t REC_TIME = 'T';
+const uint8_t REC_PPG = 'P';
+const uint8_t REC_PPG_PHASES = 'O';
+const uint8_t REC_PPG_BLOCK = 'Q';
+const uint8_t REC_ACCEL = 'A';
+const uint8_t REC_EDA = 'E';
+const uint8_t REC_STATS = 'C';
+
+const int REC_START_SIZE = 10;
+const int REC_TIME_SIZE = 13;
+const int RECORD_MAX_SIZE = 18;
+const int REC_PPG_BLOCK_HEADER = 4;
+const int RECORD_PPG_BLOCK = 64;     // PPG samples per Q record, 640ms at 100Hz
+const int RECORD_PPG_CHANNELS = 5;   // tick and the four AFEPhases values
+const int REC_STATS_MAX_SIZE = 6 + 5 * 28;  // tick, count and 28 varints at their longest
+
+struct AFEPhases;
+
+int recordFileHeader(uint8_t *out);
+void recordTimeAnchor(void);
+void recordPPG(uint32_t tick, uint32_t value);
+void recordPPGPhases(uint32_t tick, const AFEPhases *phases);
+void recordPPGFlush(void);
+void recordAccel(uint32_t tick, const int16_t *xyz);
+void recordEDA(uint32_t tick, int value);
+void recordStats(void);
+
+#endif
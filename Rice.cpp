@@ -0,0 +1,189 @@
+#include "Rice.h"
+
+/*============================================
+=              Block Rice coding             =
+==============================================*/
+
+// mapped residuals of the channel being sized
+static uint32_t riceMapped[RICE_MAX_BLOCK];
+
+static uint32_t zigzag(int32_t v) {
+  return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+  return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+static int32_t signExtend(uint32_t v, int width) {
+  if (width >= 32) return (int32_t) v;
+  return (int32_t) (v << (32 - width)) >> (32 - width);
+}
+
+static int32_t predict(const int32_t *values, int i, int order) {
+  if (order && i >= 2) return (int32_t) (2u * (uint32_t) values[i - 1] - (uint32_t) values[i - 2]);
+  return values[i - 1];
+}
+
+static uint32_t residualMapped(const int32_t *values, int i, int order) {
+  return zigzag((int32_t) ((uint32_t) values[i] - (uint32_t) predict(values, i, order)));
+}
+
+static uint32_t riceCost(const uint32_t *mapped, int count, int k) {
+  uint32_t bits = 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t q = mapped[i] >> k;
+    bits += q < (uint32_t) RICE_ESCAPE ? q + 1 + k : RICE_ESCAPE + 32;
+  }
+  return bits;
+}
+
+/**
+Pick the predictor with the smaller residuals, then the cheapest k up to
+the one their mean suggests, falling back to verbatim values when nothing
+beats them. count is at most RICE_MAX_BLOCK.
+**/
+void riceChoose(const int32_t *values, int count, int width, RiceChannel *channel) {
+  uint32_t header = 1 + 5 + width;
+  int n = count - 1;
+
+  uint64_t sum[2] = { 0, 0 };
+  for (int i = 1; i < count; i++) {
+    sum[0] += residualMapped(values, i, 0);
+    sum[1] += residualMapped(values, i, 1);
+  }
+  channel->order = sum[1] < sum[0];
+  for (int i = 1; i < count; i++) riceMapped[i - 1] = residualMapped(values, i, channel->order);
+
+  channel->k = RICE_VERBATIM;
+  channel->bits = header + (uint32_t) n * width;
+  if (n <= 0) return;
+
+  uint64_t mean = sum[channel->order] / n;
+  int estimate = 0;
+  while (estimate < 30 && (mean >> (estimate + 1))) estimate++;
+
+  // the mean is pulled up by outliers that escape cheaply, so smaller k
+  // are worth trying too
+  for (int k = 0; k <= estimate + 1 && k < RICE_VERBATIM; k++) {
+    uint32_t bits = header + riceCost(riceMapped, n, k);
+    if (bits < channel->bits) {
+      channel->bits = bits;
+      channel->k = k;
+    }
+  }
+}
+
+/*----------  Bit writer  ----------*/
+
+void riceWriterInit(RiceWriter *w, uint8_t *out) {
+  w->out = out;
+  w->acc = 0;
+  w->used = 0;
+}
+
+static void putBits(RiceWriter *w, uint32_t value, int bits) {
+  // acc holds fewer than 8 unwritten bits between calls
+  while (bits > 0) {
+    int take = bits > 24 ? 24 : bits;
+    bits -= take;
+    w->acc = (w->acc << take) | ((value >> bits) & ((1u << take) - 1));
+    w->used += take;
+    while (w->used >= 8) {
+      w->used -= 8;
+      *w->out++ = w->acc >> w->used;
+    }
+  }
+}
+
+static void putOnes(RiceWriter *w, uint32_t count) {
+  while (count >= 16) {
+    putBits(w, 0xFFFF, 16);
+    count -= 16;
+  }
+  if (count) putBits(w, (1u << count) - 1, count);
+}
+
+/**
+Append a channel coded as riceChoose() chose
+**/
+void riceEncode(RiceWriter *w, const int32_t *values, int count, int width, const RiceChannel *channel) {
+  putBits(w, channel->order, 1);
+  putBits(w, channel->k, 5);
+  putBits(w, (uint32_t) values[0], width);
+
+  for (int i = 1; i < count; i++) {
+    if (channel->k == RICE_VERBATIM) {
+      putBits(w, (uint32_t) values[i], width);
+      continue;
+    }
+    uint32_t mapped = residualMapped(values, i, channel->order);
+    uint32_t q = mapped >> channel->k;
+    if (q < (uint32_t) RICE_ESCAPE) {
+      putOnes(w, q);
+      putBits(w, 0, 1);
+      putBits(w, mapped, channel->k);
+    } else {
+      putOnes(w, RICE_ESCAPE);
+      putBits(w, mapped, 32);
+    }
+  }
+}
+
+/**
+Pad the last byte with zeros; returns the bytes written since start
+**/
+int riceWriterFinish(RiceWriter *w, uint8_t *start) {
+  if (w->used) putBits(w, 0, 8 - w->used);
+  return w->out - start;
+}
+
+/*----------  Bit reader  ----------*/
+
+void riceReaderInit(RiceReader *r, const uint8_t *in, const uint8_t *end) {
+  r->in = in;
+  r->end = end;
+  r->acc = 0;
+  r->used = 0;
+  r->overrun = false;
+}
+
+static uint32_t getBits(RiceReader *r, int bits) {
+  uint32_t value = 0;
+  while (bits > 0) {
+    if (r->used == 0) {
+      if (r->in >= r->end) {
+        r->overrun = true;
+        return 0;
+      }
+      r->acc = *r->in++;
+      r->used = 8;
+    }
+    int take = bits < r->used ? bits : r->used;
+    r->used -= take;
+    bits -= take;
+    value = (value << take) | ((r->acc >> r->used) & ((1u << take) - 1));
+  }
+  return value;
+}
+
+/**
+Read back one channel; false if the data ran out
+**/
+bool riceDecode(RiceReader *r, int32_t *values, int count, int width) {
+  int order = getBits(r, 1);
+  int k = getBits(r, 5);
+  values[0] = signExtend(getBits(r, width), width);
+
+  for (int i = 1; i < count && !r->overrun; i++) {
+    if (k == RICE_VERBATIM) {
+      values[i] = signExtend(getBits(r, width), width);
+      continue;
+    }
+    uint32_t q = 0;
+    while (q < (uint32_t) RICE_ESCAPE && getBits(r, 1) && !r->overrun) q++;
+    uint32_t mapped = q < (uint32_t) RICE_ESCAPE ? (q << k) | getBits(r, k) : getBits(r, 32);
+    values[i] = (int32_t) ((uint32_t) predict(values, i, order) + (uint32_t) unzigzag(mapped));
+  }
+  return !r->overrun;
+}
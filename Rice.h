@@ -0,0 +1,53 @@
+#ifndef RICE_H
+#define RICE_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Lossless block coder for slowly varying sample streams. Each channel of  =
+=  a block is coded on its own, most significant bit first:                 =
+=                                                                           =
+=    order:1 k:5 first:W residual...                                        =
+=                                                                           =
+=  The first value is stored in W bits. Each later value is predicted from  =
+=  the previous one (order 0) or by extending the line through the previous =
+=  two (order 1). The residual is zigzag mapped to unsigned and Rice coded  =
+=  with parameter k: the quotient in unary (ones ended by a zero), then the =
+=  low k bits. A quotient of RICE_ESCAPE or more is written as RICE_ESCAPE  =
+=  ones followed by the mapped residual in 32 bits. k = RICE_VERBATIM means =
+=  the remaining values follow as they are, in W bits each.                 =
+==============================================================================*/
+
+const int RICE_MAX_BLOCK = 64;   // values per channel
+const int RICE_ESCAPE = 16;
+const int RICE_VERBATIM = 31;
+
+// coding chosen for one channel, and its size in bits
+struct RiceChannel {
+  uint8_t order;
+  uint8_t k;
+  uint32_t bits;
+};
+
+struct RiceWriter {
+  uint8_t *out;
+  uint32_t acc;
+  int used;     // bits in acc
+};
+
+struct RiceReader {
+  const uint8_t *in;
+  const uint8_t *end;
+  uint32_t acc;
+  int used;     // bits left in acc
+  bool overrun;
+};
+
+void riceChoose(const int32_t *values, int count, int width, RiceChannel *channel);
+void riceWriterInit(RiceWriter *w, uint8_t *out);
+void riceEncode(RiceWriter *w, const int32_t *values, int count, int width, const RiceChannel *channel);
+int riceWriterFinish(RiceWriter *w, uint8_t *start);
+void riceReaderInit(RiceReader *r, const uint8_t *in, const uint8_t *end);
+bool riceDecode(RiceReader *r, int32_t *values, int count, int width);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Fixed-capacity single-producer/single-consumer ring. An ISR pushes each  =
+=  sample as it is taken and loop() pops them in batches. Each side only    =
+=  writes its own index, so on a single core no locking is needed. When     =
+=  full the newest sample is dropped and counted; highWater records the     =
+=  deepest the ring has been, to size N against loop() stalls.              =
+==============================================================================*/
+
+// keeps the compiler from moving the slot copy across the index update
+#define RING_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+template <typename T, uint16_t N>
+struct SampleRing {
+  static_assert(N && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+  T items[N];
+  volatile uint16_t head;       // next slot the producer writes
+  volatile uint16_t tail;       // next slot the consumer reads
+  volatile uint16_t highWater;  // most samples queued at once
+  volatile uint32_t overflows;  // samples dropped because the ring was full
+
+  /**
+  Producer (ISR) side
+  **/
+  bool push(const T &item) {
+    uint16_t h = head;
+    uint16_t used = (uint16_t) (h - tail);
+    if (used >= N) {
+      overflows++;
+      return false;
+    }
+    items[h & (N - 1)] = item;
+    RING_BARRIER();
+    head = (uint16_t) (h + 1);
+    if (used + 1 > highWater) highWater = used + 1;
+    return true;
+  }
+
+  /**
+  Consumer (loop) side
+  **/
+  bool empty(void) const {
+    return head == tail;
+  }
+
+  uint16_t count(void) const {
+    return (uint16_t) (head - tail);
+  }
+
+  const T &peek(void) const {
+    return items[tail & (N - 1)];
+  }
+
+  bool pop(T &item) {
+    uint16_t t = tail;
+    if (head == t) return false;
+    RING_BARRIER();
+    item = items[t & (N - 1)];
+    RING_BARRIER();
+    tail = (uint16_t) (t + 1);
+    return true;
+  }
+
+  // discard everything queued so far
+  void clear(void) {
+    tail = head;
+  }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <Arduino.h>
+#include <string.h>
+#include "Stats.h"
+#include "HAL.h"
+#include "Memory.h"
+#include "Power.h"
+#include "PPG.h"
+#include "MPU.h"
+#include "EDA.h"
+
+/*============================================
+=          Acquisition counters              =
+==============================================*/
+
+// written by the sensor ISRs
+static volatile uint32_t statsProducedCount[STORE_STREAMS];
+static volatile uint32_t statsMissedCount[STORE_STREAMS];
+static volatile uint32_t statsBusWaits = 0;
+static volatile uint32_t statsBusWaitLongest = 0;
+
+// written by loop()
+static uint32_t statsConsumedCount[STORE_STREAMS];
+static uint32_t statsLatency[STORE_STREAMS];
+static uint32_t statsFIFOResets = 0;
+static uint32_t statsFlushes = 0;
+static uint32_t statsFlushLongest = 0;
+static uint32_t statsServiceLongest = 0;
+static uint32_t statsWindowStart = 0;   // tick of the last C record
+
+void statsProduced(StoreStream stream) {
+  statsProducedCount[stream]++;
+}
+
+void statsMissed(StoreStream stream, uint32_t count) {
+  statsMissedCount[stream] += count;
+}
+
+/**
+A sample logged by loop(): its latency is how long it waited since its
+tick, ISR and ring included
+**/
+void statsConsumed(StoreStream stream, uint32_t tick) {
+  statsConsumedCount[stream]++;
+  uint32_t waited = halTicks() - tick;
+  if (waited > statsLatency[stream]) statsLatency[stream] = waited;
+}
+
+void statsFIFOReset(uint32_t packets) {
+  statsFIFOResets++;
+  statsMissedCount[STORE_STREAM_ACCEL] += packets;
+}
+
+// a page from due to programmed
+void statsFlush(uint32_t ticks) {
+  statsFlushes++;
+  if (ticks > statsFlushLongest) statsFlushLongest = ticks;
+}
+
+// one memService() step, the longest loop() is held up by flash
+void statsService(uint32_t ticks) {
+  if (ticks > statsServiceLongest) statsServiceLongest = ticks;
+}
+
+// an ISR's bus request from queued to run, with interrupts disabled
+void statsBusWait(uint32_t ticks) {
+  statsBusWaits++;
+  if (ticks > statsBusWaitLongest) statsBusWaitLongest = ticks;
+}
+
+/**
+Everything counted so far. A new window starts the worst-case fields over,
+as each C record does.
+**/
+void statsRead(StatsSnapshot *stats, bool newWindow) {
+  stats->tick = halTicks();
+  noInterrupts();
+  for (int s = 0; s < STORE_STREAMS; s++) {
+    stats->produced[s] = statsProducedCount[s];
+    stats->missed[s] = statsMissedCount[s];
+  }
+  stats->busWaits = statsBusWaits;
+  stats->busWaitLongest = statsBusWaitLongest;
+  if (newWindow) statsBusWaitLongest = 0;
+  interrupts();
+
+  stats->overflows[STORE_STREAM_PPG] = PPGRing.overflows;
+  stats->overflows[STORE_STREAM_ACCEL] = MPURing.overflows;
+  stats->overflows[STORE_STREAM_EDA] = EDARing.overflows;
+  for (int s = 0; s < STORE_STREAMS; s++) {
+    stats->consumed[s] = statsConsumedCount[s];
+    stats->latency[s] = statsLatency[s];
+  }
+  stats->fifoResets = statsFIFOResets;
+  stats->recordsDropped = memDroppedRecords();
+  stats->flushes = statsFlushes;
+  stats->flushLongest = statsFlushLongest;
+  stats->serviceLongest = statsServiceLongest;
+
+  PowerStats power;
+  powerStats(&power);
+  stats->wakes = power.wakes;
+  stats->activeMs = power.activeTicks / (HAL_TICK_HZ / 1000);
+  stats->sleepMs = power.sleepTicks / (HAL_TICK_HZ / 1000);
+
+  HalHeap heap;
+  halHeap(&heap);
+  stats->heapHighWater = heap.highWater;
+  stats->heapInUse = heap.inUse;
+  stats->heapFreeChunks = heap.freeChunks;
+
+  if (newWindow) {
+    memset(statsLatency, 0, sizeof(statsLatency));
+    statsFlushLongest = 0;
+    statsServiceLongest = 0;
+    statsWindowStart = stats->tick;
+  }
+}
+
+bool statsRecordDue(void) {
+  return halTicks() - statsWindowStart >= STATS_RECORD_TICKS;
+}
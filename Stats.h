@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "Store.h"
+
+/*============================================================================
+=  Acquisition counters, to tell whether samples are lost and where the     =
+=  time goes. Sensor ISRs count what they produce, loop() what it logs and  =
+=  how long after its tick; the flash side counts pages and the longest     =
+=  waits. Logged once a minute as a C record (Record.h) and readable over   =
+=  USB with the offload protocol's S request (Offload.h).                   =
+==============================================================================*/
+
+const uint32_t STATS_RECORD_TICKS = 60000000; // log a C record once a minute
+
+// counts are from boot; the worst-case fields cover the time since the last C record
+struct StatsSnapshot {
+  uint32_t tick;                        // halTicks() when taken
+  uint32_t produced[STORE_STREAMS];     // ADC_RDY edges, MPU INTs, sample timer overflows
+  uint32_t consumed[STORE_STREAMS];     // samples loop() logged
+  uint32_t overflows[STORE_STREAMS];    // dropped by a full sample ring
+  uint32_t missed[STORE_STREAMS];       // lost before a ring: an ADC_RDY while a read was
+                                        // already deferred, MPU packets a FIFO reset discarded
+  uint32_t latency[STORE_STREAMS];      // worst sample tick to logged, us
+  uint32_t fifoResets;                  // MPU FIFO overflows
+  uint32_t recordsDropped;              // no room in the log buffers
+  uint32_t flushes;                     // flash pages programmed
+  uint32_t flushLongest;                // worst page due to programmed, us
+  uint32_t serviceLongest;              // worst single memService() step, us
+  uint32_t wakes;                       // Power.h
+  uint32_t activeMs;
+  uint32_t sleepMs;
+  uint32_t heapHighWater;               // HAL.h; nothing should allocate once running
+  uint32_t heapInUse;
+  uint32_t heapFreeChunks;              // fragmentation
+  uint32_t busWaits;                    // ISR transactions queued behind loop() on SPI (Bus.h)
+  uint32_t busWaitLongest;              // worst of those waits, us
+};
+
+// values after the tick, as the C record and the host tools list them
+const int STATS_FIELDS = sizeof(StatsSnapshot) / 4 - 1;
+static_assert(sizeof(StatsSnapshot) == 4 * (1 + STATS_FIELDS), "stats are all u32");
+
+extern const char *const STATS_FIELD_NAMES[STATS_FIELDS];
+
+void statsProduced(StoreStream stream);
+void statsMissed(StoreStream stream, uint32_t count);
+void statsConsumed(StoreStream stream, uint32_t tick);
+void statsFIFOReset(uint32_t packets);
+void statsFlush(uint32_t ticks);
+void statsService(uint32_t ticks);
+void statsBusWait(uint32_t ticks);
+void statsRead(StatsSnapshot *stats, bool newWindow);
+bool statsRecordDue(void);
+
+#endif
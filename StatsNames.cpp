@@ -0,0 +1,10 @@
+#include "Stats.h"
+
+// kept apart from Stats.cpp so the host tools link it without the firmware
+const char *const STATS_FIELD_NAMES[STATS_FIELDS] = {
+  "ppg_produced", "accel_produced", "eda_produced", "ppg_consumed", "accel_consumed", "eda_consumed",
+  "ppg_overflows", "accel_overflows", "eda_overflows", "ppg_missed", "accel_missed", "eda_missed",
+  "ppg_latency_us", "accel_latency_us", "eda_latency_us", "fifo_resets", "records_dropped", "flushes",
+  "flush_longest_us", "service_longest_us", "wakes", "active_ms", "sleep_ms", "heap_high_water",
+  "heap_in_use", "heap_free_chunks", "bus_waits", "bus_wait_longest_us"
+};
@@ -0,0 +1,164 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include "Crc.h"
+
+/*============================================================================
+=  On-flash layout of the log store. The chip is used raw, in 64KB erase    =
+=  blocks, with no file system:                                             =
+=                                                                           =
+=    blocks 0, 1   superblocks: an append-only array of 32 byte             =
+=                  checkpoints, one written each time a segment is opened.  =
+=                  When one block fills, the other is erased and takes over =
+=    blocks 2..    segments: a 32 byte header in the first 256 byte page,   =
+=                  then pages of an 8 byte page header and up to 248 bytes  =
+=                  of record stream (Record.h). A page flagged as a stream  =
+=                  start begins a new stream, as after a reset              =
+=                                                                           =
+=  Pages are committed one at a time and in order, so a reset loses at      =
+=  most the page being filled and a torn last page fails its crc. Boot      =
+=  finds where to carry on by binary searching the newest segment for its   =
+=  first erased page.                                                       =
+=                                                                           =
+=  With two chips a segment spans the same block on both, its 256 byte      =
+=  pages alternating between them starting on the first chip, so one chip   =
+=  programs while the next page goes to the other. The superblocks and      =
+=  segment headers are on the first chip.                                   =
+=                                                                           =
+=  When a segment's last page is written a 32 byte summary follows its      =
+=  header: when its first and last samples were taken and how many of each  =
+=  stream it holds. Segments are in time order by sequence, so a time range =
+=  is found by binary searching the summaries of the segments kept; the     =
+=  segment still being written has none and runs on to the present. The     =
+=  order holds across resets because the RTC is only set when its           =
+=  oscillator stopped, and then not to before the newest time on the store  =
+=  (RTCinit()).                                                             =
+=                                                                           =
+=  Mounting binary searches each superblock for its last checkpoint, takes  =
+=  the newer one and checks the segment after the one it names, so boot     =
+=  reads a few dozen bytes however much has been recorded. Segments are     =
+=  written in order of their sequence number; in circular mode they wrap    =
+=  round to block 2, and the checkpoint's tail is the oldest one still      =
+=  kept.                                                                    =
+=  Multi-byte fields are little-endian; crc is crc32() of the fields        =
+=  before it.                                                               =
+==============================================================================*/
+
+const uint32_t STORE_BLOCK_SIZE = 65536;
+const uint32_t STORE_PAGE_SIZE = 256;
+const uint32_t STORE_MAX_STRIPES = 2;
+const uint32_t STORE_SUPERBLOCKS = 2;
+const uint32_t STORE_FIRST_SEGMENT = STORE_SUPERBLOCKS; // block index
+const uint32_t STORE_CHECKPOINT_MAGIC = 0x50434E53;     // "SNCP"
+const uint32_t STORE_SEGMENT_MAGIC = 0x47534E53;        // "SNSG"
+const uint32_t STORE_ERASED = 0xFFFFFFFF;
+
+struct StoreCheckpoint {
+  uint32_t magic;
+  uint32_t sequence;         // of this checkpoint, across both superblocks
+  uint32_t segment;          // block index of the newest segment
+  uint32_t segmentSequence;  // and its sequence number
+  uint32_t tail;             // block index of the oldest segment kept
+  uint32_t tailSequence;
+  uint32_t reserved;         // 0xFFFFFFFF
+  uint32_t crc;
+};
+
+struct StoreSegmentHeader {
+  uint32_t magic;
+  uint32_t sequence;         // 1 for the first segment, then counting up
+  uint32_t stripes;          // chips its pages alternate across
+  uint32_t opened;           // RTC time it was opened, UTC seconds
+  uint32_t reserved[3];      // 0xFFFFFFFF
+  uint32_t crc;
+};
+
+struct StorePageHeader {
+  uint16_t index;            // page number within the segment, from 1
+  uint8_t length;            // record stream bytes in the page
+  uint8_t flags;
+  uint32_t crc;              // of the fields before it and the bytes used
+};
+
+// sample streams a summary counts
+enum StoreStream { STORE_STREAM_PPG, STORE_STREAM_ACCEL, STORE_STREAM_EDA, STORE_STREAMS };
+
+struct StoreSegmentSummary {
+  uint32_t magic;
+  uint32_t first;            // RTC time of its first sample, UTC seconds
+  uint32_t last;             // and of its last
+  uint32_t samples[STORE_STREAMS];
+  uint32_t flags;
+  uint32_t crc;
+};
+
+const uint8_t STORE_PAGE_STREAM_START = 0x01;
+const uint32_t STORE_SUMMARY_MAGIC = 0x49534E53;       // "SNSI"
+const uint32_t STORE_SUMMARY_PARTIAL = 0x01;           // counts only since a reset resumed the segment
+
+const uint32_t STORE_CHECKPOINT_SIZE = sizeof(StoreCheckpoint);
+const uint32_t STORE_CHECKPOINTS = STORE_BLOCK_SIZE / STORE_CHECKPOINT_SIZE;
+const uint32_t STORE_SEGMENT_HEADER_SIZE = sizeof(StoreSegmentHeader);
+const uint32_t STORE_PAGE_HEADER_SIZE = sizeof(StorePageHeader);
+const uint32_t STORE_PAGE_DATA = STORE_PAGE_SIZE - STORE_PAGE_HEADER_SIZE;
+
+static_assert(sizeof(StoreCheckpoint) == 32, "checkpoint layout");
+static_assert(sizeof(StoreSegmentHeader) == 32, "segment header layout");
+static_assert(sizeof(StorePageHeader) == 8, "page header layout");
+static_assert(sizeof(StoreSegmentSummary) == 32, "segment summary layout");
+
+inline bool storeCheckpointValid(const StoreCheckpoint *cp) {
+  return cp->magic == STORE_CHECKPOINT_MAGIC && cp->crc == crc32(cp, sizeof(*cp) - 4);
+}
+
+inline bool storeSegmentValid(const StoreSegmentHeader *h) {
+  return h->magic == STORE_SEGMENT_MAGIC && h->stripes >= 1 && h->stripes <= STORE_MAX_STRIPES &&
+         h->crc == crc32(h, sizeof(*h) - 4);
+}
+
+inline bool storeSummaryValid(const StoreSegmentSummary *s) {
+  return s->magic == STORE_SUMMARY_MAGIC && s->crc == crc32(s, sizeof(*s) - 4);
+}
+
+// time a segment starts: its first sample, or when it was opened if it has no summary
+inline uint32_t storeSegmentStart(const StoreSegmentHeader *h, const StoreSegmentSummary *s) {
+  return storeSummaryValid(s) ? s->first : h->opened;
+}
+
+// and ends: open-ended while it is being written, or if its summary was lost
+inline uint32_t storeSegmentEnd(const StoreSegmentSummary *s) {
+  return storeSummaryValid(s) ? s->last : STORE_ERASED;
+}
+
+// block of the segment places after the one in block tail, with blocks per chip
+inline uint32_t storeSegmentBlock(uint32_t tail, uint32_t places, uint32_t blocks) {
+  return STORE_FIRST_SEGMENT + (tail - STORE_FIRST_SEGMENT + places) % (blocks - STORE_FIRST_SEGMENT);
+}
+
+// pages in a segment, its header page included
+inline uint32_t storeSegmentPages(uint32_t stripes) {
+  return stripes * STORE_BLOCK_SIZE / STORE_PAGE_SIZE;
+}
+
+inline uint32_t storePageCrc(const StorePageHeader *h, const uint8_t *data) {
+  return crc32(data, h->length, crc32(h, 4));
+}
+
+// a committed page, data following its header
+inline bool storePageValid(const StorePageHeader *h, uint32_t index, const uint8_t *data) {
+  return h->index == index && h->length <= STORE_PAGE_DATA && h->crc == storePageCrc(h, data);
+}
+
+inline bool storePageErased(const StorePageHeader *h) {
+  return h->index == 0xFFFF && h->length == 0xFF && h->flags == 0xFF;
+}
+
+// chip and address of a byte of a segment, counting from its header
+inline uint32_t storeAddress(uint32_t segment, uint32_t stripes, uint32_t offset, uint32_t *chip) {
+  uint32_t page = offset / STORE_PAGE_SIZE;
+  *chip = page % stripes;
+  return segment * STORE_BLOCK_SIZE + page / stripes * STORE_PAGE_SIZE + offset % STORE_PAGE_SIZE;
+}
+
+#endif
@@ -2,63 +2,169 @@
 #include <Time.h> 
 #include <Wire.h>
 #include "AFE4400regs.h"
+#include "HAL.h"
+#include "Bus.h"
+#include "I2C.h"
 #include "RTCtime.h"
 #include "MPU.h"
 #include "EDA.h"
 #include "PPG.h"
 #include "Memory.h"
+#include "Record.h"
+#include "Offload.h"
+#include "Power.h"
+#include "Stats.h"
+#include "Format.h"
 
 void setup() {
   analogReadResolution(12);
   
-  Serial.begin(9600);
+  // native USB CDC runs at full speed whatever the baud rate
+  SerialUSB.begin(115200);
+  halTickBegin();
   SPI.begin();
   Wire.begin();
-  // Disable PPG AFE
-  digitalWrite(PIN_SS_AFE, HIGH);
-  // Initialize memory chip and release SPI bus
+  // MPU and RTC reads off the CPU, in Fast mode
+  i2cBegin();
+  // Deselect the AFE and both flash chips
+  busInit();
+  // Initialize memory chip
   memInit();
-  memDisable();
-  // Initialize RTC with time from computer, set time sync
-  RTCinit(__TIME__, __DATE__);
+  // Set the RTC to the build time if it has stopped, set time sync
+  RTCinit(__TIME__, __DATE__, memLatestTime());
   setSyncProvider(RTCsyncProvider);
+  RTCupdateAnchor();
   // Initialize accelerometer
   MPUinit();
-  // Initialize PPG AFE registers to sample at 100Hz
+#if MPU_BENCHMARK
+  MPUBenchmarkMath();
+#endif
+  // Initialize PPG AFE registers to sample at PPG_SAMPLE_HZ, and check them
+  busAcquire(BUS_AFE);
   AFE4400InitConfigs();
-  AFE4400InitTimings100Hz();
+  AFEApplyProfile(&AFE_PROFILE_DEFAULT);
+  if (!AFE4400SelfTest()) SerialUSB.println(F("AFE4400 self-test failed"));
+  busRelease();
   // Setup AFE interrupt
   attachInterrupt(PIN_ADC_RDY, sampleAFE, RISING);
 
   setupInternalInterrupts(true);
+  powerInit();
 }
 
-void loop() { 
-  String toWrite;
+enum SampleStream { STREAM_NONE, STREAM_EDA, STREAM_MPU, STREAM_PPG };
 
-  bool wrote = false;
+/**
+Stream whose oldest queued sample was taken first, so samples are logged
+in time order across the three rings. Nothing is logged while the oldest
+sample is an accelerometer packet waiting for its burst, unless it has
+waited so long the MPU is not being read; then the other streams go on.
+**/
+SampleStream nextStream(void) {
+  SampleStream next = STREAM_NONE;
+  uint32_t oldest = 0;
 
-  if(isEDADataAvailable()) {
-    toWrite = "E:" + String(getEDAData());
-    memWrite(toWrite.c_str()); 
-    wrote = true;
+  if (!EDARing.empty()) {
+    next = STREAM_EDA;
+    oldest = EDARing.peek().tick;
   }
-  
-  if (isMPUDataAvailable()) {
-    toWrite = "A:" + getMPUData();
-    memWrite(toWrite.c_str()); 
-    wrote = true;
+  uint32_t mpuTick;
+  if (!MPUStalled() && peekMPUTick(&mpuTick) && (next == STREAM_NONE || (int32_t) (mpuTick - oldest) < 0)) {
+    next = STREAM_MPU;
+    oldest = mpuTick;
   }
-  
-  if (isAFEDataAvailable()) { 
-    restAFEReady();
-    toWrite = "P:" + String(getPPGData());
-    memWrite(toWrite.c_str()); 
+  if (!PPGRing.empty() && (next == STREAM_NONE || (int32_t) (PPGRing.peek().tick - oldest) < 0)) {
+    next = STREAM_PPG;
+  }
+  if (next == STREAM_MPU && !MPUBurstReady()) return STREAM_NONE;
+  return next;
+}
+
+/**
+Work loop() could do right now. A page waiting for flash is not counted:
+memService() moves it on a step per wake, which the PPG alone
+makes often enough. Nor is an I2C read in flight; its interrupt wakes
+loop() when it ends, unless its next phase waits on a STOP.
+**/
+static bool loopBusy(void) {
+  return nextStream() != STREAM_NONE || MPUServiceDue() || RTCanchorDue() || offloadBusy() ||
+         i2cServiceDue() || SerialUSB.available() > 0;
+}
+
+void loop() { 
+  SampleStream stream;
+  EDASample eda = { 0, 0 };
+  PPGSample ppg;
+  MPUSample accel;
+
+  i2cService();
+  MPUService();
+
+#if LOG_BINARY_RECORDS
+  while ((stream = nextStream()) != STREAM_NONE) {
+    if (stream == STREAM_EDA) {
+      EDARing.pop(eda);
+      recordEDA(eda.tick, eda.value);
+      statsConsumed(STORE_STREAM_EDA, eda.tick);
+    } else if (stream == STREAM_MPU) {
+      if (!popMPUSample(&accel)) continue;
+      recordAccel(accel.tick, accel.accel);
+      statsConsumed(STORE_STREAM_ACCEL, accel.tick);
+    } else {
+      PPGRing.pop(ppg);
+      recordPPGPhases(ppg.tick, &ppg.phases);
+      statsConsumed(STORE_STREAM_PPG, ppg.tick);
+    }
+  }
+#else
+  // lines are built here, never on the heap
+  char line[FORMAT_LINE_MAX];
+  char *end;
+
+  bool wrote = false;
+
+  while ((stream = nextStream()) != STREAM_NONE) {
+    StoreStream counted;
+    uint32_t tick;
+    if (stream == STREAM_EDA) {
+      EDARing.pop(eda);
+      end = formatEDAData(formatText(line, "E:"), &eda);
+      counted = STORE_STREAM_EDA;
+      tick = eda.tick;
+    } else if (stream == STREAM_MPU) {
+      if (!popMPUSample(&accel)) continue;
+      end = formatMPUData(formatText(line, "A:"), &accel);
+      counted = STORE_STREAM_ACCEL;
+      tick = accel.tick;
+    } else {
+      PPGRing.pop(ppg);
+      end = formatPPGData(formatText(line, "P:"), &ppg.phases);
+      counted = STORE_STREAM_PPG;
+      tick = ppg.tick;
+    }
+    if (memWrite(line, end - line)) memCountSamples(counted, 1, tick, tick);
+    statsConsumed(counted, tick);
     wrote = true;
   }
 
   if(wrote) {
-    toWrite = "T:" + getTimeData();
-    memWrite(toWrite.c_str());
+    end = formatTimeData(formatText(line, "T:"));
+    memWrite(line, end - line);
   }
+#endif
+  // the next burst reads while the flash is serviced
+  MPUService();
+
+  if (RTCanchorDue() && RTCpollAnchor()) {
+#if LOG_BINARY_RECORDS
+    recordTimeAnchor();
+#endif
+  }
+#if LOG_BINARY_RECORDS
+  if (statsRecordDue()) recordStats();
+#endif
+
+  memService();
+  offloadService();
+  powerSleep(loopBusy);
 }
@@ -0,0 +1,214 @@
+#include "Arduino.h"
+#include "Sim.h"
+#include "SimDevices.h"
+
+/*============================================
+=               Pins and timing              =
+==============================================*/
+
+void pinMode(uint32_t pin, uint32_t mode) {
+  (void) pin;
+  (void) mode;
+}
+
+void digitalWrite(uint32_t pin, uint32_t value) {
+  simAdvanceNanos(SIM_GPIO_NS);
+  simPinWrite(pin, value ? HIGH : LOW);
+}
+
+int digitalRead(uint32_t pin) {
+  simAdvanceNanos(SIM_GPIO_NS);
+  return simPinRead(pin);
+}
+
+int analogRead(uint32_t pin) {
+  simStats.busOps++;
+  simStats.adcConversions++;
+  simAdvanceNanos(SIM_ADC_CONVERSION_NS);
+  return simADCRead(pin);
+}
+
+void analogReadResolution(int res) {
+  simADCResolution(res);
+}
+
+void attachInterrupt(uint32_t pin, voidFuncPtr callback, uint32_t mode) {
+  (void) mode;
+  simIRQAttach(simPinIRQLine(pin), callback);
+}
+
+void detachInterrupt(uint32_t pin) {
+  simIRQDetach(simPinIRQLine(pin));
+}
+
+unsigned long millis(void) {
+  return (unsigned long) (simNowNanos() / 1000000ULL);
+}
+
+unsigned long micros(void) {
+  return (unsigned long) (simNowNanos() / 1000ULL);
+}
+
+void delay(unsigned long ms) {
+  simStats.busOps++;
+  simAdvanceNanos((uint64_t) ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  simAdvanceNanos((uint64_t) us * 1000ULL);
+}
+
+void noInterrupts(void) {
+  simInterruptsEnable(false);
+}
+
+void interrupts(void) {
+  simInterruptsEnable(true);
+}
+
+/*============================================
+=                  WString                   =
+==============================================*/
+
+SimStringHeap simStringHeap;
+
+void String::track(void) {
+  unsigned int need = s.length() + 1;
+  if (need <= capacity) return;
+  simStringHeap.allocations++;
+  simStringHeap.inUse += need - capacity;
+  if (simStringHeap.inUse > simStringHeap.highWater) simStringHeap.highWater = simStringHeap.inUse;
+  capacity = need;
+}
+
+static std::string formatInteger(unsigned long value, unsigned char base, bool negative) {
+  char buf[8 * sizeof(long) + 2];
+  char *p = buf + sizeof(buf) - 1;
+  *p = '\0';
+  if (base < 2) base = 10;
+  do {
+    int digit = value % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value);
+  if (negative) *--p = '-';
+  return std::string(p);
+}
+
+static std::string formatLong(long value, unsigned char base) {
+  if (base != 10) return formatInteger((unsigned long) value, base, false);
+  return formatInteger(value < 0 ? -(unsigned long) value : value, 10, value < 0);
+}
+
+static std::string formatDouble(double value, unsigned char decimalPlaces) {
+  char buf[48];
+  snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+  return std::string(buf);
+}
+
+String::String(int value, unsigned char base)
+  : s(base == 10 ? formatLong(value, 10) : formatInteger((unsigned int) value, base, false)), capacity(0) {
+  track();
+}
+
+String::String(unsigned int value, unsigned char base) : s(formatInteger(value, base, false)), capacity(0) {
+  track();
+}
+
+String::String(long value, unsigned char base) : s(formatLong(value, base)), capacity(0) {
+  track();
+}
+
+String::String(unsigned long value, unsigned char base) : s(formatInteger(value, base, false)), capacity(0) {
+  track();
+}
+
+String::String(float value, unsigned char decimalPlaces) : s(formatDouble(value, decimalPlaces)), capacity(0) {
+  track();
+}
+
+String::String(double value, unsigned char decimalPlaces) : s(formatDouble(value, decimalPlaces)), capacity(0) {
+  track();
+}
+
+void String::toCharArray(char *buf, unsigned int bufsize, unsigned int index) const {
+  if (!bufsize || !buf) return;
+  if (index >= s.length()) {
+    buf[0] = '\0';
+    return;
+  }
+  unsigned int n = s.length() - index;
+  if (n > bufsize - 1) n = bufsize - 1;
+  memcpy(buf, s.c_str() + index, n);
+  buf[n] = '\0';
+}
+
+String operator+(const String &lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String &lhs, const char *rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const char *lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String &lhs, char rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String &lhs, int rhs) { return lhs + String(rhs); }
+String operator+(const String &lhs, unsigned int rhs) { return lhs + String(rhs); }
+String operator+(const String &lhs, long rhs) { return lhs + String(rhs); }
+String operator+(const String &lhs, unsigned long rhs) { return lhs + String(rhs); }
+
+/*============================================
+=             Print / serial ports           =
+==============================================*/
+
+size_t Print::write(const uint8_t *buf, size_t len) {
+  size_t n = 0;
+  while (len--) n += write(*buf++);
+  return n;
+}
+
+// the core's Print formats on the stack, so these stay off simStringHeap
+size_t Print::print(long n, int base) {
+  return print(formatLong(n, base).c_str());
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return print(formatInteger(n, base, false).c_str());
+}
+
+size_t Print::print(double n, int digits) {
+  return print(formatDouble(n, digits).c_str());
+}
+
+static bool serialEcho = false;
+
+void SimSerial::echo(bool enable) {
+  serialEcho = enable;
+}
+
+size_t SimSerial::write(uint8_t c) {
+  if (sink) sink(&c, 1);
+  else if (serialEcho) fputc(c, stderr);
+  return 1;
+}
+
+int SimSerial::available(void) {
+  return input.size();
+}
+
+int SimSerial::read(void) {
+  if (input.empty()) return -1;
+  int c = (uint8_t) input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+int SimSerial::peek(void) {
+  return input.empty() ? -1 : (uint8_t) input[0];
+}
+
+void SimSerial::hostInject(const uint8_t *data, size_t len) {
+  input.append((const char *) data, len);
+}
+
+void SimSerial::hostCapture(void (*sink)(const uint8_t *data, size_t len)) {
+  this->sink = sink;
+}
+
+SimSerial Serial("Serial");
+SimSerial SerialUSB("SerialUSB");
@@ -0,0 +1,190 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+/*============================================================================
+=  Host stand-in for the subset of the Arduino SAMD core used by the        =
+=  firmware. Timing goes through the virtual clock in Sim.h.                =
+==============================================================================*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE  2
+#define FALLING 3
+#define RISING  4
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+
+#define F(s) (s)
+
+// binary.h, only the constants the firmware uses
+#define B1     1
+#define B010   2
+#define B100   4
+#define B0100  4
+#define B110   6
+#define B1010  10
+#define B10000 16
+
+typedef void (*voidFuncPtr)(void);
+
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+int analogRead(uint32_t pin);
+void analogReadResolution(int res);
+void attachInterrupt(uint32_t pin, voidFuncPtr callback, uint32_t mode);
+void detachInterrupt(uint32_t pin);
+#define digitalPinToInterrupt(p) (p)
+
+unsigned long millis(void);
+unsigned long micros(void);
+
+#define F_CPU 48000000L
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void noInterrupts(void);
+void interrupts(void);
+
+/*----------  WString  ----------*/
+
+// heap the core's String would take: every buffer is malloc()ed at its
+// exact size and realloc()ed as it grows, and each of those is counted
+struct SimStringHeap {
+  uint64_t allocations;
+  uint32_t inUse;
+  uint32_t highWater;
+};
+
+extern SimStringHeap simStringHeap;
+
+class String {
+ public:
+  String(const char *cstr = "") : s(cstr ? cstr : ""), capacity(0) { track(); }
+  String(const std::string &str) : s(str), capacity(0) { track(); }
+  String(const String &other) : s(other.s), capacity(0) { track(); }
+  explicit String(char c) : s(1, c), capacity(0) { track(); }
+  explicit String(int value, unsigned char base = 10);
+  explicit String(unsigned int value, unsigned char base = 10);
+  explicit String(long value, unsigned char base = 10);
+  explicit String(unsigned long value, unsigned char base = 10);
+  explicit String(float value, unsigned char decimalPlaces = 2);
+  explicit String(double value, unsigned char decimalPlaces = 2);
+  ~String() { simStringHeap.inUse -= capacity; }
+  String &operator=(const String &rhs) { s = rhs.s; track(); return *this; }
+
+  unsigned int length(void) const { return s.length(); }
+  const char *c_str(void) const { return s.c_str(); }
+  void toCharArray(char *buf, unsigned int bufsize, unsigned int index = 0) const;
+  char charAt(unsigned int index) const { return index < s.length() ? s[index] : 0; }
+  long toInt(void) const { return atol(s.c_str()); }
+
+  String &operator+=(const String &rhs) { s += rhs.s; track(); return *this; }
+  String &operator+=(const char *rhs) { s += rhs; track(); return *this; }
+  String &operator+=(char c) { s += c; track(); return *this; }
+  bool operator==(const String &rhs) const { return s == rhs.s; }
+  bool operator==(const char *rhs) const { return s == rhs; }
+  bool operator!=(const String &rhs) const { return s != rhs.s; }
+
+ private:
+  std::string s;
+  unsigned int capacity;   // bytes charged to simStringHeap
+
+  void track(void);
+};
+
+String operator+(const String &lhs, const String &rhs);
+String operator+(const String &lhs, const char *rhs);
+String operator+(const char *lhs, const String &rhs);
+String operator+(const String &lhs, char rhs);
+String operator+(const String &lhs, int rhs);
+String operator+(const String &lhs, unsigned int rhs);
+String operator+(const String &lhs, long rhs);
+String operator+(const String &lhs, unsigned long rhs);
+
+/*----------  Print / serial ports  ----------*/
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t len);
+  size_t write(const char *str) { return write((const uint8_t *) str, strlen(str)); }
+
+  size_t print(const char *str) { return write(str); }
+  size_t print(const String &str) { return write(str.c_str()); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(int n, int base = DEC) { return print((long) n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println(void) { return write("\r\n"); }
+  template <typename T> size_t println(const T &v) { size_t n = print(v); return n + println(); }
+  template <typename T> size_t println(const T &v, int fmt) { size_t n = print(v, fmt); return n + println(); }
+};
+
+class SimSerial : public Print {
+ public:
+  explicit SimSerial(const char *name) : name(name) {}
+  void begin(unsigned long baud) { (void) baud; }
+  void end(void) {}
+  operator bool() { return true; }
+  int available(void);
+  int read(void);
+  int peek(void);
+  void flush(void) {}
+  size_t write(uint8_t c);
+  using Print::write;
+
+  /* host side of the port, used by the simulator */
+  void hostInject(const uint8_t *data, size_t len);
+  void hostCapture(void (*sink)(const uint8_t *data, size_t len));
+  static void echo(bool enable);
+
+ private:
+  const char *name;
+  std::string input;
+  void (*sink)(const uint8_t *data, size_t len) = NULL;
+};
+
+extern SimSerial Serial;
+extern SimSerial SerialUSB;
+
+/*----------  Sketch entry points  ----------*/
+
+void setup(void);
+void loop(void);
+
+#endif
@@ -0,0 +1,186 @@
+#include "Arduino.h"
+#include "Wire.h"
+#include "../HAL.h"
+#include "Sim.h"
+#include "SimDevices.h"
+
+/*============================================
+=      Host simulator implementation of HAL.h =
+==============================================*/
+
+// TC5 in normal frequency mode: 48MHz / 64 / 65536
+static const uint64_t SAMPLE_TIMER_PERIOD_NS = 65536ULL * 64ULL * 1000000000ULL / 48000000ULL;
+
+static int sampleTimerEvent = -1;
+static int sampleTimerLine = -1;
+
+static void sampleTimerOverflow(void *ctx) {
+  (void) ctx;
+  simEDATick();
+  simIRQRaise(sampleTimerLine);
+}
+
+void halSampleTimerBegin(halISR isr) {
+  if (sampleTimerLine < 0) sampleTimerLine = simIRQLine("TC5");
+  halSampleTimerEnd();
+  simIRQAttach(sampleTimerLine, isr);
+  sampleTimerEvent = simEventStart(SAMPLE_TIMER_PERIOD_NS, sampleTimerOverflow, NULL);
+}
+
+void halSampleTimerEnd(void) {
+  if (sampleTimerEvent >= 0) simEventStop(sampleTimerEvent);
+  sampleTimerEvent = -1;
+  if (sampleTimerLine >= 0) simIRQDetach(sampleTimerLine);
+}
+
+/**
+ADC conversions end SIM_ADC_CONVERSION_NS after they start, with the
+value the EDA front end gives then and the ADC interrupt
+**/
+static int adcLine = -1;
+static uint32_t adcPin = 0;
+static uint16_t adcValue = 0;
+
+static void adcConversionEnd(void *ctx) {
+  (void) ctx;
+  adcValue = simADCRead(adcPin);
+  simIRQRaise(adcLine);
+}
+
+void halADCBegin(uint32_t pin, halISR done) {
+  if (adcLine < 0) adcLine = simIRQLine("ADC");
+  adcPin = pin;
+  simIRQAttach(adcLine, done);
+}
+
+void halADCStart(void) {
+  simStats.busOps++;
+  simStats.adcConversions++;
+  simEventOnce(SIM_ADC_CONVERSION_NS, adcConversionEnd, NULL);
+}
+
+void halADCEnd(void) {
+  if (adcLine >= 0) simIRQDetach(adcLine);
+}
+
+uint16_t halADCResult(void) {
+  return adcValue;
+}
+
+// TC3 at 1MHz, read straight off the virtual clock
+static uint64_t tickBaseNs = 0;
+
+void halTickBegin(void) {
+  tickBaseNs = simNowNanos();
+}
+
+uint32_t halTicks(void) {
+  return (uint32_t) ((simNowNanos() - tickBaseNs) / 1000ULL);
+}
+
+/**
+Interrupts are masked around busy() as on the board; the virtual clock
+then runs on event by event until one raises an interrupt, which is
+serviced as they are unmasked
+**/
+static uint32_t raisedInterrupts(void) {
+  uint32_t raised = 0;
+  for (int i = 0; i < simIRQCount(); i++) raised += simIRQStats(i)->raised;
+  return raised;
+}
+
+// PRIMASK: 1 while masked, as in an ISR
+uint32_t halIRQSave(void) {
+  uint32_t saved = simInterruptsEnabled() ? 0 : 1;
+  simInterruptsEnable(false);
+  return saved;
+}
+
+void halIRQRestore(uint32_t saved) {
+  if (!saved) simInterruptsEnable(true);
+}
+
+bool halSleepUnless(bool (*busy)(void)) {
+  simInterruptsEnable(false);
+  if (busy()) {
+    simInterruptsEnable(true);
+    return false;
+  }
+
+  uint32_t raised = raisedInterrupts();
+  while (raisedInterrupts() == raised && !simDeadlineReached()) simIdleUntilNextEvent();
+  simInterruptsEnable(true);
+  return true;
+}
+
+// the host heap says nothing about the board's: report the String model in
+// Arduino.h, which does not place blocks and so has no fragmentation
+void halHeap(HalHeap *heap) {
+  heap->highWater = simStringHeap.highWater;
+  heap->inUse = simStringHeap.inUse;
+  heap->freeChunks = 0;
+}
+
+/**
+I2C transfers timed as Wire times them: the write phase, then the read,
+then the DMAC interrupt. The device sees both at the start of the read,
+which is when the RTC latches its registers.
+**/
+static int i2cLine = -1;
+static HalI2CTransfer *i2cCurrent = NULL;
+static int i2cEvent = -1;
+
+static uint64_t i2cPhaseNs(size_t bytes) {
+  uint64_t bits = 2 + 9 * (bytes + 1);
+  uint64_t ns = bits * 1000000000ULL / Wire.getClock();
+  simStats.i2cBytes += bytes + 1;
+  simStats.i2cBusyNs += ns;
+  return ns;
+}
+
+static void i2cTransferEnd(void *ctx) {
+  (void) ctx;
+  i2cCurrent = NULL;
+  simIRQRaise(i2cLine);
+}
+
+static void i2cWriteEnd(void *ctx) {
+  (void) ctx;
+  SimI2CDevice *dev = simI2CDevice(i2cCurrent->address);
+  if (!dev) {
+    i2cCurrent->failed = true;
+    i2cTransferEnd(NULL);
+    return;
+  }
+  dev->i2cWrite(i2cCurrent->tx, i2cCurrent->txLength);
+  i2cCurrent->readTick = halTicks();
+  dev->i2cRead(i2cCurrent->rx, i2cCurrent->rxLength);
+  i2cEvent = simEventOnce(i2cPhaseNs(i2cCurrent->rxLength), i2cTransferEnd, NULL);
+}
+
+void halI2CBegin(uint32_t hz, halISR done) {
+  if (i2cLine < 0) i2cLine = simIRQLine("DMAC");
+  simIRQAttach(i2cLine, done);
+  Wire.setClock(hz);
+}
+
+void halI2CStart(HalI2CTransfer *transfer) {
+  transfer->failed = false;
+  i2cCurrent = transfer;
+  simStats.busOps++;
+  i2cEvent = simEventOnce(i2cPhaseNs(transfer->txLength), i2cWriteEnd, NULL);
+}
+
+// the model's STOPs take no time, so no phase waits for one
+void halI2CPoll(void) {
+}
+
+bool halI2CWaiting(void) {
+  return false;
+}
+
+// the model ends every transfer, a NACK included, so this is only a timeout
+void halI2CAbort(void) {
+  if (i2cCurrent) simEventStop(i2cEvent);
+  i2cCurrent = NULL;
+}
@@ -0,0 +1,42 @@
+#include "I2Cdev.h"
+#include "Wire.h"
+
+int8_t I2Cdev::readByte(uint8_t devAddr, uint8_t regAddr, uint8_t *data) {
+  return readBytes(devAddr, regAddr, 1, data);
+}
+
+/**
+Register read in Wire-buffer sized chunks, like the real library
+**/
+int8_t I2Cdev::readBytes(uint8_t devAddr, uint8_t regAddr, uint8_t length, uint8_t *data) {
+  int8_t count = 0;
+
+  Wire.beginTransmission(devAddr);
+  Wire.write(regAddr);
+  if (Wire.endTransmission()) return -1;
+
+  for (uint8_t k = 0; k < length; k += WIRE_BUFFER_SIZE) {
+    uint8_t chunk = length - k < WIRE_BUFFER_SIZE ? length - k : WIRE_BUFFER_SIZE;
+    Wire.requestFrom(devAddr, chunk);
+    while (Wire.available()) data[count++] = Wire.read();
+  }
+  return count;
+}
+
+bool I2Cdev::writeByte(uint8_t devAddr, uint8_t regAddr, uint8_t data) {
+  return writeBytes(devAddr, regAddr, 1, &data);
+}
+
+bool I2Cdev::writeBytes(uint8_t devAddr, uint8_t regAddr, uint8_t length, const uint8_t *data) {
+  Wire.beginTransmission(devAddr);
+  Wire.write(regAddr);
+  Wire.write(data, length);
+  return Wire.endTransmission() == 0;
+}
+
+bool I2Cdev::writeBit(uint8_t devAddr, uint8_t regAddr, uint8_t bitNum, bool value) {
+  uint8_t b;
+  if (readByte(devAddr, regAddr, &b) != 1) return false;
+  b = value ? (b | (1 << bitNum)) : (b & ~(1 << bitNum));
+  return writeByte(devAddr, regAddr, b);
+}
@@ -0,0 +1,19 @@
+#ifndef SIM_I2CDEV_H
+#define SIM_I2CDEV_H
+
+#include "Arduino.h"
+
+/*============================================
+=    Host stand-in for i2cdevlib's I2Cdev    =
+==============================================*/
+
+class I2Cdev {
+ public:
+  static int8_t readByte(uint8_t devAddr, uint8_t regAddr, uint8_t *data);
+  static int8_t readBytes(uint8_t devAddr, uint8_t regAddr, uint8_t length, uint8_t *data);
+  static bool writeByte(uint8_t devAddr, uint8_t regAddr, uint8_t data);
+  static bool writeBytes(uint8_t devAddr, uint8_t regAddr, uint8_t length, const uint8_t *data);
+  static bool writeBit(uint8_t devAddr, uint8_t regAddr, uint8_t bitNum, bool value);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "MPU6050.h"
+#include "Wire.h"
+
+void MPU6050::initialize(void) {
+  // clock source PLL with X gyro, sleep disabled
+  I2Cdev::writeByte(devAddr, MPU6050_RA_PWR_MGMT_1, 0x01);
+}
+
+bool MPU6050::testConnection(void) {
+  uint8_t id = 0;
+  I2Cdev::readByte(devAddr, MPU6050_RA_WHO_AM_I, &id);
+  return (id >> 1) == 0x34;
+}
+
+/**
+Stand-in for the MotionApps20 bring-up: device reset, a firmware-sized
+memory upload (for the bus time), DMP interrupt enable and FIFO enable
+**/
+uint8_t MPU6050::dmpInitialize(void) {
+  I2Cdev::writeBit(devAddr, MPU6050_RA_PWR_MGMT_1, MPU6050_PWR1_DEVICE_RESET_BIT, true);
+  delay(30);
+  I2Cdev::writeBit(devAddr, MPU6050_RA_PWR_MGMT_1, MPU6050_PWR1_SLEEP_BIT, false);
+
+  if (!testConnection()) return 1;
+
+  uint8_t chunk[16];
+  memset(chunk, 0, sizeof(chunk));
+  for (int i = 0; i < 1929; i += sizeof(chunk)) {
+    I2Cdev::writeBytes(devAddr, MPU6050_RA_MEM_R_W, sizeof(chunk), chunk);
+  }
+
+  I2Cdev::writeByte(devAddr, MPU6050_RA_INT_ENABLE, 0x02);
+  setFIFOEnabled(true);
+  resetFIFO();
+  return 0;
+}
+
+void MPU6050::setDMPEnabled(bool enabled) {
+  I2Cdev::writeBit(devAddr, MPU6050_RA_USER_CTRL, MPU6050_USERCTRL_DMP_EN_BIT, enabled);
+}
+
+void MPU6050::setFIFOEnabled(bool enabled) {
+  I2Cdev::writeBit(devAddr, MPU6050_RA_USER_CTRL, MPU6050_USERCTRL_FIFO_EN_BIT, enabled);
+}
+
+void MPU6050::setSleepEnabled(bool enabled) {
+  I2Cdev::writeBit(devAddr, MPU6050_RA_PWR_MGMT_1, MPU6050_PWR1_SLEEP_BIT, enabled);
+}
+
+uint8_t MPU6050::getIntStatus(void) {
+  uint8_t status = 0;
+  I2Cdev::readByte(devAddr, MPU6050_RA_INT_STATUS, &status);
+  return status;
+}
+
+uint16_t MPU6050::getFIFOCount(void) {
+  uint8_t buffer[2] = { 0, 0 };
+  I2Cdev::readBytes(devAddr, MPU6050_RA_FIFO_COUNTH, 2, buffer);
+  return (((uint16_t) buffer[0]) << 8) | buffer[1];
+}
+
+void MPU6050::resetFIFO(void) {
+  I2Cdev::writeBit(devAddr, MPU6050_RA_USER_CTRL, MPU6050_USERCTRL_FIFO_RESET_BIT, true);
+}
+
+void MPU6050::getFIFOBytes(uint8_t *data, uint8_t length) {
+  if (length > 0) I2Cdev::readBytes(devAddr, MPU6050_RA_FIFO_R_W, length, data);
+}
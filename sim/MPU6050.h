@@ -0,0 +1,67 @@
+#ifndef SIM_MPU6050_H
+#define SIM_MPU6050_H
+
+#include "Arduino.h"
+#include "I2Cdev.h"
+#include "helper_3dmath.h"
+
+/*============================================================================
+=  Host stand-in for i2cdevlib's MPU6050 class. Register access goes over   =
+=  the simulated Wire bus to the model in SimMPU6050.cpp.                   =
+==============================================================================*/
+
+#define MPU6050_RA_INT_ENABLE   0x38
+#define MPU6050_RA_INT_STATUS   0x3A
+#define MPU6050_RA_USER_CTRL    0x6A
+#define MPU6050_RA_PWR_MGMT_1   0x6B
+#define MPU6050_RA_MEM_R_W      0x6F
+#define MPU6050_RA_FIFO_COUNTH  0x72
+#define MPU6050_RA_FIFO_R_W     0x74
+#define MPU6050_RA_WHO_AM_I     0x75
+
+#define MPU6050_USERCTRL_DMP_EN_BIT     7
+#define MPU6050_USERCTRL_FIFO_EN_BIT    6
+#define MPU6050_USERCTRL_DMP_RESET_BIT  3
+#define MPU6050_USERCTRL_FIFO_RESET_BIT 2
+#define MPU6050_PWR1_DEVICE_RESET_BIT   7
+#define MPU6050_PWR1_SLEEP_BIT          6
+
+#define MPU6050_DMP_PACKET_SIZE 42
+
+class MPU6050 {
+ public:
+  MPU6050(uint8_t address = 0x68) : devAddr(address) {}
+
+  void initialize(void);
+  bool testConnection(void);
+  uint8_t dmpInitialize(void);
+
+  void setXGyroOffset(int16_t offset) { (void) offset; }
+  void setYGyroOffset(int16_t offset) { (void) offset; }
+  void setZGyroOffset(int16_t offset) { (void) offset; }
+  void setZAccelOffset(int16_t offset) { (void) offset; }
+
+  void setDMPEnabled(bool enabled);
+  void setFIFOEnabled(bool enabled);
+  void setSleepEnabled(bool enabled);
+  uint8_t getIntStatus(void);
+  uint16_t getFIFOCount(void);
+  void resetFIFO(void);
+  void getFIFOBytes(uint8_t *data, uint8_t length);
+
+  uint16_t dmpGetFIFOPacketSize(void) { return MPU6050_DMP_PACKET_SIZE; }
+  uint8_t dmpGetQuaternion(int32_t *data, const uint8_t *packet);
+  uint8_t dmpGetQuaternion(int16_t *data, const uint8_t *packet);
+  uint8_t dmpGetQuaternion(Quaternion *q, const uint8_t *packet);
+  uint8_t dmpGetAccel(int32_t *data, const uint8_t *packet);
+  uint8_t dmpGetAccel(int16_t *data, const uint8_t *packet);
+  uint8_t dmpGetAccel(VectorInt16 *v, const uint8_t *packet);
+  uint8_t dmpGetGravity(VectorFloat *v, Quaternion *q);
+  uint8_t dmpGetLinearAccel(VectorInt16 *v, VectorInt16 *vRaw, VectorFloat *gravity);
+  uint8_t dmpGetLinearAccelInWorld(VectorInt16 *v, VectorInt16 *vReal, Quaternion *q);
+
+ private:
+  uint8_t devAddr;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SIM_MPU6050_6AXIS_MOTIONAPPS20_H
+#define SIM_MPU6050_6AXIS_MOTIONAPPS20_H
+
+#include <string.h>
+#include "MPU6050.h"
+
+/*============================================================================
+=  DMP packet accessors, copied in arithmetic from MotionApps20: quaternion  =
+=  at bytes 0-15 (Q30, MSB first), accel at bytes 28-39 (top 16 bits).      =
+==============================================================================*/
+
+inline uint8_t MPU6050::dmpGetQuaternion(int32_t *data, const uint8_t *packet) {
+  data[0] = ((uint32_t) packet[0] << 24) | ((uint32_t) packet[1] << 16) | ((uint32_t) packet[2] << 8) | packet[3];
+  data[1] = ((uint32_t) packet[4] << 24) | ((uint32_t) packet[5] << 16) | ((uint32_t) packet[6] << 8) | packet[7];
+  data[2] = ((uint32_t) packet[8] << 24) | ((uint32_t) packet[9] << 16) | ((uint32_t) packet[10] << 8) | packet[11];
+  data[3] = ((uint32_t) packet[12] << 24) | ((uint32_t) packet[13] << 16) | ((uint32_t) packet[14] << 8) | packet[15];
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetQuaternion(int16_t *data, const uint8_t *packet) {
+  data[0] = ((packet[0] << 8) | packet[1]);
+  data[1] = ((packet[4] << 8) | packet[5]);
+  data[2] = ((packet[8] << 8) | packet[9]);
+  data[3] = ((packet[12] << 8) | packet[13]);
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetQuaternion(Quaternion *q, const uint8_t *packet) {
+  int16_t qI[4];
+  dmpGetQuaternion(qI, packet);
+  q->w = (float) qI[0] / 16384.0f;
+  q->x = (float) qI[1] / 16384.0f;
+  q->y = (float) qI[2] / 16384.0f;
+  q->z = (float) qI[3] / 16384.0f;
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetAccel(int32_t *data, const uint8_t *packet) {
+  data[0] = ((uint32_t) packet[28] << 24) | ((uint32_t) packet[29] << 16) | ((uint32_t) packet[30] << 8) | packet[31];
+  data[1] = ((uint32_t) packet[32] << 24) | ((uint32_t) packet[33] << 16) | ((uint32_t) packet[34] << 8) | packet[35];
+  data[2] = ((uint32_t) packet[36] << 24) | ((uint32_t) packet[37] << 16) | ((uint32_t) packet[38] << 8) | packet[39];
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetAccel(int16_t *data, const uint8_t *packet) {
+  data[0] = (packet[28] << 8) | packet[29];
+  data[1] = (packet[32] << 8) | packet[33];
+  data[2] = (packet[36] << 8) | packet[37];
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetAccel(VectorInt16 *v, const uint8_t *packet) {
+  v->x = (packet[28] << 8) | packet[29];
+  v->y = (packet[32] << 8) | packet[33];
+  v->z = (packet[36] << 8) | packet[37];
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetGravity(VectorFloat *v, Quaternion *q) {
+  v->x = 2 * (q->x*q->z - q->w*q->y);
+  v->y = 2 * (q->w*q->x + q->y*q->z);
+  v->z = q->w*q->w - q->x*q->x - q->y*q->y + q->z*q->z;
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetLinearAccel(VectorInt16 *v, VectorInt16 *vRaw, VectorFloat *gravity) {
+  // get rid of the gravity component (+1g = +8192 in standard DMP FIFO packet, sensitivity is 2g)
+  v->x = vRaw->x - gravity->x*8192;
+  v->y = vRaw->y - gravity->y*8192;
+  v->z = vRaw->z - gravity->z*8192;
+  return 0;
+}
+
+inline uint8_t MPU6050::dmpGetLinearAccelInWorld(VectorInt16 *v, VectorInt16 *vReal, Quaternion *q) {
+  // rotate measured 3D acceleration vector into original state
+  // frame of reference based on orientation quaternion
+  memcpy(v, vReal, sizeof(VectorInt16));
+  v->rotate(q);
+  return 0;
+}
+
+#endif
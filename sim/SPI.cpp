@@ -0,0 +1,39 @@
+#include "SPI.h"
+#include "Sim.h"
+#include "SimDevices.h"
+
+SPIClass SPI;
+
+void SPIClass::beginTransaction(SPISettings settings) {
+  uint32_t hz = settings.clock < SIM_SPI_MAX_HZ ? settings.clock : SIM_SPI_MAX_HZ;
+  byteNs = 8ULL * 1000000000ULL / hz;
+  simStats.spiBusyNs += SIM_SPI_TRANSACTION_NS;
+  simAdvanceNanos(SIM_SPI_TRANSACTION_NS);
+}
+
+void SPIClass::endTransaction(void) {
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+  uint64_t ns = byteNs + SIM_SPI_BYTE_OVERHEAD_NS;
+  simStats.busOps++;
+  simStats.spiBytes++;
+  simStats.spiBusyNs += ns;
+  simAdvanceNanos(ns);
+
+  SimSPIDevice *dev = simSPISelected();
+  return dev ? dev->transfer(data) : 0xFF;
+}
+
+uint16_t SPIClass::transfer16(uint16_t data) {
+  uint16_t hi = transfer(data >> 8);
+  return (hi << 8) | transfer(data & 0xFF);
+}
+
+void SPIClass::transfer(void *buf, size_t count) {
+  uint8_t *p = (uint8_t *) buf;
+  while (count--) {
+    *p = transfer(*p);
+    p++;
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef SIM_SPI_H
+#define SIM_SPI_H
+
+#include "Arduino.h"
+
+/*============================================
+=   Host stand-in for the SAMD SPI library   =
+==============================================*/
+
+#define SPI_MODE0 0x02
+#define SPI_MODE1 0x00
+#define SPI_MODE2 0x03
+#define SPI_MODE3 0x01
+
+class SPISettings {
+ public:
+  SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode)
+    : clock(clock), bitOrder(bitOrder), dataMode(dataMode) {}
+  SPISettings() : clock(4000000), bitOrder(MSBFIRST), dataMode(SPI_MODE0) {}
+
+  uint32_t clock;
+  uint8_t bitOrder;
+  uint8_t dataMode;
+};
+
+class SPIClass {
+ public:
+  void begin(void) {}
+  void end(void) {}
+  void usingInterrupt(int interruptNumber) { (void) interruptNumber; }
+  void beginTransaction(SPISettings settings);
+  void endTransaction(void);
+  uint8_t transfer(uint8_t data);
+  uint16_t transfer16(uint16_t data);
+  void transfer(void *buf, size_t count);
+
+ private:
+  uint64_t byteNs = 8ULL * 1000000000ULL / 4000000ULL;
+};
+
+extern SPIClass SPI;
+
+#endif
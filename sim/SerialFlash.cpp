@@ -0,0 +1,204 @@
+#include "SerialFlash.h"
+#include "SimDevices.h"
+
+SerialFlashChip SerialFlash;
+uint32_t SerialFlashChip::dirindex = 0;
+
+static const uint32_t SIM_FLASH_DIR_SIZE = 262144;
+static const uint32_t DIR_ENTRY_SIZE = 32;
+static const uint32_t DIR_ENTRIES = SIM_FLASH_DIR_SIZE / DIR_ENTRY_SIZE;
+static const uint32_t DIR_NAME_SIZE = 24;
+static const uint8_t DIR_FREE = 0xFF;
+static const uint8_t DIR_DELETED = 0x00;
+
+static SimFlashChip *chip = NULL;
+
+static uint32_t getLE32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static const uint8_t *entry(uint32_t index) {
+  return chip->data() + index * DIR_ENTRY_SIZE;
+}
+
+bool SerialFlashChip::begin(uint8_t pin) {
+  chip = simFlashChip(pin);
+  if (!chip || !chip->ok()) return false;
+  uint8_t id[5];
+  readID(id);
+  return true;
+}
+
+uint32_t SerialFlashChip::capacity(const uint8_t *id) {
+  (void) id;
+  return SIM_FLASH_CAPACITY;
+}
+
+uint32_t SerialFlashChip::blockSize(void) {
+  return SIM_FLASH_BLOCK_SIZE;
+}
+
+void SerialFlashChip::readID(uint8_t *buf) {
+  chip->read(0, NULL, 0);
+  // Micron N25Q512
+  buf[0] = 0x20;
+  buf[1] = 0xBA;
+  buf[2] = 0x20;
+}
+
+void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len) {
+  chip->read(addr, buf, len);
+}
+
+bool SerialFlashChip::ready(void) {
+  chip->statusPoll();
+  return !chip->busy();
+}
+
+void SerialFlashChip::wait(void) {
+  chip->waitReady();
+}
+
+void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len) {
+  chip->program(addr, buf, len);
+}
+
+void SerialFlashChip::eraseAll(void) {
+  chip->eraseAll();
+}
+
+void SerialFlashChip::eraseBlock(uint32_t addr) {
+  chip->eraseBlock(addr);
+}
+
+void SerialFlashChip::printStatus(void) {
+  uint32_t files = 0;
+  for (uint32_t i = 0; i < DIR_ENTRIES && entry(i)[0] != DIR_FREE; i++) {
+    if (entry(i)[0] != DIR_DELETED) files++;
+  }
+  SerialUSB.print("SerialFlash: CS ");
+  SerialUSB.print(chip->chipSelect());
+  SerialUSB.print(", ");
+  SerialUSB.print(SIM_FLASH_CAPACITY);
+  SerialUSB.print(" bytes, ");
+  SerialUSB.print(files);
+  SerialUSB.println(" files");
+}
+
+/**
+Directory scan; charges the bus time of reading a 2 byte hash per entry
+the way the library's hash table lookup would
+**/
+int SerialFlashChip::lookup(const char *filename) {
+  uint32_t i;
+  for (i = 0; i < DIR_ENTRIES && entry(i)[0] != DIR_FREE; i++) {
+    if (entry(i)[0] == DIR_DELETED) continue;
+    if (strncmp((const char *) entry(i), filename, DIR_NAME_SIZE) == 0) break;
+  }
+  chip->read(0, NULL, 2 * (i + 1));
+  if (i == DIR_ENTRIES || entry(i)[0] == DIR_FREE) return -1;
+  return i;
+}
+
+SerialFlashFile SerialFlashChip::open(const char *filename) {
+  SerialFlashFile file;
+  int i = lookup(filename);
+  if (i < 0) return file;
+  file.address = getLE32(entry(i) + 24);
+  file.length = getLE32(entry(i) + 28);
+  file.offset = 0;
+  return file;
+}
+
+bool SerialFlashChip::exists(const char *filename) {
+  return lookup(filename) >= 0;
+}
+
+bool SerialFlashChip::create(const char *filename, uint32_t length, uint32_t align) {
+  if (strlen(filename) >= DIR_NAME_SIZE || lookup(filename) >= 0) return false;
+  if (align < SIM_FLASH_PAGE_SIZE) align = SIM_FLASH_PAGE_SIZE;
+
+  uint32_t slot;
+  uint32_t next = SIM_FLASH_DIR_SIZE;
+  for (slot = 0; slot < DIR_ENTRIES && entry(slot)[0] != DIR_FREE; slot++) {
+    uint32_t end = getLE32(entry(slot) + 24) + getLE32(entry(slot) + 28);
+    if (end > next) next = end;
+  }
+  if (slot == DIR_ENTRIES) return false;
+
+  next = (next + align - 1) / align * align;
+  if (next + length > SIM_FLASH_CAPACITY) return false;
+
+  uint8_t record[DIR_ENTRY_SIZE];
+  memset(record, 0, sizeof(record));
+  strncpy((char *) record, filename, DIR_NAME_SIZE - 1);
+  for (int b = 0; b < 4; b++) {
+    record[24 + b] = next >> (8 * b);
+    record[28 + b] = length >> (8 * b);
+  }
+  chip->program(slot * DIR_ENTRY_SIZE, record, sizeof(record));
+  return true;
+}
+
+bool SerialFlashChip::createErasable(const char *filename, uint32_t length) {
+  uint32_t size = (length + SIM_FLASH_BLOCK_SIZE - 1) / SIM_FLASH_BLOCK_SIZE * SIM_FLASH_BLOCK_SIZE;
+  return create(filename, size, SIM_FLASH_BLOCK_SIZE);
+}
+
+bool SerialFlashChip::remove(const char *filename) {
+  int i = lookup(filename);
+  if (i < 0) return false;
+  uint8_t deleted = DIR_DELETED;
+  chip->program(i * DIR_ENTRY_SIZE, &deleted, 1);
+  return true;
+}
+
+bool SerialFlashChip::readdir(char *filename, uint32_t strsize, uint32_t &filesize) {
+  while (dirindex < DIR_ENTRIES) {
+    const uint8_t *e = entry(dirindex++);
+    chip->read(0, NULL, 2);
+    if (e[0] == DIR_FREE) {
+      dirindex = DIR_ENTRIES;
+      return false;
+    }
+    if (e[0] == DIR_DELETED) continue;
+    chip->read(0, NULL, DIR_ENTRY_SIZE);
+    strncpy(filename, (const char *) e, strsize);
+    if (strsize) filename[strsize - 1] = '\0';
+    filesize = getLE32(e + 28);
+    return true;
+  }
+  return false;
+}
+
+bool SerialFlashChip::readdir(char *filename, uint32_t strsize, unsigned long &filesize) {
+  uint32_t size;
+  bool found = readdir(filename, strsize, size);
+  if (found) filesize = size;
+  return found;
+}
+
+/*============================================
+=                   Files                    =
+==============================================*/
+
+uint32_t SerialFlashFile::read(void *buf, uint32_t rdlen) {
+  if (rdlen > length - offset) rdlen = length - offset;
+  if (!rdlen) return 0;
+  chip->read(address + offset, buf, rdlen);
+  offset += rdlen;
+  return rdlen;
+}
+
+uint32_t SerialFlashFile::write(const void *buf, uint32_t wrlen) {
+  if (wrlen > length - offset) wrlen = length - offset;
+  if (!wrlen) return 0;
+  chip->program(address + offset, buf, wrlen);
+  offset += wrlen;
+  return wrlen;
+}
+
+void SerialFlashFile::erase(void) {
+  if (address % SIM_FLASH_BLOCK_SIZE) return;
+  for (uint32_t a = address; a < address + length; a += SIM_FLASH_BLOCK_SIZE) chip->eraseBlock(a);
+}
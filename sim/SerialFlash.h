@@ -0,0 +1,68 @@
+#ifndef SIM_SERIALFLASH_H
+#define SIM_SERIALFLASH_H
+
+#include "Arduino.h"
+
+/*============================================================================
+=  Host stand-in for the SerialFlash library, on top of the flash model in  =
+=  SimFlash.cpp. The raw chip API matches the library. The file layer uses  =
+=  its own simple directory (SIM_FLASH_DIR_SIZE bytes of 32 byte entries    =
+=  at address 0), so images are not byte-compatible with the real library.  =
+==============================================================================*/
+
+class SerialFlashFile {
+ public:
+  SerialFlashFile() : address(0), length(0), offset(0) {}
+  operator bool() { return address > 0; }
+
+  uint32_t read(void *buf, uint32_t rdlen);
+  uint32_t write(const void *buf, uint32_t wrlen);
+  void seek(uint32_t n) { offset = n < length ? n : length; }
+  uint32_t position(void) { return offset; }
+  uint32_t size(void) { return length; }
+  uint32_t available(void) { return length - offset; }
+  uint32_t getFlashAddress(void) { return address; }
+  void erase(void);
+  void flush(void) {}
+  void close(void) {}
+
+ private:
+  friend class SerialFlashChip;
+  uint32_t address;
+  uint32_t length;
+  uint32_t offset;
+};
+
+class SerialFlashChip {
+ public:
+  static bool begin(uint8_t pin = 6);
+  static uint32_t capacity(const uint8_t *id);
+  static uint32_t blockSize(void);
+  static void sleep(void) {}
+  static void wakeup(void) {}
+  static void readID(uint8_t *buf);
+  static void read(uint32_t addr, void *buf, uint32_t len);
+  static bool ready(void);
+  static void wait(void);
+  static void write(uint32_t addr, const void *buf, uint32_t len);
+  static void eraseAll(void);
+  static void eraseBlock(uint32_t addr);
+  static void printStatus(void);
+
+  static SerialFlashFile open(const char *filename);
+  static bool create(const char *filename, uint32_t length, uint32_t align = 0);
+  static bool createErasable(const char *filename, uint32_t length);
+  static bool exists(const char *filename);
+  static bool remove(const char *filename);
+  static void opendir(void) { dirindex = 0; }
+  static bool readdir(char *filename, uint32_t strsize, uint32_t &filesize);
+  static bool readdir(char *filename, uint32_t strsize, unsigned long &filesize);
+
+ private:
+  static int lookup(const char *filename);
+  static uint32_t dirindex;
+};
+
+extern SerialFlashChip SerialFlash;
+
+#endif
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Sim.h"
+
+/*============================================
+=            Virtual clock/events            =
+==============================================*/
+
+SimStats simStats;
+
+static uint64_t nowNs = 0;
+static uint64_t deadlineNs = 0;
+static void (*stuckHandler)(void) = NULL;
+
+// a firmware that is still busy this long after the deadline is considered hung
+static const uint64_t SIM_STUCK_GRACE_NS = 30ULL * 1000000000ULL;
+
+struct SimEvent {
+  bool active;
+  uint64_t periodNs;
+  uint64_t dueNs;
+  simEventFn fn;
+  void *ctx;
+};
+
+static const int SIM_MAX_EVENTS = 32;
+static SimEvent events[SIM_MAX_EVENTS];
+
+static int earliestEvent(uint64_t limitNs) {
+  int best = -1;
+  for (int i = 0; i < SIM_MAX_EVENTS; i++) {
+    if (!events[i].active || events[i].dueNs > limitNs) continue;
+    if (best < 0 || events[i].dueNs < events[best].dueNs) best = i;
+  }
+  return best;
+}
+
+uint64_t simNowNanos(void) {
+  return nowNs;
+}
+
+void simAdvanceNanos(uint64_t ns) {
+  uint64_t target = nowNs + ns;
+  int e;
+
+  while ((e = earliestEvent(target)) >= 0) {
+    if (events[e].dueNs > nowNs) nowNs = events[e].dueNs;
+    events[e].dueNs += events[e].periodNs;
+    if (!events[e].periodNs) events[e].active = false;
+    // may raise interrupts, whose handlers may advance the clock further
+    events[e].fn(events[e].ctx);
+  }
+  if (nowNs < target) nowNs = target;
+
+  if (deadlineNs && nowNs > deadlineNs + SIM_STUCK_GRACE_NS) {
+    if (stuckHandler) stuckHandler();
+    fprintf(stderr, "sim: firmware did not return to loop() before the deadline\n");
+    exit(3);
+  }
+}
+
+void simAdvanceMicros(uint32_t us) {
+  simAdvanceNanos((uint64_t) us * 1000);
+}
+
+uint64_t simNextEventNanos(void) {
+  int e = earliestEvent(UINT64_MAX);
+  return e < 0 ? UINT64_MAX : events[e].dueNs;
+}
+
+/**
+Fast-forward over time in which the firmware would only be polling flags
+**/
+void simIdleUntilNextEvent(void) {
+  uint64_t next = simNextEventNanos();
+  if (deadlineNs && next > deadlineNs) next = deadlineNs;
+  if (next > nowNs) simAdvanceNanos(next - nowNs);
+}
+
+void simSetDeadline(uint64_t ns) {
+  deadlineNs = ns;
+}
+
+bool simDeadlineReached(void) {
+  return deadlineNs && nowNs >= deadlineNs;
+}
+
+void simSetStuckHandler(void (*fn)(void)) {
+  stuckHandler = fn;
+}
+
+int simEventStart(uint64_t periodNs, simEventFn fn, void *ctx) {
+  for (int i = 0; i < SIM_MAX_EVENTS; i++) {
+    if (events[i].active) continue;
+    events[i].active = true;
+    events[i].periodNs = periodNs;
+    events[i].dueNs = nowNs + periodNs;
+    events[i].fn = fn;
+    events[i].ctx = ctx;
+    return i;
+  }
+  fprintf(stderr, "sim: out of event slots\n");
+  exit(3);
+}
+
+/**
+Event that runs once, afterNs from now; its slot is free again as it runs
+**/
+int simEventOnce(uint64_t afterNs, simEventFn fn, void *ctx) {
+  int handle = simEventStart(afterNs, fn, ctx);
+  events[handle].periodNs = 0;
+  return handle;
+}
+
+void simEventStop(int handle) {
+  if (handle >= 0 && handle < SIM_MAX_EVENTS) events[handle].active = false;
+}
+
+/*============================================
+=              Interrupt lines               =
+==============================================*/
+
+struct SimIRQLine {
+  simISR isr;
+  bool pending;
+  uint64_t raisedNs;
+  SimIRQStats stats;
+};
+
+static const int SIM_MAX_IRQS = 16;
+static SimIRQLine irqs[SIM_MAX_IRQS];
+static int irqCount = 0;
+static bool irqEnabled = true;
+static int isrDepth = 0;
+
+static void dispatchIRQs(void) {
+  if (!irqEnabled || isrDepth > 0) return;
+
+  bool ran = true;
+  while (ran) {
+    ran = false;
+    for (int i = 0; i < irqCount; i++) {
+      if (!irqs[i].pending) continue;
+      irqs[i].pending = false;
+      if (!irqs[i].isr) continue;
+
+      uint64_t latency = nowNs - irqs[i].raisedNs;
+      if (latency > irqs[i].stats.maxLatencyNs) irqs[i].stats.maxLatencyNs = latency;
+      irqs[i].stats.serviced++;
+
+      isrDepth++;
+      irqEnabled = false;
+      irqs[i].isr();
+      irqEnabled = true;
+      isrDepth--;
+      ran = true;
+    }
+  }
+}
+
+int simIRQLine(const char *name) {
+  for (int i = 0; i < irqCount; i++) {
+    if (strcmp(irqs[i].stats.name, name) == 0) return i;
+  }
+  if (irqCount == SIM_MAX_IRQS) {
+    fprintf(stderr, "sim: out of interrupt lines\n");
+    exit(3);
+  }
+  memset(&irqs[irqCount], 0, sizeof(irqs[irqCount]));
+  irqs[irqCount].stats.name = strdup(name);
+  return irqCount++;
+}
+
+void simIRQAttach(int line, simISR isr) {
+  irqs[line].isr = isr;
+}
+
+void simIRQDetach(int line) {
+  irqs[line].isr = NULL;
+  irqs[line].pending = false;
+}
+
+void simIRQRaise(int line) {
+  SimIRQLine &l = irqs[line];
+  if (!l.isr) return;
+
+  l.stats.raised++;
+  if (l.pending) {
+    l.stats.lost++;
+    return;
+  }
+  l.pending = true;
+  l.raisedNs = nowNs;
+  dispatchIRQs();
+}
+
+void simInterruptsEnable(bool enable) {
+  irqEnabled = enable;
+  if (enable) dispatchIRQs();
+}
+
+bool simInterruptsEnabled(void) {
+  return irqEnabled;
+}
+
+const SimIRQStats *simIRQStats(int line) {
+  return &irqs[line].stats;
+}
+
+int simIRQCount(void) {
+  return irqCount;
+}
+
+/*============================================
+=                    Pins                    =
+==============================================*/
+
+static const int SIM_MAX_PINS = 64;
+
+struct SimPin {
+  int value;
+  int irqLine;
+  simPinWriteFn watch;
+  void *watchCtx;
+};
+
+static SimPin pins[SIM_MAX_PINS];
+static bool pinsInitialised = false;
+
+static void initPins(void) {
+  if (pinsInitialised) return;
+  for (int i = 0; i < SIM_MAX_PINS; i++) pins[i].irqLine = -1;
+  pinsInitialised = true;
+}
+
+void simPinWrite(int pin, int value) {
+  initPins();
+  if (pin < 0 || pin >= SIM_MAX_PINS) return;
+  int old = pins[pin].value;
+  pins[pin].value = value;
+  if (old != value && pins[pin].watch) pins[pin].watch(pin, value, pins[pin].watchCtx);
+}
+
+int simPinRead(int pin) {
+  initPins();
+  if (pin < 0 || pin >= SIM_MAX_PINS) return 0;
+  return pins[pin].value;
+}
+
+void simPinWatch(int pin, simPinWriteFn fn, void *ctx) {
+  initPins();
+  pins[pin].watch = fn;
+  pins[pin].watchCtx = ctx;
+}
+
+int simPinIRQLine(int pin) {
+  initPins();
+  if (pins[pin].irqLine < 0) {
+    char name[16];
+    snprintf(name, sizeof(name), "pin %d", pin);
+    pins[pin].irqLine = simIRQLine(name);
+  }
+  return pins[pin].irqLine;
+}
+
+/*============================================
+=                   Buses                    =
+==============================================*/
+
+struct SimSPISlot {
+  int cs;
+  SimSPIDevice *dev;
+};
+
+static const int SIM_MAX_SPI = 4;
+static SimSPISlot spiSlots[SIM_MAX_SPI];
+static int spiCount = 0;
+
+static void spiChipSelectChanged(int pin, int value, void *ctx) {
+  SimSPIDevice *dev = (SimSPIDevice *) ctx;
+  if (value) dev->deselect();
+  else dev->select();
+}
+
+void simSPIAttach(int csPin, SimSPIDevice *dev) {
+  spiSlots[spiCount].cs = csPin;
+  spiSlots[spiCount].dev = dev;
+  spiCount++;
+  simPinWrite(csPin, 1);
+  simPinWatch(csPin, spiChipSelectChanged, dev);
+}
+
+SimSPIDevice *simSPISelected(void) {
+  SimSPIDevice *found = NULL;
+  for (int i = 0; i < spiCount; i++) {
+    if (simPinRead(spiSlots[i].cs)) continue;
+    if (found) simStats.spiContention++;
+    else found = spiSlots[i].dev;
+  }
+  return found;
+}
+
+/**
+Count a transfer to the device on csPin while another device drives MISO
+**/
+void simSPICheckContention(int csPin) {
+  for (int i = 0; i < spiCount; i++) {
+    if (spiSlots[i].cs != csPin && spiSlots[i].dev->drivesMISO()) simStats.spiContention++;
+  }
+}
+
+static SimI2CDevice *i2cDevices[128];
+
+void simI2CAttach(uint8_t address, SimI2CDevice *dev) {
+  i2cDevices[address & 0x7F] = dev;
+}
+
+SimI2CDevice *simI2CDevice(uint8_t address) {
+  return i2cDevices[address & 0x7F];
+}
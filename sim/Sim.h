@@ -0,0 +1,102 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*============================================================================
+=  Host simulation core: a virtual clock that advances only when simulated  =
+=  hardware is busy (bus transfers, ADC conversions, flash programming,     =
+=  delay()), periodic device events, interrupt lines with NVIC-like         =
+=  pending semantics, and the pin/SPI/I2C routing used by the mocked        =
+=  Arduino libraries in this directory.                                     =
+==============================================================================*/
+
+typedef void (*simISR)(void);
+typedef void (*simEventFn)(void *ctx);
+
+/*----------  Virtual clock  ----------*/
+
+uint64_t simNowNanos(void);
+void simAdvanceNanos(uint64_t ns);
+void simAdvanceMicros(uint32_t us);
+uint64_t simNextEventNanos(void);
+void simIdleUntilNextEvent(void);
+void simSetDeadline(uint64_t ns);
+bool simDeadlineReached(void);
+void simSetStuckHandler(void (*fn)(void));
+
+/*----------  Device events  ----------*/
+
+int simEventStart(uint64_t periodNs, simEventFn fn, void *ctx);
+int simEventOnce(uint64_t afterNs, simEventFn fn, void *ctx);
+void simEventStop(int handle);
+
+/*----------  Interrupt lines  ----------*/
+
+struct SimIRQStats {
+  const char *name;
+  uint32_t raised;
+  uint32_t serviced;
+  uint32_t lost;            // edges that arrived while the line was already pending
+  uint64_t maxLatencyNs;    // raise to ISR entry
+};
+
+int simIRQLine(const char *name);
+void simIRQAttach(int line, simISR isr);
+void simIRQDetach(int line);
+void simIRQRaise(int line);
+void simInterruptsEnable(bool enable);
+bool simInterruptsEnabled(void);
+const SimIRQStats *simIRQStats(int line);
+int simIRQCount(void);
+
+/*----------  Pins  ----------*/
+
+typedef void (*simPinWriteFn)(int pin, int value, void *ctx);
+
+void simPinWrite(int pin, int value);
+int simPinRead(int pin);
+void simPinWatch(int pin, simPinWriteFn fn, void *ctx);
+int simPinIRQLine(int pin);
+
+/*----------  Buses  ----------*/
+
+class SimSPIDevice {
+ public:
+  virtual ~SimSPIDevice() {}
+  virtual void select(void) {}
+  virtual void deselect(void) {}
+  virtual uint8_t transfer(uint8_t out) = 0;
+  virtual bool drivesMISO(void) { return false; }
+};
+
+class SimI2CDevice {
+ public:
+  virtual ~SimI2CDevice() {}
+  // write phase of a transaction, first byte is normally a register pointer
+  virtual void i2cWrite(const uint8_t *data, size_t len) = 0;
+  virtual void i2cRead(uint8_t *data, size_t len) = 0;
+};
+
+void simSPIAttach(int csPin, SimSPIDevice *dev);
+SimSPIDevice *simSPISelected(void);
+void simSPICheckContention(int csPin);
+void simI2CAttach(uint8_t address, SimI2CDevice *dev);
+SimI2CDevice *simI2CDevice(uint8_t address);
+
+/*----------  Counters shared by the models  ----------*/
+
+struct SimStats {
+  uint64_t spiBytes;
+  uint64_t spiBusyNs;
+  uint32_t spiContention;   // transfers while another device drove MISO
+  uint64_t i2cBytes;
+  uint64_t i2cBusyNs;
+  uint32_t adcConversions;
+  uint64_t busOps;          // any simulated hardware access, used to detect idle loops
+};
+
+extern SimStats simStats;
+
+#endif
@@ -0,0 +1,199 @@
+#include <math.h>
+#include <string.h>
+#include "SimDevices.h"
+#include "../AFE4400regs.h"
+
+/*============================================================================
+=  AFE4400 model: 24-bit register file behind 4-byte SPI frames (chained   =
+=  while STE stays low), the pulse repetition timer driving ADC_RDY, and a  =
+=  synthetic two-wavelength PPG (pulse + respiration + noise) in the       =
+=  LEDx/ALEDx result registers.                                             =
+==============================================================================*/
+
+SimStreamStats simStreamPPG = { "PPG", 0, 0, 0 };
+
+static const uint32_t AFE_SPI_READ = 1L << 0;
+static const uint32_t AFE_SW_RST = 1L << 3;
+static const uint32_t AFE_TIMEREN = 1L << 8;
+static const uint32_t AFE_DIGOUT_TRISTATE = 1L << 10;
+
+class SimAFE4400 : public SimSPIDevice {
+ public:
+  SimAFE4400(int adcRdyPin, int pdnPin, uint32_t seed)
+    : adcRdyPin(adcRdyPin), pdnPin(pdnPin), rng(seed ? seed : 1), event(-1),
+      selected(false), byteIndex(0), address(0), shift(0), readValue(0), writeLost(false),
+      sampleSeq(0), readSeq(0), ignored(0) {
+    memset(regs, 0, sizeof(regs));
+  }
+
+  void select(void) {
+    selected = true;
+    byteIndex = 0;
+  }
+
+  void deselect(void) {
+    selected = false;
+  }
+
+  bool drivesMISO(void) {
+    return poweredUp() && !(regs[CONTROL2] & AFE_DIGOUT_TRISTATE) && !selected;
+  }
+
+  uint8_t transfer(uint8_t out) {
+    if (!poweredUp()) return 0x00;
+
+    uint8_t in = 0x00;
+    if (byteIndex == 0) {
+      address = out;
+      shift = 0;
+      writeLost = false;
+      if ((regs[CONTROL0] & AFE_SPI_READ) && address != CONTROL0) {
+        readValue = readRegister(address);
+      }
+    } else if (byteIndex <= 3) {
+      if ((regs[CONTROL0] & AFE_SPI_READ) && address != CONTROL0) {
+        in = (readValue >> (8 * (3 - byteIndex))) & 0xFF;
+        // registers are read-only while SPI_READ is set; data on MOSI means a lost write
+        if (out && !writeLost) {
+          writeLost = true;
+          ignored++;
+        }
+      } else {
+        shift = (shift << 8) | out;
+        if (byteIndex == 3) writeRegister(address, shift & 0xFFFFFF);
+      }
+    }
+    // frames can follow each other under one chip select
+    byteIndex = (byteIndex + 1) % 4;
+    return in;
+  }
+
+  void pdnChanged(int value) {
+    if (!value) stopTimer();
+    else configureTimer();
+  }
+
+  static void onPDN(int pin, int value, void *ctx) {
+    (void) pin;
+    ((SimAFE4400 *) ctx)->pdnChanged(value);
+  }
+
+  static void onADCReady(void *ctx) {
+    ((SimAFE4400 *) ctx)->convert();
+  }
+
+  uint32_t ignoredWrites(void) const {
+    return ignored;
+  }
+
+ private:
+  bool poweredUp(void) {
+    return simPinRead(pdnPin) != 0;
+  }
+
+  uint32_t readRegister(uint8_t addr) {
+    if (addr >= LED2VAL && addr <= LED1ABSVAL && sampleSeq != readSeq) {
+      readSeq = sampleSeq;
+      simStreamPPG.consumed++;
+    }
+    return addr <= DIAG ? regs[addr] : 0;
+  }
+
+  void writeRegister(uint8_t addr, uint32_t value) {
+    if (addr == CONTROL0) {
+      if (value & AFE_SW_RST) {
+        memset(regs, 0, sizeof(regs));
+        configureTimer();
+        return;
+      }
+      regs[CONTROL0] = value & AFE_SPI_READ;
+      return;
+    }
+    if (addr >= LED2VAL) return;
+    regs[addr] = value;
+    if (addr == CONTROL1 || addr == PRPCOUNT) configureTimer();
+  }
+
+  void stopTimer(void) {
+    if (event >= 0) simEventStop(event);
+    event = -1;
+  }
+
+  void configureTimer(void) {
+    stopTimer();
+    if (!poweredUp() || !(regs[CONTROL1] & AFE_TIMEREN) || regs[PRPCOUNT] == 0) return;
+    uint64_t periodNs = (uint64_t) (regs[PRPCOUNT] + 1) * 1000000000ULL / AFE_CLOCK_HZ;
+    event = simEventStart(periodNs, onADCReady, this);
+  }
+
+  double noise(double amplitude) {
+    rng = rng * 1664525u + 1013904223u;
+    return amplitude * ((double) (rng >> 8) / 8388608.0 - 1.0);
+  }
+
+  static uint32_t toRegister(double counts) {
+    long v = lround(counts);
+    if (v > 2097151) v = 2097151;
+    if (v < -2097152) v = -2097152;
+    return (uint32_t) v & 0xFFFFFF;
+  }
+
+  void convert(void) {
+    double t = (double) simNowNanos() / 1e9;
+    double heartPhase = fmod(t * 1.2, 1.0);
+    double pulse = exp(-pow((heartPhase - 0.2) / 0.07, 2)) + 0.4 * exp(-pow((heartPhase - 0.45) / 0.1, 2));
+    double breath = sin(2 * M_PI * 0.25 * t);
+
+    double ambient = 24000 + 800 * sin(2 * M_PI * 0.05 * t);
+    double led1 = 620000 + 9000 * breath - 7500 * pulse;   // IR
+    double led2 = 540000 + 7000 * breath - 4200 * pulse;   // red
+
+    double aled1 = ambient + noise(30);
+    double aled2 = ambient + noise(30);
+    led1 += ambient + noise(40);
+    led2 += ambient + noise(40);
+
+    regs[LED2VAL] = toRegister(led2);
+    regs[ALED2VAL] = toRegister(aled2);
+    regs[LED1VAL] = toRegister(led1);
+    regs[ALED1VAL] = toRegister(aled1);
+    regs[LED2ABSVAL] = toRegister(led2 - aled2);
+    regs[LED1ABSVAL] = toRegister(led1 - aled1);
+    regs[DIAG] = 0;
+
+    sampleSeq++;
+    simStreamPPG.produced++;
+    simIRQRaise(simPinIRQLine(adcRdyPin));
+  }
+
+  int adcRdyPin;
+  int pdnPin;
+  uint32_t rng;
+  int event;
+
+  bool selected;
+  int byteIndex;
+  uint8_t address;
+  uint32_t shift;
+  uint32_t readValue;
+  bool writeLost;
+
+  uint32_t regs[DIAG + 1];
+  uint64_t sampleSeq;
+  uint64_t readSeq;
+  uint32_t ignored;
+};
+
+static SimAFE4400 *afe = NULL;
+
+void simAFEInit(int csPin, int adcRdyPin, int pdnPin, uint32_t seed) {
+  afe = new SimAFE4400(adcRdyPin, pdnPin, seed);
+  // PDN is pulled up on the board, so the part runs unless the firmware drives it low
+  simPinWrite(pdnPin, 1);
+  simPinWatch(pdnPin, SimAFE4400::onPDN, afe);
+  simSPIAttach(csPin, afe);
+}
+
+uint32_t simAFEIgnoredWrites(void) {
+  return afe ? afe->ignoredWrites() : 0;
+}
@@ -0,0 +1,108 @@
+#ifndef SIM_DEVICES_H
+#define SIM_DEVICES_H
+
+#include <stdint.h>
+#include "Sim.h"
+
+/*============================================================================
+=  Simulated board: AFE4400 on SPI, MPU6050 DMP and M41T62 RTC on I2C,      =
+=  EDA front end on the ADC, and file-backed SerialFlash chips.             =
+=  Timing constants are typical datasheet/ArduinoCore-samd figures; they    =
+=  set what the virtual clock charges for each access.                      =
+==============================================================================*/
+
+/*----------  Timing model  ----------*/
+
+const uint64_t SIM_GPIO_NS = 600;                    // digitalWrite() in ArduinoCore-samd
+const uint64_t SIM_ADC_CONVERSION_NS = 425000;       // stock analogRead(), DIV512 prescaler
+const uint32_t SIM_SPI_MAX_HZ = 12000000;            // SERCOM SPI ceiling at 48MHz
+const uint64_t SIM_SPI_BYTE_OVERHEAD_NS = 400;       // per SPI.transfer() call
+const uint64_t SIM_SPI_TRANSACTION_NS = 1000;        // beginTransaction()/endTransaction()
+const uint64_t SIM_LOOP_OVERHEAD_NS = 2000;          // one pass through loop() with nothing to do
+
+// SAMD21G18 at 48MHz from the DFLL, for the duty cycle report only
+const double SIM_MCU_ACTIVE_MA = 3.5;                // running from flash, peripherals clocked
+const double SIM_MCU_IDLE_MA = 1.4;                  // IDLE0 sleep, DFLL and GCLKs left running
+const double SIM_SUPPLY_V = 3.3;
+
+const uint32_t SIM_FLASH_CAPACITY = 67108864;        // 512Mbit, as reported for the board
+const uint32_t SIM_FLASH_PAGE_SIZE = 256;
+const uint32_t SIM_FLASH_BLOCK_SIZE = 65536;
+const uint64_t SIM_FLASH_PAGE_PROGRAM_NS = 500000;   // tPP typical, N25Q512A class part
+const uint64_t SIM_FLASH_BLOCK_ERASE_NS = 700000000; // tSE typical, 64KB sector
+const uint64_t SIM_FLASH_CHIP_ERASE_NS = 170000000000ULL;
+
+/*----------  Stream accounting  ----------*/
+
+struct SimStreamStats {
+  const char *name;
+  uint64_t produced;   // samples the sensor made available
+  uint64_t consumed;   // distinct samples the firmware read back
+  uint64_t dropped;    // samples the sensor discarded (FIFO overflow/reset)
+};
+
+extern SimStreamStats simStreamPPG;
+extern SimStreamStats simStreamMPU;
+extern SimStreamStats simStreamEDA;
+
+/*----------  Analog front ends  ----------*/
+
+void simADCResolution(int bits);
+int simADCRead(uint32_t pin);
+void simEDATick(void);
+
+void simAFEInit(int csPin, int adcRdyPin, int pdnPin, uint32_t seed);
+uint32_t simAFEIgnoredWrites(void);
+
+/*----------  I2C devices  ----------*/
+
+void simMPUInit(uint8_t address, int intPin, uint32_t seed);
+void simRTCInit(uint8_t address, double crystalPpm, const char *statePath, bool cold);
+double simRTCDriftPpm(void);
+
+/*----------  SPI NOR flash  ----------*/
+
+struct SimFlashStats {
+  uint64_t bytesRead;
+  uint64_t bytesProgrammed;
+  uint32_t pagePrograms;
+  uint32_t blockErases;
+  uint64_t busyNs;         // time the array spent programming/erasing
+  uint64_t waitNs;         // time callers spent blocked on a busy array
+  uint64_t maxWaitNs;
+};
+
+class SimFlashChip {
+ public:
+  SimFlashChip(int csPin, const char *path, bool erase);
+  ~SimFlashChip();
+
+  bool ok(void) const { return image != NULL; }
+  int chipSelect(void) const { return cs; }
+  uint32_t capacity(void) const { return SIM_FLASH_CAPACITY; }
+
+  bool busy(void);
+  void waitReady(void);
+  void read(uint32_t addr, void *buf, uint32_t len);
+  void program(uint32_t addr, const void *buf, uint32_t len);
+  void eraseBlock(uint32_t addr);
+  void eraseAll(void);
+  void statusPoll(void);
+
+  const uint8_t *data(void) const { return image; }
+  SimFlashStats stats;
+
+ private:
+  void command(uint32_t bytes);
+
+  int cs;
+  int fd;
+  uint8_t *image;
+  uint64_t busyUntilNs;
+};
+
+void simFlashAttach(int csPin, const char *path, bool erase);
+SimFlashChip *simFlashChip(int csPin);
+SimFlashChip *simFlashChipIfUsed(int index);
+
+#endif
@@ -0,0 +1,42 @@
+#include <math.h>
+#include "Arduino.h"
+#include "SimDevices.h"
+
+/*============================================================================
+=  EDA front end on A6: tonic skin conductance drift with phasic skin       =
+=  conductance responses every few seconds, quantised by the SAMD ADC.      =
+==============================================================================*/
+
+SimStreamStats simStreamEDA = { "EDA", 0, 0, 0 };
+
+static int adcBits = 10;
+static uint64_t tickSeq = 0;
+static uint64_t readSeq = 0;
+
+void simADCResolution(int bits) {
+  if (bits >= 8 && bits <= 12) adcBits = bits;
+}
+
+void simEDATick(void) {
+  tickSeq++;
+  simStreamEDA.produced++;
+}
+
+static double edaVolts(double t) {
+  double tonic = 1.1 + 0.25 * sin(2 * M_PI * t / 600.0);
+  double sinceResponse = fmod(t, 7.3);
+  double phasic = sinceResponse < 0.8 ? 0 : 0.18 * exp(-(sinceResponse - 0.8) / 2.5) * (1 - exp(-(sinceResponse - 0.8) / 0.4));
+  return tonic + phasic;
+}
+
+int simADCRead(uint32_t pin) {
+  if (pin != A6) return 0;
+  if (tickSeq != readSeq) {
+    readSeq = tickSeq;
+    simStreamEDA.consumed++;
+  }
+  double v = edaVolts((double) simNowNanos() / 1e9);
+  int full = (1 << adcBits) - 1;
+  int code = (int) lround(v / 3.3 * full);
+  return code < 0 ? 0 : (code > full ? full : code);
+}
@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SimDevices.h"
+
+/*============================================================================
+=  SPI NOR flash model backed by a memory-mapped image file. Programming    =
+=  only clears bits, erase sets a whole 64KB block back to 0xFF, and the    =
+=  array stays busy for tPP/tSE after each command.                         =
+==============================================================================*/
+
+SimFlashChip::SimFlashChip(int csPin, const char *path, bool erase)
+  : cs(csPin), fd(-1), image(NULL), busyUntilNs(0) {
+  memset(&stats, 0, sizeof(stats));
+
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(path);
+    return;
+  }
+
+  struct stat st;
+  bool fresh = fstat(fd, &st) != 0 || (uint64_t) st.st_size != SIM_FLASH_CAPACITY;
+  if (fresh && ftruncate(fd, SIM_FLASH_CAPACITY) != 0) {
+    perror(path);
+    return;
+  }
+
+  void *map = mmap(NULL, SIM_FLASH_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return;
+  }
+  image = (uint8_t *) map;
+  if (fresh || erase) memset(image, 0xFF, SIM_FLASH_CAPACITY);
+}
+
+SimFlashChip::~SimFlashChip() {
+  if (image) munmap(image, SIM_FLASH_CAPACITY);
+  if (fd >= 0) close(fd);
+}
+
+/**
+Bus time for one chip-selected command of `bytes` bytes (opcode, address, data)
+**/
+void SimFlashChip::command(uint32_t bytes) {
+  uint64_t ns = SIM_SPI_TRANSACTION_NS + (uint64_t) bytes * 8ULL * 1000000000ULL / SIM_SPI_MAX_HZ;
+  simStats.busOps++;
+  simStats.spiBytes += bytes;
+  simStats.spiBusyNs += ns;
+  simSPICheckContention(cs);
+  simAdvanceNanos(ns);
+}
+
+bool SimFlashChip::busy(void) {
+  return simNowNanos() < busyUntilNs;
+}
+
+void SimFlashChip::statusPoll(void) {
+  command(2);
+}
+
+void SimFlashChip::waitReady(void) {
+  if (!busy()) return;
+  uint64_t wait = busyUntilNs - simNowNanos();
+  stats.waitNs += wait;
+  if (wait > stats.maxWaitNs) stats.maxWaitNs = wait;
+  simAdvanceNanos(wait);
+}
+
+/**
+4-byte address read; buf may be NULL to charge the bus time only
+**/
+void SimFlashChip::read(uint32_t addr, void *buf, uint32_t len) {
+  waitReady();
+  command(5 + len);
+  stats.bytesRead += len;
+  if (!buf || addr >= SIM_FLASH_CAPACITY) return;
+  if (len > SIM_FLASH_CAPACITY - addr) len = SIM_FLASH_CAPACITY - addr;
+  memcpy(buf, image + addr, len);
+}
+
+void SimFlashChip::program(uint32_t addr, const void *buf, uint32_t len) {
+  const uint8_t *src = (const uint8_t *) buf;
+
+  while (len > 0 && addr < SIM_FLASH_CAPACITY) {
+    uint32_t chunk = SIM_FLASH_PAGE_SIZE - (addr % SIM_FLASH_PAGE_SIZE);
+    if (chunk > len) chunk = len;
+
+    waitReady();
+    command(1);          // write enable
+    command(5 + chunk);  // page program
+    for (uint32_t i = 0; i < chunk; i++) image[addr + i] &= src[i];
+
+    busyUntilNs = simNowNanos() + SIM_FLASH_PAGE_PROGRAM_NS;
+    stats.busyNs += SIM_FLASH_PAGE_PROGRAM_NS;
+    stats.pagePrograms++;
+    stats.bytesProgrammed += chunk;
+
+    addr += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+}
+
+void SimFlashChip::eraseBlock(uint32_t addr) {
+  addr -= addr % SIM_FLASH_BLOCK_SIZE;
+  if (addr >= SIM_FLASH_CAPACITY) return;
+
+  waitReady();
+  command(1);
+  command(5);
+  memset(image + addr, 0xFF, SIM_FLASH_BLOCK_SIZE);
+
+  busyUntilNs = simNowNanos() + SIM_FLASH_BLOCK_ERASE_NS;
+  stats.busyNs += SIM_FLASH_BLOCK_ERASE_NS;
+  stats.blockErases++;
+}
+
+void SimFlashChip::eraseAll(void) {
+  waitReady();
+  command(1);
+  command(1);
+  memset(image, 0xFF, SIM_FLASH_CAPACITY);
+
+  busyUntilNs = simNowNanos() + SIM_FLASH_CHIP_ERASE_NS;
+  stats.busyNs += SIM_FLASH_CHIP_ERASE_NS;
+  stats.blockErases += SIM_FLASH_CAPACITY / SIM_FLASH_BLOCK_SIZE;
+}
+
+/*============================================
+=             Chips on the board             =
+==============================================*/
+
+/**
+The chip seen on the SPI bus directly rather than through SerialFlash;
+only read status register is modelled, for firmware that polls the chips
+itself
+**/
+class SimFlashSPI : public SimSPIDevice {
+ public:
+  SimFlashSPI(int csPin) : cs(csPin), byteIndex(0), opcode(0) {}
+
+  void select(void) {
+    byteIndex = 0;
+  }
+
+  uint8_t transfer(uint8_t out) {
+    if (byteIndex++ == 0) {
+      opcode = out;
+      return 0xFF;
+    }
+    if (opcode != 0x05) return 0xFF;
+    SimFlashChip *chip = simFlashChip(cs);
+    return chip && chip->busy() ? 0x03 : 0x00; // WIP | WEL while busy
+  }
+
+ private:
+  int cs;
+  uint32_t byteIndex;
+  uint8_t opcode;
+};
+
+// images are only created once the firmware selects the chip
+struct SimFlashSlot {
+  int cs;
+  const char *path;
+  bool erase;
+  SimFlashChip *chip;
+};
+
+static const int SIM_MAX_FLASH = 2;
+static SimFlashSlot slots[SIM_MAX_FLASH];
+static int slotCount = 0;
+
+void simFlashAttach(int csPin, const char *path, bool erase) {
+  if (slotCount == SIM_MAX_FLASH) return;
+  slots[slotCount].cs = csPin;
+  slots[slotCount].path = path;
+  slots[slotCount].erase = erase;
+  slots[slotCount].chip = NULL;
+  slotCount++;
+  simSPIAttach(csPin, new SimFlashSPI(csPin));
+}
+
+SimFlashChip *simFlashChip(int csPin) {
+  for (int i = 0; i < slotCount; i++) {
+    if (slots[i].cs != csPin) continue;
+    if (!slots[i].chip) slots[i].chip = new SimFlashChip(csPin, slots[i].path, slots[i].erase);
+    return slots[i].chip;
+  }
+  return NULL;
+}
+
+SimFlashChip *simFlashChipIfUsed(int index) {
+  return index < slotCount ? slots[index].chip : NULL;
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SimDevices.h"
+
+/*============================================================================
+=  M41T62 RTC model: BCD timekeeping registers 0x00-0x07 with pointer       =
+=  auto-increment, a crystal that runs off by a fixed ppm, and the          =
+=  calibration register (0x08) that trims it. The time and registers are    =
+=  kept in a state file as if on the backup supply; a part with no state    =
+=  powers up at 2000-01-01 with the oscillator-fail flag set.               =
+==============================================================================*/
+
+static int bcdToDec(uint8_t bcd) {
+  return 10 * (bcd >> 4) + (bcd & 0x0F);
+}
+
+static uint8_t decToBcd(int dec) {
+  return ((dec / 10) << 4) | (dec % 10);
+}
+
+// days since 2000-01-01 for a proleptic Gregorian date
+static int64_t daysFromCivil(int y, int m, int d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 730425;
+}
+
+static void civilFromDays(int64_t z, int &y, int &m, int &d) {
+  z += 730425;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int64_t doe = z - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = yoe + era * 400 + (m <= 2);
+}
+
+class SimM41T62 : public SimI2CDevice {
+ public:
+  explicit SimM41T62(double crystalPpm)
+    : crystalPpm(crystalPpm), pointer(0), baseCentis(0), baseNs(0) {
+    memset(regs, 0, sizeof(regs));
+    regs[0x0F] = 0x04; // OF, set at initial power-up
+  }
+
+  bool loadState(FILE *in) {
+    int64_t centis;
+    uint8_t saved[16];
+    if (fread(&centis, sizeof(centis), 1, in) != 1 || fread(saved, sizeof(saved), 1, in) != 1) return false;
+    memcpy(regs, saved, sizeof(regs));
+    baseCentis = centis;
+    baseNs = simNowNanos();
+    return true;
+  }
+
+  // the board is powered straight back up, so the clock carries on from here
+  void saveState(FILE *out) const {
+    int64_t centis = nowCentis();
+    fwrite(&centis, sizeof(centis), 1, out);
+    fwrite(regs, sizeof(regs), 1, out);
+  }
+
+  void i2cWrite(const uint8_t *data, size_t len) {
+    if (!len) return;
+    pointer = data[0] & 0x0F;
+    if (len == 1) return;
+
+    uint8_t time[8];
+    snapshot(time);
+    bool timeWritten = false;
+    for (size_t i = 1; i < len; i++) {
+      if (pointer <= 0x07) {
+        time[pointer] = data[i];
+        timeWritten = true;
+      } else {
+        if (pointer == 0x08) rebase();
+        regs[pointer] = data[i];
+      }
+      pointer = (pointer + 1) & 0x0F;
+    }
+    if (timeWritten) load(time);
+  }
+
+  void i2cRead(uint8_t *data, size_t len) {
+    uint8_t time[8];
+    // the M41T62 latches the time registers for the duration of a burst read
+    snapshot(time);
+    for (size_t i = 0; i < len; i++) {
+      data[i] = pointer <= 0x07 ? time[pointer] : regs[pointer];
+      pointer = (pointer + 1) & 0x0F;
+    }
+  }
+
+  double effectivePpm(void) const {
+    uint8_t cal = regs[0x08];
+    int steps = cal & 0x1F;
+    double trim = (cal & 0x20) ? 4.068 * steps : -2.034 * steps;
+    return crystalPpm + trim;
+  }
+
+ private:
+  int64_t nowCentis(void) const {
+    double elapsed = (double) (simNowNanos() - baseNs) * (1.0 + effectivePpm() * 1e-6);
+    return baseCentis + (int64_t) (elapsed / 1e7);
+  }
+
+  void rebase(void) {
+    baseCentis = nowCentis();
+    baseNs = simNowNanos();
+  }
+
+  void snapshot(uint8_t *time) const {
+    int64_t centis = nowCentis();
+    int64_t secs = centis / 100;
+    int64_t days = secs / 86400;
+    int y, m, d;
+    civilFromDays(days, y, m, d);
+
+    time[0] = decToBcd(centis % 100);
+    time[1] = decToBcd(secs % 60);
+    time[2] = decToBcd((secs / 60) % 60);
+    time[3] = decToBcd((secs / 3600) % 24);
+    time[4] = (regs[0x04] & 0xF0) | (uint8_t) ((days + 5) % 7 + 1); // 2000-01-01 was a Saturday
+    time[5] = decToBcd(d);
+    time[6] = (((y - 2000) / 100) & 0x03) << 6 | decToBcd(m);
+    time[7] = decToBcd(y % 100);
+  }
+
+  void load(const uint8_t *time) {
+    int y = 2000 + 100 * (time[6] >> 6) + bcdToDec(time[7]);
+    int m = bcdToDec(time[6] & 0x1F);
+    int d = bcdToDec(time[5] & 0x3F);
+    if (m < 1 || m > 12) m = 1;
+    if (d < 1 || d > 31) d = 1;
+
+    int64_t secs = daysFromCivil(y, m, d) * 86400
+                 + bcdToDec(time[3] & 0x3F) * 3600
+                 + bcdToDec(time[2] & 0x7F) * 60
+                 + bcdToDec(time[1] & 0x7F);
+    regs[0x04] = (regs[0x04] & 0x07) | (time[4] & 0xF0);
+    baseCentis = secs * 100 + bcdToDec(time[0]);
+    baseNs = simNowNanos();
+  }
+
+  double crystalPpm;
+  uint8_t pointer;
+  uint8_t regs[16];
+  int64_t baseCentis;
+  uint64_t baseNs;
+};
+
+static SimM41T62 *rtc = NULL;
+static const char *rtcStatePath = NULL;
+
+static void rtcSave(void) {
+  FILE *out = fopen(rtcStatePath, "wb");
+  if (!out) {
+    perror(rtcStatePath);
+    return;
+  }
+  rtc->saveState(out);
+  fclose(out);
+}
+
+void simRTCInit(uint8_t address, double crystalPpm, const char *statePath, bool cold) {
+  rtc = new SimM41T62(crystalPpm);
+  rtcStatePath = statePath;
+  FILE *in = cold ? NULL : fopen(statePath, "rb");
+  if (in) {
+    if (!rtc->loadState(in)) fprintf(stderr, "%s: short RTC state, starting cold\n", statePath);
+    fclose(in);
+  }
+  atexit(rtcSave);
+  simI2CAttach(address, rtc);
+}
+
+double simRTCDriftPpm(void) {
+  return rtc ? rtc->effectivePpm() : 0;
+}
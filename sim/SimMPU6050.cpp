@@ -0,0 +1,201 @@
+#include <math.h>
+#include <string.h>
+#include "SimDevices.h"
+#include "MPU6050.h"
+
+/*============================================================================
+=  MPU6050 + DMP model: a 1024 byte FIFO filled with 42 byte MotionApps20   =
+=  packets at 100Hz (Q30 quaternion and gravity-inclusive accel for a       =
+=  slowly swaying, walking wearer), INT_STATUS flags and the INT pin.       =
+==============================================================================*/
+
+SimStreamStats simStreamMPU = { "MPU", 0, 0, 0 };
+
+static const uint64_t DMP_PERIOD_NS = 10000000;   // 100Hz default DMP FIFO rate
+static const int FIFO_SIZE = 1024;
+static const double ACCEL_LSB_PER_G = 8192.0;
+
+class SimMPU6050 : public SimI2CDevice {
+ public:
+  SimMPU6050(int intPin, uint32_t seed)
+    : intPin(intPin), rng(seed ? seed : 1), pointer(0), fifoHead(0), fifoCount(0),
+      bytesRead(0), bytesDropped(0) {
+    memset(regs, 0, sizeof(regs));
+    regs[MPU6050_RA_PWR_MGMT_1] = 1 << MPU6050_PWR1_SLEEP_BIT;
+    regs[MPU6050_RA_WHO_AM_I] = 0x34 << 1;
+    simEventStart(DMP_PERIOD_NS, onDMPTick, this);
+  }
+
+  void i2cWrite(const uint8_t *data, size_t len) {
+    if (!len) return;
+    pointer = data[0];
+    for (size_t i = 1; i < len; i++) {
+      writeRegister(pointer, data[i]);
+      if (pointer != MPU6050_RA_FIFO_R_W && pointer != MPU6050_RA_MEM_R_W) pointer++;
+    }
+  }
+
+  void i2cRead(uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      data[i] = readRegister(pointer);
+      if (pointer != MPU6050_RA_FIFO_R_W) pointer++;
+    }
+  }
+
+  static void onDMPTick(void *ctx) {
+    ((SimMPU6050 *) ctx)->dmpTick();
+  }
+
+ private:
+  uint8_t readRegister(uint8_t reg) {
+    switch (reg) {
+      case MPU6050_RA_INT_STATUS: {
+        uint8_t status = regs[reg];
+        regs[reg] = 0;
+        return status;
+      }
+      case MPU6050_RA_FIFO_COUNTH:
+        return fifoCount >> 8;
+      case MPU6050_RA_FIFO_COUNTH + 1:
+        return fifoCount & 0xFF;
+      case MPU6050_RA_FIFO_R_W:
+        return popFIFO();
+      default:
+        return regs[reg];
+    }
+  }
+
+  void writeRegister(uint8_t reg, uint8_t value) {
+    switch (reg) {
+      case MPU6050_RA_USER_CTRL:
+        if (value & (1 << MPU6050_USERCTRL_FIFO_RESET_BIT)) dropFIFO(fifoCount);
+        regs[reg] = value & ~((1 << MPU6050_USERCTRL_FIFO_RESET_BIT) | (1 << MPU6050_USERCTRL_DMP_RESET_BIT));
+        break;
+      case MPU6050_RA_PWR_MGMT_1:
+        if (value & (1 << MPU6050_PWR1_DEVICE_RESET_BIT)) {
+          uint8_t who = regs[MPU6050_RA_WHO_AM_I];
+          memset(regs, 0, sizeof(regs));
+          regs[MPU6050_RA_WHO_AM_I] = who;
+          regs[reg] = 1 << MPU6050_PWR1_SLEEP_BIT;
+          dropFIFO(fifoCount);
+        } else {
+          regs[reg] = value;
+        }
+        break;
+      case MPU6050_RA_INT_STATUS:
+      case MPU6050_RA_FIFO_COUNTH:
+      case MPU6050_RA_FIFO_COUNTH + 1:
+      case MPU6050_RA_WHO_AM_I:
+      case MPU6050_RA_MEM_R_W:
+        break;
+      default:
+        regs[reg] = value;
+    }
+  }
+
+  uint8_t popFIFO(void) {
+    if (!fifoCount) return 0;
+    uint8_t b = fifo[fifoHead];
+    fifoHead = (fifoHead + 1) % FIFO_SIZE;
+    fifoCount--;
+    bytesRead++;
+    simStreamMPU.consumed = bytesRead / MPU6050_DMP_PACKET_SIZE;
+    return b;
+  }
+
+  void dropFIFO(int n) {
+    fifoHead = (fifoHead + n) % FIFO_SIZE;
+    fifoCount -= n;
+    bytesDropped += n;
+    simStreamMPU.dropped = bytesDropped / MPU6050_DMP_PACKET_SIZE;
+  }
+
+  void pushFIFO(const uint8_t *data, int len) {
+    int overflow = fifoCount + len - FIFO_SIZE;
+    if (overflow > 0) {
+      // FIFO keeps the newest bytes, which leaves it misaligned
+      dropFIFO(overflow);
+      regs[MPU6050_RA_INT_STATUS] |= 0x10;
+    }
+    for (int i = 0; i < len; i++) {
+      fifo[(fifoHead + fifoCount) % FIFO_SIZE] = data[i];
+      fifoCount++;
+    }
+  }
+
+  static void putWord(uint8_t *p, int32_t v) {
+    p[0] = (uint32_t) v >> 24;
+    p[1] = (uint32_t) v >> 16;
+    p[2] = (uint32_t) v >> 8;
+    p[3] = (uint32_t) v;
+  }
+
+  double noise(double amplitude) {
+    rng = rng * 1664525u + 1013904223u;
+    return amplitude * ((double) (rng >> 8) / 8388608.0 - 1.0);
+  }
+
+  void makePacket(uint8_t *packet) {
+    double t = (double) simNowNanos() / 1e9;
+
+    // orientation: gentle sway around all three axes
+    double yaw = 0.6 * sin(2 * M_PI * 0.02 * t);
+    double pitch = 0.3 * sin(2 * M_PI * 0.13 * t);
+    double roll = 0.25 * sin(2 * M_PI * 0.17 * t + 1.0);
+    double cy = cos(yaw / 2), sy = sin(yaw / 2);
+    double cp = cos(pitch / 2), sp = sin(pitch / 2);
+    double cr = cos(roll / 2), sr = sin(roll / 2);
+    Quaternion q(cr * cp * cy + sr * sp * sy,
+                 sr * cp * cy - cr * sp * sy,
+                 cr * sp * cy + sr * cp * sy,
+                 cr * cp * sy - sr * sp * cy);
+
+    // world-frame linear acceleration of a walking gait, in g, plus gravity
+    double step = 2 * M_PI * 1.8 * t;
+    Quaternion world(0,
+                     0.12 * sin(step) + noise(0.01),
+                     0.07 * cos(step) + noise(0.01),
+                     1.0 + 0.2 * sin(2 * step) + noise(0.01));
+    // accelerometer sees the world vector in the sensor frame: q* v q
+    Quaternion sensor = q.getConjugate().getProduct(world).getProduct(q);
+
+    memset(packet, 0, MPU6050_DMP_PACKET_SIZE);
+    putWord(packet + 0, (int32_t) lround(q.w * 1073741824.0));
+    putWord(packet + 4, (int32_t) lround(q.x * 1073741824.0));
+    putWord(packet + 8, (int32_t) lround(q.y * 1073741824.0));
+    putWord(packet + 12, (int32_t) lround(q.z * 1073741824.0));
+    putWord(packet + 28, (int32_t) ((uint32_t) lround(sensor.x * ACCEL_LSB_PER_G) << 16));
+    putWord(packet + 32, (int32_t) ((uint32_t) lround(sensor.y * ACCEL_LSB_PER_G) << 16));
+    putWord(packet + 36, (int32_t) ((uint32_t) lround(sensor.z * ACCEL_LSB_PER_G) << 16));
+  }
+
+  void dmpTick(void) {
+    uint8_t userCtrl = regs[MPU6050_RA_USER_CTRL];
+    bool running = (userCtrl & (1 << MPU6050_USERCTRL_DMP_EN_BIT)) &&
+                   (userCtrl & (1 << MPU6050_USERCTRL_FIFO_EN_BIT)) &&
+                   !(regs[MPU6050_RA_PWR_MGMT_1] & (1 << MPU6050_PWR1_SLEEP_BIT));
+    if (!running) return;
+
+    uint8_t packet[MPU6050_DMP_PACKET_SIZE];
+    makePacket(packet);
+    pushFIFO(packet, sizeof(packet));
+    simStreamMPU.produced++;
+
+    regs[MPU6050_RA_INT_STATUS] |= 0x02;
+    if (regs[MPU6050_RA_INT_ENABLE] & 0x02) simIRQRaise(simPinIRQLine(intPin));
+  }
+
+  int intPin;
+  uint32_t rng;
+  uint8_t pointer;
+  uint8_t regs[128];
+  uint8_t fifo[FIFO_SIZE];
+  int fifoHead;
+  int fifoCount;
+  uint64_t bytesRead;
+  uint64_t bytesDropped;
+};
+
+void simMPUInit(uint8_t address, int intPin, uint32_t seed) {
+  simI2CAttach(address, new SimMPU6050(intPin, seed));
+}
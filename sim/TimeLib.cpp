@@ -0,0 +1,126 @@
+#include "TimeLib.h"
+
+/*============================================================================
+=  Same calendar arithmetic and sync behaviour as the Arduino Time library  =
+=  (tmElements_t years are offsets from 1970, resync every syncInterval).   =
+==============================================================================*/
+
+#define SECS_PER_DAY 86400UL
+#define LEAP_YEAR(Y) (((1970 + (Y)) > 0) && !((1970 + (Y)) % 4) && (((1970 + (Y)) % 100) || !((1970 + (Y)) % 400)))
+
+static const uint8_t monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+static uint32_t sysTime = 0;
+static uint32_t prevMillis = 0;
+static uint32_t nextSyncTime = 0;
+static uint32_t syncInterval = 300;
+static timeStatus_t status = timeNotSet;
+static getExternalTime getTimePtr = NULL;
+
+time_t makeTime(const tmElements_t &tm) {
+  uint32_t seconds = tm.Year * (SECS_PER_DAY * 365);
+  for (int i = 0; i < tm.Year; i++) {
+    if (LEAP_YEAR(i)) seconds += SECS_PER_DAY;
+  }
+  for (int i = 1; i < tm.Month; i++) {
+    if (i == 2 && LEAP_YEAR(tm.Year)) seconds += SECS_PER_DAY * 29;
+    else seconds += SECS_PER_DAY * monthDays[i - 1];
+  }
+  seconds += (tm.Day - 1) * SECS_PER_DAY;
+  seconds += tm.Hour * 3600UL;
+  seconds += tm.Minute * 60UL;
+  seconds += tm.Second;
+  return (time_t) seconds;
+}
+
+void breakTime(time_t timeInput, tmElements_t &tm) {
+  uint32_t time = (uint32_t) timeInput;
+  tm.Second = time % 60;
+  time /= 60;
+  tm.Minute = time % 60;
+  time /= 60;
+  tm.Hour = time % 24;
+  time /= 24;
+  tm.Wday = ((time + 4) % 7) + 1;
+
+  uint8_t year = 0;
+  uint32_t days = 0;
+  while ((unsigned) (days += (LEAP_YEAR(year) ? 366 : 365)) <= time) year++;
+  tm.Year = year;
+
+  days -= LEAP_YEAR(year) ? 366 : 365;
+  time -= days;
+
+  uint8_t month;
+  for (month = 0; month < 12; month++) {
+    uint8_t monthLength = monthDays[month];
+    if (month == 1 && LEAP_YEAR(year)) monthLength = 29;
+    if (time >= monthLength) time -= monthLength;
+    else break;
+  }
+  tm.Month = month + 1;
+  tm.Day = time + 1;
+}
+
+time_t now(void) {
+  while (millis() - prevMillis >= 1000) {
+    sysTime++;
+    prevMillis += 1000;
+  }
+  if (nextSyncTime <= sysTime && getTimePtr) {
+    time_t t = getTimePtr();
+    if (t != 0) {
+      setTime(t);
+    } else {
+      nextSyncTime = sysTime + syncInterval;
+      status = (status == timeNotSet) ? timeNotSet : timeNeedsSync;
+    }
+  }
+  return (time_t) sysTime;
+}
+
+void setTime(time_t t) {
+  sysTime = (uint32_t) t;
+  nextSyncTime = (uint32_t) t + syncInterval;
+  status = timeSet;
+  prevMillis = millis();
+}
+
+void adjustTime(long adjustment) {
+  sysTime += adjustment;
+}
+
+timeStatus_t timeStatus(void) {
+  now();
+  return status;
+}
+
+void setSyncProvider(getExternalTime getTimeFunction) {
+  getTimePtr = getTimeFunction;
+  nextSyncTime = sysTime;
+  now();
+}
+
+void setSyncInterval(time_t interval) {
+  syncInterval = (uint32_t) interval;
+  nextSyncTime = sysTime + syncInterval;
+}
+
+static tmElements_t cached;
+static time_t cacheTime = (time_t) -1;
+
+static const tmElements_t &elements(time_t t) {
+  if (t != cacheTime) {
+    breakTime(t, cached);
+    cacheTime = t;
+  }
+  return cached;
+}
+
+int year(time_t t) { return 1970 + elements(t).Year; }
+int month(time_t t) { return elements(t).Month; }
+int day(time_t t) { return elements(t).Day; }
+int hour(time_t t) { return elements(t).Hour; }
+int minute(time_t t) { return elements(t).Minute; }
+int second(time_t t) { return elements(t).Second; }
+int weekday(time_t t) { return elements(t).Wday; }
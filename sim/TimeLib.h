@@ -0,0 +1,42 @@
+#ifndef SIM_TIMELIB_H
+#define SIM_TIMELIB_H
+
+#include <time.h>
+#include "Arduino.h"
+
+/*============================================
+=   Host stand-in for the Arduino Time lib   =
+==============================================*/
+
+typedef struct {
+  uint8_t Second;
+  uint8_t Minute;
+  uint8_t Hour;
+  uint8_t Wday;   // day of week, sunday is day 1
+  uint8_t Day;
+  uint8_t Month;
+  uint8_t Year;   // offset from 1970
+} tmElements_t;
+
+typedef enum { timeNotSet, timeNeedsSync, timeSet } timeStatus_t;
+typedef time_t (*getExternalTime)(void);
+
+time_t now(void);
+void setTime(time_t t);
+void adjustTime(long adjustment);
+timeStatus_t timeStatus(void);
+void setSyncProvider(getExternalTime getTimeFunction);
+void setSyncInterval(time_t interval);
+
+time_t makeTime(const tmElements_t &tm);
+void breakTime(time_t time, tmElements_t &tm);
+
+int year(time_t t);
+int month(time_t t);
+int day(time_t t);
+int hour(time_t t);
+int minute(time_t t);
+int second(time_t t);
+int weekday(time_t t);
+
+#endif
@@ -0,0 +1,60 @@
+#include "Wire.h"
+#include "Sim.h"
+
+TwoWire Wire;
+
+/**
+Bus time for a START, the address byte, `bytes` data bytes and a STOP
+**/
+void TwoWire::charge(size_t bytes) {
+  uint64_t bits = 2 + 9 * (bytes + 1);
+  uint64_t ns = bits * 1000000000ULL / clockHz;
+  simStats.busOps++;
+  simStats.i2cBytes += bytes + 1;
+  simStats.i2cBusyNs += ns;
+  simAdvanceNanos(ns);
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  txAddress = address;
+  txLength = 0;
+}
+
+uint8_t TwoWire::endTransmission(bool stopBit) {
+  (void) stopBit;
+  charge(txLength);
+  SimI2CDevice *dev = simI2CDevice(txAddress);
+  if (!dev) return 2; // address NACK
+  dev->i2cWrite(txBuffer, txLength);
+  txLength = 0;
+  return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, size_t quantity, bool stopBit) {
+  (void) stopBit;
+  if (quantity > WIRE_BUFFER_SIZE) quantity = WIRE_BUFFER_SIZE;
+  rxIndex = 0;
+  rxLength = 0;
+
+  SimI2CDevice *dev = simI2CDevice(address);
+  if (!dev) {
+    charge(0);
+    return 0;
+  }
+  charge(quantity);
+  dev->i2cRead(rxBuffer, quantity);
+  rxLength = quantity;
+  return quantity;
+}
+
+size_t TwoWire::write(uint8_t data) {
+  if (txLength >= WIRE_BUFFER_SIZE) return 0;
+  txBuffer[txLength++] = data;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t quantity) {
+  size_t n = 0;
+  while (n < quantity && write(data[n])) n++;
+  return n;
+}
@@ -0,0 +1,43 @@
+#ifndef SIM_WIRE_H
+#define SIM_WIRE_H
+
+#include "Arduino.h"
+
+/*============================================
+=  Host stand-in for the SAMD Wire library   =
+==============================================*/
+
+#define WIRE_BUFFER_SIZE 64
+
+class TwoWire {
+ public:
+  void begin(void) {}
+  void end(void) {}
+  void setClock(uint32_t hz) { clockHz = hz; }
+  uint32_t getClock(void) const { return clockHz; }
+
+  void beginTransmission(uint8_t address);
+  uint8_t endTransmission(bool stopBit = true);
+  uint8_t requestFrom(uint8_t address, size_t quantity, bool stopBit = true);
+
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *data, size_t quantity);
+  int available(void) { return rxLength - rxIndex; }
+  int read(void) { return rxIndex < rxLength ? rxBuffer[rxIndex++] : -1; }
+  int peek(void) { return rxIndex < rxLength ? rxBuffer[rxIndex] : -1; }
+
+ private:
+  void charge(size_t bytes);
+
+  uint32_t clockHz = 100000;
+  uint8_t txAddress = 0;
+  uint8_t txBuffer[WIRE_BUFFER_SIZE];
+  size_t txLength = 0;
+  uint8_t rxBuffer[WIRE_BUFFER_SIZE];
+  size_t rxLength = 0;
+  size_t rxIndex = 0;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Arduino.h"
+#include "../HAL.h"
+#include "helper_3dmath.h"
+#include "Sim.h"
+#include "SimDevices.h"
+#include "../Memory.h"
+#include "../Record.h"
+#include "../MPU.h"
+#include "../PPG.h"
+#include "../Rice.h"
+#include "../Format.h"
+
+/*============================================================================
+=  senti-bench: host CPU micro-benchmarks of firmware code paths, run       =
+=  against the simulated board. Absolute numbers are for the host; compare =
+=  them against each other, not against the Cortex-M0+.                     =
+=                                                                           =
+=    senti-bench append    appends/s at 0%, 50% and 90% buffer fill         =
+=    senti-bench dmp       fixed vs float DMP world-frame accel: accuracy   =
+=                          against a double reference, and cost per packet  =
+=    senti-bench ppg [CSV] Q block compression of PPG phases: ratio against =
+=                          O records and text, cost per sample, round trip; =
+=                          on the sim AFE, or the O rows of a CSV trace     =
+=                          from sentidecode --csv                           =
+=    senti-bench format    legacy A: lines with String against the stack    =
+=                          formatters: cost and heap allocations per line   =
+==============================================================================*/
+
+static double hostNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*============================================
+=                   append                   =
+==============================================*/
+
+// memWrite() as it was before the append cursor, for comparison, with the
+// old 16KB file buffer
+static const int legacyFileSize = 16384;
+static char legacyBuffer[legacyFileSize];
+
+static void legacyWrite(const char *s) {
+  if(strlen(legacyBuffer) < legacyFileSize*0.9) {
+    strcat(legacyBuffer, s);
+    strcat(legacyBuffer, "\n");
+  } else {
+    memset(legacyBuffer, 0, sizeof(legacyBuffer));
+    legacyWrite(s);
+  }
+}
+
+static int legacyFill(void) {
+  return strlen(legacyBuffer);
+}
+
+static void cursorText(void) {
+  memWrite("P:581981", 8);
+}
+
+static void cursorRecord(void) {
+  recordPPG(millis(), 581981);
+}
+
+static void legacyText(void) {
+  legacyWrite("P:581981");
+}
+
+static unsigned long legacyDropped(void) {
+  return 0;
+}
+
+/**
+Appends per second while the buffer fill is within +/-5% of each target.
+Untimed appends are spaced 1ms apart in virtual time and give the
+background flush a step, as loop() would. A batch in which an append was
+dropped copied less than the others, so it is not counted.
+**/
+static void measureAppends(void (*append)(void), int (*fill)(void), int capacity, unsigned long (*dropped)(void),
+                           double *rates) {
+  static const int targets[3] = { 0, 50, 90 };
+  static const int batch = 32;
+  static const long wanted = 200000;
+  long count[3] = { 0, 0, 0 };
+  double ns[3] = { 0, 0, 0 };
+
+  while (count[0] < wanted || count[1] < wanted || count[2] < wanted) {
+    int percent = fill() * 100 / capacity;
+    int bucket = -1;
+    for (int b = 0; b < 3; b++) {
+      if (percent >= targets[b] - 5 && percent < targets[b] + 5) bucket = b;
+    }
+    if (bucket < 0 || count[bucket] >= wanted) {
+      append();
+      simAdvanceMicros(1000);
+      memService();
+      continue;
+    }
+
+    unsigned long droppedBefore = dropped();
+    double start = hostNanos();
+    for (int i = 0; i < batch; i++) append();
+    double elapsed = hostNanos() - start;
+    if (dropped() != droppedBefore) {
+      simAdvanceMicros(1000);
+      memService();
+      continue;
+    }
+    ns[bucket] += elapsed;
+    count[bucket] += batch;
+  }
+
+  for (int b = 0; b < 3; b++) rates[b] = count[b] / (ns[b] / 1e9);
+}
+
+static int benchAppend(void) {
+  simFlashAttach(FlashChipSelect1, "senti-bench-flash.img", true);
+  memInit();
+  setShouldRecordData(true);
+
+  double text[3], record[3], legacy[3];
+  measureAppends(cursorText, memBufferFill, memBufferSize, memDroppedRecords, text);
+  measureAppends(cursorRecord, memBufferFill, memBufferSize, memDroppedRecords, record);
+  measureAppends(legacyText, legacyFill, legacyFileSize, legacyDropped, legacy);
+
+  printf("append: appends/s by buffer fill (host CPU, %d byte cursor buffer, %d byte legacy buffer)\n",
+         memBufferSize, legacyFileSize);
+  if (memDroppedRecords()) printf("  (%lu records dropped, in batches left out of the rates)\n", memDroppedRecords());
+  printf("  fill    cursor text   cursor record   legacy strlen/strcat\n");
+  static const int targets[3] = { 0, 50, 90 };
+  for (int b = 0; b < 3; b++) {
+    printf("  %3d%%  %11.2fM  %13.2fM  %20.2fM\n", targets[b], text[b] / 1e6, record[b] / 1e6, legacy[b] / 1e6);
+  }
+  return 0;
+}
+
+/*============================================
+=                    dmp                     =
+==============================================*/
+
+static uint64_t hostCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint32_t dmpRng = 12345;
+
+static double uniform(double lo, double hi) {
+  dmpRng = dmpRng * 1664525u + 1013904223u;
+  return lo + (hi - lo) * (dmpRng >> 8) / 16777216.0;
+}
+
+static void putWord(uint8_t *p, int32_t v) {
+  p[0] = (uint32_t) v >> 24;
+  p[1] = (uint32_t) v >> 16;
+  p[2] = (uint32_t) v >> 8;
+  p[3] = (uint32_t) v;
+}
+
+/**
+DMP packet for a random orientation and a random world-frame linear
+acceleration of up to 0.5g, laid out as MotionApps20 does
+**/
+static void randomPacket(uint8_t *packet) {
+  double q[4], n = 0;
+  for (int i = 0; i < 4; i++) {
+    q[i] = uniform(-1, 1);
+    n += q[i] * q[i];
+  }
+  n = sqrt(n);
+  for (int i = 0; i < 4; i++) q[i] /= n;
+
+  Quaternion orientation(q[0], q[1], q[2], q[3]);
+  Quaternion world(0, uniform(-0.5, 0.5), uniform(-0.5, 0.5), 1.0 + uniform(-0.5, 0.5));
+  Quaternion sensor = orientation.getConjugate().getProduct(world).getProduct(orientation);
+
+  memset(packet, 0, 42);
+  for (int i = 0; i < 4; i++) putWord(packet + 4 * i, (int32_t) lround(q[i] * 1073741824.0));
+  putWord(packet + 28, (int32_t) ((uint32_t) lround(sensor.x * 8192) << 16));
+  putWord(packet + 32, (int32_t) ((uint32_t) lround(sensor.y * 8192) << 16));
+  putWord(packet + 36, (int32_t) ((uint32_t) lround(sensor.z * 8192) << 16));
+}
+
+/**
+The float path's arithmetic in double, on the same Q14 quaternion and raw
+accel, without intermediate truncation
+**/
+static void referenceWorldAccel(const uint8_t *packet, double *out) {
+  double q[4], a[3];
+  for (int i = 0; i < 4; i++) q[i] = (int16_t) ((packet[4 * i] << 8) | packet[4 * i + 1]) / 16384.0;
+  for (int i = 0; i < 3; i++) a[i] = (int16_t) ((packet[28 + 4 * i] << 8) | packet[29 + 4 * i]);
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+
+  double g[3] = { 2 * (x*z - w*y), 2 * (w*x + y*z), w*w - x*x - y*y + z*z };
+  double v[3];
+  for (int i = 0; i < 3; i++) v[i] = a[i] - g[i] * 8192;
+
+  // q v q*
+  double pw = -x*v[0] - y*v[1] - z*v[2];
+  double px = w*v[0] + y*v[2] - z*v[1];
+  double py = w*v[1] - x*v[2] + z*v[0];
+  double pz = w*v[2] + x*v[1] - y*v[0];
+  out[0] = -pw*x + px*w - py*z + pz*y;
+  out[1] = -pw*y + px*z + py*w - pz*x;
+  out[2] = -pw*z - px*y + py*x + pz*w;
+}
+
+struct ErrorStats {
+  double maxAbs;
+  double sumAbs;
+  long n;
+};
+
+static void addError(ErrorStats &e, double err) {
+  err = fabs(err);
+  if (err > e.maxAbs) e.maxAbs = err;
+  e.sumAbs += err;
+  e.n++;
+}
+
+static double timePath(void (*path)(const uint8_t *, int16_t *), const uint8_t *packets, int count,
+                       int rounds, double *cycles) {
+  int16_t xyz[3];
+  volatile int32_t sink = 0;
+  double start = hostNanos();
+  uint64_t c0 = hostCycles();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < count; i++) {
+      path(packets + 42 * i, xyz);
+      sink += xyz[0] + xyz[1] + xyz[2];
+    }
+  }
+  *cycles = (double) (hostCycles() - c0) / ((double) rounds * count);
+  return (hostNanos() - start) / ((double) rounds * count);
+}
+
+static int benchDMP(void) {
+  static const int count = 100000;
+  static uint8_t packets[count * 42];
+  for (int i = 0; i < count; i++) randomPacket(packets + 42 * i);
+
+  ErrorStats fixedRef = { 0, 0, 0 }, floatRef = { 0, 0, 0 }, fixedFloat = { 0, 0, 0 };
+  for (int i = 0; i < count; i++) {
+    const uint8_t *packet = packets + 42 * i;
+    int16_t fixed[3], flt[3];
+    double ref[3];
+    MPUWorldAccelFixed(packet, fixed);
+    MPUWorldAccelFloat(packet, flt);
+    referenceWorldAccel(packet, ref);
+    for (int j = 0; j < 3; j++) {
+      addError(fixedRef, fixed[j] - ref[j]);
+      addError(floatRef, flt[j] - ref[j]);
+      addError(fixedFloat, fixed[j] - flt[j]);
+    }
+  }
+
+  double fixedCycles, floatCycles;
+  double floatNs = timePath(MPUWorldAccelFloat, packets, count, 10, &floatCycles);
+  double fixedNs = timePath(MPUWorldAccelFixed, packets, count, 10, &fixedCycles);
+
+  printf("dmp: world-frame linear accel, %d random packets (LSB, 8192 = 1g)\n", count);
+  printf("                      max err   mean err\n");
+  printf("  fixed vs reference  %7.2f   %8.3f\n", fixedRef.maxAbs, fixedRef.sumAbs / fixedRef.n);
+  printf("  float vs reference  %7.2f   %8.3f\n", floatRef.maxAbs, floatRef.sumAbs / floatRef.n);
+  printf("  fixed vs float      %7.2f   %8.3f\n", fixedFloat.maxAbs, fixedFloat.sumAbs / fixedFloat.n);
+  printf("  per packet (host)   float %.1f ns / %.0f cycles, fixed %.1f ns / %.0f cycles, %.1fx\n",
+         floatNs, floatCycles, fixedNs, fixedCycles, floatNs / fixedNs);
+
+  // the fixed path should never be further off than the float path can be
+  if (fixedRef.maxAbs > 1.0) {
+    printf("  FAIL: fixed point result outside tolerance\n");
+    return 1;
+  }
+  return 0;
+}
+
+/*============================================
+=                    ppg                     =
+==============================================*/
+
+static const char *ppgTracePath = NULL;
+
+// the record's tick channel and four AFEPhases channels, per sample
+struct PPGTrace {
+  std::vector<int32_t> rows;
+  size_t samples(void) const { return rows.size() / RECORD_PPG_CHANNELS; }
+};
+
+static void tracePush(PPGTrace &trace, uint32_t tick, int32_t a, int32_t b, int32_t c, int32_t d) {
+  int32_t row[RECORD_PPG_CHANNELS] = { (int32_t) tick, a, b, c, d };
+  trace.rows.insert(trace.rows.end(), row, row + RECORD_PPG_CHANNELS);
+}
+
+static int32_t signed24(uint32_t v) {
+  return (int32_t) (v << 8) >> 8;
+}
+
+/**
+Ten minutes of the simulated AFE, timestamped by sampleAFE() as on the board
+**/
+static void simTrace(PPGTrace &trace) {
+  simAFEInit(PIN_SS_AFE, PIN_ADC_RDY, PIN_AFE_PDN, 1);
+  halTickBegin();
+  AFE4400InitConfigs();
+  AFEApplyProfile(&AFE_PROFILE_DEFAULT);
+  attachInterrupt(PIN_ADC_RDY, sampleAFE, RISING);
+
+  PPGSample sample;
+  for (int ms = 0; ms < 600000; ms++) {
+    simAdvanceMicros(1000);
+    while (PPGRing.pop(sample)) {
+      const AFEPhases &p = sample.phases;
+      tracePush(trace, sample.tick, signed24(p.led2Abs), signed24(p.led1Abs), signed24(p.aled2),
+                signed24(p.aled1));
+    }
+  }
+  detachInterrupt(PIN_ADC_RDY);
+}
+
+/**
+O rows of sentidecode --csv output: wallclock,tick,O,led2abs,led1abs,aled2,aled1
+**/
+static bool csvTrace(PPGTrace &trace, const char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char *tick = strchr(line, ',');
+    if (!tick) continue;
+    unsigned long t;
+    int a, b, c, d;
+    if (sscanf(tick + 1, "%lu,O,%d,%d,%d,%d", &t, &a, &b, &c, &d) == 5) tracePush(trace, t, a, b, c, d);
+  }
+  fclose(in);
+  return true;
+}
+
+/**
+Code one block the way recordPPGFlush() does; returns the record size
+**/
+static int encodeBlock(const int32_t *channels, int count, uint8_t *out) {
+  RiceChannel coding[RECORD_PPG_CHANNELS];
+  RiceWriter w;
+  uint8_t *bits = out + REC_PPG_BLOCK_HEADER;
+  riceWriterInit(&w, bits);
+  for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+    riceChoose(channels + c * count, count, c ? 24 : 32, &coding[c]);
+    riceEncode(&w, channels + c * count, count, c ? 24 : 32, &coding[c]);
+  }
+  int size = riceWriterFinish(&w, bits);
+  out[0] = REC_PPG_BLOCK;
+  out[1] = count;
+  out[2] = size & 0xFF;
+  out[3] = size >> 8;
+  return REC_PPG_BLOCK_HEADER + size;
+}
+
+static int benchPPG(void) {
+  PPGTrace trace;
+  if (ppgTracePath) {
+    if (!csvTrace(trace, ppgTracePath)) return 1;
+  } else {
+    simTrace(trace);
+  }
+  size_t samples = trace.samples();
+  if (samples < 2) {
+    printf("ppg: no samples in trace\n");
+    return 1;
+  }
+
+  // blocks in channel-major order, as recordPPGFlush() holds them
+  size_t blocks = (samples + RECORD_PPG_BLOCK - 1) / RECORD_PPG_BLOCK;
+  std::vector<int32_t> planar(blocks * RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS);
+  std::vector<int> counts(blocks);
+  for (size_t b = 0; b < blocks; b++) {
+    int count = (int) std::min((size_t) RECORD_PPG_BLOCK, samples - b * RECORD_PPG_BLOCK);
+    counts[b] = count;
+    int32_t *block = &planar[b * RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS];
+    for (int i = 0; i < count; i++) {
+      for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+        block[c * count + i] = trace.rows[(b * RECORD_PPG_BLOCK + i) * RECORD_PPG_CHANNELS + c];
+      }
+    }
+  }
+
+  // legacy sizes: O records with a varint tick delta, and text P: lines
+  size_t oBytes = 0, textBytes = 0;
+  for (size_t i = 0; i < samples; i++) {
+    uint32_t dt = i ? (uint32_t) (trace.rows[i * RECORD_PPG_CHANNELS] - trace.rows[(i - 1) * RECORD_PPG_CHANNELS]) : 0;
+    int varint = 1;
+    while (dt >= 0x80) {
+      dt >>= 7;
+      varint++;
+    }
+    oBytes += 1 + varint + 12;
+    char text[32];
+    uint32_t led2 = trace.rows[i * RECORD_PPG_CHANNELS + 1] & 0xFFFFFF;
+    uint32_t led1 = trace.rows[i * RECORD_PPG_CHANNELS + 2] & 0xFFFFFF;
+    textBytes += snprintf(text, sizeof(text), "P:%u\n", (led1 + led2) / 2);
+  }
+
+  std::vector<uint8_t> coded(blocks * (REC_PPG_BLOCK_HEADER + RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS * 4 + 8));
+  std::vector<size_t> offsets(blocks + 1);
+  static const int rounds = 20;
+  double encodeNs = 0, decodeNs = 0;
+  uint64_t encodeCycles = 0, decodeCycles = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    double start = hostNanos();
+    uint64_t c0 = hostCycles();
+    size_t offset = 0;
+    for (size_t b = 0; b < blocks; b++) {
+      offsets[b] = offset;
+      offset += encodeBlock(&planar[b * RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS], counts[b], &coded[offset]);
+    }
+    offsets[blocks] = offset;
+    encodeCycles += hostCycles() - c0;
+    encodeNs += hostNanos() - start;
+  }
+
+  int32_t decoded[RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS];
+  size_t mismatches = 0;
+  for (int r = 0; r < rounds; r++) {
+    double start = hostNanos();
+    uint64_t c0 = hostCycles();
+    for (size_t b = 0; b < blocks; b++) {
+      RiceReader reader;
+      riceReaderInit(&reader, &coded[offsets[b]] + REC_PPG_BLOCK_HEADER, &coded[offsets[b + 1]]);
+      for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+        riceDecode(&reader, decoded + c * counts[b], counts[b], c ? 24 : 32);
+      }
+      if (r == 0 && memcmp(decoded, &planar[b * RECORD_PPG_BLOCK * RECORD_PPG_CHANNELS],
+                           counts[b] * RECORD_PPG_CHANNELS * sizeof(int32_t))) {
+        mismatches++;
+      }
+    }
+    decodeCycles += hostCycles() - c0;
+    decodeNs += hostNanos() - start;
+  }
+
+  size_t qBytes = offsets[blocks];
+  double perSample = (double) rounds * samples;
+  printf("ppg: %zu samples in %zu Q blocks (%s)\n", samples, blocks, ppgTracePath ? ppgTracePath : "sim AFE, 10 minutes");
+  printf("                 bytes   per sample   vs O records\n");
+  printf("  O records  %10zu   %10.2f   %11.2fx\n", oBytes, (double) oBytes / samples, 1.0);
+  printf("  Q blocks   %10zu   %10.2f   %11.2fx\n", qBytes, (double) qBytes / samples, (double) oBytes / qBytes);
+  printf("  text P:    %10zu   %10.2f   (one channel)\n", textBytes, (double) textBytes / samples);
+  printf("  per sample (host)   encode %.1f ns / %.0f cycles, decode %.1f ns / %.0f cycles\n",
+         encodeNs / perSample, encodeCycles / perSample, decodeNs / perSample, decodeCycles / perSample);
+  printf("  64MB chip holds %.1f hours of PPG as Q blocks, %.1f as O records\n",
+         SIM_FLASH_CAPACITY / (qBytes / (double) samples * 100.0) / 3600.0,
+         SIM_FLASH_CAPACITY / (oBytes / (double) samples * 100.0) / 3600.0);
+
+  if (mismatches) {
+    printf("  FAIL: %zu blocks did not decode to the original samples\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
+
+/*============================================
+=                   main                     =
+==============================================*/
+
+struct Bench {
+  const char *name;
+  int (*run)(void);
+};
+
+/*============================================
+=                   format                   =
+==============================================*/
+
+// the A: line as main.cpp built it before Format.h
+static String legacyAccelLine(const MPUSample *sample) {
+  return "A:" + (String(sample->accel[0]) + ":" + String(sample->accel[1]) + ":" + String(sample->accel[2]));
+}
+
+static int benchFormat(void) {
+  static const int lines = 200000;
+  std::vector<MPUSample> samples(lines);
+  uint32_t rng = 1;
+  for (int i = 0; i < lines; i++) {
+    for (int k = 0; k < 3; k++) {
+      rng = rng * 1664525u + 1013904223u;
+      samples[i].accel[k] = (int16_t) (rng >> 16);
+    }
+  }
+
+  size_t mismatches = 0;
+  size_t bytes = 0;
+  uint64_t allocations = simStringHeap.allocations;
+  double start = hostNanos();
+  for (int i = 0; i < lines; i++) bytes += legacyAccelLine(&samples[i]).length();
+  double legacyNs = (hostNanos() - start) / lines;
+  double legacyAllocations = (double) (simStringHeap.allocations - allocations) / lines;
+
+  allocations = simStringHeap.allocations;
+  char line[FORMAT_LINE_MAX];
+  start = hostNanos();
+  for (int i = 0; i < lines; i++) bytes += formatMPUData(formatText(line, "A:"), &samples[i]) - line;
+  double formatNs = (hostNanos() - start) / lines;
+  double formatAllocations = (double) (simStringHeap.allocations - allocations) / lines;
+
+  for (int i = 0; i < lines; i++) {
+    String legacy = legacyAccelLine(&samples[i]);
+    char *end = formatMPUData(formatText(line, "A:"), &samples[i]);
+    if (legacy.length() != (unsigned) (end - line) || memcmp(legacy.c_str(), line, end - line)) mismatches++;
+  }
+
+  printf("format: legacy A: lines, %d random samples (%zu bytes)\n", lines, bytes / 2);
+  printf("                  ns/line   heap allocations/line\n");
+  printf("  String         %8.1f   %21.2f\n", legacyNs, legacyAllocations);
+  printf("  Format.h       %8.1f   %21.2f\n", formatNs, formatAllocations);
+  printf("  %zu lines differ\n", mismatches);
+  return mismatches ? 1 : 0;
+}
+
+static const Bench benches[] = {
+  { "append", benchAppend },
+  { "dmp", benchDMP },
+  { "ppg", benchPPG },
+  { "format", benchFormat },
+};
+
+int main(int argc, char **argv) {
+  int count = sizeof(benches) / sizeof(benches[0]);
+  int status = 0;
+  bool ran = false;
+
+  // the argument after ppg is its trace, unless it names a bench
+  for (int a = 2; a < argc; a++) {
+    bool bench = false;
+    for (int i = 0; i < count; i++) bench |= !strcmp(argv[a], benches[i].name);
+    if (!bench && !strcmp(argv[a - 1], "ppg")) ppgTracePath = argv[a];
+  }
+
+  for (int i = 0; i < count; i++) {
+    bool selected = argc < 2;
+    for (int a = 1; a < argc; a++) {
+      if (!strcmp(argv[a], benches[i].name)) selected = true;
+    }
+    if (!selected) continue;
+    if (ran) printf("\n");
+    status |= benches[i].run();
+    ran = true;
+  }
+
+  if (!ran) {
+    fprintf(stderr, "usage: senti-bench [");
+    for (int i = 0; i < count; i++) fprintf(stderr, "%s%s", i ? "|" : "", benches[i].name);
+    fprintf(stderr, "]... (ppg takes an optional sentidecode --csv trace)\n");
+    return 2;
+  }
+  return status;
+}
@@ -0,0 +1,75 @@
+#ifndef SIM_HELPER_3DMATH_H
+#define SIM_HELPER_3DMATH_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*============================================================================
+=  Same arithmetic as helper_3dmath.h from the i2cdevlib MPU6050 library,   =
+=  so the float DMP path behaves identically on the host.                   =
+==============================================================================*/
+
+class Quaternion {
+ public:
+  float w, x, y, z;
+
+  Quaternion() : w(1.0f), x(0.0f), y(0.0f), z(0.0f) {}
+  Quaternion(float nw, float nx, float ny, float nz) : w(nw), x(nx), y(ny), z(nz) {}
+
+  Quaternion getProduct(Quaternion q) {
+    return Quaternion(
+      w*q.w - x*q.x - y*q.y - z*q.z,
+      w*q.x + x*q.w + y*q.z - z*q.y,
+      w*q.y - x*q.z + y*q.w + z*q.x,
+      w*q.z + x*q.y - y*q.x + z*q.w);
+  }
+
+  Quaternion getConjugate() {
+    return Quaternion(w, -x, -y, -z);
+  }
+
+  float getMagnitude() {
+    return sqrt(w*w + x*x + y*y + z*z);
+  }
+
+  void normalize() {
+    float m = getMagnitude();
+    w /= m; x /= m; y /= m; z /= m;
+  }
+};
+
+class VectorInt16 {
+ public:
+  int16_t x, y, z;
+
+  VectorInt16() : x(0), y(0), z(0) {}
+  VectorInt16(int16_t nx, int16_t ny, int16_t nz) : x(nx), y(ny), z(nz) {}
+
+  void rotate(Quaternion *q) {
+    Quaternion p(0, x, y, z);
+    p = q->getProduct(p);
+    p = p.getProduct(q->getConjugate());
+    x = p.x;
+    y = p.y;
+    z = p.z;
+  }
+};
+
+class VectorFloat {
+ public:
+  float x, y, z;
+
+  VectorFloat() : x(0), y(0), z(0) {}
+  VectorFloat(float nx, float ny, float nz) : x(nx), y(ny), z(nz) {}
+
+  void rotate(Quaternion *q) {
+    Quaternion p(0, x, y, z);
+    p = q->getProduct(p);
+    p = p.getProduct(q->getConjugate());
+    x = p.x;
+    y = p.y;
+    z = p.z;
+  }
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "Sim.h"
+#include "SimDevices.h"
+#include "offloadtest.h"
+#include "../Memory.h"
+#include "../tools/OffloadClient.h"
+
+// bytes back from the device that are damaged, and that start a lost run
+static const uint32_t CORRUPT_ONE_IN = 200000;
+static const uint32_t DROP_ONE_IN = 500000;
+static const uint32_t DROP_RUN = 300;
+
+struct LoopbackLink {
+  void (*step)(void);
+  std::string fromDevice;
+  uint32_t rng;
+  uint32_t dropping;      // bytes of a lost run still to go
+  uint64_t wireBytes;
+  uint32_t corrupted;
+  uint32_t dropped;
+};
+
+static LoopbackLink loopback;
+
+static uint32_t nextRandom(void) {
+  loopback.rng ^= loopback.rng << 13;
+  loopback.rng ^= loopback.rng >> 17;
+  loopback.rng ^= loopback.rng << 5;
+  return loopback.rng;
+}
+
+// device to host, with damage on the way
+static void capture(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    loopback.wireBytes++;
+    if (loopback.dropping) {
+      loopback.dropping--;
+      continue;
+    }
+    uint8_t c = data[i];
+    if (nextRandom() % DROP_ONE_IN == 0) {
+      loopback.dropping = DROP_RUN;
+      loopback.dropped++;
+      continue;
+    }
+    if (nextRandom() % CORRUPT_ONE_IN == 0) {
+      c ^= 1 << (nextRandom() % 8);
+      loopback.corrupted++;
+    }
+    loopback.fromDevice += (char) c;
+  }
+}
+
+static void linkSend(void *context, const uint8_t *data, size_t len) {
+  (void) context;
+  SerialUSB.hostInject(data, len);
+}
+
+// run the firmware until it has answered, or for timeoutMs of virtual time
+static size_t linkReceive(void *context, uint8_t *data, size_t len, int timeoutMs) {
+  (void) context;
+  uint64_t until = simNowNanos() + (uint64_t) timeoutMs * 1000000ULL;
+  while (loopback.fromDevice.empty() && simNowNanos() < until) loopback.step();
+
+  size_t n = loopback.fromDevice.size() < len ? loopback.fromDevice.size() : len;
+  memcpy(data, loopback.fromDevice.data(), n);
+  loopback.fromDevice.erase(0, n);
+  return n;
+}
+
+struct Image {
+  std::vector<uint8_t> bytes;
+  uint32_t stopAt;        // sink gives up here, as if the cable came out
+};
+
+static bool imageSink(void *context, uint32_t offset, const uint8_t *data, uint32_t length) {
+  Image *image = (Image *) context;
+  if (offset >= image->stopAt) return false;
+  if (image->bytes.size() != offset) return false;
+  if (data) image->bytes.insert(image->bytes.end(), data, data + length);
+  else image->bytes.insert(image->bytes.end(), length, 0xFF);
+  return true;
+}
+
+static int check(bool ok, const char *what) {
+  printf("  %-52s %s\n", what, ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+static bool matchesChip(const std::vector<uint8_t> &bytes, uint32_t chip) {
+  SimFlashChip *flash = simFlashChipIfUsed(chip);
+  return flash && bytes.size() <= flash->capacity() && !memcmp(&bytes[0], flash->data(), bytes.size());
+}
+
+static bool chipErased(uint32_t chip) {
+  SimFlashChip *flash = simFlashChipIfUsed(chip);
+  if (!flash) return false;
+  for (uint32_t i = 0; i < flash->capacity(); i++) {
+    if (flash->data()[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+/**
+Read the stats and list, which leave recording going, then pull each
+chip's store (the first one cut off half way and resumed), pull a whole
+chip, erase, then turn recording back on into the empty store. Virtual time covers the flash reads; USB transfer time is not
+modelled.
+**/
+int offloadLoopbackTest(void (*step)(void), uint32_t seed) {
+  loopback.step = step;
+  loopback.rng = seed * 2654435761u + 1;
+  SerialUSB.hostCapture(capture);
+  simSetDeadline(0);
+
+  OffloadLink link = { NULL, linkSend, linkReceive };
+  OffloadClient client;
+  offloadClientInit(&client, link);
+  int failed = 0;
+
+  printf("\noffload loopback\n");
+  MemStoreInfo before, after;
+  memStoreInfo(&before);
+  StatsSnapshot stats;
+  bool counted = offloadStats(&client, &stats);
+  memStoreInfo(&after);
+  // the simulated AFE may have raised another ADC_RDY or two since
+  uint32_t produced = stats.produced[STORE_STREAM_PPG];
+  failed += check(counted && produced <= simStreamPPG.produced && produced + 2 >= simStreamPPG.produced &&
+                  !stats.missed[STORE_STREAM_PPG] && after.recording == before.recording,
+                  "stats count every ADC_RDY, recording goes on");
+
+  OffloadInfo info;
+  std::vector<OffloadSegment> segments;
+  bool listed = offloadList(&client, &info, &segments);
+  memStoreInfo(&after);
+  failed += check(listed && after.recording == before.recording, "list, recording goes on");
+  if (!listed) return failed;
+  uint32_t kept = info.headSequence - info.tailSequence + (info.headPages ? 1 : 0);
+  failed += check(segments.size() == kept, "one header per segment kept");
+  bool valid = true;
+  for (size_t i = 0; i < segments.size(); i++) {
+    valid = valid && storeSegmentValid(&segments[i].header) &&
+            segments[i].header.sequence == info.tailSequence + i;
+  }
+  failed += check(valid, "headers valid and in sequence");
+
+  // every segment but the one being written has its summary
+  bool summarised = !segments.empty();
+  for (size_t i = 0; i + 1 < segments.size(); i++) {
+    const StoreSegmentSummary &summary = segments[i].summary;
+    summarised = summarised && storeSummaryValid(&summary) && summary.first <= summary.last &&
+                 summary.samples[STORE_STREAM_PPG] && summary.samples[STORE_STREAM_ACCEL];
+  }
+  failed += check(summarised, "closed segments summarised");
+
+  // a minute from the middle of the recording
+  const OffloadSegment &middle = segments[segments.size() / 2];
+  uint32_t from = storeSegmentStart(&middle.header, &middle.summary) + 30;
+  uint32_t to = from + 60;
+  std::vector<uint32_t> expected, found;
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (storeSegmentEnd(&segments[i].summary) >= from &&
+        storeSegmentStart(&segments[i].header, &segments[i].summary) <= to) {
+      expected.push_back(segments[i].block);
+    }
+  }
+  std::vector<OffloadSegment> inRange;
+  OffloadInfo findInfo;
+  bool searched = offloadFind(&client, from, to, &findInfo, &inRange);
+  for (size_t i = 0; i < inRange.size(); i++) found.push_back(inRange[i].block);
+  char what[64];
+  snprintf(what, sizeof(what), "find a minute: %zu of %zu segments", found.size(), segments.size());
+  failed += check(searched && !found.empty() && found == expected, what);
+
+  uint32_t extent = offloadExtent(info);
+  uint64_t pulled = 0;
+  uint64_t startNs = simNowNanos();
+  double hostStart = (double) clock() / CLOCKS_PER_SEC;
+  for (uint32_t chip = 0; chip < info.chips; chip++) {
+    Image image;
+    image.stopAt = chip == 0 ? extent / 2 : extent;
+    bool ok = offloadRead(&client, chip, 0, extent, imageSink, &image);
+    if (chip == 0) {
+      failed += check(!ok && image.bytes.size() >= extent / 2, "pull cut off half way");
+      image.stopAt = extent;
+      ok = offloadRead(&client, chip, image.bytes.size(), extent, imageSink, &image);
+    }
+    snprintf(what, sizeof(what), "chip %u: %u store bytes match the flash", chip, extent);
+    failed += check(ok && image.bytes.size() == extent && matchesChip(image.bytes, chip), what);
+    pulled += image.bytes.size();
+  }
+
+  Image whole;
+  whole.stopAt = info.blocks * info.blockSize;
+  bool ok = offloadRead(&client, info.chips - 1, 0, whole.stopAt, imageSink, &whole);
+  failed += check(ok && whole.bytes.size() == whole.stopAt && matchesChip(whole.bytes, info.chips - 1),
+                  "whole last chip matches the flash");
+  pulled += whole.bytes.size();
+
+  double seconds = (simNowNanos() - startNs) / 1e9;
+  double host = (double) clock() / CLOCKS_PER_SEC - hostStart;
+  printf("  pulled %.1f MB in %.2f s virtual (%.2f MB/s), %.2f s host; %llu bytes on the wire\n",
+         pulled / 1048576.0, seconds, seconds > 0 ? pulled / 1048576.0 / seconds : 0.0, host,
+         (unsigned long long) loopback.wireBytes);
+  printf("  %u bytes damaged, %u runs lost: %u frames failed crc, %u reads resumed\n", loopback.corrupted,
+         loopback.dropped, client.badFrames, client.resumes);
+
+  failed += check(offloadErase(&client), "erase");
+  bool erased = true;
+  for (uint32_t chip = 0; chip < info.chips; chip++) erased = erased && chipErased(chip);
+  failed += check(erased, "chips read back erased");
+
+  memStoreInfo(&after);
+  failed += check(!after.recording && offloadRecord(&client, true), "recording stays off until turned on");
+  uint64_t until = simNowNanos() + 5000000000ULL;
+  while (simNowNanos() < until) step();
+  listed = offloadList(&client, &info, &segments);
+  failed += check(listed && segments.size() == 1 && segments[0].header.sequence == 1 && info.headPages > 1,
+                  "recording starts over in an empty store");
+  return failed;
+}
@@ -0,0 +1,15 @@
+#ifndef SIM_OFFLOAD_TEST_H
+#define SIM_OFFLOAD_TEST_H
+
+#include <stdint.h>
+
+/*============================================================================
+=  Loopback test of the offload protocol: tools/OffloadClient talks to the  =
+=  firmware through the simulated SerialUSB, with damaged and lost bytes    =
+=  on the way back, and what it pulls is checked against the flash images.  =
+==============================================================================*/
+
+// step runs loop() once; returns the number of checks that failed
+int offloadLoopbackTest(void (*step)(void), uint32_t seed);
+
+#endif
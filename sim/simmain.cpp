@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Arduino.h"
+#include "Sim.h"
+#include "SimDevices.h"
+#include "offloadtest.h"
+#include "../PPG.h"
+#include "../MPU.h"
+#include "../EDA.h"
+#include "../Memory.h"
+#include "../RTCtime.h"
+#include "../HAL.h"
+#include "../Power.h"
+#include "../Stats.h"
+
+/*============================================================================
+=  senti-sim: runs the firmware's setup()/loop() against the simulated      =
+=  board for a fixed span of virtual time and reports sample throughput,    =
+=  loop() latency and flash throughput. Virtual time covers bus, ADC,       =
+=  flash and delay() time; CPU time between them is reported from the host  =
+=  clock separately. The firmware's own duty cycle accounting is reported   =
+=  with the MCU current it implies.                                         =
+==============================================================================*/
+
+struct SimOptions {
+  double seconds;
+  const char *image1;
+  const char *image2;
+  const char *rtcState;
+  bool erase;
+  bool record;
+  bool serial;
+  uint32_t seed;
+  double rtcPpm;
+  bool check;
+  double stallMs;
+  bool circular;
+  uint32_t retainSeconds;
+  uint32_t retainKB;
+  double stopAfter;
+  double mpuNackAfter;
+  bool offloadTest;
+};
+
+struct LoopStats {
+  uint64_t iterations;
+  uint64_t busyIterations;
+  uint64_t busyNs;
+  uint64_t maxNs;
+  uint64_t hostNs;
+  uint64_t maxHostNs;
+  int maxPending;            // committed bytes waiting for flash, of both buffers
+  uint64_t flushStartNs;
+  uint64_t maxFlushNs;       // longest a committed page waited to reach flash
+};
+
+static SimOptions options = { 60.0, "senti-flash.img", "senti-flash-2.img", "senti-rtc.state", false, true, false, 1, 20.0, false, 0.0,
+                              false, 0, 0, 0.0, 0.0, false };
+static LoopStats loopStats;
+static double hostStart;
+
+static double hostSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: senti-sim [options]\n"
+    "  --seconds N     virtual seconds to simulate (default 60)\n"
+    "  --image PATH    flash image for the chip on CS %d (default senti-flash.img)\n"
+    "  --image2 PATH   flash image for the chip on CS %d (default senti-flash-2.img)\n"
+    "  --rtc-state PATH\n"
+    "                  RTC time kept between runs (default senti-rtc.state)\n"
+    "  --erase         start from erased flash images and a stopped RTC\n"
+    "  --no-record     leave recording disabled after setup()\n"
+    "  --serial        echo firmware serial output to stderr\n"
+    "  --seed N        sensor noise seed (default 1)\n"
+    "  --rtc-ppm X     RTC crystal error in ppm (default 20)\n"
+    "  --check         exit 1 if any PPG sample or log record was lost\n"
+    "  --stall MS      stall loop() for MS once a second (storage hiccup)\n"
+    "  --circular      reuse the oldest segments once the flash is full\n"
+    "  --retain-seconds N, --retain-kb N\n"
+    "                  retention window for --circular\n"
+    "  --stop-after S  stop recording after S virtual seconds\n"
+    "  --mpu-nack S    the MPU stops answering on I2C after S virtual seconds\n"
+    "  --offload-test  then pull the flash over the offload protocol and check it\n",
+    FlashChipSelect1, FlashChipSelect2);
+  exit(2);
+}
+
+static void parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (!strcmp(arg, "--seconds") && value) options.seconds = atof(argv[++i]);
+    else if (!strcmp(arg, "--image") && value) options.image1 = argv[++i];
+    else if (!strcmp(arg, "--image2") && value) options.image2 = argv[++i];
+    else if (!strcmp(arg, "--rtc-state") && value) options.rtcState = argv[++i];
+    else if (!strcmp(arg, "--erase")) options.erase = true;
+    else if (!strcmp(arg, "--no-record")) options.record = false;
+    else if (!strcmp(arg, "--serial")) options.serial = true;
+    else if (!strcmp(arg, "--seed") && value) options.seed = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--rtc-ppm") && value) options.rtcPpm = atof(argv[++i]);
+    else if (!strcmp(arg, "--check")) options.check = true;
+    else if (!strcmp(arg, "--stall") && value) options.stallMs = atof(argv[++i]);
+    else if (!strcmp(arg, "--circular")) options.circular = true;
+    else if (!strcmp(arg, "--retain-seconds") && value) options.retainSeconds = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--retain-kb") && value) options.retainKB = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(arg, "--stop-after") && value) options.stopAfter = atof(argv[++i]);
+    else if (!strcmp(arg, "--mpu-nack") && value) options.mpuNackAfter = atof(argv[++i]);
+    else if (!strcmp(arg, "--offload-test")) options.offloadTest = true;
+    else usage();
+  }
+}
+
+static uint64_t streamLost(const SimStreamStats &s) {
+  if (s.consumed + s.dropped > s.produced) return 0;
+  return s.produced - s.consumed - s.dropped;
+}
+
+static void reportStream(const SimStreamStats &s, double seconds) {
+  uint64_t lost = streamLost(s);
+  printf("  %-6s %10llu %10llu %10llu %10llu %12.2f\n", s.name,
+         (unsigned long long) s.produced, (unsigned long long) s.consumed,
+         (unsigned long long) s.dropped, (unsigned long long) lost,
+         seconds > 0 ? s.consumed / seconds : 0.0);
+}
+
+static void reportRing(const char *name, int capacity, uint16_t highWater, uint32_t overflows) {
+  printf("  %-10s %10d %10u %10u\n", name, capacity, highWater, overflows);
+}
+
+static void reportFlash(const SimFlashChip *chip, double seconds) {
+  const SimFlashStats &f = chip->stats;
+  printf("  CS %d   programmed %llu bytes in %u page programs, %u block erases, read %llu bytes\n",
+         chip->chipSelect(), (unsigned long long) f.bytesProgrammed, f.pagePrograms, f.blockErases,
+         (unsigned long long) f.bytesRead);
+  printf("         array busy %.1f ms, callers blocked %.1f ms (longest %.2f ms)\n",
+         f.busyNs / 1e6, f.waitNs / 1e6, f.maxWaitNs / 1e6);
+  printf("         sustained write %.2f KB/s, while programming %.2f KB/s\n",
+         seconds > 0 ? f.bytesProgrammed / seconds / 1024.0 : 0.0,
+         f.busyNs ? f.bytesProgrammed / (f.busyNs / 1e9) / 1024.0 : 0.0);
+}
+
+/**
+Duty cycle as the firmware accounts it, and what it would cost at the
+assumed SAMD21 supply currents
+**/
+static void reportPower(void) {
+  PowerStats p;
+  powerStats(&p);
+  double active = p.activeTicks / (double) HAL_TICK_HZ;
+  double asleep = p.sleepTicks / (double) HAL_TICK_HZ;
+  double total = active + asleep;
+  uint64_t samples = simStreamPPG.consumed + simStreamMPU.consumed + simStreamEDA.consumed;
+  double joules = (active * SIM_MCU_ACTIVE_MA + asleep * SIM_MCU_IDLE_MA) / 1e3 * SIM_SUPPLY_V;
+
+  printf("\npower (POWER_SLEEP %d)\n", POWER_SLEEP);
+  printf("  active %.2f%% of %.3f s, %u wakes (%.1f/s)\n", total > 0 ? 100.0 * active / total : 0.0, total,
+         p.wakes, total > 0 ? p.wakes / total : 0.0);
+  if (p.wakes) {
+    printf("  per wake active avg %.1f us, max %.1f us; asleep avg %.1f us, max %.1f us\n",
+           active * 1e6 / p.wakes, p.longestActive * 1e6 / HAL_TICK_HZ, asleep * 1e6 / p.wakes,
+           p.longestSleep * 1e6 / HAL_TICK_HZ);
+  }
+  printf("  MCU %.2f mA average, %.2f uJ per sample (%.1f mA active, %.1f mA idle at %.1f V)\n",
+         total > 0 ? joules / total / SIM_SUPPLY_V * 1e3 : 0.0, samples ? joules * 1e6 / samples : 0.0,
+         SIM_MCU_ACTIVE_MA, SIM_MCU_IDLE_MA, SIM_SUPPLY_V);
+}
+
+/**
+What the firmware counted itself, to hold against the simulator's own
+figures above; the worst cases cover the time since its last C record
+**/
+static void reportStats(void) {
+  static const char *const names[STORE_STREAMS] = { "PPG", "accel", "EDA" };
+  StatsSnapshot s;
+  statsRead(&s, false);
+
+  printf("\nfirmware stats   produced   consumed  overflows     missed  worst latency\n");
+  for (int i = 0; i < STORE_STREAMS; i++) {
+    printf("  %-10s %10u %10u %10u %10u %11.1f ms\n", names[i], s.produced[i], s.consumed[i], s.overflows[i],
+           s.missed[i], s.latency[i] / 1e3);
+  }
+  printf("  %u MPU FIFO resets, %u pages flushed (longest %.2f ms), longest memService() step %.2f ms\n",
+         s.fifoResets, s.flushes, s.flushLongest / 1e3, s.serviceLongest / 1e3);
+  printf("  %u SPI bus requests waited for loop() to let go of the bus (longest %.3f ms)\n", s.busWaits,
+         s.busWaitLongest / 1e3);
+}
+
+/**
+What the firmware's Strings would take from the board's heap
+**/
+static void reportHeap(void) {
+  HalHeap heap;
+  halHeap(&heap);
+  uint64_t samples = simStreamPPG.consumed + simStreamMPU.consumed + simStreamEDA.consumed;
+  printf("\nheap (String)\n");
+  printf("  %llu allocations, %.2f per sample; high water %u bytes, %u in use\n",
+         (unsigned long long) simStringHeap.allocations, samples ? (double) simStringHeap.allocations / samples : 0.0,
+         heap.highWater, heap.inUse);
+}
+
+static void report(void) {
+  double seconds = simNowNanos() / 1e9;
+  double host = hostSeconds() - hostStart;
+
+  printf("senti-sim: %.3f s simulated in %.3f s host (%.1fx real time)\n\n",
+         seconds, host, host > 0 ? seconds / host : 0.0);
+
+  printf("  stream   produced   consumed    dropped       lost   consumed/s\n");
+  reportStream(simStreamPPG, seconds);
+  reportStream(simStreamMPU, seconds);
+  reportStream(simStreamEDA, seconds);
+
+  printf("\nloop()\n");
+  printf("  %llu iterations, %llu did work\n",
+         (unsigned long long) loopStats.iterations, (unsigned long long) loopStats.busyIterations);
+  if (loopStats.busyIterations) {
+    printf("  virtual latency avg %.1f us, max %.1f us\n",
+           loopStats.busyNs / 1e3 / loopStats.busyIterations, loopStats.maxNs / 1e3);
+    printf("  host cpu avg %.2f us, max %.2f us\n",
+           loopStats.hostNs / 1e3 / loopStats.busyIterations, loopStats.maxHostNs / 1e3);
+  }
+
+  reportPower();
+  reportStats();
+  reportHeap();
+
+  printf("\nsample rings   capacity high water  overflows\n");
+  reportRing("PPG", PPG_RING_SIZE, PPGRing.highWater, PPGRing.overflows);
+  reportRing("MPU", MPU_RING_SIZE, MPURing.highWater, MPURing.overflows);
+  reportRing("EDA", EDA_RING_SIZE, EDARing.highWater, EDARing.overflows);
+
+  printf("\nlog buffers\n");
+  printf("  %lu records dropped, most waiting for flash %d of %d bytes\n",
+         memDroppedRecords(), loopStats.maxPending, 2 * memBufferSize);
+  printf("  longest flush %.2f ms from a page due to it programmed\n", loopStats.maxFlushNs / 1e6);
+  printf("  %d committed bytes not on flash at the end\n", memPendingBytes());
+
+  printf("\nflash\n");
+  for (int i = 0; i < 2; i++) {
+    SimFlashChip *chip = simFlashChipIfUsed(i);
+    if (chip) reportFlash(chip, seconds);
+  }
+
+  printf("\nrtc\n");
+  printf("  crystal %+.2f ppm, %+.2f ppm after calibration, last estimate %+.2f ppm\n",
+         options.rtcPpm, simRTCDriftPpm(), RTCdriftPpb() / 1000.0);
+
+  printf("\nbuses\n");
+  printf("  SPI %llu bytes (%.1f ms), I2C %llu bytes (%.1f ms), %u ADC conversions\n",
+         (unsigned long long) simStats.spiBytes, simStats.spiBusyNs / 1e6,
+         (unsigned long long) simStats.i2cBytes, simStats.i2cBusyNs / 1e6, simStats.adcConversions);
+  printf("  MISO contention %u, AFE writes ignored in SPI_READ mode %u\n",
+         simStats.spiContention, simAFEIgnoredWrites());
+
+  printf("\ninterrupts       raised   serviced  coalesced  max latency\n");
+  for (int i = 0; i < simIRQCount(); i++) {
+    const SimIRQStats *s = simIRQStats(i);
+    printf("  %-10s %10u %10u %10u %10.1f us\n", s->name, s->raised, s->serviced, s->lost,
+           s->maxLatencyNs / 1e3);
+  }
+  fflush(stdout);
+}
+
+static void stuck(void) {
+  report();
+  fprintf(stderr, "senti-sim: firmware stopped returning from loop()\n");
+}
+
+static uint64_t nextStallNs = 1000000000ULL;
+static uint64_t stopNs = 0;
+static uint64_t mpuNackNs = 0;
+
+/**
+One pass of loop() with its bookkeeping; an idle pass that did not sleep
+itself lets virtual time run on to the next device event, as polling would
+**/
+static void step(void) {
+  if (options.stallMs > 0 && simNowNanos() >= nextStallNs) {
+    // interrupts keep firing while loop() is held up
+    simAdvanceNanos((uint64_t) (options.stallMs * 1e6));
+    nextStallNs += 1000000000ULL;
+  }
+  if (stopNs && simNowNanos() >= stopNs) {
+    setShouldRecordData(false);
+    stopNs = 0;
+  }
+  if (mpuNackNs && simNowNanos() >= mpuNackNs) {
+    // its DMP keeps raising INT, but every read of it now fails
+    simI2CAttach(MPU_I2C_ADDR, NULL);
+    mpuNackNs = 0;
+  }
+
+  uint64_t ops = simStats.busOps;
+  uint64_t start = simNowNanos();
+  PowerStats power;
+  powerStats(&power);
+  uint32_t wakes = power.wakes;
+  uint64_t sleepTicks = power.sleepTicks;
+  double hostBefore = hostSeconds();
+
+  loop();
+
+  // time asleep at the end of loop() is not latency
+  powerStats(&power);
+  uint64_t sleptNs = (power.sleepTicks - sleepTicks) * (1000000000ULL / HAL_TICK_HZ);
+
+  if (memPendingBytes() > loopStats.maxPending) loopStats.maxPending = memPendingBytes();
+  if (memFlushPending() && !loopStats.flushStartNs) {
+    loopStats.flushStartNs = start;
+  } else if (!memFlushPending() && loopStats.flushStartNs) {
+    uint64_t ns = simNowNanos() - loopStats.flushStartNs;
+    if (ns > loopStats.maxFlushNs) loopStats.maxFlushNs = ns;
+    loopStats.flushStartNs = 0;
+  }
+
+  loopStats.iterations++;
+  if (simStats.busOps != ops) {
+    uint64_t ns = simNowNanos() - start;
+    ns = ns > sleptNs ? ns - sleptNs : 0;
+    uint64_t hostNs = (uint64_t) ((hostSeconds() - hostBefore) * 1e9);
+    loopStats.busyIterations++;
+    loopStats.busyNs += ns;
+    if (ns > loopStats.maxNs) loopStats.maxNs = ns;
+    loopStats.hostNs += hostNs;
+    if (hostNs > loopStats.maxHostNs) loopStats.maxHostNs = hostNs;
+    simAdvanceNanos(SIM_LOOP_OVERHEAD_NS);
+  } else {
+    simAdvanceNanos(SIM_LOOP_OVERHEAD_NS);
+    if (power.wakes == wakes) simIdleUntilNextEvent();
+  }
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  SimSerial::echo(options.serial);
+
+  simAFEInit(PIN_SS_AFE, PIN_ADC_RDY, PIN_AFE_PDN, options.seed);
+  simMPUInit(MPU_I2C_ADDR, MPUInterruptPin, options.seed + 1);
+  simRTCInit(RTC_I2C_ADDR, options.rtcPpm, options.rtcState, options.erase);
+  simFlashAttach(FlashChipSelect1, options.image1, options.erase);
+  simFlashAttach(FlashChipSelect2, options.image2, options.erase);
+
+  simSetDeadline((uint64_t) (options.seconds * 1e9));
+  simSetStuckHandler(stuck);
+  hostStart = hostSeconds();
+
+  memSetRetention(options.circular, options.retainSeconds, options.retainKB);
+  setup();
+  if (options.record) setShouldRecordData(true);
+
+  stopNs = options.stopAfter > 0 ? (uint64_t) (options.stopAfter * 1e9) : 0;
+  mpuNackNs = options.mpuNackAfter > 0 ? (uint64_t) (options.mpuNackAfter * 1e9) : 0;
+  while (!simDeadlineReached()) step();
+
+  report();
+
+  if (options.check) {
+    uint64_t lost = streamLost(simStreamPPG) + simStreamPPG.dropped + PPGRing.overflows;
+    if (lost || memDroppedRecords()) {
+      fprintf(stderr, "senti-sim: check failed, %llu PPG samples lost, %lu log records dropped\n",
+              (unsigned long long) lost, memDroppedRecords());
+      return 1;
+    }
+  }
+
+  if (options.offloadTest) {
+    int failed = offloadLoopbackTest(step, options.seed);
+    if (failed) {
+      fprintf(stderr, "senti-sim: offload loopback test failed %d checks\n", failed);
+      return 1;
+    }
+  }
+  return 0;
+}
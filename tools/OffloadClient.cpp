@@ -0,0 +1,270 @@
+#include <string.h>
+#include "OffloadClient.h"
+
+// ACK after this many chunks, so the device never waits on a full window
+static const uint32_t ACK_EVERY = OFFLOAD_WINDOW / 4;
+// a chip erase takes minutes
+static const int ERASE_TIMEOUT_MS = 600000;
+
+enum FrameResult { FRAME_TIMEOUT, FRAME_BAD, FRAME_OK };
+
+void offloadClientInit(OffloadClient *c, const OffloadLink &link) {
+  c->link = link;
+  c->timeoutMs = 2000;
+  c->retries = 5;
+  c->rx.clear();
+  c->rxAt = 0;
+  c->badFrames = 0;
+  c->resumes = 0;
+}
+
+static void sendFrame(OffloadClient *c, uint8_t type, const void *payload, uint16_t length) {
+  uint8_t frame[OFFLOAD_FRAME_OVERHEAD + sizeof(OffloadReadRequest)];
+  OffloadFrameHeader header = { OFFLOAD_SYNC, type, length };
+  memcpy(frame, &header, sizeof(header));
+  if (length) memcpy(frame + sizeof(header), payload, length);
+  uint32_t crc = crc32(frame, sizeof(header) + length);
+  memcpy(frame + sizeof(header) + length, &crc, sizeof(crc));
+  c->link.send(c->link.context, frame, OFFLOAD_FRAME_OVERHEAD + length);
+}
+
+/**
+Next frame from the link. A frame that fails its crc loses its sync byte
+and is reported, so the caller can ask again for what it carried.
+**/
+static FrameResult receiveFrame(OffloadClient *c, uint8_t *type, std::vector<uint8_t> &payload, int timeoutMs) {
+  size_t &at = c->rxAt;
+  FrameResult result = FRAME_TIMEOUT;
+
+  for (;;) {
+    while (at < c->rx.size() && c->rx[at] != OFFLOAD_SYNC) at++;
+    size_t left = c->rx.size() - at;
+    if (left >= sizeof(OffloadFrameHeader)) {
+      OffloadFrameHeader header;
+      memcpy(&header, &c->rx[at], sizeof(header));
+      size_t frame = OFFLOAD_FRAME_OVERHEAD + header.length;
+      if (header.length > OFFLOAD_MAX_PAYLOAD) {
+        at++;
+        continue;
+      }
+      if (left >= frame) {
+        uint32_t crc;
+        memcpy(&crc, &c->rx[at + frame - sizeof(crc)], sizeof(crc));
+        if (crc == crc32(&c->rx[at], frame - sizeof(crc))) {
+          *type = header.type;
+          payload.assign(c->rx.begin() + at + sizeof(header), c->rx.begin() + at + frame - sizeof(crc));
+          at += frame;
+          result = FRAME_OK;
+        } else {
+          c->badFrames++;
+          at++;
+          result = FRAME_BAD;
+        }
+        break;
+      }
+    }
+
+    // drop what has been framed before taking in more
+    c->rx.erase(c->rx.begin(), c->rx.begin() + at);
+    at = 0;
+    uint8_t buf[65536];
+    size_t n = c->link.receive(c->link.context, buf, sizeof(buf), timeoutMs);
+    if (n == 0) break;
+    c->rx.insert(c->rx.end(), buf, buf + n);
+  }
+  return result;
+}
+
+static void sendRead(OffloadClient *c, uint32_t chip, uint32_t start, uint32_t end) {
+  OffloadReadRequest read = { (uint8_t) chip, (uint8_t) OFFLOAD_WINDOW, 0, start, end };
+  sendFrame(c, OFFLOAD_READ, &read, sizeof(read));
+}
+
+static void sendAck(OffloadClient *c, uint32_t offset) {
+  OffloadAck ack = { offset };
+  sendFrame(c, OFFLOAD_ACK, &ack, sizeof(ack));
+}
+
+/**
+Store info and the segments a list or find request answers with, oldest
+first. Asked again from the top if an answer is lost or damaged.
+**/
+static bool listSegments(OffloadClient *c, uint8_t request, const void *body, size_t length, OffloadInfo *info,
+                         std::vector<OffloadSegment> *segments) {
+  std::vector<uint8_t> payload;
+  uint8_t type;
+
+  for (int attempt = 0; attempt <= c->retries; attempt++) {
+    segments->clear();
+    bool haveInfo = false;
+    sendFrame(c, request, body, length);
+
+    FrameResult result;
+    while ((result = receiveFrame(c, &type, payload, c->timeoutMs)) == FRAME_OK) {
+      if (type == OFFLOAD_INFO && payload.size() == sizeof(*info)) {
+        memcpy(info, &payload[0], sizeof(*info));
+        haveInfo = true;
+      } else if (type == OFFLOAD_SEGMENT && payload.size() == sizeof(OffloadSegment) && haveInfo) {
+        OffloadSegment segment;
+        memcpy(&segment, &payload[0], sizeof(segment));
+        segments->push_back(segment);
+      } else if (type == OFFLOAD_DONE && payload.size() == sizeof(OffloadDone) && payload[0] == request) {
+        if (haveInfo && payload[1] == OFFLOAD_OK) return true;
+        break;
+      }
+    }
+  }
+  return false;
+}
+
+// store info and every segment kept
+bool offloadList(OffloadClient *c, OffloadInfo *info, std::vector<OffloadSegment> *segments) {
+  return listSegments(c, OFFLOAD_LIST, NULL, 0, info, segments);
+}
+
+// store info and the segments with samples from from to to, UTC seconds
+bool offloadFind(OffloadClient *c, uint32_t from, uint32_t to, OffloadInfo *info,
+                 std::vector<OffloadSegment> *segments) {
+  OffloadFindRequest find = { from, to };
+  return listSegments(c, OFFLOAD_FIND, &find, sizeof(find), info, segments);
+}
+
+/**
+Chip bytes [start, end) to sink, in order. A chunk that is damaged or
+missing, or a timeout, sends the read again from the first byte not yet
+taken; chunks still in flight from before are ignored until it arrives.
+**/
+bool offloadRead(OffloadClient *c, uint32_t chip, uint32_t start, uint32_t end, OffloadSink sink, void *context) {
+  std::vector<uint8_t> payload;
+  uint8_t type;
+  uint32_t offset = start;
+  uint32_t unacked = 0;
+  int timeouts = 0;
+  bool resuming = false;
+
+  sendRead(c, chip, offset, end);
+  while (offset < end) {
+    FrameResult result = receiveFrame(c, &type, payload, c->timeoutMs);
+    if (result != FRAME_OK) {
+      if (result == FRAME_TIMEOUT && ++timeouts > c->retries) return false;
+      if (result == FRAME_TIMEOUT || !resuming) {
+        sendRead(c, chip, offset, end);
+        c->resumes++;
+        resuming = true;
+        unacked = 0;
+      }
+      continue;
+    }
+    timeouts = 0;
+
+    if (type == OFFLOAD_DONE && payload.size() == sizeof(OffloadDone) && payload[0] == OFFLOAD_READ &&
+        payload[1] != OFFLOAD_OK) {
+      return false;
+    }
+    if (type != OFFLOAD_DATA || payload.size() < sizeof(OffloadData)) continue;
+
+    OffloadData chunk;
+    memcpy(&chunk, &payload[0], sizeof(chunk));
+    bool erased = chunk.flags & OFFLOAD_DATA_ERASED;
+    if (payload.size() != sizeof(chunk) + (erased ? 0 : chunk.length)) continue;
+
+    if (chunk.offset == offset) {
+      if (!sink(context, offset, erased ? NULL : &payload[sizeof(chunk)], chunk.length)) return false;
+      offset += chunk.length;
+      resuming = false;
+      if (++unacked >= ACK_EVERY || offset == end) {
+        sendAck(c, offset);
+        unacked = 0;
+      }
+    } else if (chunk.offset > offset && !resuming) {
+      sendRead(c, chip, offset, end);
+      c->resumes++;
+      resuming = true;
+      unacked = 0;
+    }
+  }
+
+  // the device finishes once it has the last acknowledgement; the data is
+  // all here whether or not that is heard
+  for (int attempt = 0; attempt <= c->retries; attempt++) {
+    FrameResult result;
+    while ((result = receiveFrame(c, &type, payload, c->timeoutMs)) != FRAME_TIMEOUT) {
+      if (result == FRAME_OK && type == OFFLOAD_DONE && payload.size() == sizeof(OffloadDone) &&
+          payload[0] == OFFLOAD_READ) {
+        return true;
+      }
+    }
+    sendAck(c, end);
+  }
+  return true;
+}
+
+/**
+Erase both chips. The request is sent once, as sending it again just as
+the erase finishes would start another.
+**/
+bool offloadErase(OffloadClient *c) {
+  std::vector<uint8_t> payload;
+  uint8_t type;
+  OffloadEraseRequest erase = { OFFLOAD_ERASE_KEY };
+
+  sendFrame(c, OFFLOAD_ERASE, &erase, sizeof(erase));
+  for (int waited = 0; waited < ERASE_TIMEOUT_MS; waited += c->timeoutMs) {
+    FrameResult result;
+    while ((result = receiveFrame(c, &type, payload, c->timeoutMs)) != FRAME_TIMEOUT) {
+      if (result == FRAME_OK && type == OFFLOAD_DONE && payload.size() == sizeof(OffloadDone) &&
+          payload[0] == OFFLOAD_ERASE) {
+        return payload[1] == OFFLOAD_OK;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+The device's acquisition counters; recording goes on meanwhile
+**/
+bool offloadStats(OffloadClient *c, StatsSnapshot *stats) {
+  std::vector<uint8_t> payload;
+  uint8_t type;
+
+  for (int attempt = 0; attempt <= c->retries; attempt++) {
+    sendFrame(c, OFFLOAD_STATS, NULL, 0);
+    FrameResult result;
+    while ((result = receiveFrame(c, &type, payload, c->timeoutMs)) == FRAME_OK) {
+      if (type == OFFLOAD_COUNTERS && payload.size() == sizeof(*stats)) {
+        memcpy(stats, &payload[0], sizeof(*stats));
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+Turn recording on or off; asking again after a timeout does no harm
+**/
+bool offloadRecord(OffloadClient *c, bool on) {
+  std::vector<uint8_t> payload;
+  uint8_t type;
+  OffloadRecordRequest record = { (uint8_t) on, { 0, 0, 0 } };
+
+  for (int attempt = 0; attempt <= c->retries; attempt++) {
+    sendFrame(c, OFFLOAD_RECORD, &record, sizeof(record));
+    FrameResult result;
+    while ((result = receiveFrame(c, &type, payload, c->timeoutMs)) != FRAME_TIMEOUT) {
+      if (result == FRAME_OK && type == OFFLOAD_DONE && payload.size() == sizeof(OffloadDone) &&
+          payload[0] == OFFLOAD_RECORD) {
+        return payload[1] == OFFLOAD_OK;
+      }
+    }
+  }
+  return false;
+}
+
+uint32_t offloadExtent(const OffloadInfo &info) {
+  // once circular recording has wrapped, kept segments can be anywhere
+  if (info.tail > info.head) return info.blocks * info.blockSize;
+  uint32_t last = info.headPages ? info.head : info.head - 1;
+  return (last + 1) * info.blockSize;
+}
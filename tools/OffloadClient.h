@@ -0,0 +1,48 @@
+#ifndef OFFLOAD_CLIENT_H
+#define OFFLOAD_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "../Offload.h"
+
+/*============================================================================
+=  Host side of the offload protocol (Offload.h), over any byte link: a     =
+=  serial port in sentioffload, the simulated SerialUSB in senti-sim. Calls =
+=  block until the device has answered; a read resumes on its own after     =
+=  damaged or lost chunks and timeouts.                                     =
+==============================================================================*/
+
+struct OffloadLink {
+  void *context;
+  void (*send)(void *context, const uint8_t *data, size_t len);
+  // up to len bytes, waiting at most timeoutMs for the first
+  size_t (*receive)(void *context, uint8_t *data, size_t len, int timeoutMs);
+};
+
+struct OffloadClient {
+  OffloadLink link;
+  int timeoutMs;
+  int retries;                // give up after this many timeouts in a row
+  std::vector<uint8_t> rx;    // bytes received
+  size_t rxAt;                // first not yet framed
+  uint32_t badFrames;         // failed their crc
+  uint32_t resumes;           // reads sent again from the first missing byte
+};
+
+// flash bytes arrived in order; data is NULL for an erased chunk
+typedef bool (*OffloadSink)(void *context, uint32_t offset, const uint8_t *data, uint32_t length);
+
+void offloadClientInit(OffloadClient *c, const OffloadLink &link);
+bool offloadList(OffloadClient *c, OffloadInfo *info, std::vector<OffloadSegment> *segments);
+bool offloadFind(OffloadClient *c, uint32_t from, uint32_t to, OffloadInfo *info,
+                 std::vector<OffloadSegment> *segments);
+bool offloadRead(OffloadClient *c, uint32_t chip, uint32_t start, uint32_t end, OffloadSink sink, void *context);
+bool offloadErase(OffloadClient *c);
+bool offloadStats(OffloadClient *c, StatsSnapshot *stats);
+bool offloadRecord(OffloadClient *c, bool on);
+
+// chip bytes the kept segments and the superblocks lie in, from the start
+uint32_t offloadExtent(const OffloadInfo &info);
+
+#endif
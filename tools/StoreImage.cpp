@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include "StoreImage.h"
+
+/**
+Map an image read-only, skip bytes in (e.g. a directory). An empty file
+maps as an empty image.
+**/
+bool mapImage(const char *path, size_t skip, ChipImage *image) {
+  image->data = NULL;
+  image->size = image->mapped = 0;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  if ((size_t) st.st_size > skip) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return false;
+    }
+    image->data = (const uint8_t *) map + skip;
+    image->size = st.st_size - skip;
+    image->mapped = st.st_size;
+  }
+  close(fd);
+  return true;
+}
+
+void unmapImage(ChipImage *image) {
+  if (image->mapped) munmap((void *) (image->data + image->size - image->mapped), image->mapped);
+  image->data = NULL;
+  image->size = image->mapped = 0;
+}
+
+static bool newestCheckpoint(const ChipImage &image, StoreCheckpoint *newest) {
+  bool found = false;
+  for (size_t at = 0; at + STORE_CHECKPOINT_SIZE <= image.size &&
+       at < STORE_SUPERBLOCKS * STORE_BLOCK_SIZE; at += STORE_CHECKPOINT_SIZE) {
+    StoreCheckpoint cp;
+    memcpy(&cp, image.data + at, sizeof(cp));
+    if (!storeCheckpointValid(&cp)) continue;
+    if (!found || (int32_t) (cp.sequence - newest->sequence) > 0) *newest = cp;
+    found = true;
+  }
+  return found;
+}
+
+/**
+Oldest segment the store still keeps, from its newest checkpoint; older
+ones left on the flash were given up by circular recording
+**/
+uint32_t storeTailSequence(const ChipImage &image) {
+  StoreCheckpoint newest;
+  return newestCheckpoint(image, &newest) ? newest.tailSequence : 0;
+}
+
+// chips the newest segment is striped over, 0 if the image holds no store
+uint32_t storeStripes(const ChipImage &image) {
+  StoreCheckpoint newest;
+  StoreSegmentHeader header;
+  StoreSegmentSummary summary;
+  if (!newestCheckpoint(image, &newest) || !readSegmentIndex(image, newest.segment, &header, &summary)) return 0;
+  return header.stripes;
+}
+
+// header and summary of the segment in a block; false if it has no valid header
+bool readSegmentIndex(const ChipImage &image, uint32_t block, StoreSegmentHeader *header,
+                      StoreSegmentSummary *summary) {
+  size_t at = (size_t) block * STORE_BLOCK_SIZE;
+  if (at + STORE_SEGMENT_HEADER_SIZE + sizeof(*summary) > image.size) return false;
+  memcpy(header, image.data + at, sizeof(*header));
+  memcpy(summary, image.data + at + STORE_SEGMENT_HEADER_SIZE, sizeof(*summary));
+  return storeSegmentValid(header);
+}
+
+/**
+Segments kept that may hold samples from from to to (UTC seconds), oldest
+first, as the firmware would find them: the newest checkpoint gives the
+segments kept, and the first one ending in the range is binary searched
+for by its summary, so only a few headers outside the range are read.
+probes, if given, counts the segments looked at.
+**/
+std::vector<Segment> findSegmentsInTime(const ChipImage &image, uint32_t from, uint32_t to, uint32_t *probes) {
+  std::vector<Segment> segments;
+  uint32_t looked = 0;
+  StoreCheckpoint cp;
+  uint32_t blocks = image.size / STORE_BLOCK_SIZE;
+  if (probes) *probes = 0;
+  if (blocks <= STORE_FIRST_SEGMENT || !newestCheckpoint(image, &cp)) return segments;
+
+  // segments opened after the last checkpoint, and the oldest still there
+  StoreSegmentHeader header;
+  StoreSegmentSummary summary;
+  uint32_t head = cp.segment, headSequence = cp.segmentSequence;
+  for (;;) {
+    uint32_t next = storeSegmentBlock(head, 1, blocks);
+    looked++;
+    if (!readSegmentIndex(image, next, &header, &summary) || header.sequence != headSequence + 1) break;
+    head = next;
+    headSequence++;
+  }
+  uint32_t tail = cp.tail, tailSequence = cp.tailSequence;
+  while (tailSequence != headSequence &&
+         (!readSegmentIndex(image, tail, &header, &summary) || header.sequence != tailSequence)) {
+    looked++;
+    tail = storeSegmentBlock(tail, 1, blocks);
+    tailSequence++;
+  }
+
+  uint32_t low = 0, high = headSequence - tailSequence + 1;
+  while (low < high) {
+    uint32_t middle = (low + high) / 2;
+    looked++;
+    readSegmentIndex(image, storeSegmentBlock(tail, middle, blocks), &header, &summary);
+    if (storeSegmentEnd(&summary) < from) low = middle + 1;
+    else high = middle;
+  }
+
+  for (uint32_t i = low; i <= headSequence - tailSequence; i++) {
+    uint32_t block = storeSegmentBlock(tail, i, blocks);
+    looked++;
+    if (!readSegmentIndex(image, block, &header, &summary) || header.sequence != tailSequence + i) continue;
+    if (storeSegmentStart(&header, &summary) > to) break;
+    Segment segment = { block, header.sequence, header.stripes };
+    segments.push_back(segment);
+  }
+  if (probes) *probes = looked;
+  return segments;
+}
+
+/**
+UTC time as seconds since 1970, or YYYY-MM-DD[THH:MM[:SS]] (a space in
+place of the T is taken too)
+**/
+bool parseTime(const char *text, uint32_t *seconds) {
+  char *end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (*end == 0 && end != text) {
+    *seconds = value;
+    return true;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  int n = sscanf(text, "%d-%d-%d%*1[T ]%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+                 &tm.tm_sec);
+  if (n != 3 && n < 5) return false;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  *seconds = timegm(&tm);
+  return true;
+}
+
+/**
+Record streams of the log store segments in an image, oldest first; empty
+if the image holds no store
+**/
+std::vector<Segment> findSegments(const ChipImage &image) {
+  std::vector<Segment> segments;
+  uint32_t tail = storeTailSequence(image);
+  for (size_t block = STORE_FIRST_SEGMENT * STORE_BLOCK_SIZE; block + STORE_BLOCK_SIZE <= image.size;
+       block += STORE_BLOCK_SIZE) {
+    StoreSegmentHeader header;
+    memcpy(&header, image.data + block, sizeof(header));
+    if (!storeSegmentValid(&header) || header.sequence < tail) continue;
+    Segment segment = { (uint32_t) (block / STORE_BLOCK_SIZE), header.sequence, header.stripes };
+    segments.push_back(segment);
+  }
+  std::sort(segments.begin(), segments.end(),
+            [](const Segment &a, const Segment &b) { return a.sequence < b.sequence; });
+  return segments;
+}
+
+/**
+Gather the record streams in a segment from the chip images its pages
+alternate across, reading pages up to the first erased one. A page that
+fails its crc ends the stream it was part of; pages after it are skipped
+until one starts a new stream. False if an image is missing or too short.
+**/
+bool readSegment(const ChipImage *chips, size_t count, const Segment &segment,
+                 std::vector<std::vector<uint8_t> > &streams) {
+  streams.clear();
+  if (segment.stripes > count) return false;
+  bool inStream = false;
+  for (uint32_t index = 1; index < storeSegmentPages(segment.stripes); index++) {
+    uint32_t chip;
+    uint32_t address = storeAddress(segment.block, segment.stripes, index * STORE_PAGE_SIZE, &chip);
+    if (address + STORE_PAGE_SIZE > chips[chip].size) return false;
+    const uint8_t *page = chips[chip].data + address;
+    StorePageHeader header;
+    memcpy(&header, page, sizeof(header));
+    const uint8_t *data = page + STORE_PAGE_HEADER_SIZE;
+
+    if (storePageErased(&header)) break;
+    if (!storePageValid(&header, index, data)) {
+      inStream = false;
+      continue;
+    }
+    if (header.flags & STORE_PAGE_STREAM_START) {
+      streams.push_back(std::vector<uint8_t>());
+      inStream = true;
+    }
+    if (inStream) streams.back().insert(streams.back().end(), data, data + header.length);
+  }
+  return true;
+}
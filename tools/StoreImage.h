@@ -0,0 +1,42 @@
+#ifndef STORE_IMAGE_H
+#define STORE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "../Store.h"
+
+/*============================================================================
+=  Reading the log store (Store.h) out of flash images, for the host tools. =
+=  Images are memory-mapped read-only; a store striped over two chips needs =
+=  the image of each.                                                       =
+==============================================================================*/
+
+struct ChipImage {
+  const uint8_t *data;
+  size_t size;
+  size_t mapped;     // bytes mapped from the start of the file
+};
+
+struct Segment {
+  uint32_t block;
+  uint32_t sequence;
+  uint32_t stripes;
+};
+
+bool mapImage(const char *path, size_t skip, ChipImage *image);
+void unmapImage(ChipImage *image);
+
+uint32_t storeTailSequence(const ChipImage &image);
+uint32_t storeStripes(const ChipImage &image);
+std::vector<Segment> findSegments(const ChipImage &image);
+bool readSegmentIndex(const ChipImage &image, uint32_t block, StoreSegmentHeader *header,
+                      StoreSegmentSummary *summary);
+std::vector<Segment> findSegmentsInTime(const ChipImage &image, uint32_t from, uint32_t to,
+                                        uint32_t *probes = NULL);
+bool readSegment(const ChipImage *chips, size_t count, const Segment &segment,
+                 std::vector<std::vector<uint8_t> > &streams);
+
+bool parseTime(const char *text, uint32_t *seconds);
+
+#endif
@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "../Record.h"
+#include "../Rice.h"
+#include "../Stats.h"
+#include "../Store.h"
+#include "StoreImage.h"
+
+/*============================================================================
+=  sentidecode: turns binary log files (Record.h) back into text. A flash   =
+=  image holding a log store (Store.h) is decoded segment by segment in     =
+=  sequence order, each record stream in a segment on its own; a store      =
+=  striped over two chips takes both images, the CS 7 one first. Anything   =
+=  else is read in file-size chunks, so one 16KB file or several            =
+=  concatenated ones can be given; chunks that do not start with an S       =
+=  record are skipped.                                                      =
+=                                                                           =
+=  Default output is the legacy "E:/A:/P:/T:" lines the analysis pipeline   =
+=  already parses. --csv prints one sample per line with its tick and the   =
+=  wall clock interpolated from the last T anchor; PPG phases (O records    =
+=  and Q blocks) keep all four signed channels there as stream O. --stats   =
+=  prints the C records of acquisition counters instead of the samples.     =
+==============================================================================*/
+
+struct Anchor {
+  bool valid;
+  uint32_t tick;
+  time_t wall;   // anchor wall clock, as UTC seconds
+  int millis;    // and the milliseconds past it
+};
+
+struct Options {
+  bool csv;
+  bool stats;
+  size_t fileSize;
+  size_t skip;
+  bool range;      // only samples taken from from to to, UTC seconds
+  uint32_t from;
+  uint32_t to;
+};
+
+static uint32_t get16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get24(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return get16(p) | (get16(p + 2) << 16);
+}
+
+static int32_t signed24(uint32_t v) {
+  return (int32_t) (v << 8) >> 8;
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &value) {
+  value = 0;
+  for (int shift = 0; p < end && shift < 35; shift += 7) {
+    uint8_t b = *p++;
+    value |= (uint32_t) (b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static void formatWall(const Anchor &anchor, uint32_t tick, uint32_t tickHz, bool legacy, char *out, size_t size) {
+  if (!anchor.valid) {
+    snprintf(out, size, legacy ? "0:0:0:0:0:0:0" : "");
+    return;
+  }
+  int64_t elapsed = (int64_t) (int32_t) (tick - anchor.tick);
+  int64_t ms = elapsed * 1000 / (int64_t) tickHz + anchor.millis;
+  int64_t secs = ms / 1000;
+  ms %= 1000;
+  if (ms < 0) {
+    ms += 1000;
+    secs--;
+  }
+  time_t t = anchor.wall + secs;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  if (legacy) {
+    snprintf(out, size, "%d:%d:%d:%d:%d:%d:%d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, (int) ms);
+  } else {
+    snprintf(out, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03d", tm.tm_year + 1900, tm.tm_mon + 1,
+             tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int) ms);
+  }
+}
+
+// UTC seconds at a tick, or -1 without an anchor
+static int64_t wallSeconds(const Anchor &anchor, uint32_t tick, uint32_t tickHz) {
+  if (!anchor.valid) return -1;
+  int64_t elapsed = (int64_t) (int32_t) (tick - anchor.tick);
+  int64_t ms = elapsed * 1000 / (int64_t) tickHz + anchor.millis;
+  return anchor.wall + (ms >= 0 ? ms / 1000 : (ms - 999) / 1000);
+}
+
+// one decoded sample, held until every record that can precede it is read
+struct Sample {
+  int64_t order;   // tick unwrapped across 32-bit rollovers
+  uint32_t tick;
+  uint32_t tickHz;
+  Anchor anchor;   // latest T anchor in the file when the sample was read
+  char stream;
+  int32_t values[4];
+};
+
+/**
+Q blocks are written when they fill, after the records of samples taken
+during them and possibly in the next file, so samples are sorted in a
+window that trails the newest tick by PRINT_DELAY_SECONDS
+**/
+const int PRINT_DELAY_SECONDS = 2;
+
+struct TimedAnchor {
+  int64_t order;
+  Anchor anchor;
+};
+
+// one C record
+struct StatsRow {
+  int64_t order;
+  uint32_t tick;
+  uint32_t tickHz;
+  Anchor anchor;
+  std::vector<uint32_t> values;
+};
+
+struct Output {
+  std::vector<Sample> pending;
+  std::vector<StatsRow> stats;
+  std::vector<TimedAnchor> anchors;   // in tick order, from the one in use
+  bool started;
+  int64_t base;     // unwrapped ticks of the boots before this one end below it
+  int64_t latest;   // newest unwrapped tick so far
+  size_t samples;
+};
+
+static int64_t unwrap(Output &o, uint32_t tick) {
+  if (!o.started) {
+    o.latest = o.base + tick;
+    o.started = true;
+  }
+  int64_t order = o.latest + (int32_t) (tick - (uint32_t) (o.latest - o.base));
+  if (order > o.latest) o.latest = order;
+  return order;
+}
+
+static void addAnchor(Output &o, const Anchor &anchor) {
+  TimedAnchor a = { unwrap(o, anchor.tick), anchor };
+  size_t i = o.anchors.size();
+  while (i > 0 && o.anchors[i - 1].order > a.order) i--;
+  o.anchors.insert(o.anchors.begin() + i, a);
+}
+
+static void addSample(Output &o, uint32_t tick, uint32_t tickHz, const Anchor &anchor, char stream,
+                      int32_t a, int32_t b = 0, int32_t c = 0, int32_t d = 0) {
+  int64_t order = unwrap(o, tick);
+  Sample s = { order, tick, tickHz, anchor, stream, { a, b, c, d } };
+  o.pending.push_back(s);
+  o.samples++;
+}
+
+/**
+Print the pending samples outside the reorder window (or all of them) in
+tick order
+**/
+static void printSamples(Output &o, bool all, const Options &opt, FILE *out) {
+  std::vector<Sample> &samples = o.pending;
+  if (opt.stats) {
+    samples.clear();
+    return;
+  }
+  std::stable_sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) {
+    return a.order < b.order;
+  });
+
+  size_t count = 0;
+  while (count < samples.size() &&
+         (all || samples[count].order < o.latest - (int64_t) samples[count].tickHz * PRINT_DELAY_SECONDS)) {
+    count++;
+  }
+
+  char wall[48];
+  for (size_t i = 0; i < count; i++) {
+    Sample &s = samples[i];
+    uint32_t tickHz = s.tickHz;
+
+    // place each sample from the last anchor taken before it
+    while (o.anchors.size() > 1 && o.anchors[1].order <= s.order) o.anchors.erase(o.anchors.begin());
+    if (!o.anchors.empty() && o.anchors[0].order <= s.order) s.anchor = o.anchors[0].anchor;
+
+    if (opt.range) {
+      int64_t t = wallSeconds(s.anchor, s.tick, tickHz);
+      if (t < opt.from || t > opt.to) continue;
+    }
+
+    const int32_t *v = s.values;
+    if (opt.csv) {
+      formatWall(s.anchor, s.tick, tickHz, false, wall, sizeof(wall));
+      if (s.stream == 'O') fprintf(out, "%s,%u,O,%d,%d,%d,%d\n", wall, s.tick, v[0], v[1], v[2], v[3]);
+      else if (s.stream == 'A') fprintf(out, "%s,%u,A,%d,%d,%d\n", wall, s.tick, v[0], v[1], v[2]);
+      else fprintf(out, "%s,%u,%c,%u\n", wall, s.tick, s.stream, (uint32_t) v[0]);
+      continue;
+    }
+
+    if (s.stream == 'O') {
+      // the value getPPGData() returns, from the raw 24-bit registers
+      fprintf(out, "P:%u\n", ((v[0] & 0xFFFFFF) + (v[1] & 0xFFFFFF)) / 2);
+    } else if (s.stream == 'A') {
+      fprintf(out, "A:%d:%d:%d\n", v[0], v[1], v[2]);
+    } else {
+      fprintf(out, "%c:%u\n", s.stream, (uint32_t) v[0]);
+    }
+    // legacy text has one T line after each group of same-tick samples
+    if (i + 1 == samples.size() || samples[i + 1].tick != s.tick) {
+      formatWall(s.anchor, s.tick, tickHz, true, wall, sizeof(wall));
+      fprintf(out, "T:%s\n", wall);
+    }
+  }
+  samples.erase(samples.begin(), samples.begin() + count);
+}
+
+/**
+C records in tick order, one line each with the counters by name
+**/
+static void printStats(Output &o, const Options &opt, FILE *out) {
+  std::stable_sort(o.stats.begin(), o.stats.end(), [](const StatsRow &a, const StatsRow &b) {
+    return a.order < b.order;
+  });
+  fprintf(out, "wallclock,tick");
+  for (int i = 0; i < STATS_FIELDS; i++) fprintf(out, ",%s", STATS_FIELD_NAMES[i]);
+  fprintf(out, "\n");
+
+  char wall[48];
+  for (size_t r = 0; r < o.stats.size(); r++) {
+    const StatsRow &row = o.stats[r];
+    if (opt.range) {
+      int64_t t = wallSeconds(row.anchor, row.tick, row.tickHz);
+      if (t < opt.from || t > opt.to) continue;
+    }
+    formatWall(row.anchor, row.tick, row.tickHz, false, wall, sizeof(wall));
+    fprintf(out, "%s,%u", wall, row.tick);
+    // a newer firmware's extra counters are left off
+    for (int i = 0; i < STATS_FIELDS; i++) {
+      if (i < (int) row.values.size()) fprintf(out, ",%u", row.values[i]);
+      else fprintf(out, ",");
+    }
+    fprintf(out, "\n");
+  }
+}
+
+/**
+C record: counters as varints after their own tick
+**/
+static bool decodeStats(const uint8_t *&p, const uint8_t *end, uint32_t tickHz, const Anchor &anchor,
+                        Output &o) {
+  if (end - p < 5) return false;
+  StatsRow row;
+  row.tick = get32(p);
+  row.tickHz = tickHz;
+  row.anchor = anchor;
+  int count = p[4];
+  p += 5;
+  for (int i = 0; i < count; i++) {
+    uint32_t value;
+    if (!getVarint(p, end, value)) return false;
+    row.values.push_back(value);
+  }
+  row.order = unwrap(o, row.tick);
+  o.stats.push_back(row);
+  return true;
+}
+
+/**
+Q record: a Rice coded block of PPG phase samples with their own ticks
+**/
+static bool decodePPGBlock(const uint8_t *&p, const uint8_t *end, uint32_t tickHz, const Anchor &anchor,
+                           Output &o) {
+  if (end - p < REC_PPG_BLOCK_HEADER - 1) return false;
+  int count = p[0];
+  int size = get16(p + 1);
+  p += REC_PPG_BLOCK_HEADER - 1;
+  if (count == 0 || end - p < size) return false;
+
+  std::vector<int32_t> channels(RECORD_PPG_CHANNELS * count);
+  RiceReader r;
+  riceReaderInit(&r, p, p + size);
+  for (int c = 0; c < RECORD_PPG_CHANNELS; c++) {
+    if (!riceDecode(&r, &channels[c * count], count, c ? 24 : 32)) return false;
+  }
+  p += size;
+
+  for (int i = 0; i < count; i++) {
+    addSample(o, (uint32_t) channels[i], tickHz, anchor, 'O', channels[count + i], channels[2 * count + i],
+              channels[3 * count + i], channels[4 * count + i]);
+  }
+  return true;
+}
+
+/**
+Decode one file's worth of records into the output window
+**/
+static void decodeFile(const uint8_t *p, const uint8_t *end, Output &o) {
+  if (end - p < REC_START_SIZE || p[0] != REC_START) return;
+  if (p[1] < 1 || p[1] > RECORD_FORMAT_VERSION) {
+    fprintf(stderr, "sentidecode: unsupported format version %d\n", p[1]);
+    return;
+  }
+  // T records gained a centisecond field in version 3
+  int timeSize = p[1] >= 3 ? REC_TIME_SIZE : REC_TIME_SIZE - 1;
+  uint32_t tickHz = get32(p + 2);
+  uint32_t tick = get32(p + 6);
+  p += REC_START_SIZE;
+
+  // a stream opened at boot has a tick base of 0: halTicks() started over,
+  // so its ticks go after everything decoded so far
+  if (tick == 0 && o.started) {
+    o.base = o.latest + 1;
+    o.started = false;
+  }
+
+  Anchor anchor = { false, 0, 0, 0 };
+
+  while (p < end && *p != 0x00 && *p != 0xFF) {
+    uint8_t tag = *p++;
+
+    if (tag == REC_TIME) {
+      if (end - p < timeSize - 1) break;
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      tm.tm_year = get16(p + 4) - 1900;
+      tm.tm_mon = p[6] - 1;
+      tm.tm_mday = p[7];
+      tm.tm_hour = p[8];
+      tm.tm_min = p[9];
+      tm.tm_sec = p[10];
+      anchor.valid = true;
+      anchor.tick = get32(p);
+      anchor.wall = timegm(&tm);
+      anchor.millis = timeSize == REC_TIME_SIZE ? p[11] * 10 : 0;
+      addAnchor(o, anchor);
+      p += timeSize - 1;
+      continue;
+    }
+
+    if (tag == REC_PPG_BLOCK) {
+      if (decodePPGBlock(p, end, tickHz, anchor, o)) continue;
+      fprintf(stderr, "sentidecode: truncated PPG block\n");
+      break;
+    }
+
+    if (tag == REC_STATS) {
+      if (decodeStats(p, end, tickHz, anchor, o)) continue;
+      fprintf(stderr, "sentidecode: truncated stats record\n");
+      break;
+    }
+
+    uint32_t dt;
+    if (!getVarint(p, end, dt)) break;
+    tick += dt;
+
+    if (tag == REC_PPG && end - p >= 3) {
+      addSample(o, tick, tickHz, anchor, 'P', get24(p));
+      p += 3;
+    } else if (tag == REC_PPG_PHASES && end - p >= 12) {
+      addSample(o, tick, tickHz, anchor, 'O', signed24(get24(p)), signed24(get24(p + 3)),
+                signed24(get24(p + 6)), signed24(get24(p + 9)));
+      p += 12;
+    } else if (tag == REC_ACCEL && end - p >= 6) {
+      addSample(o, tick, tickHz, anchor, 'A', (int16_t) get16(p), (int16_t) get16(p + 2), (int16_t) get16(p + 4));
+      p += 6;
+    } else if (tag == REC_EDA && end - p >= 2) {
+      addSample(o, tick, tickHz, anchor, 'E', get16(p) & 0x0FFF);
+      p += 2;
+    } else {
+      fprintf(stderr, "sentidecode: unknown or truncated record 0x%02x\n", tag);
+      break;
+    }
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: sentidecode [--csv|--stats] [--from TIME] [--to TIME] [--file-size N] [--skip N] FILE...\n"
+    "  --csv           one sample per line: wallclock,tick,stream,values\n"
+    "  --stats         the acquisition counters logged once a minute, as csv\n"
+    "  --from, --to    only samples in this UTC range, YYYY-MM-DDTHH:MM:SS or seconds\n"
+    "                  since 1970; only the store segments holding them are read\n"
+    "  --file-size N   size of each file in input without a log store (default 16384)\n"
+    "  --skip N        bytes to skip at the start of each input (e.g. a directory)\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options opt = { false, false, 16384, 0, false, 0, STORE_ERASED };
+  std::vector<const char *> inputs;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--csv")) opt.csv = true;
+    else if (!strcmp(argv[i], "--stats")) opt.stats = true;
+    else if (!strcmp(argv[i], "--file-size") && i + 1 < argc) opt.fileSize = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--skip") && i + 1 < argc) opt.skip = strtoul(argv[++i], NULL, 0);
+    else if ((!strcmp(argv[i], "--from") || !strcmp(argv[i], "--to")) && i + 1 < argc) {
+      if (!parseTime(argv[i + 1], !strcmp(argv[i], "--from") ? &opt.from : &opt.to)) usage();
+      opt.range = true;
+      i++;
+    }
+    else if (argv[i][0] == '-') usage();
+    else inputs.push_back(argv[i]);
+  }
+  if (inputs.empty() || opt.fileSize == 0) usage();
+  if (opt.csv && !opt.stats) printf("wallclock,tick,stream,value\n");
+
+  size_t files = 0;
+  Output output;
+  output.started = false;
+  output.base = 0;
+  output.latest = 0;
+  output.samples = 0;
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    ChipImage chips[STORE_MAX_STRIPES];
+    ChipImage &image = chips[0];
+    if (!mapImage(inputs[i], opt.skip, &image)) return 1;
+
+    uint32_t probes = 0;
+    std::vector<Segment> segments = opt.range ? findSegmentsInTime(image, opt.from, opt.to, &probes)
+                                              : findSegments(image);
+    // an image holding a store has a checkpoint, even if no segment is in range
+    bool store = opt.range ? storeTailSequence(image) != 0 : !segments.empty();
+    if (opt.range && store) {
+      fprintf(stderr, "sentidecode: %s: %zu segments in range, %u headers read\n", inputs[i], segments.size(),
+              probes);
+    }
+    size_t count = 1;
+    for (size_t s = 0; s <= segments.size(); s++) {
+      // with none in range the newest segment tells whether a second image goes with this one
+      uint32_t stripes = s < segments.size() ? segments[s].stripes : opt.range ? storeStripes(image) : 0;
+      if (stripes <= count) continue;
+      if (i + 1 == inputs.size()) {
+        fprintf(stderr, "sentidecode: %s is striped over two chips, give both images\n", inputs[i]);
+        return 1;
+      }
+      if (!mapImage(inputs[++i], opt.skip, &chips[1])) return 1;
+      count = 2;
+    }
+
+    std::vector<std::vector<uint8_t> > streams;
+    for (size_t s = 0; s < segments.size(); s++) {
+      if (!readSegment(chips, count, segments[s], streams)) {
+        fprintf(stderr, "sentidecode: segment %u is cut short\n", segments[s].sequence);
+        continue;
+      }
+      for (size_t k = 0; k < streams.size(); k++) {
+        decodeFile(&streams[k][0], &streams[k][0] + streams[k].size(), output);
+        printSamples(output, false, opt, stdout);
+        files++;
+      }
+    }
+
+    for (size_t at = 0; !store && at < image.size; at += opt.fileSize) {
+      const uint8_t *chunk = image.data + at;
+      size_t len = std::min(opt.fileSize, image.size - at);
+      if (chunk[0] != REC_START) continue;
+      decodeFile(chunk, chunk + len, output);
+      printSamples(output, false, opt, stdout);
+      files++;
+    }
+    for (size_t c = 0; c < count; c++) unmapImage(&chips[c]);
+  }
+  printSamples(output, true, opt, stdout);
+  if (opt.stats) printStats(output, opt, stdout);
+
+  fprintf(stderr, "sentidecode: %zu files or streams, %zu samples\n", files, output.samples);
+  return 0;
+}
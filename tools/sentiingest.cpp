@@ -0,0 +1,519 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "StoreImage.h"
+#include "../Record.h"
+
+/*============================================================================
+=  sentiingest: turns text logs ("E:/A:/P:/T:" lines, Record.h with         =
+=  LOG_BINARY_RECORDS=0) into one binary array per column per stream, for   =
+=  numpy.fromfile() and the like. Inputs are memory-mapped and split into   =
+=  independent pieces that are parsed on every core:                        =
+=                                                                           =
+=    a flash image holding a log store      one piece per segment; a store  =
+=                                           striped over two chips takes    =
+=                                           both images, CS 7 first         =
+=    r<N>.txt, or any other .txt file       pieces of about 1MB ending on a =
+=                                           T line; r<N>.txt in order of N  =
+=    any other image (an old chip dump)     file-size chunks, as            =
+=                                           sentidecode reads them          =
+=                                                                           =
+=  Each sample takes the time of the T line after it, as the analysis       =
+=  pipeline pairs them; samples after the last T line of a piece take the   =
+=  one before them. PPG values are sign extended from 22 bits and scaled as =
+=  convert_ADC_to_float() does. Pieces holding binary records are skipped;  =
+=  sentidecode --csv reads those.                                           =
+==============================================================================*/
+
+struct Options {
+  const char *out;
+  size_t fileSize;
+  size_t skip;
+  unsigned threads;
+  double benchMB;
+};
+
+// one independent stretch of log text
+struct Piece {
+  const uint8_t *data;           // text, or NULL for a store segment
+  size_t size;
+  const ChipImage *chips;        // the segment's images
+  size_t chipCount;
+  Segment segment;
+};
+
+// columns parsed from one piece
+struct Columns {
+  std::vector<int64_t> eTime;
+  std::vector<uint16_t> eValue;
+  std::vector<int64_t> aTime;
+  std::vector<int16_t> ax, ay, az;
+  std::vector<int64_t> pTime;
+  std::vector<uint32_t> pRegister;
+  std::vector<int32_t> pRaw;
+  std::vector<float> pValue;
+  uint64_t bytes;
+  uint32_t untimed;              // samples with no T line in their piece
+  bool binary;
+};
+
+// milliseconds since 1970 UTC, without the locale and table lookups of timegm()
+static int64_t epochMillis(int y, int mon, int d, int h, int min, int s, int ms) {
+  y -= mon <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = (int64_t) era * 146097 + doe - 719468;
+  return ((days * 24 + h) * 60 + min) * 60000LL + s * 1000LL + ms;
+}
+
+// fields separated by ':' up to the end of the line; returns how many
+static int parseFields(const uint8_t *&p, const uint8_t *end, int32_t *fields, int max) {
+  int n = 0;
+  while (p < end && *p != '\n') {
+    bool negative = *p == '-';
+    if (negative) p++;
+    int32_t v = 0;
+    while (p < end && (unsigned) (*p - '0') < 10) v = v * 10 + (*p++ - '0');
+    if (n < max) fields[n] = negative ? -v : v;
+    n++;
+    if (p < end && *p == ':') p++;
+    else break;
+  }
+  while (p < end && *p != '\n') p++;
+  if (p < end) p++;
+  return n;
+}
+
+/**
+22-bit two's complement to int32 and to [-1.0, 1.0), four at a time where
+the host has vector registers
+**/
+static void signExtend22(const uint32_t *in, int32_t *raw, float *value, size_t n) {
+  size_t i = 0;
+  const float scale = 1.0f / 2097152.0f;
+#if defined(__SSE2__)
+  const __m128 scale4 = _mm_set1_ps(scale);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+    v = _mm_srai_epi32(_mm_slli_epi32(v, 10), 10);
+    _mm_storeu_si128((__m128i *) (raw + i), v);
+    _mm_storeu_ps(value + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale4));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t v = vshrq_n_s32(vshlq_n_s32(vreinterpretq_s32_u32(vld1q_u32(in + i)), 10), 10);
+    vst1q_s32(raw + i, v);
+    vst1q_f32(value + i, vmulq_n_f32(vcvtq_f32_s32(v), scale));
+  }
+#endif
+  for (; i < n; i++) {
+    raw[i] = (int32_t) (in[i] << 10) >> 10;
+    value[i] = raw[i] * scale;
+  }
+}
+
+static void fillTimes(std::vector<int64_t> &times, size_t from, int64_t t) {
+  std::fill(times.begin() + from, times.end(), t);
+}
+
+/**
+Parse log text into c. Samples wait for the T line after them; the
+vectors' sizes at the last T line mark where the waiting ones start.
+**/
+static void parseText(const uint8_t *p, const uint8_t *end, Columns &c) {
+  size_t eFrom = c.eTime.size(), aFrom = c.aTime.size(), pFrom = c.pTime.size();
+  bool timed = false;
+  int64_t last = 0;
+  int32_t f[7];
+
+  c.bytes += end - p;
+  while (p < end && *p != 0x00 && *p != 0xFF) {
+    uint8_t tag = *p;
+    if (p + 1 >= end || p[1] != ':') {
+      while (p < end && *p != '\n') p++;
+      if (p < end) p++;
+      continue;
+    }
+    p += 2;
+    int n = parseFields(p, end, f, 7);
+
+    if (tag == 'P' && n == 1) {
+      c.pRegister.push_back((uint32_t) f[0]);
+      c.pTime.push_back(0);
+    } else if (tag == 'A' && n == 3) {
+      c.ax.push_back(f[0]);
+      c.ay.push_back(f[1]);
+      c.az.push_back(f[2]);
+      c.aTime.push_back(0);
+    } else if (tag == 'E' && n == 1) {
+      c.eValue.push_back(f[0]);
+      c.eTime.push_back(0);
+    } else if (tag == 'T' && n == 7) {
+      last = epochMillis(f[0], f[1], f[2], f[3], f[4], f[5], f[6]);
+      timed = true;
+      fillTimes(c.eTime, eFrom, last);
+      fillTimes(c.aTime, aFrom, last);
+      fillTimes(c.pTime, pFrom, last);
+      eFrom = c.eTime.size();
+      aFrom = c.aTime.size();
+      pFrom = c.pTime.size();
+    }
+  }
+
+  // nothing follows these; the T line before them is the nearest
+  fillTimes(c.eTime, eFrom, last);
+  fillTimes(c.aTime, aFrom, last);
+  fillTimes(c.pTime, pFrom, last);
+  if (!timed) c.untimed += (c.eTime.size() - eFrom) + (c.aTime.size() - aFrom) + (c.pTime.size() - pFrom);
+}
+
+static bool isBinary(const uint8_t *p, size_t size) {
+  return size > 0 && p[0] == REC_START;
+}
+
+static void parsePiece(const Piece &piece, Columns &c) {
+  if (piece.data) {
+    if (isBinary(piece.data, piece.size)) c.binary = true;
+    else parseText(piece.data, piece.data + piece.size, c);
+  } else {
+    std::vector<std::vector<uint8_t> > streams;
+    if (!readSegment(piece.chips, piece.chipCount, piece.segment, streams)) return;
+    for (size_t k = 0; k < streams.size(); k++) {
+      if (streams[k].empty()) continue;
+      const uint8_t *p = &streams[k][0];
+      if (isBinary(p, streams[k].size())) c.binary = true;
+      else parseText(p, p + streams[k].size(), c);
+    }
+  }
+  c.pRaw.resize(c.pRegister.size());
+  c.pValue.resize(c.pRegister.size());
+  if (!c.pRegister.empty()) signExtend22(&c.pRegister[0], &c.pRaw[0], &c.pValue[0], c.pRegister.size());
+}
+
+/**
+Parse every piece on threads workers, each taking the next piece not yet
+started
+**/
+static void parseAll(const std::vector<Piece> &pieces, std::vector<Columns> &results, unsigned threads) {
+  results.assign(pieces.size(), Columns());
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i; (i = next++) < pieces.size();) {
+      results[i].bytes = 0;
+      results[i].untimed = 0;
+      results[i].binary = false;
+      parsePiece(pieces[i], results[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++) workers.push_back(std::thread(work));
+  work();
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+template <typename T>
+static size_t writeColumn(const std::string &dir, const char *name, const std::vector<Columns> &results,
+                          std::vector<T> Columns::*column, FILE *index, const char *type) {
+  std::string path = dir + "/" + name;
+  FILE *out = fopen(path.c_str(), "wb");
+  if (!out) {
+    perror(path.c_str());
+    exit(1);
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    const std::vector<T> &v = results[i].*column;
+    if (!v.empty() && fwrite(&v[0], sizeof(T), v.size(), out) != v.size()) {
+      perror(path.c_str());
+      exit(1);
+    }
+    count += v.size();
+  }
+  fclose(out);
+  fprintf(index, "%s %s %zu\n", name, type, count);
+  return count;
+}
+
+static void writeColumns(const char *dir, const std::vector<Columns> &results) {
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    perror(dir);
+    exit(1);
+  }
+  std::string d = dir;
+  std::string indexPath = d + "/index.txt";
+  FILE *index = fopen(indexPath.c_str(), "w");
+  if (!index) {
+    perror(indexPath.c_str());
+    exit(1);
+  }
+  fprintf(index, "# column dtype count; times are int64 ms since 1970 UTC, little-endian throughout\n");
+  writeColumn(d, "E.time", results, &Columns::eTime, index, "int64");
+  writeColumn(d, "E.value", results, &Columns::eValue, index, "uint16");
+  writeColumn(d, "A.time", results, &Columns::aTime, index, "int64");
+  writeColumn(d, "A.x", results, &Columns::ax, index, "int16");
+  writeColumn(d, "A.y", results, &Columns::ay, index, "int16");
+  writeColumn(d, "A.z", results, &Columns::az, index, "int16");
+  writeColumn(d, "P.time", results, &Columns::pTime, index, "int64");
+  writeColumn(d, "P.raw", results, &Columns::pRaw, index, "int32");
+  writeColumn(d, "P.value", results, &Columns::pValue, index, "float32");
+  fclose(index);
+}
+
+// text files are cut into pieces of about this size, after a T line
+static const size_t TEXT_PIECE = 1 << 20;
+
+static bool isText(const char *path) {
+  size_t n = strlen(path);
+  return n >= 4 && !strcmp(path + n - 4, ".txt");
+}
+
+// N of a file named r<N>.txt, or -1
+static long logNumber(const char *path) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  char *end;
+  if (base[0] != 'r' || (unsigned) (base[1] - '0') >= 10) return -1;
+  long n = strtol(base + 1, &end, 10);
+  return strcmp(end, ".txt") ? -1 : n;
+}
+
+/**
+A text file as pieces that each end with a T line, so no sample is parted
+from the time after it
+**/
+static void textPieces(const ChipImage &text, std::vector<Piece> &pieces) {
+  const uint8_t *p = text.data, *end = text.data + text.size;
+  while (p < end) {
+    const uint8_t *cut = p + std::min(TEXT_PIECE, (size_t) (end - p));
+    while (cut < end && !(cut[-1] == '\n' && cut[0] == 'T')) cut++;
+    while (cut < end && *cut != '\n') cut++;
+    if (cut < end) cut++;
+    Piece piece = { p, (size_t) (cut - p), NULL, 0, Segment() };
+    pieces.push_back(piece);
+    p = cut;
+  }
+}
+
+/**
+Split the mapped inputs into pieces, in recording order
+**/
+static bool findPieces(const std::vector<const char *> &inputs, const Options &opt,
+                       std::vector<ChipImage> &images, std::vector<Piece> &pieces) {
+  images.reserve(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    images.push_back(ChipImage());
+    ChipImage *image = &images.back();
+    if (!mapImage(inputs[i], isText(inputs[i]) ? 0 : opt.skip, image)) return false;
+
+    if (isText(inputs[i])) {
+      textPieces(*image, pieces);
+      continue;
+    }
+
+    std::vector<Segment> segments = findSegments(*image);
+    size_t count = 1;
+    for (size_t s = 0; s < segments.size(); s++) {
+      if (segments[s].stripes <= count) continue;
+      if (i + 1 == inputs.size()) {
+        fprintf(stderr, "sentiingest: %s is striped over two chips, give both images\n", inputs[i]);
+        return false;
+      }
+      images.push_back(ChipImage());
+      if (!mapImage(inputs[++i], opt.skip, &images.back())) return false;
+      count = 2;
+    }
+    for (size_t s = 0; s < segments.size(); s++) {
+      Piece piece = { NULL, 0, image, count, segments[s] };
+      pieces.push_back(piece);
+    }
+
+    for (size_t at = 0; segments.empty() && at < image->size; at += opt.fileSize) {
+      Piece piece = { image->data + at, std::min(opt.fileSize, image->size - at), NULL, 0, Segment() };
+      pieces.push_back(piece);
+    }
+  }
+  return true;
+}
+
+/**
+A recording's worth of log text in the legacy chunk layout: batches of
+PPG, accelerometer and EDA lines each followed by a T line, as loop()
+writes them, cut into fileSize chunks padded with erased bytes
+**/
+static std::vector<uint8_t> benchInput(double megabytes, size_t fileSize) {
+  std::vector<uint8_t> image;
+  std::string chunk;
+  uint32_t seed = 1;
+  int64_t ms = epochMillis(2026, 10, 17, 8, 0, 0, 0);
+  while (image.size() < megabytes * 1048576) {
+    char line[64];
+    std::string batch;
+    for (int i = 0; i < 4; i++) {
+      seed = seed * 1103515245 + 12345;
+      snprintf(line, sizeof(line), "P:%u\n", (seed >> 8) & 0x3FFFFF);
+      batch += line;
+    }
+    snprintf(line, sizeof(line), "A:%d:%d:%d\n", (int) (seed % 2001) - 1000, (int) (seed % 301) - 150,
+             (int) (seed % 4001) - 2000);
+    batch += line;
+    snprintf(line, sizeof(line), "E:%u\n", seed % 4096);
+    batch += line;
+    ms += 40;
+    time_t t = ms / 1000;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(line, sizeof(line), "T:%d:%d:%d:%d:%d:%d:%d\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (ms % 1000));
+    batch += line;
+
+    if (chunk.size() + batch.size() > fileSize) {
+      chunk.resize(fileSize, (char) 0xFF);
+      image.insert(image.end(), chunk.begin(), chunk.end());
+      chunk.clear();
+    }
+    chunk += batch;
+  }
+  return image;
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+Parse rate on one core and on all of them, and of the sign extension on
+its own with and without the vector loop
+**/
+static void bench(const Options &opt) {
+  std::vector<uint8_t> image = benchInput(opt.benchMB, opt.fileSize);
+  std::vector<Piece> pieces;
+  for (size_t at = 0; at < image.size(); at += opt.fileSize) {
+    Piece piece = { &image[at], opt.fileSize, NULL, 0, Segment() };
+    pieces.push_back(piece);
+  }
+  double mb = image.size() / 1048576.0;
+  printf("ingest: %.1f MB of log text in %zu chunks\n", mb, pieces.size());
+
+  std::vector<Columns> results;
+  unsigned counts[] = { 1, opt.threads };
+  for (int k = 0; k < (opt.threads > 1 ? 2 : 1); k++) {
+    double best = 1e9;
+    for (int run = 0; run < 3; run++) {
+      double start = seconds();
+      parseAll(pieces, results, counts[k]);
+      best = std::min(best, seconds() - start);
+    }
+    printf("  %2u thread(s)   %8.1f MB/s\n", counts[k], mb / best);
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < results.size(); i++) n += results[i].pRegister.size();
+  std::vector<uint32_t> in(n);
+  for (size_t i = 0, at = 0; i < results.size(); i++) {
+    std::copy(results[i].pRegister.begin(), results[i].pRegister.end(), in.begin() + at);
+    at += results[i].pRegister.size();
+  }
+  std::vector<int32_t> raw(n);
+  std::vector<float> value(n);
+  double start = seconds();
+  for (int run = 0; run < 20; run++) signExtend22(&in[0], &raw[0], &value[0], n);
+  double vector = (seconds() - start) / 20;
+  start = seconds();
+  for (int run = 0; run < 20; run++) {
+    for (size_t i = 0; i < n; i++) {
+      int32_t s = (int32_t) (in[i] << 10) >> 10;
+      raw[i] = s;
+      value[i] = float(s) / 2097152.0f;
+      __asm__ volatile("" ::: "memory"); // keep this loop scalar
+    }
+  }
+  double scalar = (seconds() - start) / 20;
+  printf("  sign extension of %zu PPG values: %.2f ns each vector, %.2f ns scalar\n", n, vector * 1e9 / n,
+         scalar * 1e9 / n);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: sentiingest [--out DIR] [--threads N] [--file-size N] [--skip N] IMAGE|FILE.txt...\n"
+    "       sentiingest --bench MB [--threads N]\n"
+    "  --out DIR       directory for the column files and index.txt (default ingest)\n"
+    "  --threads N     parse on N threads (default: every core)\n"
+    "  --file-size N   size of each file in a dump without a log store (default 16384)\n"
+    "  --skip N        bytes to skip at the start of each image (e.g. a directory)\n"
+    "  --bench MB      time parsing MB of generated log text, writing nothing\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options opt = { "ingest", 16384, 0, std::thread::hardware_concurrency(), 0 };
+  std::vector<const char *> inputs;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--out") && i + 1 < argc) opt.out = argv[++i];
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc) opt.threads = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--file-size") && i + 1 < argc) opt.fileSize = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--skip") && i + 1 < argc) opt.skip = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--bench") && i + 1 < argc) opt.benchMB = atof(argv[++i]);
+    else if (argv[i][0] == '-') usage();
+    else inputs.push_back(argv[i]);
+  }
+  if (opt.threads == 0) opt.threads = 1;
+  if (opt.fileSize == 0) usage();
+  if (opt.benchMB > 0) {
+    bench(opt);
+    return 0;
+  }
+  if (inputs.empty()) usage();
+
+  // r<N>.txt files in the order they were written
+  std::stable_sort(inputs.begin(), inputs.end(), [](const char *a, const char *b) {
+    long na = logNumber(a), nb = logNumber(b);
+    return na >= 0 && nb >= 0 && na < nb;
+  });
+
+  double start = seconds();
+  std::vector<ChipImage> images;
+  std::vector<Piece> pieces;
+  if (!findPieces(inputs, opt, images, pieces)) return 1;
+
+  std::vector<Columns> results;
+  parseAll(pieces, results, opt.threads);
+  double parsed = seconds();
+  writeColumns(opt.out, results);
+
+  uint64_t bytes = 0, untimed = 0, binary = 0, samples = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    bytes += results[i].bytes;
+    untimed += results[i].untimed;
+    binary += results[i].binary;
+    samples += results[i].eTime.size() + results[i].aTime.size() + results[i].pTime.size();
+  }
+  for (size_t i = 0; i < images.size(); i++) unmapImage(&images[i]);
+
+  fprintf(stderr, "sentiingest: %llu samples from %.1f MB of text in %zu pieces, %.1f MB/s on %u threads\n",
+          (unsigned long long) samples, bytes / 1048576.0, pieces.size(),
+          parsed > start ? bytes / 1048576.0 / (parsed - start) : 0.0, opt.threads);
+  if (untimed) fprintf(stderr, "sentiingest: %llu samples in pieces without a T line\n", (unsigned long long) untimed);
+  if (binary) {
+    fprintf(stderr, "sentiingest: skipped %llu pieces of binary records, use sentidecode --csv\n",
+            (unsigned long long) binary);
+  }
+  return 0;
+}
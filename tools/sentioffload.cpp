@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "OffloadClient.h"
+#include "StoreImage.h"
+
+/*============================================================================
+=  sentioffload: pulls the log store off a Senti over its USB serial port   =
+=  with the offload protocol (Offload.h).                                   =
+=                                                                           =
+=    list    store geometry and the segments kept                           =
+=    pull    one flash image per chip, PREFIX.img and PREFIX-2.img, ready   =
+=            for sentidecode. Only the part of each chip holding the store  =
+=            is read unless --all; --resume carries on from the end of      =
+=            images left by an interrupted pull                             =
+=    erase   both chips (needs --yes)                                       =
+=    stats   the acquisition counters (Stats.h), while recording goes on    =
+=    start   turn recording on, after a pull or an erase has stopped it     =
+=    stop    turn recording off                                             =
+=                                                                           =
+=  With --from or --to list and pull take only the segments with samples    =
+=  in that time range, which the device finds from their summaries; a pull  =
+=  then reads just those blocks and the superblocks, leaving the rest of    =
+=  each image erased.                                                       =
+==============================================================================*/
+
+struct Options {
+  const char *port;
+  const char *prefix;
+  bool all;
+  bool resume;
+  bool yes;
+  bool range;
+  uint32_t from;
+  uint32_t to;
+};
+
+// image being pulled, and progress shown as it goes
+struct Pull {
+  FILE *out;
+  uint32_t start;
+  uint32_t end;
+  uint64_t bytes;
+  double started;
+  double shown;
+};
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void portSend(void *context, const uint8_t *data, size_t len) {
+  int fd = *(int *) context;
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      perror("sentioffload: write");
+      exit(1);
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+static size_t portReceive(void *context, uint8_t *data, size_t len, int timeoutMs) {
+  int fd = *(int *) context;
+  struct pollfd p = { fd, POLLIN, 0 };
+  if (poll(&p, 1, timeoutMs) <= 0) return 0;
+  ssize_t n = read(fd, data, len);
+  return n > 0 ? n : 0;
+}
+
+static int openPort(const char *path) {
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static bool pullSink(void *context, uint32_t offset, const uint8_t *data, uint32_t length) {
+  Pull *pull = (Pull *) context;
+  static const std::vector<uint8_t> erased(OFFLOAD_CHUNK, 0xFF);
+  if (fwrite(data ? data : &erased[0], 1, length, pull->out) != length) return false;
+  pull->bytes += length;
+
+  double now = seconds();
+  if (now - pull->shown >= 0.5 || offset + length == pull->end) {
+    fprintf(stderr, "\r  %6.1f of %.1f MB, %.2f MB/s", (offset + length - pull->start) / 1048576.0,
+            (pull->end - pull->start) / 1048576.0, pull->bytes / 1048576.0 / (now - pull->started));
+    pull->shown = now;
+  }
+  return true;
+}
+
+static void printList(const OffloadInfo &info, const std::vector<OffloadSegment> &segments) {
+  printf("%u chip(s) of %u blocks, %s, %s\n", info.chips, info.blocks, info.circular ? "circular" : "linear",
+         info.recording ? "was recording" : "not recording");
+  printf("head segment %u (sequence %u, %u pages), oldest kept %u (sequence %u)\n", info.head,
+         info.headSequence, info.headPages, info.tail, info.tailSequence);
+  for (size_t i = 0; i < segments.size(); i++) {
+    const StoreSegmentHeader &h = segments[i].header;
+    if (!storeSegmentValid(&h)) {
+      printf("  block %5u  damaged header\n", segments[i].block);
+      continue;
+    }
+    time_t opened = h.opened;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&opened));
+    printf("  block %5u  sequence %6u  chips %u  opened %s", segments[i].block, h.sequence, h.stripes, when);
+    const StoreSegmentSummary &summary = segments[i].summary;
+    if (storeSummaryValid(&summary)) {
+      printf("  %us  PPG %u  accel %u  EDA %u%s", summary.last - summary.first, summary.samples[STORE_STREAM_PPG],
+             summary.samples[STORE_STREAM_ACCEL], summary.samples[STORE_STREAM_EDA],
+             summary.flags & STORE_SUMMARY_PARTIAL ? " (since a reset)" : "");
+    }
+    printf("\n");
+  }
+}
+
+static void printStats(const StatsSnapshot &stats) {
+  uint32_t values[1 + STATS_FIELDS];
+  memcpy(values, &stats, sizeof(values));
+  printf("%-20s %u\n", "tick", values[0]);
+  for (int i = 0; i < STATS_FIELDS; i++) printf("%-20s %u\n", STATS_FIELD_NAMES[i], values[1 + i]);
+}
+
+/**
+Pull one chip into its image: the store's extent of it, then erased
+bytes up to the chip's size, so the image is the chip as sentidecode
+expects it
+**/
+static bool pullChip(OffloadClient *c, const OffloadInfo &info, uint32_t chip, const std::string &path,
+                     const Options &opt) {
+  uint32_t capacity = info.blocks * info.blockSize;
+  uint32_t end = opt.all ? capacity : offloadExtent(info);
+  uint32_t start = 0;
+
+  FILE *out = fopen(path.c_str(), opt.resume ? "ab" : "wb");
+  if (!out) {
+    perror(path.c_str());
+    return false;
+  }
+  if (opt.resume) {
+    fseek(out, 0, SEEK_END);
+    long have = ftell(out);
+    start = have > 0 ? (uint32_t) have : 0;
+  }
+
+  fprintf(stderr, "%s: chip %u\n", path.c_str(), chip);
+  Pull pull = { out, start, end, 0, seconds(), 0 };
+  bool ok = start >= end || offloadRead(c, chip, start, end, pullSink, &pull);
+  fprintf(stderr, "\n");
+
+  // the rest of the chip is erased as far as the store is concerned
+  std::vector<uint8_t> erased(info.blockSize, 0xFF);
+  for (uint32_t at = start > end ? start : end; ok && at < capacity; at += info.blockSize) {
+    uint32_t n = capacity - at < info.blockSize ? capacity - at : info.blockSize;
+    ok = fwrite(&erased[0], 1, n, out) == n;
+  }
+  if (fclose(out) != 0) ok = false;
+  if (!ok) fprintf(stderr, "sentioffload: pull of chip %u stopped, --resume carries on\n", chip);
+  return ok;
+}
+
+/**
+Pull the superblocks and the blocks of the segments found on one chip
+into its image, everything else erased, so sentidecode reads it as the
+chip with only those segments kept
+**/
+static bool pullSegments(OffloadClient *c, const OffloadInfo &info, uint32_t chip, const std::string &path,
+                         const std::vector<OffloadSegment> &segments) {
+  std::vector<uint32_t> blocks;
+  for (uint32_t b = 0; b < STORE_SUPERBLOCKS; b++) blocks.push_back(b);
+  for (size_t i = 0; i < segments.size(); i++) blocks.push_back(segments[i].block);
+  std::sort(blocks.begin(), blocks.end());
+
+  FILE *out = fopen(path.c_str(), "wb");
+  if (!out) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(stderr, "%s: chip %u, %zu segments\n", path.c_str(), chip, segments.size());
+  std::vector<uint8_t> erased(info.blockSize, 0xFF);
+  uint32_t at = 0;
+  bool ok = true;
+  double started = seconds();
+  for (size_t i = 0; ok && i < blocks.size(); i++) {
+    for (; ok && at < blocks[i]; at++) ok = fwrite(&erased[0], 1, info.blockSize, out) == info.blockSize;
+    // runs of neighbouring blocks go as one read
+    size_t j = i;
+    while (j + 1 < blocks.size() && blocks[j + 1] == blocks[j] + 1) j++;
+    Pull pull = { out, blocks[i] * info.blockSize, (blocks[j] + 1) * info.blockSize, 0, started, 0 };
+    ok = ok && offloadRead(c, chip, pull.start, pull.end, pullSink, &pull);
+    at = blocks[j] + 1;
+    i = j;
+  }
+  for (; ok && at < info.blocks; at++) ok = fwrite(&erased[0], 1, info.blockSize, out) == info.blockSize;
+  fprintf(stderr, "\n");
+  if (fclose(out) != 0) ok = false;
+  if (!ok) fprintf(stderr, "sentioffload: pull of chip %u stopped\n", chip);
+  return ok;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: sentioffload [--port DEV] [--out PREFIX] [--all] [--resume] [--from TIME] [--to TIME]\n"
+    "                    list|pull|erase [--yes]|stats|start|stop\n"
+    "  --port DEV     USB serial port (default /dev/ttyACM0)\n"
+    "  --out PREFIX   images PREFIX.img and PREFIX-2.img (default senti-flash)\n"
+    "  --all          pull whole chips, not just the part the store uses\n"
+    "  --resume       carry on from the end of existing images\n"
+    "  --from, --to   only segments with samples in this UTC range, YYYY-MM-DDTHH:MM:SS\n"
+    "                 or seconds since 1970\n"
+    "  --yes          confirm erase\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options opt = { "/dev/ttyACM0", "senti-flash", false, false, false, false, 0, STORE_ERASED };
+  const char *command = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--port") && i + 1 < argc) opt.port = argv[++i];
+    else if (!strcmp(argv[i], "--out") && i + 1 < argc) opt.prefix = argv[++i];
+    else if (!strcmp(argv[i], "--all")) opt.all = true;
+    else if (!strcmp(argv[i], "--resume")) opt.resume = true;
+    else if (!strcmp(argv[i], "--yes")) opt.yes = true;
+    else if ((!strcmp(argv[i], "--from") || !strcmp(argv[i], "--to")) && i + 1 < argc) {
+      if (!parseTime(argv[i + 1], !strcmp(argv[i], "--from") ? &opt.from : &opt.to)) usage();
+      opt.range = true;
+      i++;
+    }
+    else if (argv[i][0] == '-' || command) usage();
+    else command = argv[i];
+  }
+  if (!command || (opt.range && (opt.all || opt.resume))) usage();
+
+  int fd = openPort(opt.port);
+  OffloadLink link = { &fd, portSend, portReceive };
+  OffloadClient client;
+  offloadClientInit(&client, link);
+
+  OffloadInfo info;
+  std::vector<OffloadSegment> segments;
+  if (!strcmp(command, "erase")) {
+    if (!opt.yes) usage();
+    fprintf(stderr, "erasing, this takes a few minutes\n");
+    if (!offloadErase(&client)) {
+      fprintf(stderr, "sentioffload: erase failed\n");
+      return 1;
+    }
+    return 0;
+  }
+  if (!strcmp(command, "stats")) {
+    StatsSnapshot stats;
+    if (!offloadStats(&client, &stats)) {
+      fprintf(stderr, "sentioffload: no answer from %s\n", opt.port);
+      return 1;
+    }
+    printStats(stats);
+    return 0;
+  }
+  if (!strcmp(command, "start") || !strcmp(command, "stop")) {
+    if (!offloadRecord(&client, !strcmp(command, "start"))) {
+      fprintf(stderr, "sentioffload: recording not %s\n", !strcmp(command, "start") ? "started" : "stopped");
+      return 1;
+    }
+    return 0;
+  }
+
+  bool answered = opt.range ? offloadFind(&client, opt.from, opt.to, &info, &segments)
+                            : offloadList(&client, &info, &segments);
+  if (!answered) {
+    fprintf(stderr, "sentioffload: no answer from %s\n", opt.port);
+    return 1;
+  }
+  if (info.version != OFFLOAD_VERSION) {
+    fprintf(stderr, "sentioffload: device speaks offload version %u, this is %u\n", info.version,
+            OFFLOAD_VERSION);
+    return 1;
+  }
+
+  if (!strcmp(command, "list")) {
+    printList(info, segments);
+  } else if (!strcmp(command, "pull")) {
+    double started = seconds();
+    for (uint32_t chip = 0; chip < info.chips; chip++) {
+      std::string path = std::string(opt.prefix) + (chip ? "-2.img" : ".img");
+      bool ok = opt.range ? pullSegments(&client, info, chip, path, segments)
+                          : pullChip(&client, info, chip, path, opt);
+      if (!ok) return 1;
+    }
+    fprintf(stderr, "pulled in %.1f s, %u damaged frames, %u resumes\n", seconds() - started,
+            client.badFrames, client.resumes);
+  } else {
+    usage();
+  }
+  return 0;
+}